@@ -43,6 +43,22 @@ task_pid = tasks[prog_name][0]
 ss_eid = f.event_id(name='sched/sched_switch')
 w_eid = f.event_id(name='sched/sched_waking')
 
+# Decode the "next_pid" field of all sched_switch records and the "pid"
+# field of all sched_waking records at once.
+ss_mask = data['event'] == ss_eid
+w_mask = data['event'] == w_eid
+
+pid_field = np.full(tc.size(data), -1)
+pid_field[ss_mask] = f.read_event_field(offset=data['offset'],
+                                        mask=ss_mask,
+                                        event_id=ss_eid,
+                                        field='next_pid')
+
+pid_field[w_mask] = f.read_event_field(offset=data['offset'],
+                                       mask=w_mask,
+                                       event_id=w_eid,
+                                       field='pid')
+
 # Gey the size of the data.
 i = tc.size(data)
 
@@ -52,9 +68,7 @@ delta_max = i_ss_max = i_sw_max = 0
 while i > 0:
     i = i - 1
     if data['event'][i] == ss_eid:
-        next_pid = f.read_event_field(offset=data['offset'][i],
-                                       event_id=ss_eid,
-                                       field='next_pid')
+        next_pid = pid_field[i]
 
         if next_pid == task_pid:
             time_ss = data['time'][i]
@@ -69,9 +83,7 @@ while i > 0:
                         break
 
                 if data['event'][i] == ss_eid:
-                    next_pid = f.read_event_field(offset=data['offset'][i],
-                                                  event_id=ss_eid,
-                                                  field='next_pid')
+                    next_pid = pid_field[i]
                     if next_pid == task_pid:
                         # Second sched_switch for the same task. ?
                         time_ss = data['time'][i]
@@ -81,9 +93,7 @@ while i > 0:
                     continue
 
                 if (data['event'][i] == w_eid):
-                    waking_pid = f.read_event_field(offset=data['offset'][i],
-                                                     event_id=w_eid,
-                                                     field='pid')
+                    waking_pid = pid_field[i]
 
                     if waking_pid == task_pid:
                         delta = (time_ss - data['time'][i]) / 1000.
@@ -41,6 +41,7 @@ def third_party_paths():
     include_dirs = [np.get_include()]
     libs_required = [('libtraceevent', '1.7.3'),
                      ('libtracefs',    '1.7.0'),
+                     ('libtracecmd',   '1.0.0'),
                      ('libkshark',     '2.0.1')]
     libs_found = []
 
@@ -70,13 +71,15 @@ def extension(name, sources, libraries):
 
 def main():
     module_ft = extension(name='tracecruncher.ftracepy',
-                          sources=['src/ftracepy.c', 'src/ftracepy-utils.c'],
-                          libraries=['traceevent', 'tracefs', 'tcrunchbase', 'rt'])
+                          sources=['src/ftracepy.c', 'src/ftracepy-utils.c',
+                                   'src/ftracepy-reader.c', 'src/ftracepy-recorder.c'],
+                          libraries=['traceevent', 'tracefs', 'tcrunchbase', 'rt',
+                                     'pthread'])
 
     cythonize('src/npdatawrapper.pyx', language_level = 3)
     module_data = extension(name='tracecruncher.npdatawrapper',
                             sources=['src/npdatawrapper.c'],
-                            libraries=['kshark'])
+                            libraries=['kshark', 'tracecmd'])
 
     module_ks = extension(name='tracecruncher.ksharkpy',
                           sources=['src/ksharkpy.c', 'src/ksharkpy-utils.c'],
@@ -29,6 +29,154 @@ PyDoc_STRVAR(PyTepRecord_CPU_doc,
 	     "    CPU Id number."
 );
 
+PyDoc_STRVAR(PyTepRecordBatch_size_doc,
+	     "size()\n"
+	     "--\n\n"
+	     "Get the number of records in the batch.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "size : int\n"
+	     "    Number of records."
+);
+
+PyDoc_STRVAR(PyTepRecordBatch_event_doc,
+	     "event(index)\n"
+	     "--\n\n"
+	     "Get the event of a record from the batch.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "index : int\n"
+	     "    The position of the record inside the batch.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "event : PyTepEvent\n"
+	     "    The event descriptor."
+);
+
+PyDoc_STRVAR(PyTepRecordBatch_record_doc,
+	     "record(index)\n"
+	     "--\n\n"
+	     "Get a record from the batch. The record is valid as long as the batch exists.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "index : int\n"
+	     "    The position of the record inside the batch.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "record : PyTepRecord\n"
+	     "    The record."
+);
+
+PyDoc_STRVAR(PyRecordFilter_pids_doc,
+	     "pids()\n"
+	     "--\n\n"
+	     "Get the PIDs currently accepted by the filter.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "List of PIDs. If 'follow_fork' is used, the list includes the children followed by the\n"
+	     "last call (or stream) that used the filter and has finished.\n"
+);
+
+PyDoc_STRVAR(PyTraceStream_read_batch_doc,
+	     "read_batch()\n"
+	     "--\n\n"
+	     "Get the next batch of records without waiting.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "A batch (tep_record_batch), or None if no records are available at the moment.\n"
+	     "Raises StopIteration if the stream is stopped and all buffered records are consumed.\n"
+);
+
+PyDoc_STRVAR(PyTraceStream_fileno_doc,
+	     "fileno()\n"
+	     "--\n\n"
+	     "Get a file descriptor that becomes readable when new data is available.\n"
+	     "It can be used with 'select' or with 'loop.add_reader()' of asyncio. If the stream\n"
+	     "has no threads, this is an epoll descriptor watching the ring buffers of all CPUs.\n"
+);
+
+PyDoc_STRVAR(PyTraceStream_stop_doc,
+	     "stop()\n"
+	     "--\n\n"
+	     "Stop reading the ring buffers. The records that are already buffered can still be\n"
+	     "retrieved. After that the iteration ends.\n"
+);
+
+PyDoc_STRVAR(PyTraceStream_resume_doc,
+	     "resume()\n"
+	     "--\n\n"
+	     "Resume reading the ring buffers after 'stop()'.\n"
+);
+
+PyDoc_STRVAR(PyTraceStream_stats_doc,
+	     "stats()\n"
+	     "--\n\n"
+	     "Get statistics about the data read so far. After 'close()', the statistics at the time\n"
+	     "of closing are returned.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "Dictionary with the totals of the following counters, and with 'cpus' - a list of\n"
+	     "per-CPU dictionaries of the same counters:\n"
+	     "    'delivered' - records passed to the consumer,\n"
+	     "    'filtered' - records rejected by the filter,\n"
+	     "    'missed_events' - events lost as reported by the ring-buffer pages,\n"
+	     "    'overrun' - events overwritten in the ring buffer, according to\n"
+	     "                'per_cpu/cpuN/stats', since the start of the tracing,\n"
+	     "    'dropped' - events dropped by the kernel since the start of the tracing,\n"
+	     "    'bytes' - the size of the event data read.\n"
+	     "The totals also include 'python_time' and 'native_time' - the time (in seconds) spent\n"
+	     "in Python code and in native code (including waiting for data).\n"
+);
+
+PyDoc_STRVAR(PyTraceStream_close_doc,
+	     "close()\n"
+	     "--\n\n"
+	     "Stop reading and release the buffers. The stream cannot be used anymore, except that\n"
+	     "iterating over it ends immediately and 'stats()' can still be called.\n"
+);
+
+PyDoc_STRVAR(PyAggregator_data_doc,
+	     "data(as_numpy=False)\n"
+	     "--\n\n"
+	     "Get the aggregated data.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "as_numpy : bool (optional)\n"
+	     "    If True, the data is returned as NumPy arrays.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "By default, a dictionary mapping the key (an int, or a tuple if more than one key is used)\n"
+	     "to the value (an int, or a list of bin counts for histograms). If 'as_numpy' is True, a\n"
+	     "dictionary with two arrays: 'keys' of shape (entries, keys) and 'values' of shape (entries,)\n"
+	     "or (entries, bins) for histograms.\n"
+);
+
+PyDoc_STRVAR(PyAggregator_keys_doc,
+	     "keys()\n"
+	     "--\n\n"
+	     "Get the names of the keys used by the aggregator.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "List of strings.\n"
+);
+
+PyDoc_STRVAR(PyAggregator_clear_doc,
+	     "clear()\n"
+	     "--\n\n"
+	     "Discard all aggregated data.\n"
+);
+
 PyDoc_STRVAR(PyTepEvent_name_doc,
 	     "name()\n"
 	     "--\n\n"
@@ -81,6 +229,54 @@ PyDoc_STRVAR(PyTepEvent_parse_record_field_doc,
 	     "    The value of the field."
 );
 
+PyDoc_STRVAR(PyTepEvent_parse_record_doc,
+	     "parse_record(record, fields=None, as_dict=False)\n"
+	     "--\n\n"
+	     "Get the values of several fields of a record with a single call.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "record : PyTepRecord\n"
+	     "    Event record to derive the field values from.\n"
+	     "\n"
+	     "fields : list of strings (optional)\n"
+	     "    The names of the fields. If not provided, all fields of the event are decoded,\n"
+	     "    in the order given by 'field_names()'. The value of a field of unsupported format\n"
+	     "    is None in this case.\n"
+	     "\n"
+	     "as_dict : bool (optional)\n"
+	     "    If True, return a dictionary instead of a tuple.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "values : tuple or dictionary\n"
+	     "    The values of the fields, or a dictionary mapping field names to values."
+);
+
+PyDoc_STRVAR(PyTepEvent_parse_record_array_doc,
+	     "parse_record_array(record, field, size=-1)\n"
+	     "--\n\n"
+	     "Get the content of an array field of a kprobe, defined using 'kprobe_add_array_arg()'\n"
+	     "or 'kprobe_add_string_array_arg()'. The elements of such an array are recorded in\n"
+	     "separate fields named 'field0', 'field1', ... The array ends at the first empty string.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "record : PyTepRecord\n"
+	     "    Event record to derive the array from.\n"
+	     "\n"
+	     "field : string\n"
+	     "    The name of the array field.\n"
+	     "\n"
+	     "size : int (optional)\n"
+	     "    The maximum number of elements. By default all recorded elements are returned.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "values : NumPy array (int64) or list of strings\n"
+	     "    The elements of the array."
+);
+
 PyDoc_STRVAR(PyTepEvent_get_pid_doc,
 	     "get_pid(record)\n"
 	     "--\n\n"
@@ -97,12 +293,53 @@ PyDoc_STRVAR(PyTepEvent_get_pid_doc,
 	     "    PID value."
 );
 
+PyDoc_STRVAR(PyTepEvent_accessor_doc,
+	     "accessor(field, mode='str')\n"
+	     "--\n\n"
+	     "Get an object that decodes a given field of the event. The field is looked up\n"
+	     "only once. Call the object with a record to get the value of the field, or with a\n"
+	     "batch of records (tep_record_batch) to get a list of values. Records of other\n"
+	     "events in the batch give None.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "field : string\n"
+	     "    The name of the field.\n"
+	     "\n"
+	     "mode : string (optional)\n"
+	     "    How string and dynamic fields are returned. 'str' (default) decodes a new string.\n"
+	     "    'raw' returns a read-only memoryview of the bytes of the field, without decoding\n"
+	     "    or copying them. The view keeps the record (or the batch) alive, hence it stays\n"
+	     "    valid after the callback returns. 'intern' returns the same string object for\n"
+	     "    repeated values, which is efficient for fields with few distinct values, like\n"
+	     "    'comm'.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "object : PyFieldAccessor\n"
+	     "    Callable field accessor."
+);
+
+PyDoc_STRVAR(PyFieldAccessor_name_doc,
+	     "name()\n"
+	     "--\n\n"
+	     "Get the name of the field.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "name : string\n"
+	     "    Field name."
+);
+
 PyDoc_STRVAR(PyTep_init_local_doc,
 	     "init_local(dir)\n"
 	     "--\n\n"
 	     "Initialize tep from the local events\n"
 	     "\n"
-	     "Create Trace Events Parser (tep) from a trace instance path.\n"
+	     "Create Trace Events Parser (tep) from a trace instance path. The parser is private to\n"
+	     "this object, hence registering event handlers (see 'short_kprobe_print') does not affect\n"
+	     "other parsers. If no systems are given, the format of each event is parsed the first time\n"
+	     "the event is used.\n"
 	     "\n"
 	     "Parameters\n"
 	     "----------\n"
@@ -132,6 +369,22 @@ PyDoc_STRVAR(PyTep_get_event_doc,
 	     "    A Tep Event corresponding to the given trace event."
 );
 
+PyDoc_STRVAR(PyTep_event_by_id_doc,
+	     "event_by_id(id)\n"
+	     "--\n\n"
+	     "Get a Tep Event for a given event Id.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "id : int\n"
+	     "    The Id number of the event.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "evt : PyTepEvent\n"
+	     "    A Tep Event corresponding to the given Id."
+);
+
 PyDoc_STRVAR(PyTep_event_record_doc,
 	     "event_record(event, record)\n"
 	     "--\n\n"
@@ -189,6 +442,29 @@ PyDoc_STRVAR(PyTep_info_doc,
 	     "    The recorded values of the event fields in a human-readable form."
 );
 
+PyDoc_STRVAR(PyTep_format_records_doc,
+	     "format_records(records, format='event', fd=-1)\n"
+	     "--\n\n"
+	     "Generic print of a batch of records. The records are rendered without holding the GIL. "
+	     "Calls using the same tep handle are serialized, calls using different handles "
+	     "run in parallel.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "records : PyTepRecordBatch\n"
+	     "    The batch of records.\n"
+	     "format : string\n"
+	     "    What to print for each record: 'event' (the same as 'event_record()'), "
+	     "'info' (the same as 'info()') or 'process' (the same as 'process()').\n"
+	     "fd : int\n"
+	     "    If given, write the text to this file descriptor instead of returning it.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "text : string or int\n"
+	     "    One line per record, or the number of bytes written to 'fd'."
+);
+
 PyDoc_STRVAR(PyTep_short_kprobe_print_doc,
 	     "short_kprobe_print(system, event, id)\n"
 	     "--\n\n"
@@ -1366,7 +1642,7 @@ PyDoc_STRVAR(PyFtrace_set_ftrace_loglevel_doc,
 );
 
 PyDoc_STRVAR(PyFtrace_trace_process_doc,
-	     "trace_process(argv, plugin='__main__', callback='callback', instance)\n"
+	     "trace_process(argv, plugin='__main__', callback='callback', instance, batch=0, filter=None, aggregators=None)\n"
 	     "--\n\n"
 	     "Trace a process.\n"
 	     "\n"
@@ -1379,14 +1655,32 @@ PyDoc_STRVAR(PyFtrace_trace_process_doc,
 	     "    Location to search for definition of a callback function.\n"
 	     "\n"
 	     "callback : string (optional)\n"
-	     "    A callback function to be processed on every trace event.\n"
+	     "    A callback function to be processed on every trace event. If None, no callback is\n"
+	     "    called and the records are only aggregated.\n"
 	     "\n"
 	     "instance : PyTfsInstance (optional)\n"
 	     "    The Ftrace instance. This argument is optional. If not provided, the 'top' instance is used.\n"
+	     "\n"
+	     "batch : int (optional)\n"
+	     "    If positive, the callback is called with a single argument - a batch (tep_record_batch)\n"
+	     "    of up to 'batch' records. If -1, all records read in one pass over the ring buffers\n"
+	     "    are delivered as one batch. By default (0) the callback is called for every record.\n"
+	     "\n"
+	     "filter : PyRecordFilter (optional)\n"
+	     "    Filter (see 'record_filter') evaluated before the records are passed to Python.\n"
+	     "\n"
+	     "aggregators : PyAggregator or list of PyAggregator (optional)\n"
+	     "    Aggregators (see 'aggregator') updated with every record that passes the filter.\n"
+	     "    If given, the records are passed to Python only if 'callback' is given explicitly.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "stats : dictionary\n"
+	     "    Statistics of the tracing (see 'tc_stream.stats()').\n"
 );
 
 PyDoc_STRVAR(PyFtrace_trace_shell_process_doc,
-	     "trace_shell_process(argv, plugin='__main__', callback='callback', instance)\n"
+	     "trace_shell_process(argv, plugin='__main__', callback='callback', instance, batch=0, filter=None, aggregators=None)\n"
 	     "--\n\n"
 	     "Trace a process executed within a shell.\n"
 	     "\n"
@@ -1399,11 +1693,29 @@ PyDoc_STRVAR(PyFtrace_trace_shell_process_doc,
 	     "    Location to search for definition of a callback function.\n"
 	     "\n"
 	     "callback : string (optional)\n"
-	     "    A callback function to be processed on every trace event.\n"
+	     "    A callback function to be processed on every trace event. If None, no callback is\n"
+	     "    called and the records are only aggregated.\n"
 	     "\n"
 	     "instance : PyTfsInstance (optional)\n"
 	     "    The Ftrace instance. This argument is optional. If not provided, the 'top' instance is used.\n"
-	     );
+	     "\n"
+	     "batch : int (optional)\n"
+	     "    If positive, the callback is called with a single argument - a batch (tep_record_batch)\n"
+	     "    of up to 'batch' records. If -1, all records read in one pass over the ring buffers\n"
+	     "    are delivered as one batch. By default (0) the callback is called for every record.\n"
+	     "\n"
+	     "filter : PyRecordFilter (optional)\n"
+	     "    Filter (see 'record_filter') evaluated before the records are passed to Python.\n"
+	     "\n"
+	     "aggregators : PyAggregator or list of PyAggregator (optional)\n"
+	     "    Aggregators (see 'aggregator') updated with every record that passes the filter.\n"
+	     "    If given, the records are passed to Python only if 'callback' is given explicitly.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "stats : dictionary\n"
+	     "    Statistics of the tracing (see 'tc_stream.stats()').\n"
+);
 
 PyDoc_STRVAR(PyFtrace_read_trace_doc,
 	     "read_trace(instance)\n"
@@ -1414,6 +1726,12 @@ PyDoc_STRVAR(PyFtrace_read_trace_doc,
 	     "----------\n"
 	     "instance : PyTfsInstance (optional)\n"
 	     "    The Ftrace instance. This argument is optional. If not provided, the 'top' instance is used.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "stats : dictionary\n"
+	     "    The 'overrun' and 'dropped' counters (see 'tc_stream.stats()'). The records are\n"
+	     "    not parsed, hence no other statistics are available.\n"
 	     );
 
 PyDoc_STRVAR(PyFtrace_wait_doc,
@@ -1438,9 +1756,11 @@ PyDoc_STRVAR(PyFtrace_wait_doc,
 	     );
 
 PyDoc_STRVAR(PyFtrace_iterate_trace_doc,
-	     "iterate_trace(plugin='__main__', callback='callback', instance)\n"
+	     "iterate_trace(plugin='__main__', callback='callback', instance, batch=0, parallel=False, pin=False, filter=None, aggregators=None)\n"
 	     "--\n\n"
 	     "User provided processing (via callback) of every trace event. Use 'Ctrl+c' to stop.\n"
+	     "The GIL is released while reading the ring buffers, so other Python threads keep running.\n"
+	     "Unless 'parallel' is used, only the events enabled before the call are processed.\n"
 	     "\n"
 	     "Parameters\n"
 	     "----------\n"
@@ -1448,10 +1768,201 @@ PyDoc_STRVAR(PyFtrace_iterate_trace_doc,
 	     "    Location to search for definition of a callback function.\n"
 	     "\n"
 	     "callback : string (optional)\n"
-	     "    A callback function to be processed on every trace event.\n"
+	     "    A callback function to be processed on every trace event. If None, no callback is\n"
+	     "    called and the records are only aggregated.\n"
+	     "\n"
+	     "instance : PyTfsInstance (optional)\n"
+	     "    The Ftrace instance. This argument is optional. If not provided, the 'top' instance is used.\n"
+	     "\n"
+	     "batch : int (optional)\n"
+	     "    If positive, the callback is called with a single argument - a batch (tep_record_batch)\n"
+	     "    of up to 'batch' records. If -1, all records read in one pass over the ring buffers\n"
+	     "    are delivered as one batch. By default (0) the callback is called for every record.\n"
+	     "\n"
+	     "filter : PyRecordFilter (optional)\n"
+	     "    Filter (see 'record_filter') evaluated before the records are passed to Python.\n"
+	     "\n"
+	     "aggregators : PyAggregator or list of PyAggregator (optional)\n"
+	     "    Aggregators (see 'aggregator') updated with every record that passes the filter.\n"
+	     "    If given, the records are passed to Python only if 'callback' is given explicitly.\n"
+	     "\n"
+	     "parallel : bool (optional)\n"
+	     "    If True, the ring buffers are read by native threads (one per CPU) and the records are\n"
+	     "    merged by timestamp. The GIL is held only while calling the callback. Records kept\n"
+	     "    by the callback hold a reference to their page buffer, so their data is not copied.\n"
+	     "\n"
+	     "pin : bool (optional)\n"
+	     "    Used only together with 'parallel'. If True, each reader thread runs on the CPU it reads.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "stats : dictionary\n"
+	     "    Statistics of the tracing (see 'tc_stream.stats()').\n"
+);
+
+PyDoc_STRVAR(PyFtrace_record_filter_doc,
+	     "record_filter(expression=None, pids=None, follow_fork=False)\n"
+	     "--\n\n"
+	     "Define a filter that is evaluated natively, before the records are passed to Python.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "expression : string (optional)\n"
+	     "    Filter expression, using the syntax of the kernel event filters, prefixed by the\n"
+	     "    name of the event. For example 'sched/sched_switch: prev_state != 0'. Several\n"
+	     "    events can be given, separated by commas. Records of other events are rejected.\n"
+	     "\n"
+	     "pids : int or list of ints (optional)\n"
+	     "    Accept only records generated by these processes. Large sets are supported.\n"
+	     "\n"
+	     "follow_fork : bool (optional)\n"
+	     "    Also accept the children of the processes in 'pids'. Requires the event\n"
+	     "    'sched/sched_process_fork' to be enabled ('sched/sched_process_exit' is optional).\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "object : PyRecordFilter\n"
+	     "    A filter that can be passed to 'iterate_trace', 'trace_process' or 'trace_shell_process'.\n"
+	     );
+
+PyDoc_STRVAR(PyFtrace_aggregator_doc,
+	     "aggregator(type, event=None, keys=None, field=None, bins=0, min=0, step=1)\n"
+	     "--\n\n"
+	     "Define an aggregator that is updated natively for every record, without calling Python.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "type : string\n"
+	     "    The type of the aggregation: 'count', 'sum', 'min', 'max', 'last', 'hist_log2'\n"
+	     "    (power-of-two histogram) or 'hist_linear'.\n"
+	     "\n"
+	     "event : string (optional)\n"
+	     "    Aggregate only the records of this event ('system/event'). Required by all types\n"
+	     "    except 'count'.\n"
+	     "\n"
+	     "keys : string or list of strings (optional)\n"
+	     "    The data is grouped by these keys. Supported are 'pid', 'cpu', 'event' and the\n"
+	     "    names of numeric fields of 'event'. Up to 4 keys can be used.\n"
+	     "\n"
+	     "field : string (optional)\n"
+	     "    The numeric field of 'event' to aggregate. Requires 'event'. Not used by 'count'.\n"
+	     "\n"
+	     "bins : int (optional)\n"
+	     "    The number of bins of a linear histogram. Two more bins are added: the first one counts\n"
+	     "    the values below 'min' and the last one counts the values at or above 'min + bins * step'.\n"
+	     "\n"
+	     "min : int (optional)\n"
+	     "    The lower edge of the first bin of a linear histogram.\n"
+	     "\n"
+	     "step : int (optional)\n"
+	     "    The width of the bins of a linear histogram.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "object : PyAggregator\n"
+	     "    An aggregator that can be passed to 'iterate_trace', 'trace_process' or\n"
+	     "    'trace_shell_process'.\n"
+	     );
+
+PyDoc_STRVAR(PyFtrace_stream_doc,
+	     "stream(instance, batch=1024, filter=None, buffer_pages=0, pin=False, threads=True)\n"
+	     "--\n\n"
+	     "Open an iterator over the live trace data. Each iteration returns the next batch\n"
+	     "(tep_record_batch) of records, waiting for data if needed. The ring buffers are read\n"
+	     "by native threads (one per CPU) into a bounded buffer. If the consumer does not keep\n"
+	     "up, the threads stop reading until there is space in the buffer.\n"
 	     "\n"
+	     "Parameters\n"
+	     "----------\n"
 	     "instance : PyTfsInstance (optional)\n"
 	     "    The Ftrace instance. This argument is optional. If not provided, the 'top' instance is used.\n"
+	     "\n"
+	     "batch : int (optional)\n"
+	     "    The maximum number of records in one batch.\n"
+	     "\n"
+	     "filter : PyRecordFilter (optional)\n"
+	     "    Filter (see 'record_filter') evaluated before the records are added to the batch.\n"
+	     "\n"
+	     "buffer_pages : int (optional)\n"
+	     "    The number of pages buffered per CPU. By default 32 pages are used.\n"
+	     "\n"
+	     "pin : bool (optional)\n"
+	     "    If True, each reader thread runs on the CPU it reads.\n"
+	     "\n"
+	     "threads : bool (optional)\n"
+	     "    If False, no reader threads are used and the ring buffers are read by the thread\n"
+	     "    that consumes the stream (see 'fileno()' and 'read_batch()').\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "object : PyTraceStream\n"
+	     "    Iterator over batches of records.\n"
+	     );
+
+PyDoc_STRVAR(PyFtrace_collect_trace_doc,
+	     "collect_trace(fields=None, instance, argv=None, max_records=0, time=0, stats=False)\n"
+	     "--\n\n"
+	     "Collect the trace data into NumPy arrays without calling Python for every event.\n"
+	     "Use 'Ctrl+c' to stop.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "fields : dictionary (optional)\n"
+	     "    Numeric fields to be decoded. The keys are event names ('system/event') and the values\n"
+	     "    are lists of field names. Each field gets its own int64 column, named\n"
+	     "    'system/event/field'. For the rows of other events, the column contains the minimum\n"
+	     "    value of int64.\n"
+	     "\n"
+	     "instance : PyTfsInstance (optional)\n"
+	     "    The Ftrace instance. This argument is optional. If not provided, the 'top' instance is used.\n"
+	     "\n"
+	     "argv : list of strings (optional)\n"
+	     "    Process to be started and traced. The collection stops when the process exits. If the\n"
+	     "    collection stops earlier, the process is killed.\n"
+	     "\n"
+	     "max_records : int (optional)\n"
+	     "    Stop after collecting this number of records.\n"
+	     "\n"
+	     "time : int (optional)\n"
+	     "    Stop after the given time (in milliseconds).\n"
+	     "\n"
+	     "stats : bool (optional)\n"
+	     "    If True, also return the statistics of the tracing.\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "A dictionary of NumPy arrays: 'event' (int16), 'cpu' (int16), 'pid' (int32),\n"
+	     "'time' (uint64), plus one array per requested field. If 'stats' is True, a tuple of\n"
+	     "this dictionary and the statistics (see 'tc_stream.stats()').\n"
+	     );
+
+PyDoc_STRVAR(PyFtrace_record_doc,
+	     "record(output_file, instance, argv=None, time=0)\n"
+	     "--\n\n"
+	     "Record the trace data into a file (trace.dat format). Use 'Ctrl+c' to stop.\n"
+	     "The data is recorded by native threads (one per CPU) and never passes through Python.\n"
+	     "\n"
+	     "Parameters\n"
+	     "----------\n"
+	     "output_file : string\n"
+	     "    The name of the file to create. The file can be opened with 'ksharkpy.open()'.\n"
+	     "    It must be on a file system that supports sparse files.\n"
+	     "\n"
+	     "instance : PyTfsInstance (optional)\n"
+	     "    The Ftrace instance. This argument is optional. If not provided, the 'top' instance is used.\n"
+	     "\n"
+	     "argv : list of strings (optional)\n"
+	     "    Process to be started and traced. The recording stops when the process exits. If the\n"
+	     "    recording stops first (or fails), the process is killed.\n"
+	     "\n"
+	     "time : int (optional)\n"
+	     "    Stop after the given time (in milliseconds).\n"
+	     "\n"
+	     "Returns\n"
+	     "-------\n"
+	     "stats : dictionary\n"
+	     "    The kernel counters of the statistics of the tracing (see 'tc_stream.stats()').\n"
+	     "    The recorded data is not parsed, hence the record counters are not included.\n"
 	     );
 
 PyDoc_STRVAR(PyFtrace_hook2pid_doc,
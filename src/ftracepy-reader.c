@@ -0,0 +1,846 @@
+// SPDX-License-Identifier: LGPL-2.1
+
+/*
+ * Copyright 2021 VMware Inc, Yordan Karadzhov (VMware) <y.karadz@gmail.com>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif // _GNU_SOURCE
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+// libtraceevent
+#include "kbuffer.h"
+
+// trace-cruncher
+#include "ftracepy-reader.h"
+
+/* Default number of pages in the queue of each CPU. */
+#define TC_READER_QUEUE_SIZE	32
+
+/*
+ * How often (in milliseconds) the reader threads check the ring buffers
+ * when the kernel does not wake them up.
+ */
+#define TC_READER_POLL_MS	100
+
+struct tc_reader_entry {
+	unsigned long long	ts;
+	unsigned int		offset;
+	unsigned int		size;
+};
+
+/*
+ * Reference-counted page buffer. The records returned by tc_reader_next()
+ * point into such buffers. A record can be kept after the next call of
+ * tc_reader_next() by taking a reference to its buffer (see
+ * tc_reader_page_get()). The reader does not reuse a buffer that is still
+ * referenced. It takes a new one from the pool instead.
+ */
+struct tc_page {
+	struct tc_page_pool	*pool;
+	int			refs;
+
+	/* Next buffer in the free list of the pool. */
+	struct tc_page		*next;
+
+	char			data[];
+};
+
+struct tc_page_pool {
+	pthread_mutex_t		lock;
+	struct tc_page		*free;
+	int			page_size;
+
+	/* Held by the reader and by each buffer that is in use. */
+	int			refs;
+};
+
+/* A page read from 'trace_pipe_raw', together with the index of its records. */
+struct tc_reader_page {
+	struct tc_page		*buf;
+	struct tc_reader_entry	*entries;
+	unsigned int		nr_entries;
+	int			missed_events;
+};
+
+/*
+ * Single-producer / single-consumer queue of pages. The producer is the
+ * reader thread of the CPU. The consumer is the thread that calls
+ * tc_reader_next().
+ */
+struct tc_cpu_reader {
+	struct tc_reader	*reader;
+	int			cpu;
+	int			fd;
+	struct kbuffer		*kbuf;
+	pthread_t		thread;
+	bool			running;
+
+	struct tc_reader_page	*pages;
+
+	/* Signaled by the consumer when it releases a page of a full queue. */
+	int			space_fd;
+
+	/*
+	 * Set by the producer when the ring buffer of the CPU has no data,
+	 * cleared when a new page is queued.
+	 */
+	bool			idle;
+
+	/* Written only by the producer. */
+	unsigned long		head;
+
+	/* Written only by the consumer. */
+	unsigned long		tail;
+
+	/* Consumer only: next record to read from the page at 'tail'. */
+	unsigned int		index;
+};
+
+struct tc_reader {
+	int			nr_cpus;
+	struct tc_cpu_reader	*cpus;
+	int			page_size;
+	int			flags;
+
+	/* The page buffers of all CPUs. */
+	struct tc_page_pool	*pool;
+
+	/* Number of pages in the queue of each CPU. */
+	unsigned int		queue_size;
+
+	/* Signaled by the producers when new pages are available. */
+	int			data_fd;
+
+	/*
+	 * Used only if the reader has no threads. Watches the
+	 * 'trace_pipe_raw' files of all CPUs.
+	 */
+	int			epoll_fd;
+
+	/* Signaled by the consumer to stop the producers. */
+	int			stop_fd;
+	bool			stop;
+
+	/* The CPU of the last record returned by tc_reader_next(). */
+	struct tc_cpu_reader	*last;
+};
+
+static struct tc_page_pool *page_pool_alloc(int page_size)
+{
+	struct tc_page_pool *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->page_size = page_size;
+	pool->refs = 1;
+
+	return pool;
+}
+
+static void page_pool_put(struct tc_page_pool *pool)
+{
+	struct tc_page *page;
+	bool last;
+
+	pthread_mutex_lock(&pool->lock);
+	last = --pool->refs == 0;
+	pthread_mutex_unlock(&pool->lock);
+	if (!last)
+		return;
+
+	while ((page = pool->free)) {
+		pool->free = page->next;
+		free(page);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/* Get a buffer from the free list of the pool or allocate a new one. */
+static struct tc_page *page_pool_get(struct tc_page_pool *pool)
+{
+	struct tc_page *page;
+
+	pthread_mutex_lock(&pool->lock);
+	page = pool->free;
+	if (page)
+		pool->free = page->next;
+	else
+		page = malloc(sizeof(*page) + pool->page_size);
+
+	if (page)
+		++pool->refs;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!page)
+		return NULL;
+
+	page->pool = pool;
+	page->refs = 1;
+	page->next = NULL;
+
+	return page;
+}
+
+/**
+ * tc_page_put - Release a reference to a page buffer
+ * @page - The buffer (can be NULL).
+ *
+ * Once all references are released, the buffer is returned to the pool of
+ * the reader. This API can be called after the reader is freed.
+ */
+void tc_page_put(struct tc_page *page)
+{
+	struct tc_page_pool *pool;
+
+	if (!page || __atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	pool = page->pool;
+	pthread_mutex_lock(&pool->lock);
+	page->next = pool->free;
+	pool->free = page;
+	pthread_mutex_unlock(&pool->lock);
+
+	page_pool_put(pool);
+}
+
+static void reader_parse_page(struct tc_cpu_reader *cpu_reader,
+			      struct tc_reader_page *page)
+{
+	unsigned int max_entries = cpu_reader->reader->page_size / 4;
+	struct kbuffer *kbuf = cpu_reader->kbuf;
+	unsigned long long ts;
+	void *data;
+
+	page->nr_entries = 0;
+	if (kbuffer_load_subbuffer(kbuf, page->buf->data) < 0)
+		return;
+
+	page->missed_events = kbuffer_missed_events(kbuf);
+	for (data = kbuffer_read_event(kbuf, &ts);
+	     data && page->nr_entries < max_entries;
+	     data = kbuffer_next_event(kbuf, &ts)) {
+		page->entries[page->nr_entries].ts = ts;
+		page->entries[page->nr_entries].offset =
+			(char *) data - page->buf->data;
+		page->entries[page->nr_entries].size = kbuffer_event_size(kbuf);
+		++page->nr_entries;
+	}
+}
+
+/*
+ * Wait for new data in the ring buffer or, if the queue is full, until the
+ * consumer releases a page.
+ */
+static bool reader_wait(struct tc_cpu_reader *cpu_reader, bool full)
+{
+	struct pollfd pfd[2] = {
+		{.fd = cpu_reader->reader->stop_fd, .events = POLLIN},
+		{.fd = full ? cpu_reader->space_fd : cpu_reader->fd,
+		 .events = POLLIN},
+	};
+	eventfd_t val;
+
+	if (poll(pfd, 2, full ? -1 : TC_READER_POLL_MS) < 0 && errno != EINTR)
+		return false;
+
+	if (full && (pfd[1].revents & POLLIN))
+		eventfd_read(cpu_reader->space_fd, &val);
+
+	return !__atomic_load_n(&cpu_reader->reader->stop, __ATOMIC_ACQUIRE);
+}
+
+static void reader_set_idle(struct tc_cpu_reader *cpu_reader, bool idle)
+{
+	if (__atomic_exchange_n(&cpu_reader->idle, idle, __ATOMIC_ACQ_REL) == idle)
+		return;
+
+	/* The consumer may be holding back the records of the other CPUs. */
+	if (idle && !(cpu_reader->reader->flags & TC_READER_NO_THREADS))
+		eventfd_write(cpu_reader->reader->data_fd, 1);
+}
+
+static bool reader_queue_full(struct tc_cpu_reader *cpu_reader)
+{
+	unsigned long tail = __atomic_load_n(&cpu_reader->tail, __ATOMIC_ACQUIRE);
+
+	return cpu_reader->head - tail == cpu_reader->reader->queue_size;
+}
+
+/*
+ * Read one page into the queue. Returns 1 if a page has been read, 0 if no
+ * data is available, or -1 in case of an error.
+ */
+static int reader_read_page(struct tc_cpu_reader *cpu_reader)
+{
+	struct tc_reader *reader = cpu_reader->reader;
+	struct tc_reader_page *page;
+	ssize_t r;
+
+	page = &cpu_reader->pages[cpu_reader->head % reader->queue_size];
+
+	/* The records of the previous page of this slot are still in use. */
+	if (__atomic_load_n(&page->buf->refs, __ATOMIC_ACQUIRE) > 1) {
+		struct tc_page *buf = page_pool_get(reader->pool);
+
+		if (!buf)
+			return -1;
+
+		tc_page_put(page->buf);
+		page->buf = buf;
+	}
+
+	r = read(cpu_reader->fd, page->buf->data, reader->page_size);
+	if (r <= 0) {
+		if (r < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+
+		reader_set_idle(cpu_reader, true);
+		return 0;
+	}
+
+	reader_parse_page(cpu_reader, page);
+	if (page->nr_entries) {
+		__atomic_store_n(&cpu_reader->head, cpu_reader->head + 1,
+				 __ATOMIC_RELEASE);
+		reader_set_idle(cpu_reader, false);
+	}
+
+	return 1;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct tc_cpu_reader *cpu_reader = arg;
+	struct tc_reader *reader = cpu_reader->reader;
+	int ret;
+
+	while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)) {
+		if (reader_queue_full(cpu_reader)) {
+			if (!reader_wait(cpu_reader, true))
+				break;
+
+			continue;
+		}
+
+		ret = reader_read_page(cpu_reader);
+		if (ret < 0)
+			break;
+
+		if (ret > 0) {
+			eventfd_write(reader->data_fd, 1);
+			continue;
+		}
+
+		if (!reader_wait(cpu_reader, false))
+			break;
+	}
+
+	/* Do not hold back the records of the other CPUs. */
+	reader_set_idle(cpu_reader, true);
+
+	return NULL;
+}
+
+static int open_cpu_buffer(struct tracefs_instance *instance, int cpu)
+{
+	char file[64];
+	char *path;
+	int fd;
+
+	snprintf(file, sizeof(file), "per_cpu/cpu%i/trace_pipe_raw", cpu);
+	path = tracefs_instance_get_file(instance, file);
+	if (!path)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_NONBLOCK);
+	tracefs_put_tracing_file(path);
+
+	return fd;
+}
+
+/**
+ * tc_reader_alloc - Allocate a parallel reader of the Ftrace ring buffers
+ * @instance - The Ftrace instance to read from.
+ * @tep - The tep handle used to interpret the data.
+ * @flags - TC_READER_PIN: each reader thread is pinned to the CPU it reads
+ *	    from. TC_READER_NO_THREADS: do not start reader threads. The data
+ *	    is read by tc_reader_wait() and tc_reader_fill(), called by the
+ *	    consumer.
+ * @queue_size - Number of pages buffered per CPU. Zero means default size.
+ *
+ * This API allocates a reader that uses one native thread per CPU. Each thread
+ * consumes the pages of 'trace_pipe_raw' of its CPU and splits them into
+ * records. The records are collected by calling tc_reader_next(). The reader
+ * threads are started by tc_reader_start(). If the records are not collected,
+ * the reader threads stop reading once the queue of their CPU is full.
+ *
+ * Returns a pointer to the reader, or NULL in case of an error. The reader
+ * must be freed with tc_reader_free().
+ */
+struct tc_reader *tc_reader_alloc(struct tracefs_instance *instance,
+				  struct tep_handle *tep,
+				  int flags,
+				  unsigned int queue_size)
+{
+	struct epoll_event ev = {.events = EPOLLIN};
+	struct tc_cpu_reader *cpu_reader;
+	struct tc_reader *reader;
+	int cpu, i;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return NULL;
+
+	reader->data_fd = reader->stop_fd = reader->epoll_fd = -1;
+	reader->flags = flags;
+	reader->queue_size = queue_size ? queue_size : TC_READER_QUEUE_SIZE;
+	reader->page_size = tep_get_page_size(tep);
+	if (reader->page_size <= 0)
+		reader->page_size = getpagesize();
+
+	reader->pool = page_pool_alloc(reader->page_size);
+	if (!reader->pool)
+		goto fail;
+
+	reader->nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	reader->cpus = calloc(reader->nr_cpus, sizeof(*reader->cpus));
+	if (!reader->cpus)
+		goto fail;
+
+	for (cpu = 0; cpu < reader->nr_cpus; ++cpu)
+		reader->cpus[cpu].fd = reader->cpus[cpu].space_fd = -1;
+
+	reader->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	reader->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reader->data_fd < 0 || reader->stop_fd < 0)
+		goto fail;
+
+	if (flags & TC_READER_NO_THREADS) {
+		reader->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (reader->epoll_fd < 0)
+			goto fail;
+	}
+
+	for (cpu = 0; cpu < reader->nr_cpus; ++cpu) {
+		cpu_reader = &reader->cpus[cpu];
+		cpu_reader->reader = reader;
+		cpu_reader->cpu = cpu;
+
+		/* CPUs that are not online have no buffers. Skip those. */
+		cpu_reader->fd = open_cpu_buffer(instance, cpu);
+		if (cpu_reader->fd < 0)
+			continue;
+
+		if (reader->epoll_fd >= 0) {
+			ev.data.ptr = cpu_reader;
+			if (epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD,
+				      cpu_reader->fd, &ev) < 0)
+				goto fail;
+		}
+
+		if (!(flags & TC_READER_NO_THREADS)) {
+			cpu_reader->space_fd = eventfd(0, EFD_NONBLOCK |
+							  EFD_CLOEXEC);
+			if (cpu_reader->space_fd < 0)
+				goto fail;
+		}
+
+		cpu_reader->kbuf = tep_kbuffer(tep);
+		cpu_reader->pages = calloc(reader->queue_size,
+					   sizeof(*cpu_reader->pages));
+		if (!cpu_reader->kbuf || !cpu_reader->pages)
+			goto fail;
+
+		for (i = 0; i < reader->queue_size; ++i) {
+			cpu_reader->pages[i].buf = page_pool_get(reader->pool);
+			cpu_reader->pages[i].entries =
+				malloc(reader->page_size / 4 *
+				       sizeof(struct tc_reader_entry));
+
+			if (!cpu_reader->pages[i].buf ||
+			    !cpu_reader->pages[i].entries)
+				goto fail;
+		}
+	}
+
+	return reader;
+
+ fail:
+	tc_reader_free(reader);
+	return NULL;
+}
+
+/**
+ * tc_reader_free - Free a parallel reader
+ * @reader - The reader to be freed.
+ *
+ * If the reader threads are still running, they are stopped first.
+ */
+void tc_reader_free(struct tc_reader *reader)
+{
+	struct tc_cpu_reader *cpu_reader;
+	int cpu, i;
+
+	if (!reader)
+		return;
+
+	tc_reader_stop(reader);
+	for (cpu = 0; cpu < reader->nr_cpus && reader->cpus; ++cpu) {
+		cpu_reader = &reader->cpus[cpu];
+		if (cpu_reader->fd >= 0)
+			close(cpu_reader->fd);
+
+		if (cpu_reader->space_fd >= 0)
+			close(cpu_reader->space_fd);
+
+		if (cpu_reader->kbuf)
+			kbuffer_free(cpu_reader->kbuf);
+
+		for (i = 0; cpu_reader->pages && i < reader->queue_size; ++i) {
+			tc_page_put(cpu_reader->pages[i].buf);
+			free(cpu_reader->pages[i].entries);
+		}
+
+		free(cpu_reader->pages);
+	}
+
+	if (reader->data_fd >= 0)
+		close(reader->data_fd);
+
+	if (reader->stop_fd >= 0)
+		close(reader->stop_fd);
+
+	if (reader->epoll_fd >= 0)
+		close(reader->epoll_fd);
+
+	/* The buffers that are still referenced keep the pool alive. */
+	if (reader->pool)
+		page_pool_put(reader->pool);
+
+	free(reader->cpus);
+	free(reader);
+}
+
+/**
+ * tc_reader_start - Start the reader threads
+ * @reader - The reader.
+ *
+ * Returns 0 on success, -1 in case of an error. On error, the threads that
+ * have been started already are stopped.
+ */
+int tc_reader_start(struct tc_reader *reader)
+{
+	struct tc_cpu_reader *cpu_reader;
+	pthread_attr_t attr;
+	cpu_set_t cpu_set;
+	int cpu, ret = 0;
+
+	for (cpu = 0; cpu < reader->nr_cpus; ++cpu)
+		reader->cpus[cpu].idle = false;
+
+	__atomic_store_n(&reader->stop, false, __ATOMIC_RELEASE);
+	if (reader->flags & TC_READER_NO_THREADS)
+		return 0;
+
+	for (cpu = 0; cpu < reader->nr_cpus; ++cpu) {
+		cpu_reader = &reader->cpus[cpu];
+		if (cpu_reader->fd < 0)
+			continue;
+
+		pthread_attr_init(&attr);
+		if (reader->flags & TC_READER_PIN) {
+			CPU_ZERO(&cpu_set);
+			CPU_SET(cpu, &cpu_set);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu_set),
+						    &cpu_set);
+		}
+
+		ret = pthread_create(&cpu_reader->thread, &attr,
+				     reader_thread, cpu_reader);
+		pthread_attr_destroy(&attr);
+		if (ret != 0) {
+			tc_reader_stop(reader);
+			return -1;
+		}
+
+		cpu_reader->running = true;
+	}
+
+	return 0;
+}
+
+/**
+ * tc_reader_stop - Stop the reader threads
+ * @reader - The reader.
+ *
+ * The records that are already queued can still be collected by calling
+ * tc_reader_next().
+ */
+void tc_reader_stop(struct tc_reader *reader)
+{
+	int cpu;
+
+	__atomic_store_n(&reader->stop, true, __ATOMIC_RELEASE);
+	if (reader->stop_fd >= 0)
+		eventfd_write(reader->stop_fd, 1);
+
+	for (cpu = 0; cpu < reader->nr_cpus && reader->cpus; ++cpu) {
+		if (!reader->cpus[cpu].running)
+			continue;
+
+		pthread_join(reader->cpus[cpu].thread, NULL);
+		reader->cpus[cpu].running = false;
+	}
+
+	if (reader->stop_fd >= 0) {
+		eventfd_t val;
+
+		eventfd_read(reader->stop_fd, &val);
+	}
+}
+
+/**
+ * tc_reader_fd - Get a file descriptor to watch for new data
+ * @reader - The reader.
+ *
+ * The file descriptor becomes readable when new data is available. It is
+ * meant to be used with select(), poll() or epoll (for example by an event
+ * loop). Once readable, tc_reader_fill() must be called.
+ *
+ * Returns the file descriptor. It must not be closed by the caller.
+ */
+int tc_reader_fd(struct tc_reader *reader)
+{
+	if (reader->flags & TC_READER_NO_THREADS)
+		return reader->epoll_fd;
+
+	return reader->data_fd;
+}
+
+/**
+ * tc_reader_fill - Queue the data that is available now
+ * @reader - The reader.
+ *
+ * If the reader has no threads, this API reads (without blocking) all data
+ * available in the ring buffers, until the queues are full. If the reader
+ * has threads, it only acknowledges the notification of tc_reader_fd().
+ *
+ * Returns the number of pages read, or -1 in case of an error.
+ */
+int tc_reader_fill(struct tc_reader *reader)
+{
+	struct tc_cpu_reader *cpu_reader;
+	int cpu, ret, count = 0;
+	eventfd_t val;
+
+	if (!(reader->flags & TC_READER_NO_THREADS)) {
+		eventfd_read(reader->data_fd, &val);
+		return 0;
+	}
+
+	if (__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE))
+		return 0;
+
+	for (cpu = 0; cpu < reader->nr_cpus; ++cpu) {
+		cpu_reader = &reader->cpus[cpu];
+		if (cpu_reader->fd < 0)
+			continue;
+
+		while (!reader_queue_full(cpu_reader)) {
+			ret = reader_read_page(cpu_reader);
+			if (ret < 0)
+				return -1;
+
+			if (!ret)
+				break;
+
+			++count;
+		}
+	}
+
+	return count;
+}
+
+/**
+ * tc_reader_wait - Wait for new data
+ * @reader - The reader.
+ * @timeout - Maximum time to wait (in milliseconds).
+ *
+ * If the reader has no threads, the available data is read when the waiting
+ * ends (also on timeout, because the kernel wakes up the readers only when
+ * the ring buffer is filled above a watermark). This API does not touch any
+ * Python object, so it can be called without holding the GIL.
+ *
+ * Returns 1 if new data is available, 0 on timeout, or -1 in case of an error.
+ */
+int tc_reader_wait(struct tc_reader *reader, int timeout)
+{
+	struct pollfd pfd = {.fd = reader->data_fd, .events = POLLIN};
+	struct epoll_event events[8];
+	eventfd_t val;
+	int ret;
+
+	if (reader->flags & TC_READER_NO_THREADS) {
+		ret = epoll_wait(reader->epoll_fd, events, 8, timeout);
+		if (ret < 0 && errno != EINTR)
+			return -1;
+
+		ret = tc_reader_fill(reader);
+
+		return ret < 0 ? -1 : ret > 0;
+	}
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+
+	if (ret > 0)
+		eventfd_read(reader->data_fd, &val);
+
+	return ret;
+}
+
+static void reader_release_page(struct tc_cpu_reader *cpu_reader)
+{
+	unsigned long head = __atomic_load_n(&cpu_reader->head,
+					     __ATOMIC_ACQUIRE);
+	bool full = head - cpu_reader->tail == cpu_reader->reader->queue_size;
+
+	cpu_reader->index = 0;
+	__atomic_store_n(&cpu_reader->tail, cpu_reader->tail + 1,
+			 __ATOMIC_RELEASE);
+
+	/* The producer may be waiting for a free slot. */
+	if (full && cpu_reader->space_fd >= 0)
+		eventfd_write(cpu_reader->space_fd, 1);
+}
+
+static struct tc_reader_entry *reader_peek(struct tc_cpu_reader *cpu_reader)
+{
+	struct tc_reader_page *page;
+
+	if (cpu_reader->fd < 0 ||
+	    cpu_reader->tail == __atomic_load_n(&cpu_reader->head,
+						__ATOMIC_ACQUIRE))
+		return NULL;
+
+	page = &cpu_reader->pages[cpu_reader->tail % cpu_reader->reader->queue_size];
+
+	return &page->entries[cpu_reader->index];
+}
+
+/**
+ * tc_reader_next - Get the next record
+ * @reader - The reader.
+ * @record - Output location for the record.
+ *
+ * This API returns the record with the smallest timestamp among all records
+ * that are queued by the reader threads. It does not block. While the reader
+ * is running, no record is returned until every CPU has a page queued or has
+ * reported that its ring buffer is empty. Hence, the records are returned in
+ * timestamp order, except for records that the kernel commits to an idle CPU
+ * with a timestamp older than records already returned. The data of the
+ * record stays valid until the next call of tc_reader_next(), unless a
+ * reference to its page buffer is taken with tc_reader_page_get().
+ *
+ * Returns 1 if a record is returned, or 0 if no records can be returned yet.
+ */
+int tc_reader_next(struct tc_reader *reader, struct tep_record *record)
+{
+	struct tc_cpu_reader *cpu_reader, *next = NULL;
+	struct tc_reader_entry *entry, *min = NULL;
+	struct tc_reader_page *page;
+	bool stopped;
+	int cpu;
+
+	/* The data of the previous record is no longer in use. */
+	cpu_reader = reader->last;
+	if (cpu_reader) {
+		page = &cpu_reader->pages[cpu_reader->tail % reader->queue_size];
+		if (++cpu_reader->index == page->nr_entries)
+			reader_release_page(cpu_reader);
+
+		reader->last = NULL;
+	}
+
+	stopped = __atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE);
+	for (cpu = 0; cpu < reader->nr_cpus; ++cpu) {
+		cpu_reader = &reader->cpus[cpu];
+		entry = reader_peek(cpu_reader);
+		if (!entry) {
+			/*
+			 * This CPU may still deliver older records. Wait for
+			 * its next page, unless its ring buffer is empty.
+			 */
+			if (cpu_reader->fd >= 0 && !stopped &&
+			    !__atomic_load_n(&cpu_reader->idle, __ATOMIC_ACQUIRE))
+				return 0;
+
+			continue;
+		}
+
+		if (!min || entry->ts < min->ts) {
+			min = entry;
+			next = cpu_reader;
+		}
+	}
+
+	if (!min)
+		return 0;
+
+	page = &next->pages[next->tail % reader->queue_size];
+	memset(record, 0, sizeof(*record));
+	record->ts = min->ts;
+	record->size = min->size;
+	record->data = page->buf->data + min->offset;
+	record->cpu = next->cpu;
+	record->missed_events = next->index ? 0 : page->missed_events;
+	reader->last = next;
+
+	return 1;
+}
+
+/**
+ * tc_reader_page_get - Get the page buffer of the last record
+ * @reader - The reader.
+ *
+ * The data of the record that was returned by the last call of
+ * tc_reader_next() stays valid as long as the reference to its page buffer
+ * is held. The buffer is not reused by the reader before that.
+ *
+ * Returns a new reference to the buffer that must be released with
+ * tc_page_put(), or NULL if there is no record.
+ */
+struct tc_page *tc_reader_page_get(struct tc_reader *reader)
+{
+	struct tc_cpu_reader *cpu_reader = reader->last;
+	struct tc_page *buf;
+
+	if (!cpu_reader)
+		return NULL;
+
+	buf = cpu_reader->pages[cpu_reader->tail % reader->queue_size].buf;
+	__atomic_add_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL);
+
+	return buf;
+}
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+
+/*
+ * Copyright 2021 VMware Inc, Yordan Karadzhov <y.karadz@gmail.com>
+ */
+
+#ifndef _TC_FTRACE_READER
+#define _TC_FTRACE_READER
+
+#include <stdbool.h>
+
+// libtracefs
+#include "tracefs.h"
+
+struct tc_reader;
+
+struct tc_page;
+
+enum tc_reader_flags {
+	/** Pin each reader thread to the CPU it reads from. */
+	TC_READER_PIN		= 1 << 0,
+
+	/** Do not use threads. The data is read by the consumer. */
+	TC_READER_NO_THREADS	= 1 << 1,
+};
+
+struct tc_reader *tc_reader_alloc(struct tracefs_instance *instance,
+				  struct tep_handle *tep,
+				  int flags,
+				  unsigned int queue_size);
+
+void tc_reader_free(struct tc_reader *reader);
+
+int tc_reader_start(struct tc_reader *reader);
+
+void tc_reader_stop(struct tc_reader *reader);
+
+int tc_reader_fd(struct tc_reader *reader);
+
+int tc_reader_fill(struct tc_reader *reader);
+
+int tc_reader_wait(struct tc_reader *reader, int timeout);
+
+int tc_reader_next(struct tc_reader *reader, struct tep_record *record);
+
+struct tc_page *tc_reader_page_get(struct tc_reader *reader);
+
+void tc_page_put(struct tc_page *page);
+
+#endif
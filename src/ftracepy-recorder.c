@@ -0,0 +1,709 @@
+// SPDX-License-Identifier: LGPL-2.1
+
+/*
+ * Copyright 2021 VMware Inc, Yordan Karadzhov (VMware) <y.karadz@gmail.com>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif // _GNU_SOURCE
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// trace-cruncher
+#include "ftracepy-recorder.h"
+
+/*
+ * How often (in milliseconds) the recorder threads check the ring buffers
+ * when the kernel does not wake them up.
+ */
+#define TC_RECORDER_POLL_MS	100
+
+/*
+ * The data of each CPU is spliced directly into its own region of the output
+ * file. The regions are sparse and the gaps between them are removed when
+ * the file is finalized. The size of the regions is limited such that the
+ * file does not exceed the maximum file size of the common file systems.
+ */
+#define TC_RECORDER_MAX_REGION	(1ULL << 36)
+#define TC_RECORDER_MAX_FILE	(1ULL << 44)
+
+/* Size of the buffer used to move data when the gaps cannot be collapsed. */
+#define TC_RECORDER_MOVE_BUF	(1 << 20)
+
+struct tc_cpu_recorder {
+	struct tc_recorder	*recorder;
+	int			cpu;
+	pthread_t		thread;
+	bool			running;
+
+	/* The 'trace_pipe_raw' file of the CPU. */
+	int			raw_fd;
+
+	/* Pipe used to splice the pages from 'raw_fd' into the output file. */
+	int			pipe_fd[2];
+
+	/* The region of the output file holding the pages of the CPU. */
+	off_t			offset;
+
+	/* The number of bytes written to the region. */
+	off_t			size;
+
+	bool			error;
+};
+
+struct tc_recorder {
+	char			*output_file;
+	int			fd;
+
+	/* The size of the region of each CPU and of the header. */
+	off_t			region_size;
+
+	/* If false, the output file is removed when the recorder is freed. */
+	bool			written;
+
+	int			nr_cpus;
+	struct tc_cpu_recorder	*cpus;
+	int			page_size;
+
+	/* Signaled to stop the recorder threads. */
+	int			stop_fd;
+	bool			stop;
+};
+
+static ssize_t splice_pages(struct tc_cpu_recorder *cpu_rec)
+{
+	struct tc_recorder *recorder = cpu_rec->recorder;
+	ssize_t n, ret, total;
+	loff_t pos;
+
+	if (cpu_rec->size + recorder->page_size > recorder->region_size) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	n = splice(cpu_rec->raw_fd, NULL, cpu_rec->pipe_fd[1], NULL,
+		   recorder->page_size,
+		   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n <= 0)
+		return n;
+
+	for (total = n; n > 0; n -= ret) {
+		pos = cpu_rec->offset + cpu_rec->size;
+		ret = splice(cpu_rec->pipe_fd[0], NULL, recorder->fd, &pos,
+			     n, SPLICE_F_MOVE);
+		if (ret <= 0)
+			return -1;
+
+		cpu_rec->size += ret;
+	}
+
+	return total;
+}
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+	const char *ptr = data;
+	ssize_t ret;
+
+	while (size) {
+		ret = write(fd, ptr, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			return false;
+
+		ptr += ret;
+		size -= ret;
+	}
+
+	return true;
+}
+
+static bool pwrite_all(int fd, const void *data, size_t size, off_t offset)
+{
+	const char *ptr = data;
+	ssize_t ret;
+
+	while (size) {
+		ret = pwrite(fd, ptr, size, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			return false;
+
+		ptr += ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return true;
+}
+
+/*
+ * The kernel hands over only complete pages via splice(). The pages that
+ * are still being written are retrieved with read(). This is the only case
+ * when the data gets copied to user space.
+ */
+static void flush_pages(struct tc_cpu_recorder *cpu_rec)
+{
+	int page_size = cpu_rec->recorder->page_size;
+	char page[page_size];
+	ssize_t r;
+
+	while (splice_pages(cpu_rec) > 0);
+
+	while ((r = read(cpu_rec->raw_fd, page, page_size)) > 0) {
+		/* The recorded data must consist of complete pages. */
+		memset(page + r, 0, page_size - r);
+		if (cpu_rec->size + page_size > cpu_rec->recorder->region_size ||
+		    !pwrite_all(cpu_rec->recorder->fd, page, page_size,
+				cpu_rec->offset + cpu_rec->size)) {
+			cpu_rec->error = true;
+			return;
+		}
+
+		cpu_rec->size += page_size;
+	}
+}
+
+static void *recorder_thread(void *arg)
+{
+	struct tc_cpu_recorder *cpu_rec = arg;
+	struct tc_recorder *recorder = cpu_rec->recorder;
+	struct pollfd pfd[2] = {
+		{.fd = recorder->stop_fd, .events = POLLIN},
+		{.fd = cpu_rec->raw_fd, .events = POLLIN},
+	};
+	ssize_t n;
+
+	while (!__atomic_load_n(&recorder->stop, __ATOMIC_ACQUIRE)) {
+		n = splice_pages(cpu_rec);
+		if (n > 0)
+			continue;
+
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			cpu_rec->error = true;
+			return NULL;
+		}
+
+		if (poll(pfd, 2, TC_RECORDER_POLL_MS) < 0 && errno != EINTR) {
+			cpu_rec->error = true;
+			return NULL;
+		}
+	}
+
+	flush_pages(cpu_rec);
+
+	return NULL;
+}
+
+static int open_cpu_buffer(struct tracefs_instance *instance, int cpu)
+{
+	char file[64];
+	char *path;
+	int fd;
+
+	snprintf(file, sizeof(file), "per_cpu/cpu%i/trace_pipe_raw", cpu);
+	path = tracefs_instance_get_file(instance, file);
+	if (!path)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_NONBLOCK);
+	tracefs_put_tracing_file(path);
+
+	return fd;
+}
+
+/**
+ * tc_recorder_alloc - Allocate a recorder of the Ftrace ring buffers
+ * @instance - The Ftrace instance to record.
+ * @output_file - The name of the trace.dat file to create.
+ *
+ * This API allocates a recorder that uses one native thread per CPU. The
+ * threads splice the pages of 'trace_pipe_raw' directly into the output
+ * file, so the data is never copied to user space and is written only once.
+ * The output file must be on a file system that supports sparse files. The
+ * threads are started by tc_recorder_start(). The file is finalized by
+ * tc_recorder_write().
+ *
+ * Returns a pointer to the recorder, or NULL in case of an error. The
+ * recorder must be freed with tc_recorder_free().
+ */
+struct tc_recorder *tc_recorder_alloc(struct tracefs_instance *instance,
+				      const char *output_file)
+{
+	struct tc_cpu_recorder *cpu_rec;
+	struct tc_recorder *recorder;
+	int cpu;
+
+	recorder = calloc(1, sizeof(*recorder));
+	if (!recorder)
+		return NULL;
+
+	recorder->stop_fd = recorder->fd = -1;
+	recorder->page_size = getpagesize();
+	recorder->output_file = strdup(output_file);
+	recorder->nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	recorder->cpus = calloc(recorder->nr_cpus, sizeof(*recorder->cpus));
+	if (!recorder->output_file || !recorder->cpus)
+		goto fail;
+
+	recorder->region_size = TC_RECORDER_MAX_FILE / (recorder->nr_cpus + 1);
+	if (recorder->region_size > TC_RECORDER_MAX_REGION)
+		recorder->region_size = TC_RECORDER_MAX_REGION;
+
+	recorder->region_size &= ~((off_t) recorder->page_size - 1);
+
+	for (cpu = 0; cpu < recorder->nr_cpus; ++cpu) {
+		cpu_rec = &recorder->cpus[cpu];
+		cpu_rec->raw_fd = -1;
+		cpu_rec->pipe_fd[0] = cpu_rec->pipe_fd[1] = -1;
+	}
+
+	recorder->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (recorder->stop_fd < 0)
+		goto fail;
+
+	recorder->fd = open(output_file,
+			    O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (recorder->fd < 0)
+		goto fail;
+
+	for (cpu = 0; cpu < recorder->nr_cpus; ++cpu) {
+		cpu_rec = &recorder->cpus[cpu];
+		cpu_rec->recorder = recorder;
+		cpu_rec->cpu = cpu;
+
+		/* The first region is reserved for the header. */
+		cpu_rec->offset = (cpu + 1) * recorder->region_size;
+
+		/* CPUs that are not online have no buffers. Skip those. */
+		cpu_rec->raw_fd = open_cpu_buffer(instance, cpu);
+		if (cpu_rec->raw_fd < 0)
+			continue;
+
+		if (pipe2(cpu_rec->pipe_fd, O_CLOEXEC) < 0)
+			goto fail;
+	}
+
+	return recorder;
+
+ fail:
+	tc_recorder_free(recorder);
+	return NULL;
+}
+
+static void close_fd(int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+/**
+ * tc_recorder_free - Free a recorder
+ * @recorder - The recorder to be freed.
+ *
+ * If the recorder threads are still running, they are stopped first. If
+ * the output file was not finalized by tc_recorder_write(), it is removed.
+ */
+void tc_recorder_free(struct tc_recorder *recorder)
+{
+	struct tc_cpu_recorder *cpu_rec;
+	int cpu;
+
+	if (!recorder)
+		return;
+
+	tc_recorder_stop(recorder);
+	for (cpu = 0; cpu < recorder->nr_cpus && recorder->cpus; ++cpu) {
+		cpu_rec = &recorder->cpus[cpu];
+		close_fd(cpu_rec->raw_fd);
+		close_fd(cpu_rec->pipe_fd[0]);
+		close_fd(cpu_rec->pipe_fd[1]);
+	}
+
+	if (recorder->fd >= 0) {
+		close(recorder->fd);
+		if (!recorder->written)
+			unlink(recorder->output_file);
+	}
+
+	close_fd(recorder->stop_fd);
+	free(recorder->output_file);
+	free(recorder->cpus);
+	free(recorder);
+}
+
+/**
+ * tc_recorder_start - Start the recorder threads
+ * @recorder - The recorder.
+ *
+ * Returns 0 on success, -1 in case of an error. On error, the threads that
+ * have been started already are stopped.
+ */
+int tc_recorder_start(struct tc_recorder *recorder)
+{
+	struct tc_cpu_recorder *cpu_rec;
+	int cpu;
+
+	__atomic_store_n(&recorder->stop, false, __ATOMIC_RELEASE);
+	for (cpu = 0; cpu < recorder->nr_cpus; ++cpu) {
+		cpu_rec = &recorder->cpus[cpu];
+		if (cpu_rec->raw_fd < 0)
+			continue;
+
+		if (pthread_create(&cpu_rec->thread, NULL,
+				   recorder_thread, cpu_rec) != 0) {
+			tc_recorder_stop(recorder);
+			return -1;
+		}
+
+		cpu_rec->running = true;
+	}
+
+	return 0;
+}
+
+/**
+ * tc_recorder_stop - Stop the recorder threads
+ * @recorder - The recorder.
+ *
+ * Before exiting, each thread records all data that is still in the
+ * ring buffer of its CPU.
+ */
+void tc_recorder_stop(struct tc_recorder *recorder)
+{
+	int cpu;
+
+	__atomic_store_n(&recorder->stop, true, __ATOMIC_RELEASE);
+	if (recorder->stop_fd >= 0)
+		eventfd_write(recorder->stop_fd, 1);
+
+	for (cpu = 0; cpu < recorder->nr_cpus && recorder->cpus; ++cpu) {
+		if (!recorder->cpus[cpu].running)
+			continue;
+
+		pthread_join(recorder->cpus[cpu].thread, NULL);
+		recorder->cpus[cpu].running = false;
+	}
+}
+
+static bool write_u16(int fd, uint16_t val)
+{
+	return write_all(fd, &val, sizeof(val));
+}
+
+static bool write_u32(int fd, uint32_t val)
+{
+	return write_all(fd, &val, sizeof(val));
+}
+
+static bool write_u64(int fd, uint64_t val)
+{
+	return write_all(fd, &val, sizeof(val));
+}
+
+static bool write_str(int fd, const char *str)
+{
+	return write_all(fd, str, strlen(str) + 1);
+}
+
+/* Write the size of the data (4 or 8 bytes), followed by the data itself. */
+static bool write_data(int fd, const char *data, int size, int size_len)
+{
+	if (!data)
+		size = 0;
+
+	if (!(size_len == 4 ? write_u32(fd, size) : write_u64(fd, size)))
+		return false;
+
+	return write_all(fd, data, size);
+}
+
+static bool write_tracing_file(int fd, const char *file, int size_len)
+{
+	char *data;
+	int size = 0;
+	bool ret;
+
+	data = tracefs_instance_file_read(NULL, file, &size);
+	ret = write_data(fd, data, size, size_len);
+	free(data);
+
+	return ret;
+}
+
+static bool write_section(int fd, const char *name, const char *file)
+{
+	return write_str(fd, name) && write_tracing_file(fd, file, 8);
+}
+
+static bool patch_u32(int fd, off_t offset, uint32_t val)
+{
+	return pwrite(fd, &val, sizeof(val), offset) == sizeof(val);
+}
+
+/*
+ * Write the number of events, followed by the size and the content of the
+ * format file of each event of the system.
+ */
+static bool write_system_formats(int fd, const char *system)
+{
+	char **events, *format;
+	off_t count_offset;
+	int size, count = 0;
+	bool ret = false;
+	int i;
+
+	events = tracefs_system_events(tracefs_tracing_dir(), system);
+	count_offset = lseek(fd, 0, SEEK_CUR);
+	if (!write_u32(fd, 0))
+		goto out;
+
+	for (i = 0; events && events[i]; ++i) {
+		format = tracefs_event_file_read(NULL, system, events[i],
+						 "format", &size);
+		if (!format)
+			continue;
+
+		ret = write_data(fd, format, size, 8);
+		free(format);
+		if (!ret)
+			goto out;
+
+		++count;
+	}
+
+	ret = patch_u32(fd, count_offset, count);
+
+ out:
+	tracefs_list_free(events);
+
+	return ret;
+}
+
+static bool write_event_formats(int fd)
+{
+	off_t count_offset;
+	bool ret = false;
+	char **systems;
+	int i, count = 0;
+
+	systems = tracefs_event_systems(tracefs_tracing_dir());
+	count_offset = lseek(fd, 0, SEEK_CUR);
+	if (!write_u32(fd, 0))
+		goto out;
+
+	for (i = 0; systems && systems[i]; ++i) {
+		if (strcmp(systems[i], "ftrace") == 0)
+			continue;
+
+		if (!write_str(fd, systems[i]) ||
+		    !write_system_formats(fd, systems[i]))
+			goto out;
+
+		++count;
+	}
+
+	ret = patch_u32(fd, count_offset, count);
+
+ out:
+	tracefs_list_free(systems);
+
+	return ret;
+}
+
+static char *read_proc_file(const char *path, int *size)
+{
+	char *buf = NULL, *tmp;
+	int fd, len = 0, buf_size = 0;
+	ssize_t r;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	do {
+		if (len == buf_size) {
+			buf_size = buf_size ? 2 * buf_size : 64 * 1024;
+			tmp = realloc(buf, buf_size);
+			if (!tmp) {
+				free(buf);
+				buf = NULL;
+				break;
+			}
+
+			buf = tmp;
+		}
+
+		r = read(fd, buf + len, buf_size - len);
+		if (r > 0)
+			len += r;
+	} while (r > 0);
+
+	close(fd);
+	*size = len;
+
+	return buf;
+}
+
+static bool write_kallsyms(int fd)
+{
+	char *data;
+	int size = 0;
+	bool ret;
+
+	data = read_proc_file("/proc/kallsyms", &size);
+	ret = write_data(fd, data, size, 4);
+	free(data);
+
+	return ret;
+}
+
+static bool write_header(struct tc_recorder *recorder, int fd)
+{
+	static const char magic[] = {0x17, 0x08, 0x44, 't', 'r', 'a', 'c', 'i', 'n', 'g'};
+	const uint16_t endian_test = 1;
+	char endian = *(const char *) &endian_test ? 0 : 1;
+	char long_size = sizeof(long);
+
+	return write_all(fd, magic, sizeof(magic)) &&
+	       write_str(fd, "6") &&
+	       write_all(fd, &endian, 1) &&
+	       write_all(fd, &long_size, 1) &&
+	       write_u32(fd, recorder->page_size) &&
+	       write_section(fd, "header_page", "events/header_page") &&
+	       write_section(fd, "header_event", "events/header_event") &&
+	       write_system_formats(fd, "ftrace") &&
+	       write_event_formats(fd) &&
+	       write_kallsyms(fd) &&
+	       write_tracing_file(fd, "printk_formats", 4) &&
+	       write_tracing_file(fd, "saved_cmdlines", 8) &&
+	       write_u32(fd, recorder->nr_cpus) &&
+	       write_all(fd, "options  ", 10) &&
+	       write_u16(fd, 0) &&
+	       write_str(fd, "flyrecord");
+}
+
+/* Move data towards the beginning of the file, through a buffer. */
+static bool copy_data(int fd, off_t from, off_t to, off_t size)
+{
+	size_t len;
+	ssize_t r;
+	char *buf;
+
+	buf = malloc(TC_RECORDER_MOVE_BUF);
+	if (!buf)
+		return false;
+
+	while (size) {
+		len = size < TC_RECORDER_MOVE_BUF ? size : TC_RECORDER_MOVE_BUF;
+		r = pread(fd, buf, len, from);
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		if (r <= 0 || !pwrite_all(fd, buf, r, to))
+			break;
+
+		from += r;
+		to += r;
+		size -= r;
+	}
+
+	free(buf);
+
+	return !size;
+}
+
+/*
+ * Move the data of the CPU from its region to its final offset. The gap in
+ * front of the data is collapsed, so that the data itself is not rewritten.
+ * The data of all following regions moves together with it, by 'shift'
+ * bytes in total. If the file system cannot collapse ranges, the data is
+ * copied.
+ */
+static bool move_cpu_data(struct tc_cpu_recorder *cpu_rec, off_t offset,
+			  off_t *shift)
+{
+	int fd = cpu_rec->recorder->fd;
+	off_t pos = cpu_rec->offset - *shift;
+
+	if (pos == offset)
+		return true;
+
+	if (fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, offset, pos - offset) == 0) {
+		*shift += pos - offset;
+		return true;
+	}
+
+	if (errno != EOPNOTSUPP && errno != EINVAL)
+		return false;
+
+	return copy_data(fd, pos, offset, cpu_rec->size);
+}
+
+/**
+ * tc_recorder_write - Finalize the output file
+ * @recorder - The recorder. Its threads must be stopped.
+ *
+ * This API writes a trace.dat file (version 6), containing the event formats
+ * and the recorded data of all CPUs.
+ *
+ * Returns 0 on success, -1 in case of an error.
+ */
+int tc_recorder_write(struct tc_recorder *recorder)
+{
+	struct tc_cpu_recorder *cpu_rec;
+	off_t table, offset, shift = 0;
+	int cpu, fd = recorder->fd;
+
+	if (lseek(fd, 0, SEEK_SET) < 0 || !write_header(recorder, fd))
+		return -1;
+
+	/* The table of offsets and sizes of the data of each CPU. */
+	table = lseek(fd, 0, SEEK_CUR);
+	offset = table + recorder->nr_cpus * 2 * sizeof(uint64_t);
+	if (offset > recorder->region_size)
+		return -1;
+
+	for (cpu = 0; cpu < recorder->nr_cpus; ++cpu) {
+		cpu_rec = &recorder->cpus[cpu];
+		if (cpu_rec->error)
+			return -1;
+
+		/* The data of each CPU starts at a page boundary. */
+		offset = (offset + recorder->page_size - 1) &
+			 ~((off_t) recorder->page_size - 1);
+
+		if (lseek(fd, table, SEEK_SET) < 0 ||
+		    !write_u64(fd, offset) ||
+		    !write_u64(fd, cpu_rec->size))
+			return -1;
+
+		table += 2 * sizeof(uint64_t);
+		if (cpu_rec->size && !move_cpu_data(cpu_rec, offset, &shift))
+			return -1;
+
+		offset += cpu_rec->size;
+	}
+
+	if (ftruncate(fd, offset) < 0)
+		return -1;
+
+	recorder->written = true;
+
+	return 0;
+}
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+
+/*
+ * Copyright 2021 VMware Inc, Yordan Karadzhov <y.karadz@gmail.com>
+ */
+
+#ifndef _TC_FTRACE_RECORDER
+#define _TC_FTRACE_RECORDER
+
+// libtracefs
+#include "tracefs.h"
+
+struct tc_recorder;
+
+struct tc_recorder *tc_recorder_alloc(struct tracefs_instance *instance,
+				      const char *output_file);
+
+void tc_recorder_free(struct tc_recorder *recorder);
+
+int tc_recorder_start(struct tc_recorder *recorder);
+
+void tc_recorder_stop(struct tc_recorder *recorder);
+
+int tc_recorder_write(struct tc_recorder *recorder);
+
+#endif
@@ -11,18 +11,28 @@
 // C
 #include <unistd.h>
 #include <search.h>
+#include <dirent.h>
 #include <string.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <semaphore.h>
+#include <pthread.h>
 #include <time.h>
+#include <poll.h>
+#include <fcntl.h>
 
 // trace-cruncher
 #include "tcrunch-base.h"
 #include "ftracepy-utils.h"
+#include "ftracepy-reader.h"
+#include "ftracepy-recorder.h"
 #include "trace-obj-debug.h"
 
+// NumPy
+#define NO_IMPORT_ARRAY
+#include "numpy/arrayobject.h"
+
 PyObject *TFS_ERROR;
 PyObject *TEP_ERROR;
 PyObject *TRACECRUNCHER_ERROR;
@@ -168,6 +178,68 @@ static void TfsError_setstr(struct tracefs_instance *instance,
 	}
 }
 
+/*
+ * A record that can be kept by the user. Its payload stays valid because
+ * the record holds a reference to the page buffer of the parallel reader,
+ * or to the batch that contains the payload. If there is no such owner,
+ * the payload is copied right after the record.
+ */
+struct tc_record {
+	struct tep_record	record;
+	struct tc_page		*page;
+	PyObject		*owner;
+};
+
+/*
+ * Copy the record header. The copy takes the reference to 'page' or to
+ * 'owner'.
+ */
+static struct tep_record *tc_record_copy(struct tep_record *record,
+					 struct tc_page *page,
+					 PyObject *owner)
+{
+	size_t size = sizeof(struct tc_record);
+	struct tc_record *copy;
+
+	if (!page && !owner)
+		size += record->size;
+
+	copy = malloc(size);
+	if (!copy) {
+		tc_page_put(page);
+		Py_XDECREF(owner);
+		return NULL;
+	}
+
+	copy->record = *record;
+	copy->page = page;
+	copy->owner = owner;
+	if (!page && !owner) {
+		copy->record.data = copy + 1;
+		memcpy(copy->record.data, record->data, record->size);
+	}
+
+	return &copy->record;
+}
+
+/*
+ * Free a copy made by tc_record_copy(). Only the Python objects that own
+ * their record (the "destroy" flag is set) call this.
+ */
+int tc_record_destroy(struct tep_record *record)
+{
+	struct tc_record *copy = (struct tc_record *) record;
+
+	if (!record)
+		return 0;
+
+	tc_page_put(copy->page);
+	Py_XDECREF(copy->owner);
+	free(copy);
+
+	return 0;
+}
+
 PyObject *PyTepRecord_time(PyTepRecord* self)
 {
 	unsigned long ts = self->ptrObj ? self->ptrObj->ts : 0;
@@ -180,2626 +252,4966 @@ PyObject *PyTepRecord_cpu(PyTepRecord* self)
 	return PyLong_FromLong(cpu);
 }
 
-PyObject *PyTepEvent_name(PyTepEvent* self)
+/*
+ * Export the payload of the record as a read-only buffer. A record that
+ * is borrowed from the reader (inside the callback) gets its own copy
+ * first, so that the buffer stays valid as long as the object.
+ */
+int PyTepRecord_getbuffer(PyTepRecord *self, Py_buffer *view, int flags)
 {
-	const char *name = self->ptrObj ? self->ptrObj->name : TC_NIL_MSG;
-	return PyUnicode_FromString(name);
+	struct tep_record *record;
+
+	if (!self->ptrObj) {
+		PyErr_SetString(TEP_ERROR, "The record is not initialized.");
+		view->obj = NULL;
+		return -1;
+	}
+
+	if (!self->destroy) {
+		record = tc_record_copy(self->ptrObj, NULL, NULL);
+		if (!record) {
+			MEM_ERROR;
+			view->obj = NULL;
+			return -1;
+		}
+
+		self->ptrObj = record;
+		self->destroy = true;
+	}
+
+	return PyBuffer_FillInfo(view, (PyObject *) self, self->ptrObj->data,
+				 self->ptrObj->size, 1, flags);
 }
 
-PyObject *PyTepEvent_id(PyTepEvent* self)
+void tc_record_batch_free(struct tc_record_batch *batch)
 {
-	int id = self->ptrObj ? self->ptrObj->id : -1;
-	return PyLong_FromLong(id);
+	if (!batch)
+		return;
+
+	free(batch->records);
+	free(batch->events);
+	free(batch->data_offsets);
+	free(batch->data);
+	tc_tep_put(batch->tep);
+	Py_XDECREF(batch->owner);
+	free(batch);
 }
 
-PyObject *PyTepEvent_field_names(PyTepEvent* self)
+static struct tc_tep *tc_tep_ref(struct tc_tep *tt);
+
+/* An event, together with the tep handle it belongs to. */
+struct tc_event {
+	struct tep_event	*event;
+	struct tc_tep		*tep;
+};
+
+void tc_event_free(struct tc_event *event)
 {
-	struct tep_format_field *field, **fields;
-	struct tep_event *event = self->ptrObj;
-	int i = 0, nr_fields;
-	PyObject *list;
+	if (!event)
+		return;
 
-	nr_fields= event->format.nr_fields + event->format.nr_common;
-	list = PyList_New(nr_fields);
+	tc_tep_put(event->tep);
+	free(event);
+}
 
-	/* Get all common fields. */
-	fields = tep_event_common_fields(event);
-	if (!fields) {
-		PyErr_Format(TEP_ERROR,
-			     "Failed to get common fields for event \'%s\'",
-			     self->ptrObj->name);
-		return NULL;
-	}
+/* The Python object holds a reference to the tep handle of the event. */
+static PyObject *tc_event_to_py(struct tc_tep *tt, struct tep_event *event)
+{
+	struct tc_event *tc_event;
+	PyObject *py_event;
 
-	for (field = *fields; field; field = field->next)
-		PyList_SET_ITEM(list, i++, PyUnicode_FromString(field->name));
-	free(fields);
+	if (!event)
+		return PyTepEvent_New(NULL);
 
-	/* Add all unique fields. */
-	fields = tep_event_fields(event);
-	if (!fields) {
-		PyErr_Format(TEP_ERROR,
-			     "Failed to get fields for event \'%s\'",
-			     self->ptrObj->name);
+	tc_event = malloc(sizeof(*tc_event));
+	if (!tc_event) {
+		MEM_ERROR;
 		return NULL;
 	}
 
-	for (field = *fields; field; field = field->next)
-		PyList_SET_ITEM(list, i++, PyUnicode_FromString(field->name));
-	free(fields);
+	tc_event->event = event;
+	tc_event->tep = tc_tep_ref(tt);
+	py_event = PyTepEvent_New(tc_event);
+	if (!py_event)
+		tc_event_free(tc_event);
 
-	return list;
+	return py_event;
 }
 
-static bool is_number(struct tep_format_field *field)
+/*
+ * The events of a tep handle do not change, hence a single Python object
+ * per event is sufficient. The cache holds a reference to each object, so
+ * the objects live as long as the cache. Returns a borrowed reference.
+ */
+static PyObject *tc_event_cache_get(struct tc_event_cache *cache,
+				    struct tep_event *event)
 {
-	int number_field_mask = TEP_FIELD_IS_SIGNED |
-				TEP_FIELD_IS_LONG |
-				TEP_FIELD_IS_FLAG;
+	PyObject **events;
+	int size;
 
-	return !field->flags || field->flags & number_field_mask;
-}
+	if (event->id >= cache->size) {
+		size = cache->size ? cache->size : 256;
+		while (event->id >= size)
+			size *= 2;
 
-PyObject *PyTepEvent_parse_record_field(PyTepEvent* self, PyObject *args,
-							  PyObject *kwargs)
-{
-	struct tep_format_field *field;
-	int field_offset, field_size;
-	const char *field_name;
-	PyTepRecord *record;
+		events = realloc(cache->events, size * sizeof(*events));
+		if (!events) {
+			MEM_ERROR;
+			return NULL;
+		}
 
-	static char *kwlist[] = {"record", "field", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "Os",
-					 kwlist,
-					 &record,
-					 &field_name)) {
-		return NULL;
+		memset(events + cache->size, 0,
+		       (size - cache->size) * sizeof(*events));
+		cache->events = events;
+		cache->size = size;
 	}
 
-	field = tep_find_field(self->ptrObj, field_name);
-	if (!field)
-		field = tep_find_common_field(self->ptrObj, field_name);
+	if (!cache->events[event->id])
+		cache->events[event->id] = tc_event_to_py(cache->tep, event);
 
-	if (!field) {
-		PyErr_Format(TEP_ERROR,
-			     "Failed to find field \'%s\' in event \'%s\'",
-			     field_name, self->ptrObj->name);
-		return NULL;
-	}
+	return cache->events[event->id];
+}
 
-	if (field->flags & TEP_FIELD_IS_DYNAMIC) {
-		unsigned long long val;
+static void tc_event_cache_clear(struct tc_event_cache *cache)
+{
+	int i;
 
-		val = tep_read_number(self->ptrObj->tep,
-				      record->ptrObj->data + field->offset,
-				      field->size);
-		field_offset = val & 0xffff;
-		field_size = val >> 16;
-	} else {
-		field_offset = field->offset;
-		field_size = field->size;
-	}
+	for (i = 0; i < cache->size; ++i)
+		Py_XDECREF(cache->events[i]);
 
-	if (!field_size)
-		return PyUnicode_FromString(TC_NIL_MSG);
+	free(cache->events);
+	cache->events = NULL;
+	cache->size = 0;
+}
 
-	if (field->flags & TEP_FIELD_IS_STRING) {
-		char *val_str = record->ptrObj->data + field_offset;
-		return PyUnicode_FromString(val_str);
-	} else if (is_number(field)) {
-		unsigned long long val;
+static struct tc_record_batch *tc_record_batch_alloc(int size)
+{
+	struct tc_record_batch *batch;
 
-		tep_read_number_field(field, record->ptrObj->data, &val);
-		return PyLong_FromLong(val);
-	} else if (field->flags & TEP_FIELD_IS_POINTER) {
-		void *val = record->ptrObj->data + field_offset;
-		char ptr_string[11];
+	batch = calloc(1, sizeof(*batch));
+	if (!batch)
+		return NULL;
 
-		sprintf(ptr_string, "%p", val);
-		return PyUnicode_FromString(ptr_string);
+	batch->records = calloc(size, sizeof(*batch->records));
+	batch->events = calloc(size, sizeof(*batch->events));
+	batch->data_offsets = calloc(size, sizeof(*batch->data_offsets));
+	if (!batch->records || !batch->events || !batch->data_offsets) {
+		tc_record_batch_free(batch);
+		return NULL;
 	}
 
-	PyErr_Format(TEP_ERROR,
-		     "Unsupported field format \"%li\" (TODO: implement this)",
-		     field->flags);
-	return NULL;
+	batch->size = size;
+
+	return batch;
 }
 
-int get_pid(struct tep_event *event, struct tep_record *record)
+static bool tc_record_batch_resize(struct tc_record_batch *batch, int size)
 {
-	const char *field_name = "common_pid";
-	struct tep_format_field *field;
-	unsigned long long val;
+	struct tep_record *records;
+	struct tep_event **events;
+	size_t *offsets;
 
-	field = tep_find_common_field(event, field_name);
-	if (!field) {
-		PyErr_Format(TEP_ERROR,
-			     "Failed to find field \'s\' in event \'%s\'",
-			     field_name, event->name);
-		return -1;
-	}
+	records = realloc(batch->records, size * sizeof(*records));
+	if (!records)
+		return false;
 
-	tep_read_number_field(field, record->data, &val);
+	batch->records = records;
+	events = realloc(batch->events, size * sizeof(*events));
+	if (!events)
+		return false;
 
-	return val;
+	batch->events = events;
+	offsets = realloc(batch->data_offsets, size * sizeof(*offsets));
+	if (!offsets)
+		return false;
+
+	batch->data_offsets = offsets;
+	batch->size = size;
+
+	return true;
 }
 
-PyObject *PyTepEvent_get_pid(PyTepEvent* self, PyObject *args,
-					       PyObject *kwargs)
+#define RECORD_BATCH_INIT_SIZE		1024
+#define RECORD_BATCH_INIT_DATA_SIZE	(64 * 1024)
+
+/*
+ * Copy the record into the batch. The payload of the record is only valid
+ * within the scope of the iteration callback, hence it has to be copied.
+ */
+static bool tc_record_batch_add(struct tc_record_batch *batch,
+				struct tep_event *event,
+				struct tep_record *record)
 {
-	static char *kwlist[] = {"record", NULL};
-	PyTepRecord *record;
-	int pid;
+	size_t data_size;
+	char *data;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "O",
-					 kwlist,
-					 &record)) {
-		return NULL;
+	if (batch->count == batch->size &&
+	    !tc_record_batch_resize(batch, 2 * batch->size))
+		return false;
+
+	if (batch->data_len + record->size > batch->data_size) {
+		data_size = batch->data_size ? batch->data_size :
+					       RECORD_BATCH_INIT_DATA_SIZE;
+		while (batch->data_len + record->size > data_size)
+			data_size *= 2;
+
+		data = realloc(batch->data, data_size);
+		if (!data)
+			return false;
+
+		batch->data = data;
+		batch->data_size = data_size;
 	}
 
-	pid = get_pid(self->ptrObj, record->ptrObj);
-	if (pid < 0)
-		return NULL;
+	memcpy(batch->data + batch->data_len, record->data, record->size);
+	batch->records[batch->count] = *record;
+	batch->records[batch->count].data = NULL;
+	batch->events[batch->count] = event;
+	batch->data_offsets[batch->count] = batch->data_len;
+	batch->data_len += record->size;
+	++batch->count;
 
-	return PyLong_FromLong(pid);
+	return true;
 }
 
-static struct tep_handle *get_tep(const char *dir, const char **sys_names)
+/*
+ * The "data" buffer may be reallocated while records are being added.
+ * Point the records to their payload once the batch is complete.
+ */
+static void tc_record_batch_finalize(struct tc_record_batch *batch)
 {
-	struct tep_handle *tep;
+	int i;
 
-	tep = tracefs_local_events_system(dir, sys_names);
-	if (!tep) {
-		TfsError_fmt(NULL,
-			     "Failed to get local 'tep' event from %s", dir?dir:"N/A");
-		return NULL;
+	for (i = 0; i < batch->count; ++i)
+		batch->records[i].data = batch->data + batch->data_offsets[i];
+}
+
+static bool batch_check_index(PyTepRecordBatch *self, Py_ssize_t i)
+{
+	if (!self->ptrObj || i < 0 || i >= self->ptrObj->count) {
+		PyErr_Format(PyExc_IndexError,
+			     "Record index %zi is out of range.", i);
+		return false;
 	}
 
-	return tep;
+	return true;
 }
 
-PyObject *PyTep_init_local(PyTep *self, PyObject *args,
-					PyObject *kwargs)
+static bool batch_index_from_arg(PyTepRecordBatch *self,
+				 PyObject *args, PyObject *kwargs,
+				 int *index)
 {
-	static char *kwlist[] = {"dir", "systems", NULL};
-	struct tep_handle *tep = NULL;
-	PyObject *system_list = NULL;
-	const char *dir_str;
+	static char *kwlist[] = {"index", NULL};
 
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "s|O",
+					 "i",
 					 kwlist,
-					 &dir_str,
-					 &system_list)) {
-		return NULL;
+					 index)) {
+		return false;
 	}
 
-	if (system_list) {
-		const char **sys_names = NULL;
+	return batch_check_index(self, *index);
+}
 
-		if (tc_list_get_str(system_list, &sys_names, NULL) || !sys_names) {
-			TfsError_setstr(NULL,
-					"Inconsistent \"systems\" argument.");
-			return NULL;
-		}
+PyObject *PyTepRecordBatch_size(PyTepRecordBatch *self)
+{
+	int size = self->ptrObj ? self->ptrObj->count : 0;
+	return PyLong_FromLong(size);
+}
 
-		tep = get_tep(dir_str, sys_names);
-		free(sys_names);
-	} else {
-		tep = get_tep(dir_str, NULL);
+/* Export the payload of all records of the batch as a read-only buffer. */
+int PyTepRecordBatch_getbuffer(PyTepRecordBatch *self, Py_buffer *view,
+			       int flags)
+{
+	if (!self->ptrObj) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"The batch is not initialized.");
+		view->obj = NULL;
+		return -1;
 	}
 
-	if (!tep)
-		return NULL;
-
-	tep_free(self->ptrObj);
-	self->ptrObj = tep;
-
-	Py_RETURN_NONE;
+	return PyBuffer_FillInfo(view, (PyObject *) self, self->ptrObj->data,
+				 self->ptrObj->data_len, 1, flags);
 }
 
-PyObject *PyTep_get_event(PyTep *self, PyObject *args,
-				       PyObject *kwargs)
+static PyObject *batch_event_to_py(struct tc_record_batch *batch, int i)
 {
-	static char *kwlist[] = {"system", "name", NULL};
-	const char *system, *event_name;
-	struct tep_event *event;
+	PyObject *py_event;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "ss",
-					 kwlist,
-					 &system,
-					 &event_name)) {
-		return NULL;
-	}
+	if (!batch->event_cache)
+		return tc_event_to_py(batch->tep, batch->events[i]);
 
-	event = tep_find_event_by_name(self->ptrObj, system, event_name);
+	py_event = tc_event_cache_get(batch->event_cache, batch->events[i]);
+	Py_XINCREF(py_event);
 
-	return PyTepEvent_New(event);
+	return py_event;
 }
 
-static struct trace_seq seq;
-
-static bool init_print_seq(void)
+/* The record keeps the batch (and hence its payload) alive. */
+static PyObject *batch_record_to_py(PyTepRecordBatch *self, int i)
 {
-	if (!seq.buffer)
-		trace_seq_init(&seq);
+	struct tep_record *record;
 
-	if (!seq.buffer) {
-		PyErr_SetString(TFS_ERROR, "Unable to initialize 'trace_seq'.");
-		return false;
+	Py_INCREF(self);
+	record = tc_record_copy(&self->ptrObj->records[i], NULL,
+				(PyObject *) self);
+	if (!record) {
+		MEM_ERROR;
+		return NULL;
 	}
 
-	trace_seq_reset(&seq);
-
-	return true;
+	return PyTepRecord_New(record);
 }
 
-static inline void trim_new_line(char *val)
+PyObject *PyTepRecordBatch_event(PyTepRecordBatch *self, PyObject *args,
+						       PyObject *kwargs)
 {
-	if (val[strlen(val) - 1] == '\n')
-		val[strlen(val) - 1] = '\0';
+	int i;
+
+	if (!batch_index_from_arg(self, args, kwargs, &i))
+		return NULL;
+
+	return batch_event_to_py(self->ptrObj, i);
 }
 
-static char *get_comm_from_pid(int pid)
+PyObject *PyTepRecordBatch_record(PyTepRecordBatch *self, PyObject *args,
+							PyObject *kwargs)
 {
-	char *comm_file, *comm = NULL;
-	char buff[PATH_MAX] = {0};
-	int fd, r;
+	int i;
 
-	if (asprintf(&comm_file, "/proc/%i/comm", pid) <= 0) {
-		MEM_ERROR;
+	if (!batch_index_from_arg(self, args, kwargs, &i))
 		return NULL;
-	}
 
-	/*
-	 * This file is not guaranteed to exist. Return NULL if the process
-	 * is no longer active.
-	 */
-	fd = open(comm_file, O_RDONLY);
-	free(comm_file);
-	if (fd < 0)
-		return NULL;
-
-	r = read(fd, buff, PATH_MAX);
-	close(fd);
-	if (r <= 0)
-		return NULL;
-
-	trim_new_line(buff);
-	comm = strdup(buff);
-	if (!comm)
-		MEM_ERROR;
+	return batch_record_to_py(self, i);
+}
 
-	return comm;
+Py_ssize_t PyTepRecordBatch_len(PyTepRecordBatch *self)
+{
+	return self->ptrObj ? self->ptrObj->count : 0;
 }
 
-static void print_comm_pid(struct tep_handle *tep,
-			   struct trace_seq *seq,
-			   struct tep_record *record,
-			   struct tep_event *event)
+PyObject *PyTepRecordBatch_item(PyTepRecordBatch *self, Py_ssize_t i)
 {
-	int pid = get_pid(event, record);
-	if (!tep_is_pid_registered(tep, pid)) {
-		char *comm = get_comm_from_pid(pid);
-		if (comm) {
-			tep_register_comm(tep, comm, pid);
-			free(comm);
-		}
+	PyObject *item, *py_event, *py_record;
+
+	if (!batch_check_index(self, i))
+		return NULL;
+
+	py_event = batch_event_to_py(self->ptrObj, i);
+	if (!py_event)
+		return NULL;
+
+	py_record = batch_record_to_py(self, i);
+	if (!py_record) {
+		Py_DECREF(py_event);
+		return NULL;
 	}
 
-	tep_print_event(tep, seq, record, "%s-%i",
-			TEP_PRINT_COMM,
-			TEP_PRINT_PID);
+	item = PyTuple_New(2);
+	PyTuple_SET_ITEM(item, 0, py_event);
+	PyTuple_SET_ITEM(item, 1, py_record);
+
+	return item;
 }
 
-static void print_name_info(struct tep_handle *tep,
-			    struct trace_seq *seq,
-			    struct tep_record *record,
-			    struct tep_event *event)
+PyObject *PyTepEvent_name(PyTepEvent* self)
 {
-	trace_seq_printf(seq, " %s: ", event->name);
-	tep_print_event(tep, seq, record, "%s", TEP_PRINT_INFO);
+	const char *name = self->ptrObj ? self->ptrObj->event->name : TC_NIL_MSG;
+	return PyUnicode_FromString(name);
 }
 
-static void print_event(struct tep_handle *tep,
-			struct trace_seq *seq,
-			struct tep_record *record,
-			struct tep_event *event)
+PyObject *PyTepEvent_id(PyTepEvent* self)
 {
-	tep_print_event(tep, seq, record, "%6.1000d ", TEP_PRINT_TIME);
-	print_comm_pid(tep, seq, record, event);
-	tep_print_event(tep, seq, record, " cpu=%i ", TEP_PRINT_CPU);
-	print_name_info(tep, seq, record, event);
+	int id = self->ptrObj ? self->ptrObj->event->id : -1;
+	return PyLong_FromLong(id);
 }
 
-static bool print_init(PyObject *args, PyObject *kwargs,
-		       struct tep_event **event,
-		       struct tep_record **record)
+PyObject *PyTepEvent_field_names(PyTepEvent* self)
 {
-	static char *kwlist[] = { "event", "record", NULL};
-	PyObject *obj_rec, *obj_evt;
-	PyTepRecord *py_record;
-	PyTepEvent *py_event;
+	struct tep_format_field *field, **fields;
+	struct tep_event *event = self->ptrObj->event;
+	int i = 0, nr_fields;
+	PyObject *list;
 
-	if (!init_print_seq())
-		return false;
+	nr_fields= event->format.nr_fields + event->format.nr_common;
+	list = PyList_New(nr_fields);
 
-	if(!PyArg_ParseTupleAndKeywords(args,
-					kwargs,
-					"OO",
-					kwlist,
-					&obj_evt,
-					&obj_rec)) {
-		return false;
+	/* Get all common fields. */
+	fields = tep_event_common_fields(event);
+	if (!fields) {
+		PyErr_Format(TEP_ERROR,
+			     "Failed to get common fields for event \'%s\'",
+			     event->name);
+		return NULL;
 	}
 
-	if (PyTepEvent_Check(obj_evt) && PyTepRecord_Check(obj_rec)) {
-		py_event = (PyTepEvent *)obj_evt;
-		*event = py_event->ptrObj;
-		py_record = (PyTepRecord *)obj_rec;
-		*record = py_record->ptrObj;
+	for (field = *fields; field; field = field->next)
+		PyList_SET_ITEM(list, i++, PyUnicode_FromString(field->name));
+	free(fields);
 
-		return true;
+	/* Add all unique fields. */
+	fields = tep_event_fields(event);
+	if (!fields) {
+		PyErr_Format(TEP_ERROR,
+			     "Failed to get fields for event \'%s\'",
+			     event->name);
+		return NULL;
 	}
 
-	PyErr_SetString(TRACECRUNCHER_ERROR,
-			"Inconsistent arguments.");
+	for (field = *fields; field; field = field->next)
+		PyList_SET_ITEM(list, i++, PyUnicode_FromString(field->name));
+	free(fields);
 
-	return false;
+	return list;
 }
 
-PyObject *PyTep_event_record(PyTep *self, PyObject *args,
-					  PyObject *kwargs)
+static bool is_number(struct tep_format_field *field)
 {
-	struct tep_record *record;
-	struct tep_event *event;
+	int number_field_mask = TEP_FIELD_IS_SIGNED |
+				TEP_FIELD_IS_LONG |
+				TEP_FIELD_IS_FLAG;
 
-	if (!print_init(args, kwargs, &event, &record))
-		return NULL;
+	return !field->flags || field->flags & number_field_mask;
+}
 
-	print_event(self->ptrObj, &seq, record, event);
+static bool split_event_name(const char *full_name, char **system,
+			     const char **event)
+{
+	const char *slash = strchr(full_name, '/');
 
-	return PyUnicode_FromString(seq.buffer);
+	if (!slash || slash == full_name || !slash[1]) {
+		PyErr_Format(TRACECRUNCHER_ERROR,
+			     "Failed to parse event name \'%s\' (must be \'system/event\').",
+			     full_name);
+		return false;
+	}
+
+	*system = strndup(full_name, slash - full_name);
+	if (!*system) {
+		MEM_ERROR;
+		return false;
+	}
+
+	*event = slash + 1;
+
+	return true;
 }
 
-PyObject *PyTep_info(PyTep *self, PyObject *args,
-				  PyObject *kwargs)
+/* Read a numeric field. The value of signed fields is sign-extended. */
+static int64_t read_number_field(struct tep_format_field *field, void *data)
 {
-	struct tep_record *record;
-	struct tep_event *event;
-
-	if (!print_init(args, kwargs, &event, &record))
-		return NULL;
+	unsigned long long val = 0;
+	int shift;
 
-	print_name_info(self->ptrObj, &seq, record, event);
+	tep_read_number_field(field, data, &val);
+	if (field->flags & TEP_FIELD_IS_SIGNED) {
+		shift = 64 - 8 * field->size;
+		if (shift > 0 && shift < 64)
+			return (int64_t)(val << shift) >> shift;
+	}
 
-	return PyUnicode_FromString(seq.buffer);
+	return val;
 }
 
-PyObject *PyTep_process(PyTep *self, PyObject *args,
-				     PyObject *kwargs)
+#define TC_STR_CACHE_SIZE	1024
+
+struct tc_str_cache_entry {
+	uint64_t	hash;
+	PyObject	*str;
+};
+
+struct tc_str_cache {
+	struct tc_str_cache_entry	entries[TC_STR_CACHE_SIZE];
+	int				count;
+};
+
+enum tc_field_mode {
+	TC_FIELD_DECODE,
+	TC_FIELD_RAW,
+	TC_FIELD_INTERN,
+};
+
+static const char *const field_mode_names[] = {
+	[TC_FIELD_DECODE]	= "str",
+	[TC_FIELD_RAW]		= "raw",
+	[TC_FIELD_INTERN]	= "intern",
+};
+
+enum tc_field_kind {
+	TC_FIELD_STRING,
+	TC_FIELD_NUMBER,
+	TC_FIELD_POINTER,
+	TC_FIELD_UNSUPPORTED,
+};
+
+/*
+ * Everything needed to decode a field, resolved once. Only the location of
+ * dynamic fields (arrays and strings) depends on the record.
+ */
+struct tc_field_accessor {
+	struct tep_event	*event;
+	struct tep_format_field	*field;
+	int			offset;
+	int			size;
+	bool			dynamic;
+	enum tc_field_kind	kind;
+
+	/* How the string and the dynamic fields are returned. */
+	enum tc_field_mode	mode;
+
+	/* The strings returned so far (TC_FIELD_INTERN only). */
+	struct tc_str_cache	*strings;
+
+	/* Keeps the event alive (only for the accessors returned to Python). */
+	struct tc_tep		*tep;
+};
+
+void tc_field_accessor_free(struct tc_field_accessor *acc)
 {
-	struct tep_record *record;
-	struct tep_event *event;
+	int i;
 
-	if (!print_init(args, kwargs, &event, &record))
-		return NULL;
+	if (!acc)
+		return;
 
-	print_comm_pid(self->ptrObj, &seq, record, event);
+	if (acc->strings) {
+		for (i = 0; i < TC_STR_CACHE_SIZE; ++i)
+			Py_XDECREF(acc->strings->entries[i].str);
 
-	return PyUnicode_FromString(seq.buffer);
+		free(acc->strings);
+	}
+
+	tc_tep_put(acc->tep);
+	free(acc);
 }
 
-static int kprobe_info_short(struct trace_seq *s,
-			     struct tep_record *record,
-			     struct tep_event *event,
-			     void *context)
+static uint64_t str_cache_hash(const char *str, int len)
 {
-	/* Do not print the address of the probe (first field). */
-	unsigned long long select_mask = ~0x1;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int i;
 
-	tep_record_print_selected_fields(s, record, event, select_mask);
+	/* FNV-1a */
+	for (i = 0; i < len; ++i) {
+		hash ^= (unsigned char) str[i];
+		hash *= 0x100000001b3ULL;
+	}
 
-	return 0;
+	return hash;
 }
 
-PyObject *PyTep_short_kprobe_print(PyTep *self, PyObject *args,
-						PyObject *kwargs)
+/*
+ * Get a string object for the given bytes, reusing the objects returned
+ * before. When the cache is full, new objects are created.
+ */
+static PyObject *str_cache_get(struct tc_str_cache *cache,
+			       const char *str, int len)
 {
-	static char *kwlist[] = {"system", "event", "id", NULL};
-	const char *system, *event;
-	int ret, id = -1;
+	uint64_t hash = str_cache_hash(str, len);
+	struct tc_str_cache_entry *entry;
+	const char *cached;
+	Py_ssize_t cached_len;
+	int i, n;
 
-	system = event = NO_ARG;
+	i = hash & (TC_STR_CACHE_SIZE - 1);
+	for (n = 0; n < TC_STR_CACHE_SIZE; ++n) {
+		entry = &cache->entries[i];
+		if (!entry->str)
+			break;
 
-	if(!PyArg_ParseTupleAndKeywords(args,
-					kwargs,
-					"ss|i",
-					kwlist,
-					&system,
-					&event,
-					&id)) {
-		return false;
+		if (entry->hash == hash) {
+			cached = PyUnicode_AsUTF8AndSize(entry->str, &cached_len);
+			if (cached_len == len && memcmp(cached, str, len) == 0) {
+				Py_INCREF(entry->str);
+				return entry->str;
+			}
+		}
+
+		i = (i + 1) & (TC_STR_CACHE_SIZE - 1);
 	}
 
-	ret = tep_register_event_handler(self->ptrObj, id, system, event,
-					 kprobe_info_short, NULL);
-	if (ret < 0) {
-		TfsError_fmt(NULL, "Failed to register handler for event %s/%s (%i).",
-			     system, event, id);
+	if (cache->count >= TC_STR_CACHE_SIZE * 3 / 4 || entry->str)
+		return PyUnicode_FromStringAndSize(str, len);
+
+	entry->str = PyUnicode_FromStringAndSize(str, len);
+	if (!entry->str)
 		return NULL;
-	}
 
-	Py_RETURN_NONE;
+	entry->hash = hash;
+	++cache->count;
+	Py_INCREF(entry->str);
+
+	return entry->str;
 }
 
-static bool check_file(struct tracefs_instance *instance, const char *file)
+static void field_accessor_set(struct tc_field_accessor *acc,
+			       struct tep_event *event,
+			       struct tep_format_field *field)
 {
-	if (!tracefs_file_exists(instance, file)) {
-		TfsError_fmt(instance, "File %s does not exist.", file);
-		return false;
-	}
+	acc->event = event;
+	acc->field = field;
+	acc->offset = field->offset;
+	acc->size = field->size;
+	acc->dynamic = field->flags & TEP_FIELD_IS_DYNAMIC;
+	acc->mode = TC_FIELD_DECODE;
+	acc->strings = NULL;
 
-	return true;
+	if (field->flags & TEP_FIELD_IS_STRING)
+		acc->kind = TC_FIELD_STRING;
+	else if (is_number(field))
+		acc->kind = TC_FIELD_NUMBER;
+	else if (field->flags & TEP_FIELD_IS_POINTER)
+		acc->kind = TC_FIELD_POINTER;
+	else
+		acc->kind = TC_FIELD_UNSUPPORTED;
 }
 
-static bool check_dir(struct tracefs_instance *instance, const char *dir)
+static bool field_accessor_init(struct tc_field_accessor *acc,
+				struct tep_event *event,
+				const char *field_name)
 {
-	if (!tracefs_dir_exists(instance, dir)) {
-		TfsError_fmt(instance, "Directory %s does not exist.", dir);
+	struct tep_format_field *field;
+
+	field = tep_find_field(event, field_name);
+	if (!field)
+		field = tep_find_common_field(event, field_name);
+
+	if (!field) {
+		PyErr_Format(TEP_ERROR,
+			     "Failed to find field \'%s\' in event \'%s\'",
+			     field_name, event->name);
 		return false;
 	}
 
+	field_accessor_set(acc, event, field);
+
 	return true;
 }
 
-const char *top_instance_name = "top";
-static const char *get_instance_name(struct tracefs_instance *instance)
+/* The start of the buffer exported by a record or by a batch object. */
+static char *raw_owner_data(PyObject *owner)
 {
-	const char *name = tracefs_instance_get_name(instance);
-	return name ? name : top_instance_name;
+	if (PyTepRecordBatch_Check(owner))
+		return ((PyTepRecordBatch *) owner)->ptrObj->data;
+
+	return ((PyTepRecord *) owner)->ptrObj->data;
 }
 
-static int write_to_file(struct tracefs_instance *instance,
-			 const char *file,
-			 const char *val)
+/*
+ * Return a read-only memoryview of the bytes of the field. The view is
+ * made over the buffer exported by 'owner' (see PyTepRecord_getbuffer()
+ * and PyTepRecordBatch_getbuffer()), hence it keeps the payload alive.
+ */
+static PyObject *raw_field_view(PyObject *owner, char *str, int len)
 {
-	int size;
+	Py_ssize_t offset = str - raw_owner_data(owner);
+	PyObject *view, *slice;
 
-	if (!check_file(instance, file))
-		return -1;
+	view = PyMemoryView_FromObject(owner);
+	if (!view)
+		return NULL;
 
-	size = tracefs_instance_file_write(instance, file, val);
-	if (size <= 0) {
-		TfsError_fmt(instance,
-			     "Can not write \'%s\' to file \'%s\' (inst: \'%s\').",
-			     val, file, get_instance_name(instance));
-		PyErr_Print();
-	}
+	slice = PySequence_GetSlice(view, offset, offset + len);
+	Py_DECREF(view);
 
-	return size;
+	return slice;
 }
 
-static int append_to_file(struct tracefs_instance *instance,
-			  const char *file,
-			  const char *val)
+/*
+ * Return the raw bytes of the field, or a cached string object. The raw
+ * bytes are not copied if the object owning the payload is known.
+ */
+static PyObject *field_accessor_string(struct tc_field_accessor *acc,
+				       char *str, int size, PyObject *owner)
 {
-	int size;
+	int len = size;
 
-	if (!check_file(instance, file))
-		return -1;
+	if (acc->kind == TC_FIELD_STRING)
+		len = strnlen(str, size);
 
-	size = tracefs_instance_file_append(instance, file, val);
-	if (size <= 0) {
-		TfsError_fmt(instance,
-			     "Can not append \'%s\' to file \'%s\' (inst: \'%s\').",
-			     val, file, get_instance_name(instance));
-		PyErr_Print();
-	}
+	if (acc->mode == TC_FIELD_INTERN)
+		return str_cache_get(acc->strings, str, len);
 
-	return size;
+	if (owner)
+		return raw_field_view(owner, str, len);
+
+	return PyBytes_FromStringAndSize(str, len);
 }
 
-static int read_from_file(struct tracefs_instance *instance,
-			  const char *file,
-			  char **val)
+static PyObject *field_accessor_decode(struct tc_field_accessor *acc,
+				       void *data, PyObject *owner)
 {
-	int size;
-
-	if (!check_file(instance, file))
-		return -1;
+	int offset = acc->offset, size = acc->size;
 
-	*val = tracefs_instance_file_read(instance, file, &size);
-	if (size < 0)
-		TfsError_fmt(instance, "Can not read from file %s", file);
+	if (acc->dynamic) {
+		unsigned long long val;
 
-	return size;
-}
+		val = tep_read_number(acc->event->tep, data + acc->offset,
+				      acc->size);
+		offset = val & 0xffff;
+		size = val >> 16;
+	}
 
-static bool write_to_file_and_check(struct tracefs_instance *instance,
-				    const char *file,
-				    const char *val)
-{
-	char *read_val;
-	int ret;
+	if (!size)
+		return PyUnicode_FromString(TC_NIL_MSG);
 
-	if (write_to_file(instance, file, val) <= 0)
-		return false;
+	if (acc->mode != TC_FIELD_DECODE &&
+	    (acc->kind == TC_FIELD_STRING || acc->dynamic))
+		return field_accessor_string(acc, data + offset, size, owner);
 
-	if (read_from_file(instance, file, &read_val) <= 0)
-		return false;
+	switch (acc->kind) {
+	case TC_FIELD_STRING:
+		return PyUnicode_FromString(data + offset);
 
-	trim_new_line(read_val);
-	ret = strcmp(read_val, val);
-	free(read_val);
+	case TC_FIELD_NUMBER:
+		return PyLong_FromLongLong(read_number_field(acc->field, data));
 
-	return ret == 0 ? true : false;
-}
+	case TC_FIELD_POINTER: {
+		char ptr_string[11];
 
-static PyObject *tfs_list2py_list(char **list, bool sort)
-{
-	PyObject *py_list = PyList_New(0);
-	int i;
+		sprintf(ptr_string, "%p", data + offset);
+		return PyUnicode_FromString(ptr_string);
+	}
 
-	for (i = 0; list && list[i]; i++)
-		PyList_Append(py_list, PyUnicode_FromString(list[i]));
+	default:
+		break;
+	}
 
-	if (sort)
-		PyList_Sort(py_list);
+	PyErr_Format(TEP_ERROR,
+		     "Unsupported format of field \'%s\' (flags %li)",
+		     acc->field->name, acc->field->flags);
+	return NULL;
+}
 
-	tracefs_list_free(list);
+/*
+ * The accessors of all fields of an event, resolved once per event and
+ * owned by the index of the events (see event_plan_get()).
+ */
+struct tc_event_plan {
+	struct tep_event		*event;
 
-	return py_list;
-}
+	/* The common fields first, followed by the fields of the event. */
+	int				nr_fields;
+	struct tc_field_accessor	*fields;
 
-PyObject *PyTfsInstance_dir(PyTfsInstance *self)
-{
-	return PyUnicode_FromString(tracefs_instance_get_dir(self->ptrObj));
-}
+	/* Open-addressing table of indexes in 'fields', keyed by name. */
+	int				*by_name;
+	unsigned int			mask;
+};
 
-PyObject *PyTfsInstance_reset(PyTfsInstance *self)
-{
-	tracefs_instance_reset(self->ptrObj);
-	Py_RETURN_NONE;
-}
+static struct tc_event_plan *event_plan_get(struct tc_tep *tt,
+					    struct tep_event *event);
 
-int py_instance_destroy(struct tracefs_instance *instance)
+static struct tc_field_accessor *event_plan_field(struct tc_event_plan *plan,
+						  const char *name)
 {
-	tracefs_instance_reset(instance);
-	tracefs_instance_destroy(instance);
-	return 0;
-}
+	struct tc_field_accessor *acc;
+	unsigned int i;
 
-PyObject *PyTfsInstance_delete(PyTfsInstance *self)
-{
-	py_instance_destroy(self->ptrObj);
+	i = str_cache_hash(name, strlen(name)) & plan->mask;
+	for (; plan->by_name[i] >= 0; i = (i + 1) & plan->mask) {
+		acc = &plan->fields[plan->by_name[i]];
+		if (strcmp(acc->field->name, name) == 0)
+			return acc;
+	}
 
-	Py_RETURN_NONE;
+	PyErr_Format(TEP_ERROR,
+		     "Failed to find field \'%s\' in event \'%s\'",
+		     name, plan->event->name);
+	return NULL;
 }
 
-PyObject *PyTraceHist_add_value(PyTraceHist *self, PyObject *args,
-						   PyObject *kwargs)
+PyObject *PyTepEvent_parse_record_field(PyTepEvent* self, PyObject *args,
+							  PyObject *kwargs)
 {
-	static char *kwlist[] = {"value", NULL};
-	const char *value;
+	struct tc_field_accessor *acc;
+	struct tc_event_plan *plan;
+	const char *field_name;
+	PyTepRecord *record;
 
+	static char *kwlist[] = {"record", "field", NULL};
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "s",
+					 "Os",
 					 kwlist,
-					 &value)) {
+					 &record,
+					 &field_name)) {
 		return NULL;
 	}
 
-	if (tracefs_hist_add_value(self->ptrObj, value) < 0) {
-		MEM_ERROR
+	plan = event_plan_get(self->ptrObj->tep, self->ptrObj->event);
+	if (!plan)
 		return NULL;
-	}
 
-	Py_RETURN_NONE;
-}
+	acc = event_plan_field(plan, field_name);
+	if (!acc)
+		return NULL;
 
-const char *hist_noname = "unnamed";
-static inline const char *get_hist_name(struct tracefs_hist *hist)
-{
-	const char *name = tracefs_hist_get_name(hist);
-	return name ? name : hist_noname;
+	return field_accessor_decode(acc, record->ptrObj->data, NULL);
 }
 
-static bool add_sort_key(struct tracefs_hist *hist,
-			 const char *sort_key)
+/*
+ * Add the value of the field to the tuple or to the dictionary. The key is
+ * 'py_name' if given, otherwise the name of the field. If 'skip_unsupported'
+ * is true, the value of a field of unsupported format is None.
+ */
+static bool parse_record_add(PyObject *result, int i,
+			     struct tc_field_accessor *acc,
+			     PyObject *py_name, void *data,
+			     bool skip_unsupported)
 {
-	if (tracefs_hist_add_sort_key(hist, sort_key) < 0) {
-		TfsError_fmt(NULL,
-			     "Failed to add sort key \'%s\'to histogram \'%s\'.",
-			     sort_key, get_hist_name(hist));
-		return false;
+	PyObject *val;
+	int ret = 0;
+
+	if (skip_unsupported && acc->kind == TC_FIELD_UNSUPPORTED) {
+		Py_INCREF(Py_None);
+		val = Py_None;
+	} else {
+		val = field_accessor_decode(acc, data, NULL);
+		if (!val)
+			return false;
 	}
 
-	return true;
+	if (PyTuple_CheckExact(result)) {
+		PyTuple_SET_ITEM(result, i, val);
+		return true;
+	}
+
+	if (py_name)
+		ret = PyDict_SetItem(result, py_name, val);
+	else
+		ret = PyDict_SetItemString(result, acc->field->name, val);
+
+	Py_DECREF(val);
+
+	return ret == 0;
 }
 
-PyObject *PyTraceHist_sort_keys(PyTraceHist *self, PyObject *args,
-						   PyObject *kwargs)
+static PyObject *parse_all_fields(struct tc_event *event, void *data,
+				  bool as_dict)
 {
-	static char *kwlist[] = {"keys", NULL};
-	PyObject *py_obj;
-	const char *key;
+	struct tc_event_plan *plan;
+	PyObject *result;
+	int i;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "O",
-					 kwlist,
-					 &py_obj)) {
+	plan = event_plan_get(event->tep, event->event);
+	if (!plan)
 		return NULL;
-	}
 
-	if (PyUnicode_Check(py_obj)) {
-		if (!add_sort_key(self->ptrObj, PyUnicode_DATA(py_obj)))
-			return NULL;
-	} else if (PyList_CheckExact(py_obj)) {
-		int i, n = PyList_Size(py_obj);
+	result = as_dict ? PyDict_New() : PyTuple_New(plan->nr_fields);
+	if (!result)
+		return NULL;
 
-		for (i = 0; i < n; ++i) {
-			key = tc_str_from_list(py_obj, i);
-			if (!key ||
-			    !add_sort_key(self->ptrObj, key)) {
-				PyErr_SetString(TRACECRUNCHER_ERROR,
-						"Inconsistent \"keys\" argument.");
-				return NULL;
-			}
+	for (i = 0; i < plan->nr_fields; ++i) {
+		if (!parse_record_add(result, i, &plan->fields[i], NULL, data,
+				      true)) {
+			Py_DECREF(result);
+			return NULL;
 		}
 	}
 
-	Py_RETURN_NONE;
+	return result;
 }
 
-static int sort_direction(PyObject *py_dir)
+static PyObject *parse_fields(struct tc_event *event, void *data,
+			      PyObject *py_fields, bool as_dict)
 {
-	int dir = -1;
+	PyObject *fields, *result, *py_name;
+	struct tc_field_accessor *acc;
+	struct tc_event_plan *plan;
+	const char *name;
+	Py_ssize_t i, n;
 
-	if (PyLong_CheckExact(py_dir)) {
-		dir = PyLong_AsLong(py_dir);
-	} else if (PyUnicode_Check(py_dir)) {
-		const char *dir_str =  PyUnicode_DATA(py_dir);
+	plan = event_plan_get(event->tep, event->event);
+	if (!plan)
+		return NULL;
 
-		if (lax_cmp(dir_str, "descending") ||
-		    lax_cmp(dir_str, "desc") ||
-		    lax_cmp(dir_str, "d"))
-			dir = 1;
-		else if (lax_cmp(dir_str, "ascending") ||
-			 lax_cmp(dir_str, "asc") ||
-			 lax_cmp(dir_str, "a"))
-			dir = 0;
+	fields = PySequence_Fast(py_fields,
+				 "\'fields\' must be a list of strings.");
+	if (!fields)
+		return NULL;
+
+	n = PySequence_Fast_GET_SIZE(fields);
+	result = as_dict ? PyDict_New() : PyTuple_New(n);
+	if (!result)
+		goto fail;
+
+	for (i = 0; i < n; ++i) {
+		py_name = PySequence_Fast_GET_ITEM(fields, i);
+		name = PyUnicode_Check(py_name) ? PyUnicode_AsUTF8(py_name) : NULL;
+		if (!name) {
+			PyErr_SetString(TRACECRUNCHER_ERROR,
+					"\'fields\' must be a list of strings.");
+			goto fail;
+		}
+
+		acc = event_plan_field(plan, name);
+		if (!acc ||
+		    !parse_record_add(result, i, acc, py_name, data, false))
+			goto fail;
 	}
 
-	return dir;
+	Py_DECREF(fields);
+
+	return result;
+
+ fail:
+	Py_XDECREF(result);
+	Py_DECREF(fields);
+	return NULL;
 }
 
-PyObject *PyTraceHist_sort_key_direction(PyTraceHist *self, PyObject *args,
-							    PyObject *kwargs)
+PyObject *PyTepEvent_parse_record(PyTepEvent* self, PyObject *args,
+						    PyObject *kwargs)
 {
-	static char *kwlist[] = {"sort_key", "direction", NULL};
-	const char *sort_key;
-	PyObject *py_dir;
-	int dir;
+	static char *kwlist[] = {"record", "fields", "as_dict", NULL};
+	PyObject *py_record, *py_fields = NULL;
+	int as_dict = false;
+	void *data;
 
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "sO",
+					 "O|Op",
 					 kwlist,
-					 &sort_key,
-					 &py_dir)) {
+					 &py_record,
+					 &py_fields,
+					 &as_dict)) {
 		return NULL;
 	}
 
-	dir = sort_direction(py_dir);
-
-	if (dir < 0 ||
-	    tracefs_hist_sort_key_direction(self->ptrObj, sort_key, dir) < 0) {
-		TfsError_fmt(NULL,
-			     "Failed to add sort direction to histogram \'%s\'.",
-			     get_hist_name(self->ptrObj));
+	if (!PyTepRecord_Check(py_record)) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Passing argument \'record\' with incompatible type.");
 		return NULL;
 	}
 
-	Py_RETURN_NONE;
+	data = ((PyTepRecord *) py_record)->ptrObj->data;
+	if (!py_fields || py_fields == Py_None)
+		return parse_all_fields(self->ptrObj, data, as_dict);
+
+	return parse_fields(self->ptrObj, data, py_fields, as_dict);
 }
 
-static bool get_optional_instance(PyObject *py_obj,
-				  struct tracefs_instance **instance)
+/*
+ * The elements of the arrays defined by kprobe_add_array_arg() are separate
+ * fields, named "<name>0", "<name>1", ... and defined one after another.
+ * Get the next element, without searching the list if possible.
+ */
+static struct tep_format_field *array_next_field(struct tep_event *event,
+						 struct tep_format_field *prev,
+						 const char *name, int i)
 {
-	PyTfsInstance *py_inst;
+	char field_name[128];
 
-	if (!py_obj) {
-		*instance = NULL;
-		return true;
-	}
+	snprintf(field_name, sizeof(field_name), "%s%i", name, i);
+	if (prev && prev->next && strcmp(prev->next->name, field_name) == 0)
+		return prev->next;
 
-	if (!PyTfsInstance_Check(py_obj)) {
-		PyErr_SetString(TRACECRUNCHER_ERROR,
-				"Passing argument \'instance\' with incompatible type.");
-		return false;
-	}
+	return tep_find_field(event, field_name);
+}
 
-	py_inst = (PyTfsInstance *)py_obj;
-	*instance = py_inst->ptrObj;
+/* The array ends at the first empty string. */
+static bool array_element_is_nil(struct tc_field_accessor *acc, void *data)
+{
+	unsigned long long val;
 
-	return true;
+	if (!acc->dynamic)
+		return !acc->size;
+
+	val = tep_read_number(acc->event->tep, data + acc->offset, acc->size);
+
+	return !(val >> 16);
 }
 
-bool get_instance_from_arg(PyObject *args, PyObject *kwargs,
-			   struct tracefs_instance **instance)
+static PyObject *parse_number_array(struct tc_field_accessor *elements,
+				    int n, void *data)
 {
-	static char *kwlist[] = {"instance", NULL};
-	PyObject *py_inst = NULL;
-	*instance = NULL;
-
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "|O",
-					 kwlist,
-					 &py_inst)) {
-		return false;
-	}
+	npy_intp dims = n;
+	PyObject *array;
+	int64_t *values;
+	int i;
 
-	if (!get_optional_instance(py_inst, instance))
+	array = PyArray_SimpleNew(1, &dims, NPY_INT64);
+	if (!array)
 		return NULL;
 
-	return true;
+	values = PyArray_DATA((PyArrayObject *) array);
+	for (i = 0; i < n; ++i)
+		values[i] = read_number_field(elements[i].field, data);
+
+	return array;
 }
 
-static bool hist_cmd(PyTraceHist *self, PyObject *args, PyObject *kwargs,
-		     enum tracefs_hist_command cmd,
-		     const char *err_msg)
+static PyObject *parse_string_array(struct tc_field_accessor *elements,
+				    int n, void *data)
 {
-	struct tracefs_instance *instance;
+	PyObject *list, *val;
+	int i;
 
-	if (!get_instance_from_arg(args, kwargs, &instance))
+	list = PyList_New(n);
+	if (!list)
 		return NULL;
 
-	if (tracefs_hist_command(instance, self->ptrObj, cmd) < 0) {
-		char *buff;
-
-		if (asprintf(&buff, "%s %s",
-			     err_msg, get_hist_name(self->ptrObj)) <= 0) {
-			MEM_ERROR;
-			return false;
+	for (i = 0; i < n; ++i) {
+		val = field_accessor_decode(&elements[i], data, NULL);
+		if (!val) {
+			Py_DECREF(list);
+			return NULL;
 		}
 
-		TfsError_setstr(instance, buff);
-		free(buff);
-
-		return false;
+		PyList_SET_ITEM(list, i, val);
 	}
 
-	return true;
+	return list;
 }
 
-PyObject *PyTraceHist_start(PyTraceHist *self, PyObject *args,
-					       PyObject *kwargs)
-{
-	if (!hist_cmd(self, args, kwargs,
-		      TRACEFS_HIST_CMD_START,
-		      "Failed to start filling the histogram"))
-		return false;
-
-	Py_RETURN_NONE;
-}
-
-PyObject *PyTraceHist_stop(PyTraceHist *self, PyObject *args,
-					      PyObject *kwargs)
+PyObject *PyTepEvent_parse_record_array(PyTepEvent* self, PyObject *args,
+							  PyObject *kwargs)
 {
-	if (!hist_cmd(self, args, kwargs,
-		      TRACEFS_HIST_CMD_PAUSE,
-		      "Failed to stop filling the histogram"))
-		return false;
+	static char *kwlist[] = {"record", "field", "size", NULL};
+	struct tep_event *event = self->ptrObj->event;
+	struct tc_field_accessor *elements;
+	struct tep_format_field *field = NULL;
+	const char *field_name;
+	PyObject *py_record, *ret;
+	int i, n = 0, size = -1;
+	void *data;
 
-	Py_RETURN_NONE;
-}
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "Os|i",
+					 kwlist,
+					 &py_record,
+					 &field_name,
+					 &size)) {
+		return NULL;
+	}
 
-PyObject *PyTraceHist_resume(PyTraceHist *self, PyObject *args,
-						PyObject *kwargs)
-{
-	if (!hist_cmd(self, args, kwargs,
-		      TRACEFS_HIST_CMD_CONT,
-		      "Failed to resume filling the histogram"))
-		return false;
+	if (!PyTepRecord_Check(py_record)) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Passing argument \'record\' with incompatible type.");
+		return NULL;
+	}
 
-	Py_RETURN_NONE;
-}
+	data = ((PyTepRecord *) py_record)->ptrObj->data;
+	if (size < 0)
+		size = event->format.nr_fields;
 
-PyObject *PyTraceHist_clear(PyTraceHist *self, PyObject *args,
-					       PyObject *kwargs)
-{
-	if (!hist_cmd(self, args, kwargs,
-		      TRACEFS_HIST_CMD_CLEAR,
-		      "Failed to clear the histogram"))
-		return false;
+	elements = calloc(size ? size : 1, sizeof(*elements));
+	if (!elements) {
+		MEM_ERROR;
+		return NULL;
+	}
 
-	Py_RETURN_NONE;
-}
+	for (i = 0; i < size; ++i) {
+		field = array_next_field(event, field, field_name, i);
+		if (!field)
+			break;
 
-static char *hist_read(PyTraceHist *self, PyObject *args,
-					  PyObject *kwargs)
-{
-	struct tracefs_instance *instance;
-	const char *hist_file = "hist";
-	char *data;
+		field_accessor_set(&elements[n], event, field);
+		if (array_element_is_nil(&elements[n], data))
+			break;
 
-	if (!get_instance_from_arg(args, kwargs, &instance))
-		return NULL;
+		/* All elements must have the same type. */
+		if (n && elements[n].kind != elements[0].kind)
+			break;
 
-	data = tracefs_event_file_read(instance,
-				       tracefs_hist_get_system(self->ptrObj),
-				       tracefs_hist_get_event(self->ptrObj),
-				       hist_file,
-				       NULL);
-	if (!data) {
-		TfsError_fmt(instance,
-			     "Failed read data from histogram \'%s\'.",
-			     get_hist_name(self->ptrObj));
+		++n;
 	}
 
-	return data;
-}
-
-PyObject *PyTraceHist_read(PyTraceHist *self, PyObject *args,
-					      PyObject *kwargs)
-{
-	char *data = hist_read(self, args, kwargs);
-	if (!data)
-		return NULL;
+	if (!n && !field) {
+		PyErr_Format(TEP_ERROR,
+			     "Failed to find field \'%s0\' in event \'%s\'",
+			     field_name, event->name);
+		ret = NULL;
+	} else if (n && elements[0].kind == TC_FIELD_NUMBER) {
+		ret = parse_number_array(elements, n, data);
+	} else {
+		ret = parse_string_array(elements, n, data);
+	}
 
-	PyObject *ret = PyUnicode_FromString(data);
+	free(elements);
 
-	free(data);
 	return ret;
 }
 
-PyObject *PyTraceHist_close(PyTraceHist *self, PyObject *args,
+PyObject *PyTepEvent_accessor(PyTepEvent* self, PyObject *args,
 					       PyObject *kwargs)
 {
-	if (!hist_cmd(self, args, kwargs,
-		      TRACEFS_HIST_CMD_DESTROY,
-		      "Failed to close the histogram"))
-		return false;
-
-	Py_RETURN_NONE;
-}
-
-typedef int (*add_field_ptr)(struct tracefs_synth *,
-			     const char *,
-			     const char *);
-
-PyObject *synth_add_fields(PySynthEvent *self, PyObject *args,
-					       PyObject *kwargs,
-					       bool to_start)
-{
-	static char *kwlist[] = {"fields", "names", NULL};
-	PyObject *py_fields, *py_names = NULL;
-	PyObject *item_field, *item_name;
-	add_field_ptr add_field_func;
-	const char *field, *name;
-	int ret, n, i;
+	static char *kwlist[] = {"field", "mode", NULL};
+	const char *field_name, *mode = "str";
+	struct tc_field_accessor *acc;
+	PyObject *py_acc;
+	int i, n;
 
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "O|O",
+					 "s|s",
 					 kwlist,
-					 &py_fields,
-					 &py_names)) {
+					 &field_name,
+					 &mode)) {
 		return NULL;
 	}
 
-	add_field_func = to_start ? tracefs_synth_add_start_field:
-				    tracefs_synth_add_end_field;
+	n = sizeof(field_mode_names) / sizeof(*field_mode_names);
+	for (i = 0; i < n; ++i)
+		if (strcmp(mode, field_mode_names[i]) == 0)
+			break;
 
-	n = PyList_Size(py_fields);
-	for (i = 0; i < n; ++i) {
-		item_field = PyList_GetItem(py_fields, i);
-		field = PyUnicode_DATA(item_field);
+	if (i == n) {
+		PyErr_Format(TRACECRUNCHER_ERROR,
+			     "Unknown accessor mode \'%s\'.", mode);
+		return NULL;
+	}
 
-		name = NULL;
-		if (py_names) {
-			item_name = PyList_GetItem(py_names, i);
-			if (item_name && item_name != Py_None)
-				name = PyUnicode_DATA(item_name);
-		}
+	acc = calloc(1, sizeof(*acc));
+	if (!acc) {
+		MEM_ERROR;
+		return NULL;
+	}
 
-		ret = add_field_func(self->ptrObj, field, name);
-		if (ret < 0) {
-			TfsError_fmt(NULL,
-				     "Failed to add %s field '%s' to synth. event %s",
-				     to_start ? "start" : "end", field,
-				     tracefs_synth_get_name(self->ptrObj));
-			return NULL;
+	if (!field_accessor_init(acc, self->ptrObj->event, field_name))
+		goto fail;
+
+	acc->tep = tc_tep_ref(self->ptrObj->tep);
+
+	acc->mode = i;
+	if (acc->mode == TC_FIELD_INTERN) {
+		acc->strings = calloc(1, sizeof(*acc->strings));
+		if (!acc->strings) {
+			MEM_ERROR;
+			goto fail;
 		}
 	}
 
-	Py_RETURN_NONE;
-}
+	py_acc = PyFieldAccessor_New(acc);
+	if (!py_acc)
+		goto fail;
 
-PyObject *PySynthEvent_add_start_fields(PySynthEvent *self, PyObject *args,
-							    PyObject *kwargs)
-{
-	return synth_add_fields(self, args, kwargs, true);
-}
+	return py_acc;
 
-PyObject *PySynthEvent_add_end_fields(PySynthEvent *self, PyObject *args,
-							  PyObject *kwargs)
-{
-	return synth_add_fields(self, args, kwargs, false);
+ fail:
+	tc_field_accessor_free(acc);
+	return NULL;
 }
 
-static inline void add_synth_field_err(const char *field, const char *event)
+/*
+ * Decode the field of all records of a batch. Records of other events get
+ * None. The events are compared by Id, because the accessor and the batch
+ * may use different tep handles.
+ */
+static PyObject *field_accessor_decode_batch(struct tc_field_accessor *acc,
+					     PyTepRecordBatch *py_batch)
 {
-	TfsError_fmt(NULL, "Failed to add field '%s' to synth. event %s",
-		     field, event);
+	struct tc_record_batch *batch = py_batch->ptrObj;
+	PyObject *list, *val;
+	int i;
+
+	list = PyList_New(batch->count);
+	if (!list)
+		return NULL;
+
+	for (i = 0; i < batch->count; ++i) {
+		if (batch->events[i]->id == acc->event->id) {
+			val = field_accessor_decode(acc, batch->records[i].data,
+						    (PyObject *) py_batch);
+			if (!val) {
+				Py_DECREF(list);
+				return NULL;
+			}
+		} else {
+			Py_INCREF(Py_None);
+			val = Py_None;
+		}
+
+		PyList_SET_ITEM(list, i, val);
+	}
+
+	return list;
 }
 
-static inline PyObject *
-add_synth_field(PySynthEvent *self, PyObject *args, PyObject *kwargs,
-		enum tracefs_synth_calc calc)
+PyObject *PyFieldAccessor_call(PyFieldAccessor *self, PyObject *args,
+						      PyObject *kwargs)
 {
-	static char *kwlist[] = {"name", "start_field", "end_field", NULL};
-	const char *start_field, *end_field, *name;
-	int ret;
+	static char *kwlist[] = {"record", NULL};
+	PyObject *py_obj;
 
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "sss",
+					 "O",
 					 kwlist,
-					 &name,
-					 &start_field,
-					 &end_field)) {
+					 &py_obj)) {
 		return NULL;
 	}
 
-	ret = tracefs_synth_add_compare_field(self->ptrObj,
-					      start_field, end_field, calc,
-					      name);
-	if (ret < 0) {
-		add_synth_field_err(name, tracefs_synth_get_name(self->ptrObj));
-		return NULL;
-	}
+	if (PyTepRecord_Check(py_obj))
+		return field_accessor_decode(self->ptrObj,
+					     ((PyTepRecord *) py_obj)->ptrObj->data,
+					     py_obj);
 
-	Py_RETURN_NONE;
-}
+	if (PyTepRecordBatch_Check(py_obj))
+		return field_accessor_decode_batch(self->ptrObj,
+						   (PyTepRecordBatch *) py_obj);
 
-PyObject *PySynthEvent_add_delta_start(PySynthEvent *self, PyObject *args,
-							   PyObject *kwargs)
-{
-	return add_synth_field(self, args, kwargs, TRACEFS_SYNTH_DELTA_START);
+	PyErr_SetString(TRACECRUNCHER_ERROR,
+			"Accessor argument must be a record or a batch of records.");
+	return NULL;
 }
 
-PyObject *PySynthEvent_add_delta_end(PySynthEvent *self, PyObject *args,
-							 PyObject *kwargs)
+PyObject *PyFieldAccessor_name(PyFieldAccessor *self)
 {
-	return add_synth_field(self, args, kwargs, TRACEFS_SYNTH_DELTA_END);
+	return PyUnicode_FromString(self->ptrObj->field->name);
 }
 
-PyObject *PySynthEvent_add_sum(PySynthEvent *self, PyObject *args,
-						   PyObject *kwargs)
+int get_pid(struct tep_event *event, struct tep_record *record)
 {
-	return add_synth_field(self, args, kwargs, TRACEFS_SYNTH_ADD);
+	const char *field_name = "common_pid";
+	struct tep_format_field *field;
+	unsigned long long val;
+
+	field = tep_find_common_field(event, field_name);
+	if (!field) {
+		PyErr_Format(TEP_ERROR,
+			     "Failed to find field \'s\' in event \'%s\'",
+			     field_name, event->name);
+		return -1;
+	}
+
+	tep_read_number_field(field, record->data, &val);
+
+	return val;
 }
 
-PyObject *PySynthEvent_add_delta_T(PySynthEvent *self, PyObject *args,
-						       PyObject *kwargs)
+PyObject *PyTepEvent_get_pid(PyTepEvent* self, PyObject *args,
+					       PyObject *kwargs)
 {
-	static char *kwlist[] = {"name", "hd", NULL};
-	const char *name = "delta_T";
-	const char* time_rez;
-	int ret, hd = 0;
+	static char *kwlist[] = {"record", NULL};
+	PyTepRecord *record;
+	int pid;
 
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "|sp",
+					 "O",
 					 kwlist,
-					 &name,
-					 &hd)) {
+					 &record)) {
 		return NULL;
 	}
 
-	time_rez = hd ? TRACEFS_TIMESTAMP : TRACEFS_TIMESTAMP_USECS;
-	ret = tracefs_synth_add_compare_field(self->ptrObj, time_rez, time_rez,
-					      TRACEFS_SYNTH_DELTA_END, name);
-	if (ret < 0) {
-		add_synth_field_err(name, tracefs_synth_get_name(self->ptrObj));
+	pid = get_pid(self->ptrObj->event, record->ptrObj);
+	if (pid < 0)
 		return NULL;
-	}
 
-	Py_RETURN_NONE;
+	return PyLong_FromLong(pid);
 }
 
-static void set_destroy_flag(PyObject *py_obj, bool val)
+static struct tep_handle *parse_tep(const char *dir, const char **sys_names)
 {
-	PyFtrace_Object_HEAD *obj_head = (PyFtrace_Object_HEAD *)py_obj;
-	obj_head->destroy = val;
-}
+	struct tep_handle *tep;
 
-PyObject *PySynthEvent_register(PySynthEvent *self, PyObject *args, PyObject *kwargs)
-{
-	struct tracefs_instance *instance;
-
-	if (!get_instance_from_arg(args, kwargs, &instance))
-		return NULL;
-
-	tracefs_synth_set_instance(self->ptrObj, instance);
-	if (tracefs_synth_create(self->ptrObj) < 0) {
-		TfsError_fmt(NULL, "Failed to register synth. event %s",
-			     tracefs_synth_get_name(self->ptrObj));
+	tep = tracefs_local_events_system(dir, sys_names);
+	if (!tep) {
+		TfsError_fmt(NULL,
+			     "Failed to get local 'tep' event from %s", dir?dir:"N/A");
 		return NULL;
 	}
 
+	return tep;
+}
+
+/*
+ * Index of the events of a tep handle. The events can be found in O(1)
+ * by Id or by system and name. Events are added to the index when they
+ * are looked up for the first time (see tc_event_by_id()).
+ */
+struct tc_event_index {
+	/** Array of events, indexed by event Id. */
+	struct tep_event	**by_id;
+
+	/** The accessors of the fields, indexed by event Id. Built on demand. */
+	struct tc_event_plan	**plans;
+
+	/** The size of the "by_id" and "plans" arrays. */
+	int			size;
+
+	/** Open-addressing hash table of the events keyed by system and name. */
+	struct tep_event	**by_name;
+
+	unsigned int		mask;
+
+	/** The number of events in the index. */
+	int			count;
+};
+
+/** The system and the name of an event, known before its format is parsed. */
+struct tc_event_name {
+	char	*system;
+	char	*name;
+};
+
+/*
+ * A tep handle, together with the index of its events and the resolver of
+ * the process names. The object is shared using a reference counter. The
+ * counter, the index and the names of the events are protected by the GIL.
+ */
+struct tc_tep {
+	struct tep_handle	*tep;
+	int			ref;
+
 	/*
-	 * Here the synthetic event gets added to the system.
-	 * Hence we need to 'destroy' this event at exit.
+	 * The tracing directory of a lazily parsed handle (NULL if all
+	 * events are parsed upfront). The format of an event is parsed the
+	 * first time the event is looked up (see tc_tep_load_event()).
 	 */
-	set_destroy_flag((PyObject *)self, true);
-	Py_RETURN_NONE;
-}
+	char			*dir;
 
-PyObject *PySynthEvent_unregister(PySynthEvent *self)
-{
-	if (tracefs_synth_destroy(self->ptrObj) < 0) {
-		TfsError_fmt(NULL, "Failed to unregister synth. event %s",
-			     tracefs_synth_get_name(self->ptrObj));
-		return NULL;
-	}
+	/** The names of all events, indexed by event Id (lazy handles only). */
+	struct tc_event_name	*names;
+
+	int			nr_names;
+
+	/** The value of "tep_generation" when "names" was read. */
+	unsigned int		names_generation;
 
 	/*
-	 * Here the synthetic event gets removed from the system.
-	 * Hence we no loger need to 'destroy' this event at exit.
+	 * Records are printed without the GIL (see PyTep_format_records()),
+	 * while libtraceevent builds parts of the state of the handle lazily
+	 * (the array of process names, the map of the kernel functions, the
+	 * last event found). Hence the handle is modified, and records are
+	 * printed, only while holding this lock. The GIL must never be taken
+	 * while holding the lock.
 	 */
-	set_destroy_flag((PyObject *)self, false);
-	Py_RETURN_NONE;
+	pthread_mutex_t		lock;
+
+	struct tc_event_index	index;
+
+	/** The resolver of the process names (see resolve_comm()). */
+	struct tc_comm_resolver	*comm;
+};
+
+static uint64_t event_name_hash(const char *system, const char *name)
+{
+	return str_cache_hash(system, strlen(system)) * 31 ^
+	       str_cache_hash(name, strlen(name));
 }
 
-PyObject *PySynthEvent_repr(PySynthEvent *self, PyObject *args, PyObject *kwargs)
+static void event_plan_free(struct tc_event_plan *plan)
 {
-	static char *kwlist[] = {"event", "hist_start", "hist_end", NULL};
-	int event, hist_start, hist_end;
-	char buff[2048] = {0};
-	bool new_line = false;
-	const char *str = NULL;
+	if (!plan)
+		return;
 
-	event = hist_start = hist_end = true;
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "|ppp",
-					 kwlist,
-					 &event,
-					 &hist_start,
-					 &hist_end)) {
-		return NULL;
-	}
+	free(plan->fields);
+	free(plan->by_name);
+	free(plan);
+}
 
-	if (event) {
-		strcat(buff, "synth. event: ");
-		str = tracefs_synth_show_event(self->ptrObj);
-		if (str)
-			strcat(buff, str);
-		new_line = true;
-	}
+static void event_index_free(struct tc_event_index *idx)
+{
+	int i;
 
-	if (hist_start) {
-		if (new_line)
-			strcat(buff, "\n");
-		else
-			new_line = true;
+	for (i = 0; i < idx->size; ++i)
+		event_plan_free(idx->plans[i]);
 
-		strcat(buff, "hist. start: ");
-		str = tracefs_synth_show_start_hist(self->ptrObj);
-		if (str)
-			strcat(buff, str);
-	}
+	free(idx->plans);
+	free(idx->by_id);
+	free(idx->by_name);
+}
 
-	if (hist_end) {
-		if (new_line)
-			strcat(buff, "\n");
+static bool event_index_resize(struct tc_event_index *idx, int id)
+{
+	struct tc_event_plan **plans;
+	struct tep_event **by_id;
+	int size;
 
-		strcat(buff, "hist. end: ");
-		str = tracefs_synth_show_end_hist(self->ptrObj);
-		if (str)
-			strcat(buff, str);
-	}
+	size = idx->size ? idx->size : 256;
+	while (id >= size)
+		size *= 2;
 
-	return PyUnicode_FromString(strdup(buff));
+	by_id = realloc(idx->by_id, size * sizeof(*by_id));
+	if (!by_id)
+		return false;
+
+	memset(by_id + idx->size, 0, (size - idx->size) * sizeof(*by_id));
+	idx->by_id = by_id;
+
+	plans = realloc(idx->plans, size * sizeof(*plans));
+	if (!plans)
+		return false;
+
+	memset(plans + idx->size, 0, (size - idx->size) * sizeof(*plans));
+	idx->plans = plans;
+	idx->size = size;
+
+	return true;
 }
 
-PyObject *PyFtrace_dir(PyObject *self)
+static void event_name_insert(struct tep_event **table, unsigned int mask,
+			      struct tep_event *event)
 {
-	return PyUnicode_FromString(tracefs_tracing_dir());
+	unsigned int i;
+
+	i = event_name_hash(event->system, event->name) & mask;
+	while (table[i])
+		i = (i + 1) & mask;
+
+	table[i] = event;
 }
 
-PyObject *PyFtrace_set_dir(PyObject *self, PyObject *args, PyObject *kwargs)
+static bool event_index_rehash(struct tc_event_index *idx)
 {
-	static char *kwlist[] = {"path", NULL};
-	char *custom_dir = NULL;
-	int ret;
+	unsigned int i, size = idx->by_name ? 2 * (idx->mask + 1) : 16;
+	struct tep_event **by_name;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "|s",
-					 kwlist,
-					 &custom_dir)) {
-		return NULL;
-	}
+	by_name = calloc(size, sizeof(*by_name));
+	if (!by_name)
+		return false;
 
-	if (custom_dir && custom_dir[0] != '\0')
-		ret = tracefs_set_tracing_dir(custom_dir);
-	else
-		ret = tracefs_set_tracing_dir(NULL);
+	for (i = 0; idx->by_name && i <= idx->mask; ++i)
+		if (idx->by_name[i])
+			event_name_insert(by_name, size - 1, idx->by_name[i]);
 
-	if (ret) {
-		TfsError_setstr(NULL, "Failed to set custom ftrace directory.");
-		return NULL;
-	}
+	free(idx->by_name);
+	idx->by_name = by_name;
+	idx->mask = size - 1;
 
-	Py_RETURN_NONE;
+	return true;
 }
 
-static PyObject *set_destroy(PyObject *args, PyObject *kwargs, bool destroy)
+static bool event_index_add(struct tc_event_index *idx,
+			    struct tep_event *event)
 {
-	static char *kwlist[] = {"object", NULL};
-	PyObject *py_obj;
+	if (event->id < 0)
+		return false;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "O",
-					 kwlist,
-					 &py_obj)) {
-		return NULL;
-	}
+	if (event->id >= idx->size && !event_index_resize(idx, event->id))
+		return false;
 
-	set_destroy_flag(py_obj, destroy);
+	if (idx->by_id[event->id])
+		return true;
 
-	Py_RETURN_NONE;
+	if ((!idx->by_name || 2 * (idx->count + 1) > idx->mask + 1) &&
+	    !event_index_rehash(idx))
+		return false;
+
+	idx->by_id[event->id] = event;
+	event_name_insert(idx->by_name, idx->mask, event);
+	++idx->count;
+
+	return true;
 }
 
-PyObject *PyFtrace_detach(PyObject *self, PyObject *args, PyObject *kwargs)
+static void event_names_free(struct tc_tep *tt)
 {
-	return set_destroy(args, kwargs, false);
+	int i;
+
+	for (i = 0; i < tt->nr_names; ++i) {
+		free(tt->names[i].system);
+		free(tt->names[i].name);
+	}
+
+	free(tt->names);
+	tt->names = NULL;
+	tt->nr_names = 0;
 }
 
-PyObject *PyFtrace_attach(PyObject *self, PyObject *args, PyObject *kwargs)
+static void comm_resolver_free(struct tc_comm_resolver *res);
+
+static struct tc_tep *tc_tep_ref(struct tc_tep *tt)
 {
-	return set_destroy(args, kwargs, true);
+	++tt->ref;
+
+	return tt;
 }
 
-static bool get_destroy_flag(PyObject *py_obj)
+void tc_tep_put(struct tc_tep *tt)
 {
-	PyFtrace_Object_HEAD *obj_head = (PyFtrace_Object_HEAD *)py_obj;
-	return obj_head->destroy;
+	if (!tt || --tt->ref)
+		return;
+
+	comm_resolver_free(tt->comm);
+	event_index_free(&tt->index);
+	event_names_free(tt);
+	tep_free(tt->tep);
+	pthread_mutex_destroy(&tt->lock);
+	free(tt->dir);
+	free(tt);
 }
 
-PyObject *PyFtrace_is_attached(PyObject *self, PyObject *args, PyObject *kwargs)
+/* Take the ownership of the tep handle and index its events. */
+static struct tc_tep *tc_tep_alloc(struct tep_handle *tep)
 {
-	static char *kwlist[] = {"object", NULL};
-	PyObject *py_obj;
+	struct tep_event **events;
+	struct tc_tep *tt;
+	int i;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "O",
-					 kwlist,
-					 &py_obj)) {
+	tt = calloc(1, sizeof(*tt));
+	if (!tt) {
+		tep_free(tep);
+		MEM_ERROR;
 		return NULL;
 	}
 
-	return get_destroy_flag(py_obj) ? Py_True : Py_False;
-}
+	tt->tep = tep;
+	tt->ref = 1;
+	pthread_mutex_init(&tt->lock, NULL);
 
-static char aname_pool[] =
-	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	events = tep_list_events(tep, TEP_EVENT_SORT_ID);
+	for (i = 0; events && events[i]; ++i) {
+		if (!event_index_add(&tt->index, events[i])) {
+			tc_tep_put(tt);
+			MEM_ERROR;
+			return NULL;
+		}
+	}
 
-#define ANAME_LEN	16
+	return tt;
+}
 
-char auto_name[ANAME_LEN];
+/* Incremented each time a dynamic event is added or removed. */
+static unsigned int tep_generation;
 
-static const char *autoname()
+/*
+ * Make a handle, which parses the format of an event only when the event is
+ * looked up for the first time. Only the "ftrace" system is parsed upfront.
+ */
+static struct tc_tep *tc_tep_alloc_lazy(const char *dir)
 {
-	int i, n, pool_size = sizeof(aname_pool);
-	struct timeval now;
+	const char *sys_names[] = {"ftrace", NULL};
+	struct tep_handle *tep;
+	struct tc_tep *tt;
 
-	gettimeofday(&now, NULL);
-	srand(now.tv_usec);
+	tep = parse_tep(dir, sys_names);
+	if (!tep)
+		return NULL;
 
-	for (i = 0; i < ANAME_LEN - 1; ++i) {
-		n = rand() % (pool_size - 1);
-		auto_name[i] = aname_pool[n];
+	tt = tc_tep_alloc(tep);
+	if (!tt)
+		return NULL;
+
+	tt->dir = strdup(dir);
+	if (!tt->dir) {
+		tc_tep_put(tt);
+		MEM_ERROR;
+		return NULL;
 	}
-	auto_name[i] = 0;
 
-	return auto_name;
+	return tt;
 }
 
-static bool tracing_OFF(struct tracefs_instance *instance);
-
-PyObject *PyFtrace_create_instance(PyObject *self, PyObject *args,
-						   PyObject *kwargs)
+/* Read a file of an event, e.g. "<dir>/events/sched/sched_switch/format". */
+static char *event_file_read(const char *dir, const char *system,
+			     const char *name, const char *file, int *size)
 {
-	struct tracefs_instance *instance;
-	const char *name = NO_ARG;
-	int tracing_on = true;
+	char *path, *buf = NULL, *tmp;
+	int fd, len = 0, buf_size = 0;
+	ssize_t r;
 
-	static char *kwlist[] = {"name", "tracing_on", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "|sp",
-					 kwlist,
-					 &name,
-					 &tracing_on)) {
+	if (asprintf(&path, "%s/events/%s/%s/%s", dir, system, name, file) <= 0)
 		return NULL;
-	}
 
-	if (!is_set(name))
-		name = autoname();
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return NULL;
 
-	instance = tracefs_instance_create(name);
-	if (!instance ||
-	    !tracefs_instance_exists(name) ||
-	    !tracefs_instance_is_new(instance)) {
-		TfsError_fmt(instance,
-			     "Failed to create new trace instance \'%s\'.",
-			     name);
+	do {
+		if (len + 1 >= buf_size) {
+			buf_size = buf_size ? 2 * buf_size : BUFSIZ;
+			tmp = realloc(buf, buf_size);
+			if (!tmp) {
+				r = -1;
+				break;
+			}
+
+			buf = tmp;
+		}
+
+		r = read(fd, buf + len, buf_size - len - 1);
+		if (r > 0)
+			len += r;
+	} while (r > 0);
+
+	close(fd);
+	if (r < 0) {
+		free(buf);
 		return NULL;
 	}
 
-	if (!tracing_on)
-		tracing_OFF(instance);
+	buf[len] = '\0';
+	if (size)
+		*size = len;
 
-	return PyTfsInstance_New(instance);
+	return buf;
 }
 
-PyObject *PyFtrace_find_instance(PyObject *self, PyObject *args,
-						 PyObject *kwargs)
+/*
+ * Parse the format of an event and add the event to a lazily parsed
+ * handle. Returns NULL if the event does not exist.
+ */
+static struct tep_event *tc_tep_load_event(struct tc_tep *tt,
+					   const char *system,
+					   const char *name)
 {
-	struct tracefs_instance *instance;
-	PyObject *py_inst;
-	const char *name;
+	struct tep_event *event;
+	char *format;
+	int size;
 
-	static char *kwlist[] = {"name", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "s",
-					 kwlist,
-					 &name)) {
+	if (!tt->dir)
 		return NULL;
-	}
 
-	instance = tracefs_instance_alloc(NULL, name);
-	if (!instance) {
-		TfsError_fmt(instance,
-			     "Failed to find trace instance \'%s\'.",
-			     name);
+	format = event_file_read(tt->dir, system, name, "format", &size);
+	if (!format)
 		return NULL;
-	}
 
-	py_inst = PyTfsInstance_New(instance);
-	set_destroy_flag(py_inst, false);
+	pthread_mutex_lock(&tt->lock);
+	event = tep_find_event_by_name(tt->tep, system, name);
+	if (!event && tep_parse_event(tt->tep, format, size, system) == 0)
+		event = tep_find_event_by_name(tt->tep, system, name);
 
-	return py_inst;
+	pthread_mutex_unlock(&tt->lock);
+	free(format);
+
+	if (event)
+		event_index_add(&tt->index, event);
+
+	return event;
 }
 
-static int save_instace(const char *name, void *context)
+static bool event_names_add(struct tc_tep *tt, int id,
+			    const char *system, const char *name)
 {
-	PyObject **list = (PyObject **)context;
-	struct tracefs_instance *instance;
-	PyObject *py_inst;
+	struct tc_event_name *names;
+	int size;
 
-	instance = tracefs_instance_alloc(NULL, name);
-	if (instance) {
-		py_inst = PyTfsInstance_New(instance);
-		/* Do not destroy the instance in the system, as we did not create it */
-		set_destroy_flag(py_inst, false);
-		PyList_Append(*list, py_inst);
+	if (id >= tt->nr_names) {
+		for (size = tt->nr_names ? tt->nr_names : 256; id >= size;)
+			size *= 2;
+
+		names = realloc(tt->names, size * sizeof(*names));
+		if (!names)
+			return false;
+
+		memset(names + tt->nr_names, 0,
+		       (size - tt->nr_names) * sizeof(*names));
+		tt->names = names;
+		tt->nr_names = size;
 	}
 
-	return 0;
+	if (tt->names[id].name)
+		return true;
+
+	tt->names[id].system = strdup(system);
+	tt->names[id].name = strdup(name);
+
+	return tt->names[id].system && tt->names[id].name;
 }
 
-PyObject *PyFtrace_available_instances(PyObject *self, PyObject *args,
-						       PyObject *kwargs)
+/*
+ * Read the Ids of all events of a lazily parsed handle. The Ids are read
+ * again only if dynamic events have been added or removed since.
+ */
+static void event_names_read(struct tc_tep *tt)
 {
-	PyObject *list;
+	char **systems, **events, *id;
+	int s, e;
 
-	list = PyList_New(0);
-	if (tracefs_instances_walk(save_instace, &list) < 0)
-		return NULL;
-	return list;
+	if (tt->names && tt->names_generation == tep_generation)
+		return;
+
+	event_names_free(tt);
+	tt->names_generation = tep_generation;
+
+	systems = tracefs_event_systems(tt->dir);
+	for (s = 0; systems && systems[s]; ++s) {
+		events = tracefs_system_events(tt->dir, systems[s]);
+		for (e = 0; events && events[e]; ++e) {
+			id = event_file_read(tt->dir, systems[s], events[e],
+					     "id", NULL);
+			if (id)
+				event_names_add(tt, atoi(id),
+						systems[s], events[e]);
+
+			free(id);
+		}
+
+		tracefs_list_free(events);
+	}
+
+	tracefs_list_free(systems);
 }
 
-PyObject *PyFtrace_available_tracers(PyObject *self, PyObject *args,
-						     PyObject *kwargs)
+static struct tep_event *tc_tep_load_event_by_id(struct tc_tep *tt, int id)
 {
-	struct tracefs_instance *instance;
-	char **list;
-
-	if (!get_instance_from_arg(args, kwargs, &instance))
+	if (!tt->dir || id < 0)
 		return NULL;
 
-	list = tracefs_tracers(tracefs_instance_get_dir(instance));
-	if (!list)
+	event_names_read(tt);
+	if (id >= tt->nr_names || !tt->names[id].name)
 		return NULL;
 
-	return tfs_list2py_list(list, false);
+	return tc_tep_load_event(tt, tt->names[id].system,
+				 tt->names[id].name);
 }
 
-PyObject *PyFtrace_set_current_tracer(PyObject *self, PyObject *args,
-						      PyObject *kwargs)
+/*
+ * The tep handles of the instances are cached per tracing directory and
+ * instance name, and are shared using the reference counter of the tc_tep
+ * object. The cached handles are lazily parsed. Because the events get
+ * added while the handle is in use, a cached handle is given away only
+ * if nobody else is holding it (otherwise a new handle is made). This way
+ * the trace data can be read without the GIL. The cache gets invalidated
+ * each time a dynamic event is added or removed by this module. Dynamic
+ * events created by other means are not noticed.
+ */
+struct tc_tep_cache {
+	char			*dir;
+	char			*instance;
+	struct tc_tep		*tep;
+	unsigned int		generation;
+	struct tc_tep_cache	*next;
+};
+
+static struct tc_tep_cache *tep_cache;
+
+void tc_tep_cache_invalidate(void)
 {
-	static char *kwlist[] = {"tracer", "instance", NULL};
-	const char *file = "current_tracer", *tracer;
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
+	++tep_generation;
+}
 
-	tracer = NO_ARG;
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "|sO",
-					 kwlist,
-					 &tracer,
-					 &py_inst)) {
-		return NULL;
+static void tep_cache_free(struct tc_tep_cache *entry)
+{
+	tc_tep_put(entry->tep);
+	free(entry->dir);
+	free(entry->instance);
+	free(entry);
+}
+
+static struct tc_tep *tep_cache_get(const char *dir, const char *instance)
+{
+	struct tc_tep_cache **ptr, *entry;
+	struct tc_tep *tt;
+
+	for (ptr = &tep_cache; *ptr; ptr = &(*ptr)->next)
+		if (strcmp((*ptr)->dir, dir) == 0 &&
+		    strcmp((*ptr)->instance, instance) == 0)
+			break;
+
+	entry = *ptr;
+	if (entry && entry->generation != tep_generation) {
+		*ptr = entry->next;
+		tep_cache_free(entry);
+		entry = NULL;
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
-		return NULL;
+	if (entry && entry->tep->ref == 1)
+		return tc_tep_ref(entry->tep);
 
-	if (is_set(tracer) &&
-	    strcmp(tracer, "nop") != 0) {
-		char **all_tracers =
-			tracefs_tracers(tracefs_instance_get_dir(instance));
-		int i;
+	tt = tc_tep_alloc_lazy(dir);
+	if (!tt || entry)
+		return tt;
 
-		for (i = 0; all_tracers && all_tracers[i]; i++) {
-			if (!strcmp(all_tracers[i], tracer))
-				break;
-		}
+	entry = calloc(1, sizeof(*entry));
+	if (!entry || !(entry->dir = strdup(dir)) ||
+	    !(entry->instance = strdup(instance))) {
+		if (entry)
+			free(entry->dir);
 
-		if (!all_tracers || !all_tracers[i]) {
-			TfsError_fmt(instance,
-				     "Tracer \'%s\' is not available.",
-				     tracer);
-			return NULL;
-		}
-	} else if (!is_set(tracer)) {
-		tracer = "nop";
+		free(entry);
+		return tt;
 	}
 
-	if (!write_to_file_and_check(instance, file, tracer)) {
-		TfsError_fmt(instance, "Failed to enable tracer \'%s\'",
-			     tracer);
-		return NULL;
-	}
+	entry->tep = tc_tep_ref(tt);
+	entry->generation = tep_generation;
+	entry->next = tep_cache;
+	tep_cache = entry;
 
-	Py_RETURN_NONE;
+	return tt;
 }
 
-PyObject *PyFtrace_get_current_tracer(PyObject *self, PyObject *args,
-						      PyObject *kwargs)
+static struct tep_event *tc_event_by_name(struct tc_tep *tt,
+					  const char *system,
+					  const char *name);
+
+/* Parse the formats of the events enabled in the instance. */
+static void tc_tep_load_enabled(struct tc_tep *tt,
+				struct tracefs_instance *instance)
 {
-	const char *file = "current_tracer";
-	struct tracefs_instance *instance;
-	PyObject *ret;
-	char *tracer;
+	char *buf, *line, *name, *save;
+	int size;
 
-	if (!get_instance_from_arg(args, kwargs, &instance))
-		return NULL;
+	buf = tracefs_instance_file_read(instance, "set_event", &size);
+	if (!buf)
+		return;
 
-	if (read_from_file(instance, file, &tracer) <= 0)
-		return NULL;
+	for (line = strtok_r(buf, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		name = strchr(line, ':');
+		if (!name)
+			continue;
 
-	trim_new_line(tracer);
-	ret = PyUnicode_FromString(tracer);
-	free(tracer);
+		*name++ = '\0';
+		tc_event_by_name(tt, line, name);
+	}
 
-	return ret;
+	free(buf);
 }
 
-PyObject *PyFtrace_available_event_systems(PyObject *self, PyObject *args,
-							   PyObject *kwargs)
+/*
+ * Get the tep handle used to read the trace data of an instance. The
+ * events enabled in the instance are parsed upfront, because the records
+ * are read without the GIL, when no events can be added to the handle.
+ * The returned reference must be released with tc_tep_put().
+ */
+static struct tc_tep *tc_tep_get(struct tracefs_instance *instance)
 {
-	static char *kwlist[] = {"instance", "sort", NULL};
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	int sort = false;
-	char **list;
-
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "|Op",
-					 kwlist,
-					 &py_inst,
-					 &sort)) {
-		return false;
-	}
+	const char *dir, *name;
+	struct tc_tep *tt;
 
-	if (!get_optional_instance(py_inst, &instance))
+	dir = instance ? tracefs_instance_get_trace_dir(instance) :
+			 tracefs_tracing_dir();
+	name = instance ? tracefs_instance_get_name(instance) : NULL;
+	if (!dir) {
+		TfsError_setstr(instance, "Failed to find the tracing directory.");
 		return NULL;
+	}
 
-	list = tracefs_event_systems(tracefs_instance_get_dir(instance));
-	if (!list)
-		return NULL;
+	tt = tep_cache_get(dir, name ? name : "");
+	if (tt)
+		tc_tep_load_enabled(tt, instance);
 
-	return tfs_list2py_list(list, sort);
+	return tt;
 }
 
-PyObject *PyFtrace_available_system_events(PyObject *self, PyObject *args,
-							   PyObject *kwargs)
+/*
+ * Events can be added to the tep handle by libtracefs (for example when a
+ * dynamic event is looked up). Such events get indexed when found.
+ */
+static struct tep_event *tc_event_by_id(struct tc_tep *tt, int id)
 {
-	static char *kwlist[] = {"system", "instance", "sort", NULL};
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	const char *system;
-	int sort = false;
-	char **list;
+	struct tep_event *event = NULL;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "s|Op",
-					 kwlist,
-					 &system,
-					 &py_inst,
-					 &sort)) {
-		return NULL;
+	if (id >= 0 && id < tt->index.size)
+		event = tt->index.by_id[id];
+
+	if (!event) {
+		pthread_mutex_lock(&tt->lock);
+		event = tep_find_event(tt->tep, id);
+		pthread_mutex_unlock(&tt->lock);
+		if (event)
+			event_index_add(&tt->index, event);
+		else
+			event = tc_tep_load_event_by_id(tt, id);
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
-		return NULL;
+	return event;
+}
 
-	list = tracefs_system_events(tracefs_instance_get_dir(instance),
-				     system);
+static void event_plan_add_name(struct tc_event_plan *plan, int n)
+{
+	const char *name = plan->fields[n].field->name;
+	unsigned int i;
 
-	if (!list)
-		return NULL;
+	i = str_cache_hash(name, strlen(name)) & plan->mask;
+	for (; plan->by_name[i] >= 0; i = (i + 1) & plan->mask) {
+		/* The fields of the event hide the common fields. */
+		if (strcmp(plan->fields[plan->by_name[i]].field->name,
+			   name) == 0)
+			return;
+	}
 
-	return tfs_list2py_list(list, sort);
+	plan->by_name[i] = n;
 }
 
-bool get_event_enable_file(struct tracefs_instance *instance,
-			   const char *system, const char *event,
-			   char **path)
+static struct tc_event_plan *event_plan_build(struct tep_event *event)
 {
-	char *buff = calloc(PATH_MAX, 1);
-	const char *instance_name;
+	int nr_common = event->format.nr_common, i, n = 0;
+	struct tep_format_field *field;
+	struct tc_event_plan *plan;
+	unsigned int size;
 
-	 if (!buff) {
-		MEM_ERROR
-		return false;
+	plan = calloc(1, sizeof(*plan));
+	if (!plan)
+		return NULL;
+
+	plan->event = event;
+	plan->nr_fields = nr_common + event->format.nr_fields;
+	for (size = 16; size < 2 * plan->nr_fields; size <<= 1)
+		;
+
+	plan->fields = calloc(plan->nr_fields, sizeof(*plan->fields));
+	plan->by_name = malloc(size * sizeof(*plan->by_name));
+	if ((!plan->fields && plan->nr_fields) || !plan->by_name) {
+		event_plan_free(plan);
+		return NULL;
 	}
 
-	if ((is_all(system) && is_all(event)) ||
-	    (is_all(system) && is_no_arg(event)) ||
-	    (is_no_arg(system) && is_all(event))) {
-		strcpy(buff, "events/enable");
+	plan->mask = size - 1;
+	for (i = 0; i < size; ++i)
+		plan->by_name[i] = -1;
 
-		*path = buff;
-	} else if (is_set(system)) {
-		strcpy(buff, "events/");
-		strcat(buff, system);
-		if (!check_dir(instance, buff))
-			goto fail;
+	for (field = event->format.common_fields; field; field = field->next)
+		field_accessor_set(&plan->fields[n++], event, field);
 
-		if (is_set(event)) {
-			strcat(buff, "/");
-			strcat(buff, event);
-			if (!check_dir(instance, buff))
-				goto fail;
+	for (field = event->format.fields; field; field = field->next)
+		field_accessor_set(&plan->fields[n++], event, field);
 
-			strcat(buff, "/enable");
-		} else {
-			strcat(buff, "/enable");
-		}
+	for (i = nr_common; i < n; ++i)
+		event_plan_add_name(plan, i);
 
-		*path = buff;
-	} else {
-		goto fail;
+	for (i = 0; i < nr_common; ++i)
+		event_plan_add_name(plan, i);
+
+	return plan;
+}
+
+/*
+ * Get the accessors of all fields of the event. The plan is owned by the
+ * index of the events and lives as long as the tep handle.
+ */
+static struct tc_event_plan *event_plan_get(struct tc_tep *tt,
+					    struct tep_event *event)
+{
+	struct tc_event_index *idx = &tt->index;
+	struct tc_event_plan *plan;
+
+	if (event->id < 0 || event->id >= idx->size ||
+	    idx->by_id[event->id] != event) {
+		PyErr_Format(TEP_ERROR, "Failed to find event \'%s/%s\'",
+			     event->system, event->name);
+		return NULL;
 	}
 
-	return true;
+	plan = idx->plans[event->id];
+	if (!plan) {
+		plan = idx->plans[event->id] = event_plan_build(event);
+		if (!plan)
+			MEM_ERROR;
+	}
 
- fail:
-	instance_name =
-		instance ? tracefs_instance_get_name(instance) : "top";
-	TfsError_fmt(instance,
-		     "Failed to locate event:\n Instance: %s  System: %s  Event: %s",
-		     instance_name, system, event);
-	free(buff);
-	*path = NULL;
-	return false;
+	return plan;
 }
 
-static bool event_enable_disable(struct tracefs_instance *instance,
-				 const char *system, const char *event,
-				 bool enable)
+static struct tep_event *tc_event_by_name(struct tc_tep *tt,
+					  const char *system,
+					  const char *name)
 {
-	int ret;
+	struct tc_event_index *idx = &tt->index;
+	struct tep_event *event;
+	unsigned int i;
 
-	if (system && !is_set(system))
-		system = NULL;
+	i = event_name_hash(system, name) & idx->mask;
+	for (; idx->by_name && (event = idx->by_name[i]);
+	     i = (i + 1) & idx->mask) {
+		if (strcmp(event->name, name) == 0 &&
+		    strcmp(event->system, system) == 0)
+			return event;
+	}
 
-	if (event && !is_set(event))
-		event = NULL;
-
-	if (enable)
-		ret = tracefs_event_enable(instance, system, event);
+	pthread_mutex_lock(&tt->lock);
+	event = tep_find_event_by_name(tt->tep, system, name);
+	pthread_mutex_unlock(&tt->lock);
+	if (event)
+		event_index_add(idx, event);
 	else
-		ret = tracefs_event_disable(instance, system, event);
-
-	if (ret != 0) {
-		TfsError_fmt(instance,
-			     "Failed to enable/disable event:\n System: %s  Event: %s",
-			     system ? system : "NULL",
-			     event ? event : "NULL");
+		event = tc_tep_load_event(tt, system, name);
 
-		return false;
-	}
+	return event;
+}
 
-	return true;
+static struct tep_event *tc_event_by_record(struct tc_tep *tt,
+					    struct tep_record *record)
+{
+	return tc_event_by_id(tt, tep_data_type(tt->tep, record));
 }
 
-static bool set_enable_event(PyObject *self,
-			     PyObject *args, PyObject *kwargs,
-			     bool enable)
+PyObject *PyTep_init_local(PyTep *self, PyObject *args,
+					PyObject *kwargs)
 {
-	static char *kwlist[] = {"instance", "system", "event", NULL};
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	const char *system, *event;
+	static char *kwlist[] = {"dir", "systems", NULL};
+	PyObject *system_list = NULL;
+	struct tep_handle *tep;
+	const char *dir_str;
+	struct tc_tep *tt;
 
-	system = event = NO_ARG;
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "|Oss",
+					 "s|O",
 					 kwlist,
-					 &py_inst,
-					 &system,
-					 &event)) {
-		return false;
+					 &dir_str,
+					 &system_list)) {
+		return NULL;
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
-		return false;
+	if (system_list) {
+		const char **sys_names = NULL;
 
-	return event_enable_disable(instance, system, event, enable);
-}
+		if (tc_list_get_str(system_list, &sys_names, NULL) || !sys_names) {
+			TfsError_setstr(NULL,
+					"Inconsistent \"systems\" argument.");
+			return NULL;
+		}
 
-#define ON	"1"
-#define OFF	"0"
+		tep = parse_tep(dir_str, sys_names);
+		free(sys_names);
+		tt = tep ? tc_tep_alloc(tep) : NULL;
+	} else {
+		/*
+		 * The handle is private (not taken from the cache), because
+		 * the user can modify it, e.g. by registering event handlers.
+		 * The events are parsed when used for the first time.
+		 */
+		tt = tc_tep_alloc_lazy(dir_str);
+	}
 
-PyObject *PyFtrace_enable_event(PyObject *self, PyObject *args,
-						PyObject *kwargs)
-{
-	if (!set_enable_event(self, args, kwargs, true))
+	if (!tt)
 		return NULL;
 
+	tc_tep_put(self->ptrObj);
+	self->ptrObj = tt;
+
 	Py_RETURN_NONE;
 }
 
-PyObject *PyFtrace_disable_event(PyObject *self, PyObject *args,
-						 PyObject *kwargs)
+PyObject *PyTep_get_event(PyTep *self, PyObject *args,
+				       PyObject *kwargs)
 {
-	if (!set_enable_event(self, args, kwargs, false))
+	static char *kwlist[] = {"system", "name", NULL};
+	const char *system, *event_name;
+	struct tep_event *event;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "ss",
+					 kwlist,
+					 &system,
+					 &event_name)) {
 		return NULL;
+	}
 
-	Py_RETURN_NONE;
+	event = tc_event_by_name(self->ptrObj, system, event_name);
+
+	return tc_event_to_py(self->ptrObj, event);
 }
 
-static bool set_enable_events(PyObject *self, PyObject *args, PyObject *kwargs,
-			      bool enable)
+PyObject *PyTep_event_by_id(PyTep *self, PyObject *args,
+					 PyObject *kwargs)
 {
-	static char *kwlist[] = {"events", "instance", NULL};
-	PyObject *event_dict = NULL, *py_inst = NULL;
-	struct tracefs_instance *instance;
-	PyObject *py_system, *py_events;
-	const char *system, *event;
-	Py_ssize_t pos = 0;
-	int i, n;
+	static char *kwlist[] = {"id", NULL};
+	struct tep_event *event;
+	int id;
 
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "O|O",
+					 "i",
 					 kwlist,
-					 &event_dict,
-					 &py_inst)) {
-		return false;
+					 &id)) {
+		return NULL;
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
-		return false;
+	event = tc_event_by_id(self->ptrObj, id);
+	if (!event) {
+		PyErr_Format(TEP_ERROR, "No event with Id %i.", id);
+		return NULL;
+	}
 
-	if (!PyDict_CheckExact(event_dict))
-		goto fail_with_err;
+	return tc_event_to_py(self->ptrObj, event);
+}
 
-	while (PyDict_Next(event_dict, &pos, &py_system, &py_events)) {
-		if (!PyUnicode_Check(py_system) ||
-		    !PyList_CheckExact(py_events))
-			goto fail_with_err;
+/*
+ * Each thread has its own buffer, so that records can be printed by
+ * several threads at the same time (see PyTep_format_records()).
+ */
+static __thread struct trace_seq seq;
 
-		system = PyUnicode_DATA(py_system);
-		n = PyList_Size(py_events);
+static pthread_key_t seq_key;
+static pthread_once_t seq_key_once = PTHREAD_ONCE_INIT;
 
-		if (n == 0 || (n == 1 && is_all(tc_str_from_list(py_events, 0)))) {
-			if (!event_enable_disable(instance, system, NULL,
-						  enable))
-				return false;
-			continue;
-		}
+static void seq_destroy(void *ptr)
+{
+	trace_seq_destroy(ptr);
+}
 
-		for (i = 0; i < n; ++i) {
-			event = tc_str_from_list(py_events, i);
-			if (!event)
-				goto fail_with_err;
+static void seq_key_init(void)
+{
+	pthread_key_create(&seq_key, seq_destroy);
+}
 
-			if (!event_enable_disable(instance, system, event,
-						  enable))
-				return false;
-		}
+static bool init_print_seq(void)
+{
+	if (!seq.buffer) {
+		trace_seq_init(&seq);
+
+		/* Free the buffer when the thread exits. */
+		pthread_once(&seq_key_once, seq_key_init);
+		pthread_setspecific(seq_key, &seq);
+	}
+
+	if (!seq.buffer) {
+		PyErr_SetString(TFS_ERROR, "Unable to initialize 'trace_seq'.");
+		return false;
 	}
 
+	trace_seq_reset(&seq);
+
 	return true;
+}
 
- fail_with_err:
-	TfsError_setstr(instance, "Inconsistent \"events\" argument.");
-	return false;
+static inline void trim_new_line(char *val)
+{
+	if (val[strlen(val) - 1] == '\n')
+		val[strlen(val) - 1] = '\0';
 }
 
-PyObject *PyFtrace_enable_events(PyObject *self, PyObject *args,
-						 PyObject *kwargs)
+/* The size of 'comm' in the kernel (TASK_COMM_LEN). */
+#define TC_COMM_LEN	16
+
+/*
+ * Read the name of a process from '/proc/<pid>/comm'. This file is not
+ * guaranteed to exist. Return false if the process is no longer active.
+ */
+static bool read_proc_comm(int pid, char *comm)
 {
-	if (!set_enable_events(self, args, kwargs, true))
-		return NULL;
+	char comm_file[64];
+	int fd, r;
 
-	Py_RETURN_NONE;
+	snprintf(comm_file, sizeof(comm_file), "/proc/%i/comm", pid);
+	fd = open(comm_file, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	r = read(fd, comm, TC_COMM_LEN);
+	close(fd);
+	if (r <= 0)
+		return false;
+
+	comm[r < TC_COMM_LEN ? r : TC_COMM_LEN - 1] = '\0';
+	trim_new_line(comm);
+
+	return true;
 }
 
-PyObject *PyFtrace_disable_events(PyObject *self, PyObject *args,
-						  PyObject *kwargs)
+struct tc_comm {
+	int	pid;
+	char	comm[TC_COMM_LEN];
+};
+
+static unsigned long long time_now_ns(void)
 {
-	if (!set_enable_events(self, args, kwargs, false))
-		return NULL;
+	struct timespec ts;
 
-	Py_RETURN_NONE;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static PyObject *event_is_enabled(struct tracefs_instance *instance,
-				  const char *system, const char *event)
+/*
+ * A PID that is not found in '/proc' is looked up again after this time,
+ * because the PID may be reused by a process which fork was not traced.
+ */
+#define TC_COMM_MISS_RETRY_NS	1000000000ULL
+
+struct tc_comm_miss {
+	int			pid;
+	unsigned long long	time;
+};
+
+/*
+ * Resolves the names of the processes, when printing records. All known
+ * names are loaded at once, when the first unknown PID is found. After
+ * that the names are updated from the fork, exec and rename events, so
+ * '/proc' is read only for processes that have not been seen before.
+ */
+struct tc_comm_resolver {
+	struct tep_handle	*tep;
+	bool			loaded;
+
+	/* PIDs not found in '/proc', sorted by PID. */
+	struct tc_comm_miss	*missed;
+	int			nr_missed;
+	int			missed_size;
+
+	int			fork_id;
+	struct tep_format_field	*fork_pid;
+	struct tep_format_field	*fork_comm;
+
+	int			exec_id;
+	struct tep_format_field	*exec_pid;
+	struct tep_format_field	*exec_file;
+
+	int			rename_id;
+	struct tep_format_field	*rename_pid;
+	struct tep_format_field	*rename_comm;
+};
+
+static void comm_resolver_free(struct tc_comm_resolver *res)
 {
-	char *file, *val;
-	PyObject *ret;
+	if (!res)
+		return;
 
-	if (!get_event_enable_file(instance, system, event, &file))
-		return NULL;
+	free(res->missed);
+	free(res);
+}
 
-	if (read_from_file(instance, file, &val) <= 0)
-		return NULL;
+static int cmp_comm_pid(const void *a, const void *b)
+{
+	const struct tc_comm *ca = a, *cb = b;
 
-	trim_new_line(val);
-	ret = PyUnicode_FromString(val);
+	return (ca->pid > cb->pid) - (ca->pid < cb->pid);
+}
 
-	free(file);
-	free(val);
+static int cmp_comm_miss(const void *a, const void *b)
+{
+	const struct tc_comm_miss *ma = a, *mb = b;
 
-	return ret;
+	return (ma->pid > mb->pid) - (ma->pid < mb->pid);
 }
 
-PyObject *PyFtrace_event_is_enabled(PyObject *self, PyObject *args,
-						    PyObject *kwargs)
+static bool comm_list_add(struct tc_comm **list, int *count, int *size,
+			  int pid, const char *comm)
 {
-	static char *kwlist[] = {"instance", "system", "event", NULL};
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	const char *system, *event;
+	struct tc_comm *tmp;
 
-	system = event = NO_ARG;
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "|Oss",
-					 kwlist,
-					 &py_inst,
-					 &system,
-					 &event)) {
-		return false;
+	if (*count == *size) {
+		*size = *size ? *size * 2 : 1024;
+		tmp = realloc(*list, *size * sizeof(*tmp));
+		if (!tmp)
+			return false;
+
+		*list = tmp;
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
-		return false;
+	(*list)[*count].pid = pid;
+	strncpy((*list)[*count].comm, comm, TC_COMM_LEN - 1);
+	(*list)[*count].comm[TC_COMM_LEN - 1] = '\0';
+	++(*count);
 
-	return event_is_enabled(instance, system, event);
+	return true;
 }
 
-PyObject *PyFtrace_set_event_filter(PyObject *self, PyObject *args,
-						    PyObject *kwargs)
+/*
+ * Collect the names of the running processes, followed by the names saved
+ * by the kernel ('saved_cmdlines'), which include processes that already
+ * exited. The names are registered together, each PID only once.
+ */
+static void comm_resolver_load(struct tc_comm_resolver *res)
 {
-	const char *system, *filter;
-	char *event = NULL;
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	char path[PATH_MAX];
-	bool ret;
+	int i, pid, count = 0, size = 0, buf_size;
+	char comm[TC_COMM_LEN], *buf, *line, *end;
+	struct tc_comm *list = NULL;
+	struct dirent *dent;
+	DIR *dir;
 
-	static char *kwlist[] = {"system", "filter", "event", "instance", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "ss|sO",
-					 kwlist,
-					 &system,
-					 &filter,
-					 &event,
-					 &py_inst)) {
-		return NULL;
+	res->loaded = true;
+
+	dir = opendir("/proc");
+	while (dir && (dent = readdir(dir))) {
+		pid = strtol(dent->d_name, &end, 10);
+		if (pid <= 0 || *end || !read_proc_comm(pid, comm))
+			continue;
+
+		if (!comm_list_add(&list, &count, &size, pid, comm))
+			goto out;
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
-		return NULL;
+	buf = tracefs_instance_file_read(NULL, "saved_cmdlines", &buf_size);
+	for (line = buf; line && *line; line = end) {
+		end = strchrnul(line, '\n');
+		if (*end)
+			*end++ = '\0';
 
-	if (event) {
-		sprintf(path, "events/%s/%s/filter", system, event);
-		ret = write_to_file_and_check(instance, path, filter);
-	} else {
-		/*
-		 * Filters written to system's filter file are not stored in this file.
-		 * Instead, they are sent to each event's filter file from that system,
-		 * which has the fields from the filter.
-		 * That's why write_to_file_and_check() API cannot be used in this case.
-		 */
-		sprintf(path, "events/%s/filter", system);
-		ret = (write_to_file(instance, path, filter) > 0);
-	}
-
-	if (!ret) {
-		TfsError_setstr(instance, "Failed to set event filter");
-		return NULL;
+		if (sscanf(line, "%i %15[^\n]", &pid, comm) == 2 && pid > 0 &&
+		    !comm_list_add(&list, &count, &size, pid, comm))
+			break;
 	}
 
-	Py_RETURN_NONE;
-}
+	free(buf);
 
-PyObject *PyFtrace_clear_event_filter(PyObject *self, PyObject *args,
-						      PyObject *kwargs)
-{
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	const char *system;
-	char *event = NULL;
-	char path[PATH_MAX];
+	/* Stable order is not guaranteed, but '/proc' entries come first. */
+	qsort(list, count, sizeof(*list), cmp_comm_pid);
+	for (i = 0; i < count; ++i) {
+		if (i && list[i].pid == list[i - 1].pid)
+			continue;
 
-	static char *kwlist[] = {"system", "event", "instance", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "s|sO",
-					 kwlist,
-					 &system,
-					 &event,
-					 &py_inst)) {
-		return NULL;
+		if (!tep_is_pid_registered(res->tep, list[i].pid))
+			tep_register_comm(res->tep, list[i].comm, list[i].pid);
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
-		return NULL;
-
-	if (event)
-		sprintf(path, "events/%s/%s/filter", system, event);
-	else
-		sprintf(path, "events/%s/filter", system);
-	if (!write_to_file(instance, path, OFF)) {
-		TfsError_setstr(instance, "Failed to clear event filter");
-		return NULL;
-	}
+ out:
+	if (dir)
+		closedir(dir);
 
-	Py_RETURN_NONE;
+	free(list);
 }
 
-static bool tracing_ON(struct tracefs_instance *instance)
+static void comm_resolver_find_event(struct tc_tep *tt,
+				     const char *system, const char *name,
+				     const char *pid_field,
+				     const char *comm_field,
+				     int *id,
+				     struct tep_format_field **pid,
+				     struct tep_format_field **comm)
 {
-	int ret = tracefs_trace_on(instance);
-
-	if (ret < 0 ||
-	    tracefs_trace_is_on(instance) != 1) {
-		const char *instance_name =
-			instance ? tracefs_instance_get_name(instance) : "top";
+	struct tep_event *event = tc_event_by_name(tt, system, name);
 
-		TfsError_fmt(instance,
-			     "Failed to start tracing (Instance: %s)",
-			     instance_name);
-		return false;
-	}
+	if (!event)
+		return;
 
-	return true;
+	*pid = tep_find_field(event, pid_field);
+	*comm = tep_find_field(event, comm_field);
+	if (*pid && *comm)
+		*id = event->id;
 }
 
-PyObject *PyFtrace_tracing_ON(PyObject *self, PyObject *args,
-					      PyObject *kwargs)
+/*
+ * Get the resolver of a tep handle. Each handle has its own resolver, so it
+ * is released together with the handle.
+ */
+static struct tc_comm_resolver *comm_resolver_get(struct tc_tep *tt)
 {
-	struct tracefs_instance *instance;
+	struct tc_comm_resolver *res;
 
-	if (!get_instance_from_arg(args, kwargs, &instance))
-		return NULL;
+	if (tt->comm)
+		return tt->comm;
 
-	if (!tracing_ON(instance))
+	res = calloc(1, sizeof(*res));
+	if (!res)
 		return NULL;
 
-	Py_RETURN_NONE;
+	tt->comm = res;
+	res->tep = tt->tep;
+	res->fork_id = res->exec_id = res->rename_id = -1;
+	comm_resolver_find_event(tt, "sched", "sched_process_fork",
+				 "child_pid", "child_comm",
+				 &res->fork_id, &res->fork_pid, &res->fork_comm);
+	comm_resolver_find_event(tt, "sched", "sched_process_exec",
+				 "pid", "filename",
+				 &res->exec_id, &res->exec_pid, &res->exec_file);
+	comm_resolver_find_event(tt, "task", "task_rename",
+				 "pid", "newcomm",
+				 &res->rename_id, &res->rename_pid,
+				 &res->rename_comm);
+
+	return res;
 }
 
-static bool tracing_OFF(struct tracefs_instance *instance)
+static struct tc_comm_miss *comm_miss_find(struct tc_comm_resolver *res,
+					   int pid)
 {
-	int ret = tracefs_trace_off(instance);
+	struct tc_comm_miss key = {.pid = pid};
 
-	if (ret < 0 ||
-	    tracefs_trace_is_on(instance) != 0) {
-		const char *instance_name =
-			instance ? tracefs_instance_get_name(instance) : "top";
+	return bsearch(&key, res->missed, res->nr_missed,
+		       sizeof(*res->missed), cmp_comm_miss);
+}
 
-		TfsError_fmt(instance,
-			     "Failed to stop tracing (Instance: %s)",
-			     instance_name);
-		return false;
-	}
+static void comm_resolver_missed_del(struct tc_comm_resolver *res, int pid)
+{
+	struct tc_comm_miss *ptr = comm_miss_find(res, pid);
 
-	return true;
+	if (ptr) {
+		memmove(ptr, ptr + 1,
+			(res->missed + --res->nr_missed - ptr) * sizeof(*ptr));
+	}
 }
 
-PyObject *PyFtrace_tracing_OFF(PyObject *self, PyObject *args,
-					       PyObject *kwargs)
+static void comm_resolver_missed_add(struct tc_comm_resolver *res, int pid,
+				     unsigned long long time)
 {
-	struct tracefs_instance *instance;
+	struct tc_comm_miss *tmp;
+	int i;
 
-	if (!get_instance_from_arg(args, kwargs, &instance))
-		return NULL;
+	if (res->nr_missed == res->missed_size) {
+		res->missed_size = res->missed_size ? res->missed_size * 2 : 256;
+		tmp = realloc(res->missed, res->missed_size * sizeof(*tmp));
+		if (!tmp)
+			return;
 
-	if (!tracing_OFF(instance))
-		return NULL;
+		res->missed = tmp;
+	}
 
-	Py_RETURN_NONE;
+	for (i = res->nr_missed; i > 0 && res->missed[i - 1].pid > pid; --i)
+		res->missed[i] = res->missed[i - 1];
+
+	res->missed[i].pid = pid;
+	res->missed[i].time = time;
+	++res->nr_missed;
 }
 
-PyObject *PyFtrace_is_tracing_ON(PyObject *self, PyObject *args,
-						 PyObject *kwargs)
+static void read_comm_field(struct tep_format_field *field,
+			    struct tep_record *record, bool path, char *comm)
 {
-	struct tracefs_instance *instance;
-	int ret;
+	int offset = field->offset, size = field->size;
+	const char *str, *base;
+	unsigned long long val;
 
-	if (!get_instance_from_arg(args, kwargs, &instance))
-		return NULL;
+	if (field->flags & TEP_FIELD_IS_DYNAMIC) {
+		val = tep_read_number(field->event->tep,
+				      record->data + field->offset,
+				      field->size);
+		offset = val & 0xffff;
+		size = val >> 16;
+	}
 
-	ret = tracefs_trace_is_on(instance);
-	if (ret < 0) {
-		const char *instance_name =
-			instance ? tracefs_instance_get_name(instance) : "top";
+	str = (const char *) record->data + offset;
+	size = strnlen(str, size);
 
-		TfsError_fmt(instance,
-			     "Failed to check if tracing is ON (Instance: %s)",
-			     instance_name);
-		return NULL;
+	/* After exec, the name of the process is the name of the file. */
+	base = path ? memrchr(str, '/', size) : NULL;
+	if (base) {
+		size -= base + 1 - str;
+		str = base + 1;
 	}
 
-	if (ret == 0)
-		Py_RETURN_FALSE;
+	if (size >= TC_COMM_LEN)
+		size = TC_COMM_LEN - 1;
 
-	Py_RETURN_TRUE;
+	memcpy(comm, str, size);
+	comm[size] = '\0';
 }
 
-static bool pid2file(struct tracefs_instance *instance,
-		     const char *file,
-		     int pid,
-		     bool append)
+/* Update the name of a process from the fork, exec and rename events. */
+static void comm_resolver_update(struct tc_comm_resolver *res,
+				 struct tep_event *event,
+				 struct tep_record *record)
 {
-	char pid_str[100];
-
-	if (sprintf(pid_str, "%d", pid) <= 0)
-		return false;
+	struct tep_format_field *pid_field, *comm_field;
+	char comm[TC_COMM_LEN];
+	unsigned long long pid;
 
-	if (append) {
-		if (!append_to_file(instance, file, pid_str))
-		        return false;
+	if (event->id == res->fork_id) {
+		pid_field = res->fork_pid;
+		comm_field = res->fork_comm;
+	} else if (event->id == res->exec_id) {
+		pid_field = res->exec_pid;
+		comm_field = res->exec_file;
+	} else if (event->id == res->rename_id) {
+		pid_field = res->rename_pid;
+		comm_field = res->rename_comm;
 	} else {
-		if (!write_to_file_and_check(instance, file, pid_str))
-		        return false;
+		return;
 	}
 
-	return true;
+	if (tep_read_number_field(pid_field, record->data, &pid) < 0)
+		return;
+
+	read_comm_field(comm_field, record, event->id == res->exec_id, comm);
+	tep_override_comm(res->tep, comm, pid);
+	comm_resolver_missed_del(res, pid);
 }
 
-static bool set_pid(struct tracefs_instance *instance,
-		    const char *file, PyObject *pid_val)
+static void comm_resolver_resolve(struct tc_comm_resolver *res, int pid)
 {
-	PyObject *item;
-	int n, i, pid;
+	unsigned long long now;
+	struct tc_comm_miss *miss;
+	char comm[TC_COMM_LEN];
 
-	if (PyList_CheckExact(pid_val)) {
-		n = PyList_Size(pid_val);
-		for (i = 0; i < n; ++i) {
-			item = PyList_GetItem(pid_val, i);
-			if (!PyLong_CheckExact(item))
-				goto fail;
+	if (pid <= 0 || tep_is_pid_registered(res->tep, pid))
+		return;
 
-			pid = PyLong_AsLong(item);
-			if (!pid2file(instance, file, pid, true))
-				goto fail;
-		}
-	} else if (PyLong_CheckExact(pid_val)) {
-		pid = PyLong_AsLong(pid_val);
-		if (!pid2file(instance, file, pid, true))
-			goto fail;
-	} else {
-		goto fail;
+	if (!res->loaded) {
+		comm_resolver_load(res);
+		if (tep_is_pid_registered(res->tep, pid))
+			return;
 	}
 
-	return true;
+	now = time_now_ns();
+	miss = comm_miss_find(res, pid);
+	if (miss && now - miss->time < TC_COMM_MISS_RETRY_NS)
+		return;
 
- fail:
-	TfsError_fmt(instance, "Failed to set PIDs for \"%s\"",
-		     file);
-	return false;
+	if (read_proc_comm(pid, comm)) {
+		tep_register_comm(res->tep, comm, pid);
+		if (miss)
+			comm_resolver_missed_del(res, pid);
+	} else if (miss) {
+		miss->time = now;
+	} else {
+		comm_resolver_missed_add(res, pid, now);
+	}
 }
 
-PyObject *PyFtrace_set_event_pid(PyObject *self, PyObject *args,
-						 PyObject *kwargs)
+/* Make sure the name of the process of the record is known. */
+static void resolve_comm(struct tc_tep *tt,
+			 struct tep_record *record,
+			 struct tep_event *event)
 {
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	PyObject *pid_val;
-
-	static char *kwlist[] = {"pid", "instance", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "O|O",
-					 kwlist,
-					 &pid_val,
-					 &py_inst)) {
-		return NULL;
-	}
-
-	if (!get_optional_instance(py_inst, &instance))
-		return NULL;
+	struct tc_comm_resolver *res;
 
-	if (!set_pid(instance, "set_event_pid", pid_val))
-		return NULL;
+	res = comm_resolver_get(tt);
+	if (!res)
+		return;
 
-	Py_RETURN_NONE;
+	pthread_mutex_lock(&tt->lock);
+	comm_resolver_update(res, event, record);
+	comm_resolver_resolve(res, get_pid(event, record));
+	pthread_mutex_unlock(&tt->lock);
 }
 
-PyObject *PyFtrace_set_ftrace_pid(PyObject *self, PyObject *args,
-						  PyObject *kwargs)
+static void print_comm_pid(struct tep_handle *tep,
+			   struct trace_seq *seq,
+			   struct tep_record *record,
+			   struct tep_event *event)
 {
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	PyObject *pid_val;
-
-	static char *kwlist[] = {"pid", "instance", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "O|O",
-					 kwlist,
-					 &pid_val,
-					 &py_inst)) {
-		return NULL;
-	}
-
-	if (!get_optional_instance(py_inst, &instance))
-		return NULL;
+	tep_print_event(tep, seq, record, "%s-%i",
+			TEP_PRINT_COMM,
+			TEP_PRINT_PID);
+}
 
-	if (!set_pid(instance, "set_ftrace_pid", pid_val))
-		return NULL;
+static void print_name_info(struct tep_handle *tep,
+			    struct trace_seq *seq,
+			    struct tep_record *record,
+			    struct tep_event *event)
+{
+	trace_seq_printf(seq, " %s: ", event->name);
+	tep_print_event(tep, seq, record, "%s", TEP_PRINT_INFO);
+}
 
-	Py_RETURN_NONE;
+static void print_event(struct tep_handle *tep,
+			struct trace_seq *seq,
+			struct tep_record *record,
+			struct tep_event *event)
+{
+	tep_print_event(tep, seq, record, "%6.1000d ", TEP_PRINT_TIME);
+	print_comm_pid(tep, seq, record, event);
+	tep_print_event(tep, seq, record, " cpu=%i ", TEP_PRINT_CPU);
+	print_name_info(tep, seq, record, event);
 }
 
-static bool set_opt(struct tracefs_instance *instance,
-		    const char *opt, const char *val)
+static bool print_init(PyObject *args, PyObject *kwargs,
+		       struct tep_event **event,
+		       struct tep_record **record)
 {
-	char file[PATH_MAX];
+	static char *kwlist[] = { "event", "record", NULL};
+	PyObject *obj_rec, *obj_evt;
+	PyTepRecord *py_record;
+	PyTepEvent *py_event;
 
-	if (sprintf(file, "options/%s", opt) <= 0 ||
-	    !write_to_file_and_check(instance, file, val)) {
-		TfsError_fmt(instance, "Failed to set option \"%s\"", opt);
+	if (!init_print_seq())
 		return false;
-	}
-
-	return true;
-}
 
-static PyObject *set_option_py_args(PyObject *args, PyObject *kwargs,
-				   const char *val)
-{
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	const char *opt;
+	if(!PyArg_ParseTupleAndKeywords(args,
+					kwargs,
+					"OO",
+					kwlist,
+					&obj_evt,
+					&obj_rec)) {
+		return false;
+	}
 
-	static char *kwlist[] = {"option", "instance", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "s|O",
-					 kwlist,
-					 &opt,
-					 &py_inst)) {
-		return NULL;
+	if (PyTepEvent_Check(obj_evt) && PyTepRecord_Check(obj_rec)) {
+		py_event = (PyTepEvent *)obj_evt;
+		*event = py_event->ptrObj->event;
+		py_record = (PyTepRecord *)obj_rec;
+		*record = py_record->ptrObj;
+
+		return true;
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
+	PyErr_SetString(TRACECRUNCHER_ERROR,
+			"Inconsistent arguments.");
+
+	return false;
+}
+
+PyObject *PyTep_event_record(PyTep *self, PyObject *args,
+					  PyObject *kwargs)
+{
+	struct tep_record *record;
+	struct tep_event *event;
+
+	if (!print_init(args, kwargs, &event, &record))
 		return NULL;
 
-	if (!set_opt(instance, opt, val))
+	tc_event_by_record(self->ptrObj, record);
+	resolve_comm(self->ptrObj, record, event);
+	pthread_mutex_lock(&self->ptrObj->lock);
+	print_event(self->ptrObj->tep, &seq, record, event);
+	pthread_mutex_unlock(&self->ptrObj->lock);
+
+	return PyUnicode_FromString(seq.buffer);
+}
+
+PyObject *PyTep_info(PyTep *self, PyObject *args,
+				  PyObject *kwargs)
+{
+	struct tep_record *record;
+	struct tep_event *event;
+
+	if (!print_init(args, kwargs, &event, &record))
 		return NULL;
 
-	Py_RETURN_NONE;
+	tc_event_by_record(self->ptrObj, record);
+	pthread_mutex_lock(&self->ptrObj->lock);
+	print_name_info(self->ptrObj->tep, &seq, record, event);
+	pthread_mutex_unlock(&self->ptrObj->lock);
+
+	return PyUnicode_FromString(seq.buffer);
 }
 
-PyObject *PyFtrace_enable_option(PyObject *self, PyObject *args,
-						 PyObject *kwargs)
+PyObject *PyTep_process(PyTep *self, PyObject *args,
+				     PyObject *kwargs)
 {
-	return set_option_py_args(args, kwargs, ON);
+	struct tep_record *record;
+	struct tep_event *event;
+
+	if (!print_init(args, kwargs, &event, &record))
+		return NULL;
+
+	tc_event_by_record(self->ptrObj, record);
+	resolve_comm(self->ptrObj, record, event);
+	pthread_mutex_lock(&self->ptrObj->lock);
+	print_comm_pid(self->ptrObj->tep, &seq, record, event);
+	pthread_mutex_unlock(&self->ptrObj->lock);
+
+	return PyUnicode_FromString(seq.buffer);
 }
 
-PyObject *PyFtrace_disable_option(PyObject *self, PyObject *args,
-						  PyObject *kwargs)
+typedef void (*print_record_func)(struct tep_handle *,
+				  struct trace_seq *,
+				  struct tep_record *,
+				  struct tep_event *);
+
+static const struct {
+	const char		*name;
+	print_record_func	print;
+	bool			comm;
+} print_formats[] = {
+	{"event",	print_event,	true},
+	{"info",	print_name_info, false},
+	{"process",	print_comm_pid,	true},
+};
+
+static bool write_buffer(int fd, const char *buf, size_t size)
 {
-	return set_option_py_args(args, kwargs, OFF);
+	ssize_t ret;
+
+	while (size) {
+		ret = write(fd, buf, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			return false;
+
+		buf += ret;
+		size -= ret;
+	}
+
+	return true;
 }
 
-PyObject *PyFtrace_option_is_set(PyObject *self, PyObject *args,
-						 PyObject *kwargs)
+PyObject *PyTep_format_records(PyTep *self, PyObject *args,
+					    PyObject *kwargs)
 {
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	enum tracefs_option_id opt_id;
-	const char *opt;
+	static char *kwlist[] = {"records", "format", "fd", NULL};
+	const char *format = "event";
+	struct tc_record_batch *batch;
+	struct tc_tep *tt = self->ptrObj;
+	print_record_func print = NULL;
+	PyObject *py_batch;
+	bool comm = false;
+	int i, fd = -1;
+	bool ok = true;
 
-	static char *kwlist[] = {"option", "instance", NULL};
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "s|O",
+					 "O|si",
 					 kwlist,
-					 &opt,
-					 &py_inst)) {
+					 &py_batch,
+					 &format,
+					 &fd)) {
 		return NULL;
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
+	if (!PyTepRecordBatch_Check(py_batch)) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Passing argument \'records\' with incompatible type.");
 		return NULL;
+	}
 
-	opt_id = tracefs_option_id(opt);
-	if (tracefs_option_is_enabled(instance, opt_id))
-		Py_RETURN_TRUE;
+	for (i = 0; i < sizeof(print_formats) / sizeof(*print_formats); ++i) {
+		if (strcmp(format, print_formats[i].name) == 0) {
+			print = print_formats[i].print;
+			comm = print_formats[i].comm;
+		}
+	}
 
-	Py_RETURN_FALSE;
-}
+	if (!print) {
+		PyErr_Format(TRACECRUNCHER_ERROR,
+			     "Unknown record format \'%s\'.", format);
+		return NULL;
+	}
 
-static PyObject *get_option_list(struct tracefs_instance *instance,
-				 bool enabled)
-{
-	const struct tracefs_options_mask *mask;
-	PyObject *list = PyList_New(0);
-	int i;
+	/* The events of the records must be known to the printing handle. */
+	batch = ((PyTepRecordBatch *) py_batch)->ptrObj;
+	for (i = 0; i < batch->count; ++i) {
+		tc_event_by_record(tt, &batch->records[i]);
+		if (comm)
+			resolve_comm(tt, &batch->records[i], batch->events[i]);
+	}
 
-	mask = enabled ? tracefs_options_get_enabled(instance) :
-			 tracefs_options_get_supported(instance);
+	if (!init_print_seq())
+		return NULL;
 
-	for (i = 0; i < TRACEFS_OPTION_MAX; ++i)
-		if (tracefs_option_mask_is_set(mask, i)) {
-			const char *opt = tracefs_option_name(i);
-			PyList_Append(list, PyUnicode_FromString(opt));
-		}
+	/*
+	 * The batch and the tep handle are kept alive by the arguments. Calls
+	 * with the same handle are serialized by the lock of the handle.
+	 */
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&tt->lock);
+	for (i = 0; i < batch->count; ++i) {
+		print(tt->tep, &seq, &batch->records[i], batch->events[i]);
+		trace_seq_putc(&seq, '\n');
+	}
 
-	return list;
-}
+	pthread_mutex_unlock(&tt->lock);
+	if (fd >= 0)
+		ok = write_buffer(fd, seq.buffer, seq.len);
+	Py_END_ALLOW_THREADS
 
-PyObject *PyFtrace_enabled_options(PyObject *self, PyObject *args,
-						   PyObject *kwargs)
-{
-	struct tracefs_instance *instance;
+	if (seq.state != TRACE_SEQ__GOOD) {
+		MEM_ERROR;
+		return NULL;
+	}
 
-	if (!get_instance_from_arg(args, kwargs, &instance))
+	if (fd < 0)
+		return PyUnicode_FromStringAndSize(seq.buffer, seq.len);
+
+	if (!ok) {
+		PyErr_SetFromErrno(PyExc_OSError);
 		return NULL;
+	}
 
-	return get_option_list(instance, true);
+	return PyLong_FromLong(seq.len);
 }
 
-PyObject *PyFtrace_supported_options(PyObject *self, PyObject *args,
-						     PyObject *kwargs)
+static int kprobe_info_short(struct trace_seq *s,
+			     struct tep_record *record,
+			     struct tep_event *event,
+			     void *context)
 {
-	struct tracefs_instance *instance;
+	/* Do not print the address of the probe (first field). */
+	unsigned long long select_mask = ~0x1;
 
-	if (!get_instance_from_arg(args, kwargs, &instance))
-		return NULL;
+	tep_record_print_selected_fields(s, record, event, select_mask);
 
-	return get_option_list(instance, false);
+	return 0;
 }
 
-#define TC_SYS	"tcrunch"
-
-PyObject *PyFtrace_tc_event_system(PyObject *self)
+PyObject *PyTep_short_kprobe_print(PyTep *self, PyObject *args,
+						PyObject *kwargs)
 {
-	return PyUnicode_FromString(TC_SYS);
-}
+	static char *kwlist[] = {"system", "event", "id", NULL};
+	const char *system, *event;
+	int ret, id = -1;
 
-PyObject *PyFtrace_no_arg(PyObject *self)
-{
-	return PyUnicode_FromString(NO_ARG);
-}
+	system = event = NO_ARG;
 
-static PyObject *dynevent_info2py(char *buff, int type)
-{
-	PyObject *ret;
+	if(!PyArg_ParseTupleAndKeywords(args,
+					kwargs,
+					"ss|i",
+					kwlist,
+					&system,
+					&event,
+					&id)) {
+		return false;
+	}
 
-	if (type == TRACEFS_DYNEVENT_UNKNOWN) {
-		PyErr_SetString(TFS_ERROR, "Failed to get dynevent info.");
+	pthread_mutex_lock(&self->ptrObj->lock);
+	ret = tep_register_event_handler(self->ptrObj->tep, id, system, event,
+					 kprobe_info_short, NULL);
+	pthread_mutex_unlock(&self->ptrObj->lock);
+	if (ret < 0) {
+		TfsError_fmt(NULL, "Failed to register handler for event %s/%s (%i).",
+			     system, event, id);
 		return NULL;
 	}
 
-	ret = PyUnicode_FromString(buff);
-	free(buff);
-
-	return ret;
+	Py_RETURN_NONE;
 }
 
-PyObject *PyDynevent_system(PyDynevent *self)
+static bool check_file(struct tracefs_instance *instance, const char *file)
 {
-	char *buff;
-	int type;
+	if (!tracefs_file_exists(instance, file)) {
+		TfsError_fmt(instance, "File %s does not exist.", file);
+		return false;
+	}
 
-	type = tracefs_dynevent_info(self->ptrObj, &buff, NULL, NULL, NULL, NULL);
-	return dynevent_info2py(buff, type);
+	return true;
 }
 
-PyObject *PyDynevent_event(PyDynevent *self)
+static bool check_dir(struct tracefs_instance *instance, const char *dir)
 {
-	char *buff;
-	int type;
+	if (!tracefs_dir_exists(instance, dir)) {
+		TfsError_fmt(instance, "Directory %s does not exist.", dir);
+		return false;
+	}
 
-	type = tracefs_dynevent_info(self->ptrObj, NULL, &buff, NULL, NULL, NULL);
-	return dynevent_info2py(buff, type);
+	return true;
 }
 
-PyObject *PyDynevent_address(PyDynevent *self)
+const char *top_instance_name = "top";
+static const char *get_instance_name(struct tracefs_instance *instance)
 {
-	char *buff;
-	int type;
-
-	type = tracefs_dynevent_info(self->ptrObj, NULL, NULL, NULL, &buff, NULL);
-	return dynevent_info2py(buff, type);
+	const char *name = tracefs_instance_get_name(instance);
+	return name ? name : top_instance_name;
 }
 
-PyObject *PyDynevent_probe(PyDynevent *self)
+static int write_to_file(struct tracefs_instance *instance,
+			 const char *file,
+			 const char *val)
 {
-	char *buff;
-	int type;
+	int size;
 
-	type = tracefs_dynevent_info(self->ptrObj, NULL, NULL, NULL, NULL, &buff);
-	return dynevent_info2py(buff, type);
+	if (!check_file(instance, file))
+		return -1;
+
+	size = tracefs_instance_file_write(instance, file, val);
+	if (size <= 0) {
+		TfsError_fmt(instance,
+			     "Can not write \'%s\' to file \'%s\' (inst: \'%s\').",
+			     val, file, get_instance_name(instance));
+		PyErr_Print();
+	}
+
+	return size;
 }
 
-PyObject *PyDynevent_register(PyDynevent *self)
+static int append_to_file(struct tracefs_instance *instance,
+			  const char *file,
+			  const char *val)
 {
-	if (tracefs_dynevent_create(self->ptrObj) < 0) {
-		char *evt;
-		int type;
+	int size;
 
-		type = tracefs_dynevent_info(self->ptrObj, NULL, &evt, NULL, NULL, NULL);
-		TfsError_fmt(NULL, "Failed to register dynamic event '%s'.",
-		type != TRACEFS_DYNEVENT_UNKNOWN ? evt : "UNKNOWN");
-		free(evt);
-		return NULL;
-	}
-
-	/*
-	 * Here the dynamic event gets added to the system.
-	 * Hence we need to 'destroy' this event at exit.
-	 */
-	set_destroy_flag((PyObject *)self, true);
-	Py_RETURN_NONE;
-}
-
-PyObject *PyDynevent_unregister(PyDynevent *self)
-{
-	if (tracefs_dynevent_destroy(self->ptrObj, true) < 0) {
-		char *evt;
-		int type;
+	if (!check_file(instance, file))
+		return -1;
 
-		type = tracefs_dynevent_info(self->ptrObj, NULL, &evt, NULL, NULL, NULL);
-		TfsError_fmt(NULL, "Failed to unregister dynamic event '%s'.",
-		type != TRACEFS_DYNEVENT_UNKNOWN ? evt : "UNKNOWN");
-		free(evt);
-		return NULL;
+	size = tracefs_instance_file_append(instance, file, val);
+	if (size <= 0) {
+		TfsError_fmt(instance,
+			     "Can not append \'%s\' to file \'%s\' (inst: \'%s\').",
+			     val, file, get_instance_name(instance));
+		PyErr_Print();
 	}
 
-	/*
-	 * Here the synthetic event gets removed from the system.
-	 * Hence we no loger need to 'destroy' this event at exit.
-	 */
-	set_destroy_flag((PyObject *)self, false);
-	Py_RETURN_NONE;
+	return size;
 }
 
-PyObject *PyFtrace_kprobe(PyObject *self, PyObject *args, PyObject *kwargs)
+static int read_from_file(struct tracefs_instance *instance,
+			  const char *file,
+			  char **val)
 {
-	static char *kwlist[] = {"event", "function", "probe", NULL};
-	const char *event, *function, *probe;
-	struct tracefs_dynevent *kprobe;
-	PyObject *py_dyn;
+	int size;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "sss",
-					 kwlist,
-					 &event,
-					 &function,
-					 &probe)) {
-		return NULL;
-	}
+	if (!check_file(instance, file))
+		return -1;
 
-	kprobe = tracefs_kprobe_alloc(TC_SYS, event, function, probe);
-	if (!kprobe) {
-		MEM_ERROR;
-		return NULL;
-	}
+	*val = tracefs_instance_file_read(instance, file, &size);
+	if (size < 0)
+		TfsError_fmt(instance, "Can not read from file %s", file);
 
-	py_dyn = PyDynevent_New(kprobe);
-	/*
-	 * Here we only allocated and initializes a dynamic event object.
-	 * However, no dynamic event is added to the system yet. Hence,
-	 * there is no need to 'destroy' this event at exit.
-	 */
-	set_destroy_flag(py_dyn, false);
-	return py_dyn;
+	return size;
 }
 
-PyObject *PyFtrace_kretprobe(PyObject *self, PyObject *args, PyObject *kwargs)
+static bool write_to_file_and_check(struct tracefs_instance *instance,
+				    const char *file,
+				    const char *val)
 {
-	static char *kwlist[] = {"event", "function", "probe", NULL};
-	const char *event, *function, *probe = "$retval";
-	struct tracefs_dynevent *kprobe;
-	PyObject *py_dyn;
+	char *read_val;
+	int ret;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "ss|s",
-					 kwlist,
-					 &event,
-					 &function,
-					 &probe)) {
-		return NULL;
-	}
+	if (write_to_file(instance, file, val) <= 0)
+		return false;
 
-	kprobe = tracefs_kretprobe_alloc(TC_SYS, event, function, probe, 0);
-	if (!kprobe) {
-		MEM_ERROR;
-		return NULL;
-	}
+	if (read_from_file(instance, file, &read_val) <= 0)
+		return false;
 
-	py_dyn = PyDynevent_New(kprobe);
-	/*
-	 * Here we only allocated and initializes a dynamic event object.
-	 * However, no dynamic event is added to the system yet. Hence,
-	 * there is no need to 'destroy' this event at exit.
-	 */
-	set_destroy_flag(py_dyn, false);
-	return py_dyn;
+	trim_new_line(read_val);
+	ret = strcmp(read_val, val);
+	free(read_val);
+
+	return ret == 0 ? true : false;
 }
 
-struct tep_event *dynevent_get_event(PyDynevent *event,
-				     struct tep_handle **tep_ptr)
+static PyObject *tfs_list2py_list(char **list, bool sort)
 {
-	struct tep_event *tep_evt;
-	struct tep_handle *tep;
+	PyObject *py_list = PyList_New(0);
+	int i;
 
-	tep = get_tep(NULL, NULL);
-	if (!tep)
-		return NULL;
+	for (i = 0; list && list[i]; i++)
+		PyList_Append(py_list, PyUnicode_FromString(list[i]));
 
-	tep_evt = tracefs_dynevent_get_event(tep, event->ptrObj);
-	if (!tep_evt) {
-		TfsError_setstr(NULL, "Failed to get dynevent.");
-		return NULL;
-	}
+	if (sort)
+		PyList_Sort(py_list);
 
-	if (tep_ptr)
-		*tep_ptr = tep;
+	tracefs_list_free(list);
 
-	return tep_evt;
+	return py_list;
 }
 
-PyObject *PyFtrace_eprobe(PyObject *self, PyObject *args, PyObject *kwargs)
+PyObject *PyTfsInstance_dir(PyTfsInstance *self)
 {
-	static char *kwlist[] = {"event", "target_system", "target_event", "fetch_fields", NULL};
-	const char *event, *target_system, *target_event, *fetchargs;
-	struct tracefs_dynevent *eprobe;
-	PyObject *py_dyn;
+	return PyUnicode_FromString(tracefs_instance_get_dir(self->ptrObj));
+}
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "ssss",
-					 kwlist,
-					 &event,
-					 &target_system,
-					 &target_event,
-					 &fetchargs)) {
-		return NULL;
-	}
+PyObject *PyTfsInstance_reset(PyTfsInstance *self)
+{
+	tracefs_instance_reset(self->ptrObj);
+	Py_RETURN_NONE;
+}
 
-	/* 'eprobes' are introduced in kernel version 5.15. */
-	if (!check_kernel_support("eprobe", 5, 15))
-		return NULL;
+int py_instance_destroy(struct tracefs_instance *instance)
+{
+	tracefs_instance_reset(instance);
+	tracefs_instance_destroy(instance);
+	return 0;
+}
 
-	eprobe = tracefs_eprobe_alloc(TC_SYS, event, target_system, target_event, fetchargs);
-	if (!eprobe) {
-		MEM_ERROR;
-		return NULL;
-	}
+PyObject *PyTfsInstance_delete(PyTfsInstance *self)
+{
+	py_instance_destroy(self->ptrObj);
 
-	py_dyn = PyDynevent_New(eprobe);
-	/*
-	 * Here we only allocated and initializes a dynamic event object.
-	 * However, no dynamic event is added to the system yet. Hence,
-	 * there is no need to 'destroy' this event at exit.
-	 */
-	set_destroy_flag(py_dyn, false);
-	return py_dyn;
+	Py_RETURN_NONE;
 }
 
-static PyObject *alloc_uprobe(PyObject *self, PyObject *args, PyObject *kwargs, bool pret)
+PyObject *PyTraceHist_add_value(PyTraceHist *self, PyObject *args,
+						   PyObject *kwargs)
 {
-	static char *kwlist[] = {"event", "file", "offset", "fetch_args", NULL};
-	const char *event, *file, *fetchargs = NULL;
-	unsigned long long offset;
-	struct tracefs_dynevent *uprobe;
-	PyObject *py_dyn;
+	static char *kwlist[] = {"value", NULL};
+	const char *value;
 
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "ssK|s",
+					 "s",
 					 kwlist,
-					 &event,
-					 &file,
-					 &offset,
-					 &fetchargs)) {
+					 &value)) {
 		return NULL;
 	}
 
-	if (pret)
-		uprobe = tracefs_uretprobe_alloc(TC_SYS, event, file, offset, fetchargs);
-	else
-		uprobe = tracefs_uprobe_alloc(TC_SYS, event, file, offset, fetchargs);
-	if (!uprobe) {
-		MEM_ERROR;
+	if (tracefs_hist_add_value(self->ptrObj, value) < 0) {
+		MEM_ERROR
 		return NULL;
 	}
 
-	py_dyn = PyDynevent_New(uprobe);
-	/*
-	 * Here we only allocated and initializes a dynamic event object.
-	 * However, no dynamic event is added to the system yet. Hence,
-	 * there is no need to 'destroy' this event at exit.
-	 */
-	set_destroy_flag(py_dyn, false);
-	return py_dyn;
+	Py_RETURN_NONE;
 }
 
-PyObject *PyFtrace_uprobe(PyObject *self, PyObject *args, PyObject *kwargs)
+const char *hist_noname = "unnamed";
+static inline const char *get_hist_name(struct tracefs_hist *hist)
 {
-	return alloc_uprobe(self, args, kwargs, false);
+	const char *name = tracefs_hist_get_name(hist);
+	return name ? name : hist_noname;
 }
 
-PyObject *PyFtrace_uretprobe(PyObject *self, PyObject *args, PyObject *kwargs)
+static bool add_sort_key(struct tracefs_hist *hist,
+			 const char *sort_key)
 {
-	return alloc_uprobe(self, args, kwargs, true);
+	if (tracefs_hist_add_sort_key(hist, sort_key) < 0) {
+		TfsError_fmt(NULL,
+			     "Failed to add sort key \'%s\'to histogram \'%s\'.",
+			     sort_key, get_hist_name(hist));
+		return false;
+	}
+
+	return true;
 }
 
-static PyObject *set_filter(PyObject *args, PyObject *kwargs,
-			    struct tep_handle *tep,
-			    struct tep_event *event)
+PyObject *PyTraceHist_sort_keys(PyTraceHist *self, PyObject *args,
+						   PyObject *kwargs)
 {
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	const char *filter;
+	static char *kwlist[] = {"keys", NULL};
+	PyObject *py_obj;
+	const char *key;
 
-	static char *kwlist[] = {"filter", "instance", NULL};
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "s|O",
+					 "O",
 					 kwlist,
-					 &filter,
-					 &py_inst)) {
+					 &py_obj)) {
 		return NULL;
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
-		return NULL;
+	if (PyUnicode_Check(py_obj)) {
+		if (!add_sort_key(self->ptrObj, PyUnicode_DATA(py_obj)))
+			return NULL;
+	} else if (PyList_CheckExact(py_obj)) {
+		int i, n = PyList_Size(py_obj);
 
-	if (tracefs_event_filter_apply(instance, event, filter) < 0) {
-		TfsError_fmt(NULL, "Failed to apply filter '%s' to event '%s'.",
-			     filter, event->name);
-		return NULL;
+		for (i = 0; i < n; ++i) {
+			key = tc_str_from_list(py_obj, i);
+			if (!key ||
+			    !add_sort_key(self->ptrObj, key)) {
+				PyErr_SetString(TRACECRUNCHER_ERROR,
+						"Inconsistent \"keys\" argument.");
+				return NULL;
+			}
+		}
 	}
 
 	Py_RETURN_NONE;
 }
 
-static PyObject *get_filter(PyObject *args, PyObject *kwargs,
-			    const char *system, const char* event )
+static int sort_direction(PyObject *py_dir)
 {
-	struct tracefs_instance *instance;
-	PyObject *ret = NULL;
-	char *filter = NULL;
-	char path[PATH_MAX];
-
-	if (!get_instance_from_arg(args, kwargs, &instance))
-		return NULL;
+	int dir = -1;
 
-	sprintf(path, "events/%s/%s/filter", system, event);
-	if (read_from_file(instance, path, &filter) <= 0)
-		return NULL;
+	if (PyLong_CheckExact(py_dir)) {
+		dir = PyLong_AsLong(py_dir);
+	} else if (PyUnicode_Check(py_dir)) {
+		const char *dir_str =  PyUnicode_DATA(py_dir);
 
-	trim_new_line(filter);
-	ret = PyUnicode_FromString(filter);
-	free(filter);
+		if (lax_cmp(dir_str, "descending") ||
+		    lax_cmp(dir_str, "desc") ||
+		    lax_cmp(dir_str, "d"))
+			dir = 1;
+		else if (lax_cmp(dir_str, "ascending") ||
+			 lax_cmp(dir_str, "asc") ||
+			 lax_cmp(dir_str, "a"))
+			dir = 0;
+	}
 
-	return ret;
+	return dir;
 }
 
-static PyObject *clear_filter(PyObject *args, PyObject *kwargs,
-			      struct tep_event *event)
+PyObject *PyTraceHist_sort_key_direction(PyTraceHist *self, PyObject *args,
+							    PyObject *kwargs)
 {
-	struct tracefs_instance *instance;
+	static char *kwlist[] = {"sort_key", "direction", NULL};
+	const char *sort_key;
+	PyObject *py_dir;
+	int dir;
 
-	if (!get_instance_from_arg(args, kwargs, &instance))
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "sO",
+					 kwlist,
+					 &sort_key,
+					 &py_dir)) {
 		return NULL;
+	}
 
-	if (tracefs_event_filter_clear(instance, event) < 0) {
-		TfsError_fmt(NULL, "Failed to clear filter for event '%s'.",
-			     event->name);
+	dir = sort_direction(py_dir);
+
+	if (dir < 0 ||
+	    tracefs_hist_sort_key_direction(self->ptrObj, sort_key, dir) < 0) {
+		TfsError_fmt(NULL,
+			     "Failed to add sort direction to histogram \'%s\'.",
+			     get_hist_name(self->ptrObj));
 		return NULL;
 	}
 
 	Py_RETURN_NONE;
 }
 
-PyObject *PyDynevent_set_filter(PyDynevent *self, PyObject *args,
-						  PyObject *kwargs)
+static bool get_optional_instance(PyObject *py_obj,
+				  struct tracefs_instance **instance)
 {
-	struct tep_handle *tep;
-	struct tep_event *evt;
+	PyTfsInstance *py_inst;
 
-	evt = dynevent_get_event(self, &tep);
-	if (!evt)
-		return NULL;
+	if (!py_obj) {
+		*instance = NULL;
+		return true;
+	}
+
+	if (!PyTfsInstance_Check(py_obj)) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Passing argument \'instance\' with incompatible type.");
+		return false;
+	}
+
+	py_inst = (PyTfsInstance *)py_obj;
+	*instance = py_inst->ptrObj;
 
-	return set_filter(args, kwargs, tep, evt);
+	return true;
 }
 
-PyObject *PyDynevent_get_filter(PyDynevent *self, PyObject *args,
-						  PyObject *kwargs)
+bool get_instance_from_arg(PyObject *args, PyObject *kwargs,
+			   struct tracefs_instance **instance)
 {
-	struct tep_event *evt = dynevent_get_event(self, NULL);
-	char *evt_name, *evt_system;
-	int type;
-
-	if (!evt)
-		return NULL;
+	static char *kwlist[] = {"instance", NULL};
+	PyObject *py_inst = NULL;
+	*instance = NULL;
 
-	type = tracefs_dynevent_info(self->ptrObj, &evt_system, &evt_name,
-				     NULL, NULL, NULL);
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|O",
+					 kwlist,
+					 &py_inst)) {
+		return false;
+	}
 
-	if (type == TRACEFS_DYNEVENT_UNKNOWN) {
-		PyErr_SetString(TFS_ERROR, "Failed to get dynevent info.");
+	if (!get_optional_instance(py_inst, instance))
 		return NULL;
-	}
 
-	return get_filter(args, kwargs, evt_system, evt_name);
+	return true;
 }
 
-PyObject *PyDynevent_clear_filter(PyDynevent *self, PyObject *args,
-						    PyObject *kwargs)
+static bool hist_cmd(PyTraceHist *self, PyObject *args, PyObject *kwargs,
+		     enum tracefs_hist_command cmd,
+		     const char *err_msg)
 {
-	struct tep_event *evt = dynevent_get_event(self, NULL);
+	struct tracefs_instance *instance;
 
-	if (!evt)
+	if (!get_instance_from_arg(args, kwargs, &instance))
 		return NULL;
 
-	return clear_filter(args, kwargs, evt);
-}
+	if (tracefs_hist_command(instance, self->ptrObj, cmd) < 0) {
+		char *buff;
 
-static bool enable_dynevent(PyDynevent *self, PyObject *args, PyObject *kwargs,
-			  bool enable)
-{
-	struct tracefs_instance *instance;
-	char * evt_name;
-	int type;
-	bool ret;
+		if (asprintf(&buff, "%s %s",
+			     err_msg, get_hist_name(self->ptrObj)) <= 0) {
+			MEM_ERROR;
+			return false;
+		}
 
-	if (!get_instance_from_arg(args, kwargs, &instance))
-		return false;
+		TfsError_setstr(instance, buff);
+		free(buff);
 
-	type = tracefs_dynevent_info(self->ptrObj, NULL, &evt_name, NULL, NULL, NULL);
-	if (type == TRACEFS_DYNEVENT_UNKNOWN) {
-		PyErr_SetString(TFS_ERROR, "Failed to get dynevent info.");
-		return NULL;
+		return false;
 	}
 
-	ret = event_enable_disable(instance, TC_SYS, evt_name, enable);
-	free(evt_name);
+	return true;
+}
 
-	return ret;
+PyObject *PyTraceHist_start(PyTraceHist *self, PyObject *args,
+					       PyObject *kwargs)
+{
+	if (!hist_cmd(self, args, kwargs,
+		      TRACEFS_HIST_CMD_START,
+		      "Failed to start filling the histogram"))
+		return false;
+
+	Py_RETURN_NONE;
 }
 
-PyObject *PyDynevent_enable(PyDynevent *self, PyObject *args,
+PyObject *PyTraceHist_stop(PyTraceHist *self, PyObject *args,
 					      PyObject *kwargs)
 {
-	if (!enable_dynevent(self, args, kwargs, true))
-		return NULL;
+	if (!hist_cmd(self, args, kwargs,
+		      TRACEFS_HIST_CMD_PAUSE,
+		      "Failed to stop filling the histogram"))
+		return false;
 
 	Py_RETURN_NONE;
 }
 
-PyObject *PyDynevent_disable(PyDynevent *self, PyObject *args,
+PyObject *PyTraceHist_resume(PyTraceHist *self, PyObject *args,
+						PyObject *kwargs)
+{
+	if (!hist_cmd(self, args, kwargs,
+		      TRACEFS_HIST_CMD_CONT,
+		      "Failed to resume filling the histogram"))
+		return false;
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyTraceHist_clear(PyTraceHist *self, PyObject *args,
 					       PyObject *kwargs)
 {
-	if (!enable_dynevent(self, args, kwargs, false))
-		return NULL;
+	if (!hist_cmd(self, args, kwargs,
+		      TRACEFS_HIST_CMD_CLEAR,
+		      "Failed to clear the histogram"))
+		return false;
 
 	Py_RETURN_NONE;
 }
 
-PyObject *PyDynevent_is_enabled(PyDynevent *self, PyObject *args,
-					      PyObject *kwargs)
+static char *hist_read(PyTraceHist *self, PyObject *args,
+					  PyObject *kwargs)
 {
 	struct tracefs_instance *instance;
-	char * evt_name;
-	PyObject *ret;
-	int type;
+	const char *hist_file = "hist";
+	char *data;
 
 	if (!get_instance_from_arg(args, kwargs, &instance))
 		return NULL;
 
-	type = tracefs_dynevent_info(self->ptrObj, NULL, &evt_name, NULL, NULL, NULL);
-	if (type == TRACEFS_DYNEVENT_UNKNOWN) {
-		PyErr_SetString(TFS_ERROR, "Failed to get dynevent info.");
-		return NULL;
+	data = tracefs_event_file_read(instance,
+				       tracefs_hist_get_system(self->ptrObj),
+				       tracefs_hist_get_event(self->ptrObj),
+				       hist_file,
+				       NULL);
+	if (!data) {
+		TfsError_fmt(instance,
+			     "Failed read data from histogram \'%s\'.",
+			     get_hist_name(self->ptrObj));
 	}
 
-	ret = event_is_enabled(instance, TC_SYS, evt_name);
-	free(evt_name);
+	return data;
+}
+
+PyObject *PyTraceHist_read(PyTraceHist *self, PyObject *args,
+					      PyObject *kwargs)
+{
+	char *data = hist_read(self, args, kwargs);
+	if (!data)
+		return NULL;
+
+	PyObject *ret = PyUnicode_FromString(data);
 
+	free(data);
 	return ret;
 }
 
-static enum tracefs_hist_key_type hist_key_type(PyObject * py_type)
+PyObject *PyTraceHist_close(PyTraceHist *self, PyObject *args,
+					       PyObject *kwargs)
 {
-	int type = -1;
+	if (!hist_cmd(self, args, kwargs,
+		      TRACEFS_HIST_CMD_DESTROY,
+		      "Failed to close the histogram"))
+		return false;
 
-	if (PyUnicode_Check(py_type)) {
-		const char *type_str = PyUnicode_DATA(py_type);
+	Py_RETURN_NONE;
+}
 
-		if (lax_cmp(type_str, "normal") ||
-		    lax_cmp(type_str, "n") )
-			type = TRACEFS_HIST_KEY_NORMAL;
-		else if (lax_cmp(type_str, "hex") ||
-			 lax_cmp(type_str, "h") )
-			type = TRACEFS_HIST_KEY_HEX;
-		else if (lax_cmp(type_str, "sym"))
-			 type = TRACEFS_HIST_KEY_SYM;
-		else if (lax_cmp(type_str, "sym_offset") ||
-			 lax_cmp(type_str, "so"))
-			type = TRACEFS_HIST_KEY_SYM_OFFSET;
-		else if (lax_cmp(type_str, "syscall") ||
-			 lax_cmp(type_str, "sc"))
-			type = TRACEFS_HIST_KEY_SYSCALL;
-		else if (lax_cmp(type_str, "execname") ||
-			 lax_cmp(type_str, "e"))
-			 type = TRACEFS_HIST_KEY_EXECNAME;
-		else if (lax_cmp(type_str, "log") ||
-			 lax_cmp(type_str, "l"))
+typedef int (*add_field_ptr)(struct tracefs_synth *,
+			     const char *,
+			     const char *);
+
+PyObject *synth_add_fields(PySynthEvent *self, PyObject *args,
+					       PyObject *kwargs,
+					       bool to_start)
+{
+	static char *kwlist[] = {"fields", "names", NULL};
+	PyObject *py_fields, *py_names = NULL;
+	PyObject *item_field, *item_name;
+	add_field_ptr add_field_func;
+	const char *field, *name;
+	int ret, n, i;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "O|O",
+					 kwlist,
+					 &py_fields,
+					 &py_names)) {
+		return NULL;
+	}
+
+	add_field_func = to_start ? tracefs_synth_add_start_field:
+				    tracefs_synth_add_end_field;
+
+	n = PyList_Size(py_fields);
+	for (i = 0; i < n; ++i) {
+		item_field = PyList_GetItem(py_fields, i);
+		field = PyUnicode_DATA(item_field);
+
+		name = NULL;
+		if (py_names) {
+			item_name = PyList_GetItem(py_names, i);
+			if (item_name && item_name != Py_None)
+				name = PyUnicode_DATA(item_name);
+		}
+
+		ret = add_field_func(self->ptrObj, field, name);
+		if (ret < 0) {
+			TfsError_fmt(NULL,
+				     "Failed to add %s field '%s' to synth. event %s",
+				     to_start ? "start" : "end", field,
+				     tracefs_synth_get_name(self->ptrObj));
+			return NULL;
+		}
+	}
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PySynthEvent_add_start_fields(PySynthEvent *self, PyObject *args,
+							    PyObject *kwargs)
+{
+	return synth_add_fields(self, args, kwargs, true);
+}
+
+PyObject *PySynthEvent_add_end_fields(PySynthEvent *self, PyObject *args,
+							  PyObject *kwargs)
+{
+	return synth_add_fields(self, args, kwargs, false);
+}
+
+static inline void add_synth_field_err(const char *field, const char *event)
+{
+	TfsError_fmt(NULL, "Failed to add field '%s' to synth. event %s",
+		     field, event);
+}
+
+static inline PyObject *
+add_synth_field(PySynthEvent *self, PyObject *args, PyObject *kwargs,
+		enum tracefs_synth_calc calc)
+{
+	static char *kwlist[] = {"name", "start_field", "end_field", NULL};
+	const char *start_field, *end_field, *name;
+	int ret;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "sss",
+					 kwlist,
+					 &name,
+					 &start_field,
+					 &end_field)) {
+		return NULL;
+	}
+
+	ret = tracefs_synth_add_compare_field(self->ptrObj,
+					      start_field, end_field, calc,
+					      name);
+	if (ret < 0) {
+		add_synth_field_err(name, tracefs_synth_get_name(self->ptrObj));
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PySynthEvent_add_delta_start(PySynthEvent *self, PyObject *args,
+							   PyObject *kwargs)
+{
+	return add_synth_field(self, args, kwargs, TRACEFS_SYNTH_DELTA_START);
+}
+
+PyObject *PySynthEvent_add_delta_end(PySynthEvent *self, PyObject *args,
+							 PyObject *kwargs)
+{
+	return add_synth_field(self, args, kwargs, TRACEFS_SYNTH_DELTA_END);
+}
+
+PyObject *PySynthEvent_add_sum(PySynthEvent *self, PyObject *args,
+						   PyObject *kwargs)
+{
+	return add_synth_field(self, args, kwargs, TRACEFS_SYNTH_ADD);
+}
+
+PyObject *PySynthEvent_add_delta_T(PySynthEvent *self, PyObject *args,
+						       PyObject *kwargs)
+{
+	static char *kwlist[] = {"name", "hd", NULL};
+	const char *name = "delta_T";
+	const char* time_rez;
+	int ret, hd = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|sp",
+					 kwlist,
+					 &name,
+					 &hd)) {
+		return NULL;
+	}
+
+	time_rez = hd ? TRACEFS_TIMESTAMP : TRACEFS_TIMESTAMP_USECS;
+	ret = tracefs_synth_add_compare_field(self->ptrObj, time_rez, time_rez,
+					      TRACEFS_SYNTH_DELTA_END, name);
+	if (ret < 0) {
+		add_synth_field_err(name, tracefs_synth_get_name(self->ptrObj));
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static void set_destroy_flag(PyObject *py_obj, bool val)
+{
+	PyFtrace_Object_HEAD *obj_head = (PyFtrace_Object_HEAD *)py_obj;
+	obj_head->destroy = val;
+}
+
+PyObject *PySynthEvent_register(PySynthEvent *self, PyObject *args, PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	tracefs_synth_set_instance(self->ptrObj, instance);
+	if (tracefs_synth_create(self->ptrObj) < 0) {
+		TfsError_fmt(NULL, "Failed to register synth. event %s",
+			     tracefs_synth_get_name(self->ptrObj));
+		return NULL;
+	}
+
+	tc_tep_cache_invalidate();
+
+	/*
+	 * Here the synthetic event gets added to the system.
+	 * Hence we need to 'destroy' this event at exit.
+	 */
+	set_destroy_flag((PyObject *)self, true);
+	Py_RETURN_NONE;
+}
+
+PyObject *PySynthEvent_unregister(PySynthEvent *self)
+{
+	if (tracefs_synth_destroy(self->ptrObj) < 0) {
+		TfsError_fmt(NULL, "Failed to unregister synth. event %s",
+			     tracefs_synth_get_name(self->ptrObj));
+		return NULL;
+	}
+
+	tc_tep_cache_invalidate();
+
+	/*
+	 * Here the synthetic event gets removed from the system.
+	 * Hence we no loger need to 'destroy' this event at exit.
+	 */
+	set_destroy_flag((PyObject *)self, false);
+	Py_RETURN_NONE;
+}
+
+PyObject *PySynthEvent_repr(PySynthEvent *self, PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = {"event", "hist_start", "hist_end", NULL};
+	int event, hist_start, hist_end;
+	char buff[2048] = {0};
+	bool new_line = false;
+	const char *str = NULL;
+
+	event = hist_start = hist_end = true;
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|ppp",
+					 kwlist,
+					 &event,
+					 &hist_start,
+					 &hist_end)) {
+		return NULL;
+	}
+
+	if (event) {
+		strcat(buff, "synth. event: ");
+		str = tracefs_synth_show_event(self->ptrObj);
+		if (str)
+			strcat(buff, str);
+		new_line = true;
+	}
+
+	if (hist_start) {
+		if (new_line)
+			strcat(buff, "\n");
+		else
+			new_line = true;
+
+		strcat(buff, "hist. start: ");
+		str = tracefs_synth_show_start_hist(self->ptrObj);
+		if (str)
+			strcat(buff, str);
+	}
+
+	if (hist_end) {
+		if (new_line)
+			strcat(buff, "\n");
+
+		strcat(buff, "hist. end: ");
+		str = tracefs_synth_show_end_hist(self->ptrObj);
+		if (str)
+			strcat(buff, str);
+	}
+
+	return PyUnicode_FromString(strdup(buff));
+}
+
+PyObject *PyFtrace_dir(PyObject *self)
+{
+	return PyUnicode_FromString(tracefs_tracing_dir());
+}
+
+PyObject *PyFtrace_set_dir(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = {"path", NULL};
+	char *custom_dir = NULL;
+	int ret;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|s",
+					 kwlist,
+					 &custom_dir)) {
+		return NULL;
+	}
+
+	if (custom_dir && custom_dir[0] != '\0')
+		ret = tracefs_set_tracing_dir(custom_dir);
+	else
+		ret = tracefs_set_tracing_dir(NULL);
+
+	if (ret) {
+		TfsError_setstr(NULL, "Failed to set custom ftrace directory.");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *set_destroy(PyObject *args, PyObject *kwargs, bool destroy)
+{
+	static char *kwlist[] = {"object", NULL};
+	PyObject *py_obj;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "O",
+					 kwlist,
+					 &py_obj)) {
+		return NULL;
+	}
+
+	set_destroy_flag(py_obj, destroy);
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyFtrace_detach(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	return set_destroy(args, kwargs, false);
+}
+
+PyObject *PyFtrace_attach(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	return set_destroy(args, kwargs, true);
+}
+
+static bool get_destroy_flag(PyObject *py_obj)
+{
+	PyFtrace_Object_HEAD *obj_head = (PyFtrace_Object_HEAD *)py_obj;
+	return obj_head->destroy;
+}
+
+PyObject *PyFtrace_is_attached(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = {"object", NULL};
+	PyObject *py_obj;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "O",
+					 kwlist,
+					 &py_obj)) {
+		return NULL;
+	}
+
+	return get_destroy_flag(py_obj) ? Py_True : Py_False;
+}
+
+static char aname_pool[] =
+	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+#define ANAME_LEN	16
+
+char auto_name[ANAME_LEN];
+
+static const char *autoname()
+{
+	int i, n, pool_size = sizeof(aname_pool);
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	srand(now.tv_usec);
+
+	for (i = 0; i < ANAME_LEN - 1; ++i) {
+		n = rand() % (pool_size - 1);
+		auto_name[i] = aname_pool[n];
+	}
+	auto_name[i] = 0;
+
+	return auto_name;
+}
+
+static bool tracing_OFF(struct tracefs_instance *instance);
+
+PyObject *PyFtrace_create_instance(PyObject *self, PyObject *args,
+						   PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+	const char *name = NO_ARG;
+	int tracing_on = true;
+
+	static char *kwlist[] = {"name", "tracing_on", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|sp",
+					 kwlist,
+					 &name,
+					 &tracing_on)) {
+		return NULL;
+	}
+
+	if (!is_set(name))
+		name = autoname();
+
+	instance = tracefs_instance_create(name);
+	if (!instance ||
+	    !tracefs_instance_exists(name) ||
+	    !tracefs_instance_is_new(instance)) {
+		TfsError_fmt(instance,
+			     "Failed to create new trace instance \'%s\'.",
+			     name);
+		return NULL;
+	}
+
+	if (!tracing_on)
+		tracing_OFF(instance);
+
+	return PyTfsInstance_New(instance);
+}
+
+PyObject *PyFtrace_find_instance(PyObject *self, PyObject *args,
+						 PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+	PyObject *py_inst;
+	const char *name;
+
+	static char *kwlist[] = {"name", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "s",
+					 kwlist,
+					 &name)) {
+		return NULL;
+	}
+
+	instance = tracefs_instance_alloc(NULL, name);
+	if (!instance) {
+		TfsError_fmt(instance,
+			     "Failed to find trace instance \'%s\'.",
+			     name);
+		return NULL;
+	}
+
+	py_inst = PyTfsInstance_New(instance);
+	set_destroy_flag(py_inst, false);
+
+	return py_inst;
+}
+
+static int save_instace(const char *name, void *context)
+{
+	PyObject **list = (PyObject **)context;
+	struct tracefs_instance *instance;
+	PyObject *py_inst;
+
+	instance = tracefs_instance_alloc(NULL, name);
+	if (instance) {
+		py_inst = PyTfsInstance_New(instance);
+		/* Do not destroy the instance in the system, as we did not create it */
+		set_destroy_flag(py_inst, false);
+		PyList_Append(*list, py_inst);
+	}
+
+	return 0;
+}
+
+PyObject *PyFtrace_available_instances(PyObject *self, PyObject *args,
+						       PyObject *kwargs)
+{
+	PyObject *list;
+
+	list = PyList_New(0);
+	if (tracefs_instances_walk(save_instace, &list) < 0)
+		return NULL;
+	return list;
+}
+
+PyObject *PyFtrace_available_tracers(PyObject *self, PyObject *args,
+						     PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+	char **list;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	list = tracefs_tracers(tracefs_instance_get_dir(instance));
+	if (!list)
+		return NULL;
+
+	return tfs_list2py_list(list, false);
+}
+
+PyObject *PyFtrace_set_current_tracer(PyObject *self, PyObject *args,
+						      PyObject *kwargs)
+{
+	static char *kwlist[] = {"tracer", "instance", NULL};
+	const char *file = "current_tracer", *tracer;
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+
+	tracer = NO_ARG;
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|sO",
+					 kwlist,
+					 &tracer,
+					 &py_inst)) {
+		return NULL;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return NULL;
+
+	if (is_set(tracer) &&
+	    strcmp(tracer, "nop") != 0) {
+		char **all_tracers =
+			tracefs_tracers(tracefs_instance_get_dir(instance));
+		int i;
+
+		for (i = 0; all_tracers && all_tracers[i]; i++) {
+			if (!strcmp(all_tracers[i], tracer))
+				break;
+		}
+
+		if (!all_tracers || !all_tracers[i]) {
+			TfsError_fmt(instance,
+				     "Tracer \'%s\' is not available.",
+				     tracer);
+			return NULL;
+		}
+	} else if (!is_set(tracer)) {
+		tracer = "nop";
+	}
+
+	if (!write_to_file_and_check(instance, file, tracer)) {
+		TfsError_fmt(instance, "Failed to enable tracer \'%s\'",
+			     tracer);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyFtrace_get_current_tracer(PyObject *self, PyObject *args,
+						      PyObject *kwargs)
+{
+	const char *file = "current_tracer";
+	struct tracefs_instance *instance;
+	PyObject *ret;
+	char *tracer;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	if (read_from_file(instance, file, &tracer) <= 0)
+		return NULL;
+
+	trim_new_line(tracer);
+	ret = PyUnicode_FromString(tracer);
+	free(tracer);
+
+	return ret;
+}
+
+PyObject *PyFtrace_available_event_systems(PyObject *self, PyObject *args,
+							   PyObject *kwargs)
+{
+	static char *kwlist[] = {"instance", "sort", NULL};
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+	int sort = false;
+	char **list;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|Op",
+					 kwlist,
+					 &py_inst,
+					 &sort)) {
+		return false;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return NULL;
+
+	list = tracefs_event_systems(tracefs_instance_get_dir(instance));
+	if (!list)
+		return NULL;
+
+	return tfs_list2py_list(list, sort);
+}
+
+PyObject *PyFtrace_available_system_events(PyObject *self, PyObject *args,
+							   PyObject *kwargs)
+{
+	static char *kwlist[] = {"system", "instance", "sort", NULL};
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+	const char *system;
+	int sort = false;
+	char **list;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "s|Op",
+					 kwlist,
+					 &system,
+					 &py_inst,
+					 &sort)) {
+		return NULL;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return NULL;
+
+	list = tracefs_system_events(tracefs_instance_get_dir(instance),
+				     system);
+
+	if (!list)
+		return NULL;
+
+	return tfs_list2py_list(list, sort);
+}
+
+bool get_event_enable_file(struct tracefs_instance *instance,
+			   const char *system, const char *event,
+			   char **path)
+{
+	char *buff = calloc(PATH_MAX, 1);
+	const char *instance_name;
+
+	 if (!buff) {
+		MEM_ERROR
+		return false;
+	}
+
+	if ((is_all(system) && is_all(event)) ||
+	    (is_all(system) && is_no_arg(event)) ||
+	    (is_no_arg(system) && is_all(event))) {
+		strcpy(buff, "events/enable");
+
+		*path = buff;
+	} else if (is_set(system)) {
+		strcpy(buff, "events/");
+		strcat(buff, system);
+		if (!check_dir(instance, buff))
+			goto fail;
+
+		if (is_set(event)) {
+			strcat(buff, "/");
+			strcat(buff, event);
+			if (!check_dir(instance, buff))
+				goto fail;
+
+			strcat(buff, "/enable");
+		} else {
+			strcat(buff, "/enable");
+		}
+
+		*path = buff;
+	} else {
+		goto fail;
+	}
+
+	return true;
+
+ fail:
+	instance_name =
+		instance ? tracefs_instance_get_name(instance) : "top";
+	TfsError_fmt(instance,
+		     "Failed to locate event:\n Instance: %s  System: %s  Event: %s",
+		     instance_name, system, event);
+	free(buff);
+	*path = NULL;
+	return false;
+}
+
+static bool event_enable_disable(struct tracefs_instance *instance,
+				 const char *system, const char *event,
+				 bool enable)
+{
+	int ret;
+
+	if (system && !is_set(system))
+		system = NULL;
+
+	if (event && !is_set(event))
+		event = NULL;
+
+	if (enable)
+		ret = tracefs_event_enable(instance, system, event);
+	else
+		ret = tracefs_event_disable(instance, system, event);
+
+	if (ret != 0) {
+		TfsError_fmt(instance,
+			     "Failed to enable/disable event:\n System: %s  Event: %s",
+			     system ? system : "NULL",
+			     event ? event : "NULL");
+
+		return false;
+	}
+
+	return true;
+}
+
+static bool set_enable_event(PyObject *self,
+			     PyObject *args, PyObject *kwargs,
+			     bool enable)
+{
+	static char *kwlist[] = {"instance", "system", "event", NULL};
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+	const char *system, *event;
+
+	system = event = NO_ARG;
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|Oss",
+					 kwlist,
+					 &py_inst,
+					 &system,
+					 &event)) {
+		return false;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return false;
+
+	return event_enable_disable(instance, system, event, enable);
+}
+
+#define ON	"1"
+#define OFF	"0"
+
+PyObject *PyFtrace_enable_event(PyObject *self, PyObject *args,
+						PyObject *kwargs)
+{
+	if (!set_enable_event(self, args, kwargs, true))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyFtrace_disable_event(PyObject *self, PyObject *args,
+						 PyObject *kwargs)
+{
+	if (!set_enable_event(self, args, kwargs, false))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static bool set_enable_events(PyObject *self, PyObject *args, PyObject *kwargs,
+			      bool enable)
+{
+	static char *kwlist[] = {"events", "instance", NULL};
+	PyObject *event_dict = NULL, *py_inst = NULL;
+	struct tracefs_instance *instance;
+	PyObject *py_system, *py_events;
+	const char *system, *event;
+	Py_ssize_t pos = 0;
+	int i, n;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "O|O",
+					 kwlist,
+					 &event_dict,
+					 &py_inst)) {
+		return false;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return false;
+
+	if (!PyDict_CheckExact(event_dict))
+		goto fail_with_err;
+
+	while (PyDict_Next(event_dict, &pos, &py_system, &py_events)) {
+		if (!PyUnicode_Check(py_system) ||
+		    !PyList_CheckExact(py_events))
+			goto fail_with_err;
+
+		system = PyUnicode_DATA(py_system);
+		n = PyList_Size(py_events);
+
+		if (n == 0 || (n == 1 && is_all(tc_str_from_list(py_events, 0)))) {
+			if (!event_enable_disable(instance, system, NULL,
+						  enable))
+				return false;
+			continue;
+		}
+
+		for (i = 0; i < n; ++i) {
+			event = tc_str_from_list(py_events, i);
+			if (!event)
+				goto fail_with_err;
+
+			if (!event_enable_disable(instance, system, event,
+						  enable))
+				return false;
+		}
+	}
+
+	return true;
+
+ fail_with_err:
+	TfsError_setstr(instance, "Inconsistent \"events\" argument.");
+	return false;
+}
+
+PyObject *PyFtrace_enable_events(PyObject *self, PyObject *args,
+						 PyObject *kwargs)
+{
+	if (!set_enable_events(self, args, kwargs, true))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyFtrace_disable_events(PyObject *self, PyObject *args,
+						  PyObject *kwargs)
+{
+	if (!set_enable_events(self, args, kwargs, false))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *event_is_enabled(struct tracefs_instance *instance,
+				  const char *system, const char *event)
+{
+	char *file, *val;
+	PyObject *ret;
+
+	if (!get_event_enable_file(instance, system, event, &file))
+		return NULL;
+
+	if (read_from_file(instance, file, &val) <= 0)
+		return NULL;
+
+	trim_new_line(val);
+	ret = PyUnicode_FromString(val);
+
+	free(file);
+	free(val);
+
+	return ret;
+}
+
+PyObject *PyFtrace_event_is_enabled(PyObject *self, PyObject *args,
+						    PyObject *kwargs)
+{
+	static char *kwlist[] = {"instance", "system", "event", NULL};
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+	const char *system, *event;
+
+	system = event = NO_ARG;
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|Oss",
+					 kwlist,
+					 &py_inst,
+					 &system,
+					 &event)) {
+		return false;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return false;
+
+	return event_is_enabled(instance, system, event);
+}
+
+PyObject *PyFtrace_set_event_filter(PyObject *self, PyObject *args,
+						    PyObject *kwargs)
+{
+	const char *system, *filter;
+	char *event = NULL;
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+	char path[PATH_MAX];
+	bool ret;
+
+	static char *kwlist[] = {"system", "filter", "event", "instance", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "ss|sO",
+					 kwlist,
+					 &system,
+					 &filter,
+					 &event,
+					 &py_inst)) {
+		return NULL;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return NULL;
+
+	if (event) {
+		sprintf(path, "events/%s/%s/filter", system, event);
+		ret = write_to_file_and_check(instance, path, filter);
+	} else {
+		/*
+		 * Filters written to system's filter file are not stored in this file.
+		 * Instead, they are sent to each event's filter file from that system,
+		 * which has the fields from the filter.
+		 * That's why write_to_file_and_check() API cannot be used in this case.
+		 */
+		sprintf(path, "events/%s/filter", system);
+		ret = (write_to_file(instance, path, filter) > 0);
+	}
+
+	if (!ret) {
+		TfsError_setstr(instance, "Failed to set event filter");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyFtrace_clear_event_filter(PyObject *self, PyObject *args,
+						      PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+	const char *system;
+	char *event = NULL;
+	char path[PATH_MAX];
+
+	static char *kwlist[] = {"system", "event", "instance", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "s|sO",
+					 kwlist,
+					 &system,
+					 &event,
+					 &py_inst)) {
+		return NULL;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return NULL;
+
+	if (event)
+		sprintf(path, "events/%s/%s/filter", system, event);
+	else
+		sprintf(path, "events/%s/filter", system);
+	if (!write_to_file(instance, path, OFF)) {
+		TfsError_setstr(instance, "Failed to clear event filter");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static bool tracing_ON(struct tracefs_instance *instance)
+{
+	int ret = tracefs_trace_on(instance);
+
+	if (ret < 0 ||
+	    tracefs_trace_is_on(instance) != 1) {
+		const char *instance_name =
+			instance ? tracefs_instance_get_name(instance) : "top";
+
+		TfsError_fmt(instance,
+			     "Failed to start tracing (Instance: %s)",
+			     instance_name);
+		return false;
+	}
+
+	return true;
+}
+
+PyObject *PyFtrace_tracing_ON(PyObject *self, PyObject *args,
+					      PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	if (!tracing_ON(instance))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static bool tracing_OFF(struct tracefs_instance *instance)
+{
+	int ret = tracefs_trace_off(instance);
+
+	if (ret < 0 ||
+	    tracefs_trace_is_on(instance) != 0) {
+		const char *instance_name =
+			instance ? tracefs_instance_get_name(instance) : "top";
+
+		TfsError_fmt(instance,
+			     "Failed to stop tracing (Instance: %s)",
+			     instance_name);
+		return false;
+	}
+
+	return true;
+}
+
+PyObject *PyFtrace_tracing_OFF(PyObject *self, PyObject *args,
+					       PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	if (!tracing_OFF(instance))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyFtrace_is_tracing_ON(PyObject *self, PyObject *args,
+						 PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+	int ret;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	ret = tracefs_trace_is_on(instance);
+	if (ret < 0) {
+		const char *instance_name =
+			instance ? tracefs_instance_get_name(instance) : "top";
+
+		TfsError_fmt(instance,
+			     "Failed to check if tracing is ON (Instance: %s)",
+			     instance_name);
+		return NULL;
+	}
+
+	if (ret == 0)
+		Py_RETURN_FALSE;
+
+	Py_RETURN_TRUE;
+}
+
+static bool pid2file(struct tracefs_instance *instance,
+		     const char *file,
+		     int pid,
+		     bool append)
+{
+	char pid_str[100];
+
+	if (sprintf(pid_str, "%d", pid) <= 0)
+		return false;
+
+	if (append) {
+		if (!append_to_file(instance, file, pid_str))
+		        return false;
+	} else {
+		if (!write_to_file_and_check(instance, file, pid_str))
+		        return false;
+	}
+
+	return true;
+}
+
+static bool set_pid(struct tracefs_instance *instance,
+		    const char *file, PyObject *pid_val)
+{
+	PyObject *item;
+	int n, i, pid;
+
+	if (PyList_CheckExact(pid_val)) {
+		n = PyList_Size(pid_val);
+		for (i = 0; i < n; ++i) {
+			item = PyList_GetItem(pid_val, i);
+			if (!PyLong_CheckExact(item))
+				goto fail;
+
+			pid = PyLong_AsLong(item);
+			if (!pid2file(instance, file, pid, true))
+				goto fail;
+		}
+	} else if (PyLong_CheckExact(pid_val)) {
+		pid = PyLong_AsLong(pid_val);
+		if (!pid2file(instance, file, pid, true))
+			goto fail;
+	} else {
+		goto fail;
+	}
+
+	return true;
+
+ fail:
+	TfsError_fmt(instance, "Failed to set PIDs for \"%s\"",
+		     file);
+	return false;
+}
+
+PyObject *PyFtrace_set_event_pid(PyObject *self, PyObject *args,
+						 PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+	PyObject *pid_val;
+
+	static char *kwlist[] = {"pid", "instance", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "O|O",
+					 kwlist,
+					 &pid_val,
+					 &py_inst)) {
+		return NULL;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return NULL;
+
+	if (!set_pid(instance, "set_event_pid", pid_val))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyFtrace_set_ftrace_pid(PyObject *self, PyObject *args,
+						  PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+	PyObject *pid_val;
+
+	static char *kwlist[] = {"pid", "instance", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "O|O",
+					 kwlist,
+					 &pid_val,
+					 &py_inst)) {
+		return NULL;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return NULL;
+
+	if (!set_pid(instance, "set_ftrace_pid", pid_val))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static bool set_opt(struct tracefs_instance *instance,
+		    const char *opt, const char *val)
+{
+	char file[PATH_MAX];
+
+	if (sprintf(file, "options/%s", opt) <= 0 ||
+	    !write_to_file_and_check(instance, file, val)) {
+		TfsError_fmt(instance, "Failed to set option \"%s\"", opt);
+		return false;
+	}
+
+	return true;
+}
+
+static PyObject *set_option_py_args(PyObject *args, PyObject *kwargs,
+				   const char *val)
+{
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+	const char *opt;
+
+	static char *kwlist[] = {"option", "instance", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "s|O",
+					 kwlist,
+					 &opt,
+					 &py_inst)) {
+		return NULL;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return NULL;
+
+	if (!set_opt(instance, opt, val))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyFtrace_enable_option(PyObject *self, PyObject *args,
+						 PyObject *kwargs)
+{
+	return set_option_py_args(args, kwargs, ON);
+}
+
+PyObject *PyFtrace_disable_option(PyObject *self, PyObject *args,
+						  PyObject *kwargs)
+{
+	return set_option_py_args(args, kwargs, OFF);
+}
+
+PyObject *PyFtrace_option_is_set(PyObject *self, PyObject *args,
+						 PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+	enum tracefs_option_id opt_id;
+	const char *opt;
+
+	static char *kwlist[] = {"option", "instance", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "s|O",
+					 kwlist,
+					 &opt,
+					 &py_inst)) {
+		return NULL;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return NULL;
+
+	opt_id = tracefs_option_id(opt);
+	if (tracefs_option_is_enabled(instance, opt_id))
+		Py_RETURN_TRUE;
+
+	Py_RETURN_FALSE;
+}
+
+static PyObject *get_option_list(struct tracefs_instance *instance,
+				 bool enabled)
+{
+	const struct tracefs_options_mask *mask;
+	PyObject *list = PyList_New(0);
+	int i;
+
+	mask = enabled ? tracefs_options_get_enabled(instance) :
+			 tracefs_options_get_supported(instance);
+
+	for (i = 0; i < TRACEFS_OPTION_MAX; ++i)
+		if (tracefs_option_mask_is_set(mask, i)) {
+			const char *opt = tracefs_option_name(i);
+			PyList_Append(list, PyUnicode_FromString(opt));
+		}
+
+	return list;
+}
+
+PyObject *PyFtrace_enabled_options(PyObject *self, PyObject *args,
+						   PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	return get_option_list(instance, true);
+}
+
+PyObject *PyFtrace_supported_options(PyObject *self, PyObject *args,
+						     PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	return get_option_list(instance, false);
+}
+
+#define TC_SYS	"tcrunch"
+
+PyObject *PyFtrace_tc_event_system(PyObject *self)
+{
+	return PyUnicode_FromString(TC_SYS);
+}
+
+PyObject *PyFtrace_no_arg(PyObject *self)
+{
+	return PyUnicode_FromString(NO_ARG);
+}
+
+static PyObject *dynevent_info2py(char *buff, int type)
+{
+	PyObject *ret;
+
+	if (type == TRACEFS_DYNEVENT_UNKNOWN) {
+		PyErr_SetString(TFS_ERROR, "Failed to get dynevent info.");
+		return NULL;
+	}
+
+	ret = PyUnicode_FromString(buff);
+	free(buff);
+
+	return ret;
+}
+
+PyObject *PyDynevent_system(PyDynevent *self)
+{
+	char *buff;
+	int type;
+
+	type = tracefs_dynevent_info(self->ptrObj, &buff, NULL, NULL, NULL, NULL);
+	return dynevent_info2py(buff, type);
+}
+
+PyObject *PyDynevent_event(PyDynevent *self)
+{
+	char *buff;
+	int type;
+
+	type = tracefs_dynevent_info(self->ptrObj, NULL, &buff, NULL, NULL, NULL);
+	return dynevent_info2py(buff, type);
+}
+
+PyObject *PyDynevent_address(PyDynevent *self)
+{
+	char *buff;
+	int type;
+
+	type = tracefs_dynevent_info(self->ptrObj, NULL, NULL, NULL, &buff, NULL);
+	return dynevent_info2py(buff, type);
+}
+
+PyObject *PyDynevent_probe(PyDynevent *self)
+{
+	char *buff;
+	int type;
+
+	type = tracefs_dynevent_info(self->ptrObj, NULL, NULL, NULL, NULL, &buff);
+	return dynevent_info2py(buff, type);
+}
+
+PyObject *PyDynevent_register(PyDynevent *self)
+{
+	if (tracefs_dynevent_create(self->ptrObj) < 0) {
+		char *evt;
+		int type;
+
+		type = tracefs_dynevent_info(self->ptrObj, NULL, &evt, NULL, NULL, NULL);
+		TfsError_fmt(NULL, "Failed to register dynamic event '%s'.",
+		type != TRACEFS_DYNEVENT_UNKNOWN ? evt : "UNKNOWN");
+		free(evt);
+		return NULL;
+	}
+
+	tc_tep_cache_invalidate();
+
+	/*
+	 * Here the dynamic event gets added to the system.
+	 * Hence we need to 'destroy' this event at exit.
+	 */
+	set_destroy_flag((PyObject *)self, true);
+	Py_RETURN_NONE;
+}
+
+PyObject *PyDynevent_unregister(PyDynevent *self)
+{
+	if (tracefs_dynevent_destroy(self->ptrObj, true) < 0) {
+		char *evt;
+		int type;
+
+		type = tracefs_dynevent_info(self->ptrObj, NULL, &evt, NULL, NULL, NULL);
+		TfsError_fmt(NULL, "Failed to unregister dynamic event '%s'.",
+		type != TRACEFS_DYNEVENT_UNKNOWN ? evt : "UNKNOWN");
+		free(evt);
+		return NULL;
+	}
+
+	tc_tep_cache_invalidate();
+
+	/*
+	 * Here the synthetic event gets removed from the system.
+	 * Hence we no loger need to 'destroy' this event at exit.
+	 */
+	set_destroy_flag((PyObject *)self, false);
+	Py_RETURN_NONE;
+}
+
+PyObject *PyFtrace_kprobe(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = {"event", "function", "probe", NULL};
+	const char *event, *function, *probe;
+	struct tracefs_dynevent *kprobe;
+	PyObject *py_dyn;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "sss",
+					 kwlist,
+					 &event,
+					 &function,
+					 &probe)) {
+		return NULL;
+	}
+
+	kprobe = tracefs_kprobe_alloc(TC_SYS, event, function, probe);
+	if (!kprobe) {
+		MEM_ERROR;
+		return NULL;
+	}
+
+	py_dyn = PyDynevent_New(kprobe);
+	/*
+	 * Here we only allocated and initializes a dynamic event object.
+	 * However, no dynamic event is added to the system yet. Hence,
+	 * there is no need to 'destroy' this event at exit.
+	 */
+	set_destroy_flag(py_dyn, false);
+	return py_dyn;
+}
+
+PyObject *PyFtrace_kretprobe(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = {"event", "function", "probe", NULL};
+	const char *event, *function, *probe = "$retval";
+	struct tracefs_dynevent *kprobe;
+	PyObject *py_dyn;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "ss|s",
+					 kwlist,
+					 &event,
+					 &function,
+					 &probe)) {
+		return NULL;
+	}
+
+	kprobe = tracefs_kretprobe_alloc(TC_SYS, event, function, probe, 0);
+	if (!kprobe) {
+		MEM_ERROR;
+		return NULL;
+	}
+
+	py_dyn = PyDynevent_New(kprobe);
+	/*
+	 * Here we only allocated and initializes a dynamic event object.
+	 * However, no dynamic event is added to the system yet. Hence,
+	 * there is no need to 'destroy' this event at exit.
+	 */
+	set_destroy_flag(py_dyn, false);
+	return py_dyn;
+}
+
+/*
+ * Find the event of a dynamic event. The reference to the tep handle of
+ * the event must be released with tc_tep_put().
+ */
+struct tep_event *dynevent_get_event(PyDynevent *event,
+				     struct tc_tep **tt_ptr)
+{
+	struct tep_event *tep_evt = NULL;
+	char *system, *name;
+	struct tc_tep *tt;
+
+	if (tracefs_dynevent_info(event->ptrObj, &system, &name,
+				  NULL, NULL, NULL) == TRACEFS_DYNEVENT_UNKNOWN) {
+		TfsError_setstr(NULL, "Failed to get dynevent info.");
+		return NULL;
+	}
+
+	tt = tc_tep_get(NULL);
+	if (tt)
+		tep_evt = tc_event_by_name(tt, system, name);
+
+	free(system);
+	free(name);
+	if (!tep_evt) {
+		tc_tep_put(tt);
+		TfsError_setstr(NULL, "Failed to get dynevent.");
+		return NULL;
+	}
+
+	*tt_ptr = tt;
+
+	return tep_evt;
+}
+
+PyObject *PyFtrace_eprobe(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = {"event", "target_system", "target_event", "fetch_fields", NULL};
+	const char *event, *target_system, *target_event, *fetchargs;
+	struct tracefs_dynevent *eprobe;
+	PyObject *py_dyn;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "ssss",
+					 kwlist,
+					 &event,
+					 &target_system,
+					 &target_event,
+					 &fetchargs)) {
+		return NULL;
+	}
+
+	/* 'eprobes' are introduced in kernel version 5.15. */
+	if (!check_kernel_support("eprobe", 5, 15))
+		return NULL;
+
+	eprobe = tracefs_eprobe_alloc(TC_SYS, event, target_system, target_event, fetchargs);
+	if (!eprobe) {
+		MEM_ERROR;
+		return NULL;
+	}
+
+	py_dyn = PyDynevent_New(eprobe);
+	/*
+	 * Here we only allocated and initializes a dynamic event object.
+	 * However, no dynamic event is added to the system yet. Hence,
+	 * there is no need to 'destroy' this event at exit.
+	 */
+	set_destroy_flag(py_dyn, false);
+	return py_dyn;
+}
+
+static PyObject *alloc_uprobe(PyObject *self, PyObject *args, PyObject *kwargs, bool pret)
+{
+	static char *kwlist[] = {"event", "file", "offset", "fetch_args", NULL};
+	const char *event, *file, *fetchargs = NULL;
+	unsigned long long offset;
+	struct tracefs_dynevent *uprobe;
+	PyObject *py_dyn;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "ssK|s",
+					 kwlist,
+					 &event,
+					 &file,
+					 &offset,
+					 &fetchargs)) {
+		return NULL;
+	}
+
+	if (pret)
+		uprobe = tracefs_uretprobe_alloc(TC_SYS, event, file, offset, fetchargs);
+	else
+		uprobe = tracefs_uprobe_alloc(TC_SYS, event, file, offset, fetchargs);
+	if (!uprobe) {
+		MEM_ERROR;
+		return NULL;
+	}
+
+	py_dyn = PyDynevent_New(uprobe);
+	/*
+	 * Here we only allocated and initializes a dynamic event object.
+	 * However, no dynamic event is added to the system yet. Hence,
+	 * there is no need to 'destroy' this event at exit.
+	 */
+	set_destroy_flag(py_dyn, false);
+	return py_dyn;
+}
+
+PyObject *PyFtrace_uprobe(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	return alloc_uprobe(self, args, kwargs, false);
+}
+
+PyObject *PyFtrace_uretprobe(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	return alloc_uprobe(self, args, kwargs, true);
+}
+
+static PyObject *set_filter(PyObject *args, PyObject *kwargs,
+			    struct tep_event *event)
+{
+	struct tracefs_instance *instance;
+	PyObject *py_inst = NULL;
+	const char *filter;
+
+	static char *kwlist[] = {"filter", "instance", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "s|O",
+					 kwlist,
+					 &filter,
+					 &py_inst)) {
+		return NULL;
+	}
+
+	if (!get_optional_instance(py_inst, &instance))
+		return NULL;
+
+	if (tracefs_event_filter_apply(instance, event, filter) < 0) {
+		TfsError_fmt(NULL, "Failed to apply filter '%s' to event '%s'.",
+			     filter, event->name);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *get_filter(PyObject *args, PyObject *kwargs,
+			    const char *system, const char* event )
+{
+	struct tracefs_instance *instance;
+	PyObject *ret = NULL;
+	char *filter = NULL;
+	char path[PATH_MAX];
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	sprintf(path, "events/%s/%s/filter", system, event);
+	if (read_from_file(instance, path, &filter) <= 0)
+		return NULL;
+
+	trim_new_line(filter);
+	ret = PyUnicode_FromString(filter);
+	free(filter);
+
+	return ret;
+}
+
+static PyObject *clear_filter(PyObject *args, PyObject *kwargs,
+			      struct tep_event *event)
+{
+	struct tracefs_instance *instance;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	if (tracefs_event_filter_clear(instance, event) < 0) {
+		TfsError_fmt(NULL, "Failed to clear filter for event '%s'.",
+			     event->name);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyDynevent_set_filter(PyDynevent *self, PyObject *args,
+						  PyObject *kwargs)
+{
+	struct tep_event *evt;
+	struct tc_tep *tt;
+	PyObject *ret;
+
+	evt = dynevent_get_event(self, &tt);
+	if (!evt)
+		return NULL;
+
+	ret = set_filter(args, kwargs, evt);
+	tc_tep_put(tt);
+
+	return ret;
+}
+
+PyObject *PyDynevent_get_filter(PyDynevent *self, PyObject *args,
+						  PyObject *kwargs)
+{
+	struct tep_event *evt;
+	struct tc_tep *tt;
+	PyObject *ret;
+
+	evt = dynevent_get_event(self, &tt);
+	if (!evt)
+		return NULL;
+
+	ret = get_filter(args, kwargs, evt->system, evt->name);
+	tc_tep_put(tt);
+
+	return ret;
+}
+
+PyObject *PyDynevent_clear_filter(PyDynevent *self, PyObject *args,
+						    PyObject *kwargs)
+{
+	struct tep_event *evt;
+	struct tc_tep *tt;
+	PyObject *ret;
+
+	evt = dynevent_get_event(self, &tt);
+	if (!evt)
+		return NULL;
+
+	ret = clear_filter(args, kwargs, evt);
+	tc_tep_put(tt);
+
+	return ret;
+}
+
+static bool enable_dynevent(PyDynevent *self, PyObject *args, PyObject *kwargs,
+			  bool enable)
+{
+	struct tracefs_instance *instance;
+	char * evt_name;
+	int type;
+	bool ret;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return false;
+
+	type = tracefs_dynevent_info(self->ptrObj, NULL, &evt_name, NULL, NULL, NULL);
+	if (type == TRACEFS_DYNEVENT_UNKNOWN) {
+		PyErr_SetString(TFS_ERROR, "Failed to get dynevent info.");
+		return NULL;
+	}
+
+	ret = event_enable_disable(instance, TC_SYS, evt_name, enable);
+	free(evt_name);
+
+	return ret;
+}
+
+PyObject *PyDynevent_enable(PyDynevent *self, PyObject *args,
+					      PyObject *kwargs)
+{
+	if (!enable_dynevent(self, args, kwargs, true))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyDynevent_disable(PyDynevent *self, PyObject *args,
+					       PyObject *kwargs)
+{
+	if (!enable_dynevent(self, args, kwargs, false))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PyDynevent_is_enabled(PyDynevent *self, PyObject *args,
+					      PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+	char * evt_name;
+	PyObject *ret;
+	int type;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	type = tracefs_dynevent_info(self->ptrObj, NULL, &evt_name, NULL, NULL, NULL);
+	if (type == TRACEFS_DYNEVENT_UNKNOWN) {
+		PyErr_SetString(TFS_ERROR, "Failed to get dynevent info.");
+		return NULL;
+	}
+
+	ret = event_is_enabled(instance, TC_SYS, evt_name);
+	free(evt_name);
+
+	return ret;
+}
+
+static enum tracefs_hist_key_type hist_key_type(PyObject * py_type)
+{
+	int type = -1;
+
+	if (PyUnicode_Check(py_type)) {
+		const char *type_str = PyUnicode_DATA(py_type);
+
+		if (lax_cmp(type_str, "normal") ||
+		    lax_cmp(type_str, "n") )
+			type = TRACEFS_HIST_KEY_NORMAL;
+		else if (lax_cmp(type_str, "hex") ||
+			 lax_cmp(type_str, "h") )
+			type = TRACEFS_HIST_KEY_HEX;
+		else if (lax_cmp(type_str, "sym"))
+			 type = TRACEFS_HIST_KEY_SYM;
+		else if (lax_cmp(type_str, "sym_offset") ||
+			 lax_cmp(type_str, "so"))
+			type = TRACEFS_HIST_KEY_SYM_OFFSET;
+		else if (lax_cmp(type_str, "syscall") ||
+			 lax_cmp(type_str, "sc"))
+			type = TRACEFS_HIST_KEY_SYSCALL;
+		else if (lax_cmp(type_str, "execname") ||
+			 lax_cmp(type_str, "e"))
+			 type = TRACEFS_HIST_KEY_EXECNAME;
+		else if (lax_cmp(type_str, "log") ||
+			 lax_cmp(type_str, "l"))
 			type = TRACEFS_HIST_KEY_LOG;
 		else if (lax_cmp(type_str, "users") ||
 			 lax_cmp(type_str, "u"))
@@ -2811,732 +5223,3652 @@ static enum tracefs_hist_key_type hist_key_type(PyObject * py_type)
 			TfsError_fmt(NULL, "Unknown axis type %s\n",
 				     type_str);
 		}
-	} else if (PyLong_CheckExact(py_type)) {
-		type = PyLong_AsLong(py_type);
+	} else if (PyLong_CheckExact(py_type)) {
+		type = PyLong_AsLong(py_type);
+	} else {
+		TfsError_fmt(NULL, "Unknown axis type %s\n");
+	}
+
+	return type;
+}
+
+static struct tracefs_hist *hist_from_key(struct tep_handle *tep,
+					  const char *system, const char *event,
+					  PyObject *py_key, PyObject * py_type)
+{
+	struct tracefs_hist *hist = NULL;
+	int type = 0;
+
+	if (PyUnicode_Check(py_key)) {
+		if (py_type) {
+			type = hist_key_type(py_type);
+			if (type < 0)
+				return NULL;
+		}
+
+		hist = tracefs_hist_alloc(tep, system, event,
+					  PyUnicode_DATA(py_key), type);
+	} else if (PyList_CheckExact(py_key)) {
+		int i, n_keys = PyList_Size(py_key);
+		struct tracefs_hist_axis *axes;
+		PyObject *item_type;
+
+		if (py_type) {
+			/*
+			 * The format of the types have to match the format
+			 * of the keys.
+			 */
+			if (!PyList_CheckExact(py_key) ||
+			    PyList_Size(py_type) != n_keys)
+				return NULL;
+		}
+
+		axes = calloc(n_keys + 1, sizeof(*axes));
+		if (!axes) {
+			MEM_ERROR
+			return NULL;
+		}
+
+		for (i = 0; i < n_keys; ++i) {
+			axes[i].key = tc_str_from_list(py_key, i);
+			if (!axes[i].key)
+				return NULL;
+
+			if (py_type) {
+				item_type = PyList_GetItem(py_type, i);
+				if (!PyLong_CheckExact(item_type))
+					return NULL;
+
+				type = hist_key_type(item_type);
+				if (type < 0)
+					return NULL;
+
+				axes[i].type = type;
+			}
+		}
+
+		hist = tracefs_hist_alloc_nd(tep, system, event, axes);
+		free(axes);
+	}
+
+	return hist;
+}
+
+static struct tracefs_hist *hist_from_axis(struct tep_handle *tep,
+					   const char *system, const char *event,
+					   PyObject *py_axes)
+{
+	struct tracefs_hist *hist = NULL;
+	struct tracefs_hist_axis *axes;
+	PyObject *key, *value;
+	Py_ssize_t i = 0;
+	int n_axes;
+
+	n_axes = PyDict_Size(py_axes);
+	if (PyErr_Occurred())
+		return NULL;
+
+	axes = calloc(n_axes + 1, sizeof(*axes));
+	if (!axes) {
+		MEM_ERROR
+		return NULL;
+	}
+
+	while (PyDict_Next(py_axes, &i, &key, &value)) {
+		axes[i - 1].key = PyUnicode_DATA(key);
+		axes[i - 1].type = hist_key_type(value);
+		if (PyErr_Occurred()) {
+			PyErr_Print();
+			free(axes);
+			return NULL;
+		}
+	}
+
+	hist = tracefs_hist_alloc_nd(tep, system, event, axes);
+	free(axes);
+
+	return hist;
+}
+
+PyObject *PyFtrace_hist(PyObject *self, PyObject *args,
+					PyObject *kwargs)
+{
+	static char *kwlist[] =
+		{"system", "event", "key", "type", "axes", "name", NULL};
+	PyObject *py_axes = NULL, *py_key = NULL, *py_type = NULL;
+	const char *system, *event, *name = NULL;
+	struct tracefs_hist *hist = NULL;
+	struct tc_tep *tt;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "ss|OOOs",
+					 kwlist,
+					 &system,
+					 &event,
+					 &py_key,
+					 &py_type,
+					 &py_axes,
+					 &name)) {
+		return NULL;
+	}
+
+	tt = tc_tep_get(NULL);
+	if (!tt)
+		return NULL;
+
+	/*
+	 * The event must be parsed before making the histogram. The
+	 * histogram holds its own reference to the tep handle.
+	 */
+	tc_event_by_name(tt, system, event);
+	if (py_key && ! py_axes) {
+		hist = hist_from_key(tt->tep, system, event, py_key, py_type);
+	} else if (!py_key && py_axes) {
+		hist = hist_from_axis(tt->tep, system, event, py_axes);
+	} else {
+		tc_tep_put(tt);
+		TfsError_setstr(NULL, "'key' or 'axis' must be provided.");
+		return NULL;
+	}
+
+	tc_tep_put(tt);
+
+	if (!hist)
+		goto fail;
+
+	if (name && tracefs_hist_add_name(hist, name) < 0)
+		goto fail;
+
+	return PyTraceHist_New(hist);
+
+ fail:
+	TfsError_fmt(NULL, "Failed to create histogram for %s/%s",
+		     system, event);
+	tracefs_hist_free(hist);
+	return NULL;
+}
+
+PyObject *PyFtrace_synth(PyObject *self, PyObject *args,
+					 PyObject *kwargs)
+{
+	const char *name, *start_match, *end_match, *match_name=NULL;
+	const char *start_sys, *start_evt, *end_sys, *end_evt;
+	static char *kwlist[] = {"name",
+				 "start_sys",
+				 "start_evt",
+				 "end_sys",
+				 "end_evt",
+				 "start_match",
+				 "end_match",
+				 "match_name",
+				 NULL};
+	static struct tracefs_synth *synth;
+	PyObject *py_synth;
+	struct tc_tep *tt;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "sssssss|s",
+					 kwlist,
+					 &name,
+					 &start_sys,
+					 &start_evt,
+					 &end_sys,
+					 &end_evt,
+					 &start_match,
+					 &end_match,
+					 &match_name)) {
+		return NULL;
+	}
+
+	tt = tc_tep_get(NULL);
+	if (!tt)
+		return NULL;
+
+	/*
+	 * The start and end events must be parsed before making the
+	 * synthetic event, which holds its own reference to the tep handle.
+	 */
+	tc_event_by_name(tt, start_sys, start_evt);
+	tc_event_by_name(tt, end_sys, end_evt);
+	synth = tracefs_synth_alloc(tt->tep, name,
+				    start_sys, start_evt,
+				    end_sys, end_evt,
+				    start_match, end_match,
+				    match_name);
+	tc_tep_put(tt);
+	if (!synth) {
+		MEM_ERROR;
+		return NULL;
+	}
+
+	py_synth = PySynthEvent_New(synth);
+	/*
+	 * Here we only allocated and initializes a synthetic event object.
+	 * However, no synthetic event is added to the system yet. Hence,
+	 * there is no need to 'destroy' this event at exit.
+	 */
+	set_destroy_flag(py_synth, false);
+	return py_synth;
+}
+
+#define SYNTH_SYS "synthetic"
+
+static bool enable_synth(PySynthEvent *self, PyObject *args, PyObject *kwargs,
+			 bool enable)
+{
+	struct tracefs_instance *instance;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	return event_enable_disable(instance, SYNTH_SYS,
+				    tracefs_synth_get_name(self->ptrObj),
+				    enable);
+}
+
+PyObject *PySynthEvent_enable(PySynthEvent *self, PyObject *args,
+						  PyObject *kwargs)
+{
+	if (!enable_synth(self, args, kwargs, true))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PySynthEvent_disable(PySynthEvent *self, PyObject *args,
+						   PyObject *kwargs)
+{
+	if (!enable_synth(self, args, kwargs, false))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+PyObject *PySynthEvent_is_enabled(PySynthEvent *self, PyObject *args,
+						      PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+
+	if (!get_instance_from_arg(args, kwargs, &instance))
+		return NULL;
+
+	return event_is_enabled(instance, SYNTH_SYS,
+				tracefs_synth_get_name(self->ptrObj));
+}
+
+/*
+ * Find the event of a synthetic event. The reference to the tep handle of
+ * the event must be released with tc_tep_put().
+ */
+struct tep_event *synth_get_event(PySynthEvent *event, struct tc_tep **tt_ptr)
+{
+	struct tep_event *tep_evt = NULL;
+	struct tc_tep *tt;
+
+	tt = tc_tep_get(NULL);
+	if (tt)
+		tep_evt = tc_event_by_name(tt, SYNTH_SYS,
+					   tracefs_synth_get_name(event->ptrObj));
+
+	if (!tep_evt) {
+		tc_tep_put(tt);
+		TfsError_setstr(NULL, "Failed to get synth. event.");
+		return NULL;
+	}
+
+	*tt_ptr = tt;
+
+	return tep_evt;
+}
+
+PyObject *PySynthEvent_set_filter(PySynthEvent *self, PyObject *args,
+						      PyObject *kwargs)
+{
+	struct tep_event *evt;
+	struct tc_tep *tt;
+	PyObject *ret;
+
+	evt = synth_get_event(self, &tt);
+	if (!evt)
+		return NULL;
+
+	ret = set_filter(args, kwargs, evt);
+	tc_tep_put(tt);
+
+	return ret;
+}
+
+PyObject *PySynthEvent_get_filter(PySynthEvent *self, PyObject *args,
+						      PyObject *kwargs)
+{
+	struct tep_event *evt;
+	struct tc_tep *tt;
+	PyObject *ret;
+
+	evt = synth_get_event(self, &tt);
+	if (!evt)
+		return NULL;
+
+	ret = get_filter(args, kwargs, SYNTH_SYS, evt->name);
+	tc_tep_put(tt);
+
+	return ret;
+}
+
+PyObject *PySynthEvent_clear_filter(PySynthEvent *self, PyObject *args,
+							PyObject *kwargs)
+{
+	struct tep_event *evt;
+	struct tc_tep *tt;
+	PyObject *ret;
+
+	evt = synth_get_event(self, &tt);
+	if (!evt)
+		return NULL;
+
+	ret = clear_filter(args, kwargs, evt);
+	tc_tep_put(tt);
+
+	return ret;
+}
+
+PyObject *PyFtrace_set_ftrace_loglevel(PyObject *self, PyObject *args,
+						       PyObject *kwargs)
+{
+	static char *kwlist[] = {"level", NULL};
+	int level;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "i",
+					 kwlist,
+					 &level)) {
+		return NULL;
+	}
+
+	if (level > TEP_LOG_ALL)
+		level = TEP_LOG_ALL;
+
+	if (level < 0)
+		level = 0;
+
+	tracefs_set_loglevel(level);
+	tep_set_loglevel(level);
+
+	Py_RETURN_NONE;
+}
+
+static bool set_fork_options(struct tracefs_instance *instance, bool enable)
+{
+	if (enable) {
+		if (tracefs_option_enable(instance, TRACEFS_OPTION_EVENT_FORK) < 0 ||
+		    tracefs_option_enable(instance, TRACEFS_OPTION_FUNCTION_FORK) < 0)
+			return false;
+	} else {
+		if (tracefs_option_disable(instance, TRACEFS_OPTION_EVENT_FORK) < 0 ||
+		    tracefs_option_disable(instance, TRACEFS_OPTION_FUNCTION_FORK) < 0)
+			return false;
+	}
+
+	return true;
+}
+
+static bool hook2pid(struct tracefs_instance *instance, PyObject *pid_val, int fork)
+{
+	if (!set_pid(instance, "set_ftrace_pid", pid_val) ||
+	    !set_pid(instance, "set_event_pid", pid_val))
+		goto fail;
+
+	if (fork < 0)
+		return true;
+
+	if (!set_fork_options(instance, fork))
+		goto fail;
+
+	return true;
+
+ fail:
+	TfsError_setstr(instance, "Failed to hook to PID");
+	PyErr_Print();
+	return false;
+}
+
+static void start_tracing_procces(struct tracefs_instance *instance,
+				  char *const *argv,
+				  char *const *envp)
+{
+	PyObject *pid_val = PyList_New(1);
+
+	PyList_SET_ITEM(pid_val, 0, PyLong_FromLong(getpid()));
+	if (!hook2pid(instance, pid_val, true))
+		exit(1);
+
+	tracing_ON(instance);
+	if (execvpe(argv[0], argv, envp) < 0) {
+		TfsError_fmt(instance, "Failed to exec \'%s\'",
+			     argv[0]);
+	}
+
+	exit(1);
+}
+
+static PyObject *get_callback_func(const char *plugin_name, const char * py_callback)
+{
+	PyObject *py_name, *py_module, *py_func;
+
+	py_name = PyUnicode_FromString(plugin_name);
+	py_module = PyImport_Import(py_name);
+	if (!py_module) {
+		PyErr_Format(TRACECRUNCHER_ERROR,
+			     "Failed to import plugin \'%s\'",
+			     plugin_name);
+		return NULL;
+	}
+
+	py_func = PyObject_GetAttrString(py_module, py_callback);
+	if (!py_func || !PyCallable_Check(py_func)) {
+		PyErr_Format(TRACECRUNCHER_ERROR,
+			     "Failed to import callback from \'%s\'",
+			     plugin_name);
+		return NULL;
+	}
+
+	return py_func;
+}
+
+/*
+ * The filter owned by the Python object is never used directly. Each user
+ * gets its own copy, bound to a particular tep handle, so that the matching
+ * can run without the GIL.
+ */
+struct tc_record_filter {
+	/* Filter expression in the format used by libtraceevent. */
+	char			*expression;
+
+	/*
+	 * The expression compiled for a particular tep handle. Set only in
+	 * the bound copies, together with the filter the copy is made from.
+	 */
+	struct tep_event_filter	*filter;
+	struct tep_handle	*tep;
+	struct tc_record_filter	*parent;
+
+	/* If true, only the PIDs in the 'pids' array are accepted. */
+	bool			pid_filter;
+
+	/* Sorted array of PIDs to accept. */
+	pid_t			*pids;
+	int			nr_pids;
+	int			pids_size;
+
+	/* If true, the children of the processes in 'pids' are accepted too. */
+	bool			follow_fork;
+	int			fork_id;
+	struct tep_format_field	*fork_parent;
+	struct tep_format_field	*fork_child;
+	int			exit_id;
+	struct tep_format_field	*exit_pid;
+};
+
+void tc_record_filter_free(struct tc_record_filter *filter)
+{
+	if (!filter)
+		return;
+
+	if (filter->filter)
+		tep_filter_free(filter->filter);
+
+	free(filter->expression);
+	free(filter->pids);
+	free(filter);
+}
+
+static int cmp_pid(const void *a, const void *b)
+{
+	pid_t pa = *(const pid_t *)a, pb = *(const pid_t *)b;
+
+	return (pa > pb) - (pa < pb);
+}
+
+static pid_t *filter_find_pid(struct tc_record_filter *filter, pid_t pid)
+{
+	return bsearch(&pid, filter->pids, filter->nr_pids,
+		       sizeof(*filter->pids), cmp_pid);
+}
+
+static bool filter_add_pid(struct tc_record_filter *filter, pid_t pid)
+{
+	int i;
+
+	if (filter_find_pid(filter, pid))
+		return true;
+
+	if (filter->nr_pids == filter->pids_size) {
+		int size = filter->pids_size ? 2 * filter->pids_size : 16;
+		pid_t *pids;
+
+		pids = realloc(filter->pids, size * sizeof(*pids));
+		if (!pids)
+			return false;
+
+		filter->pids = pids;
+		filter->pids_size = size;
+	}
+
+	for (i = filter->nr_pids; i > 0 && filter->pids[i - 1] > pid; --i)
+		filter->pids[i] = filter->pids[i - 1];
+
+	filter->pids[i] = pid;
+	++filter->nr_pids;
+
+	return true;
+}
+
+static void filter_remove_pid(struct tc_record_filter *filter, pid_t pid)
+{
+	pid_t *item = filter_find_pid(filter, pid);
+
+	if (!item)
+		return;
+
+	memmove(item, item + 1,
+		(filter->pids + filter->nr_pids - item - 1) * sizeof(*item));
+	--filter->nr_pids;
+}
+
+static struct tep_format_field *
+find_event_field(struct tc_tep *tt, const char *system,
+		 const char *event_name, const char *field_name, int *id)
+{
+	struct tep_event *event;
+
+	event = tc_event_by_name(tt, system, event_name);
+	if (!event)
+		return NULL;
+
+	*id = event->id;
+
+	return tep_find_any_field(event, field_name);
+}
+
+/*
+ * The events of a lazily parsed tep handle must be parsed before compiling
+ * the filter. Parse all events named "system/event" in the expression.
+ */
+static void filter_load_events(struct tc_tep *tt, const char *expression)
+{
+	const char *p = expression, *sys, *name;
+	char *system, *event;
+	int sys_len, name_len;
+
+	while (*p) {
+		for (sys = p; isalnum(*p) || *p == '_'; ++p)
+			;
+
+		sys_len = p - sys;
+		if (!sys_len || *p != '/') {
+			p += !sys_len;
+			continue;
+		}
+
+		for (name = ++p; isalnum(*p) || *p == '_'; ++p)
+			;
+
+		name_len = p - name;
+		if (!name_len)
+			continue;
+
+		system = strndup(sys, sys_len);
+		event = strndup(name, name_len);
+		if (system && event)
+			tc_event_by_name(tt, system, event);
+
+		free(system);
+		free(event);
+	}
+}
+
+static bool filter_copy_pids(struct tc_record_filter *dst,
+			     const struct tc_record_filter *src)
+{
+	pid_t *pids = NULL;
+
+	if (src->nr_pids) {
+		pids = malloc(src->nr_pids * sizeof(*pids));
+		if (!pids)
+			return false;
+
+		memcpy(pids, src->pids, src->nr_pids * sizeof(*pids));
+	}
+
+	free(dst->pids);
+	dst->pids = pids;
+	dst->nr_pids = dst->pids_size = src->nr_pids;
+
+	return true;
+}
+
+/*
+ * Make a copy of the filter, compiled for a given tep handle. The copy
+ * must be released with tc_record_filter_unbind().
+ */
+static struct tc_record_filter *
+tc_record_filter_bind(struct tc_record_filter *parent, struct tc_tep *tt)
+{
+	struct tc_record_filter *filter;
+	enum tep_errno ret;
+	char error[256];
+
+	filter = calloc(1, sizeof(*filter));
+	if (!filter || !filter_copy_pids(filter, parent)) {
+		MEM_ERROR;
+		goto fail;
+	}
+
+	filter->pid_filter = parent->pid_filter;
+	filter->follow_fork = parent->follow_fork;
+	if (parent->expression) {
+		filter_load_events(tt, parent->expression);
+		filter->filter = tep_filter_alloc(tt->tep);
+		if (!filter->filter) {
+			MEM_ERROR;
+			goto fail;
+		}
+
+		ret = tep_filter_add_filter_str(filter->filter,
+						parent->expression);
+		if (ret < 0) {
+			tep_filter_strerror(filter->filter, ret,
+					    error, sizeof(error));
+			PyErr_Format(TEP_ERROR,
+				     "Failed to compile filter \'%s\': %s",
+				     parent->expression, error);
+			goto fail;
+		}
+	}
+
+	filter->fork_id = filter->exit_id = -1;
+	if (filter->follow_fork) {
+		filter->fork_parent = find_event_field(tt, "sched",
+						       "sched_process_fork",
+						       "parent_pid",
+						       &filter->fork_id);
+		filter->fork_child = find_event_field(tt, "sched",
+						      "sched_process_fork",
+						      "child_pid",
+						      &filter->fork_id);
+		filter->exit_pid = find_event_field(tt, "sched",
+						    "sched_process_exit",
+						    "pid",
+						    &filter->exit_id);
+
+		if (!filter->fork_parent || !filter->fork_child) {
+			PyErr_SetString(TEP_ERROR,
+					"Failed to find event \'sched/sched_process_fork\'");
+			goto fail;
+		}
+	}
+
+	filter->tep = tt->tep;
+	filter->parent = parent;
+
+	return filter;
+
+ fail:
+	tc_record_filter_free(filter);
+	return NULL;
+}
+
+/*
+ * Release a bound copy of the filter. The PIDs followed by the copy become
+ * visible to the user of the original filter. Must be called with the GIL.
+ */
+static void tc_record_filter_unbind(struct tc_record_filter *filter)
+{
+	if (!filter)
+		return;
+
+	if (filter->follow_fork)
+		filter_copy_pids(filter->parent, filter);
+
+	tc_record_filter_free(filter);
+}
+
+static void filter_follow_fork(struct tc_record_filter *filter,
+			       struct tep_event *event,
+			       struct tep_record *record)
+{
+	unsigned long long parent, child, pid;
+
+	if (event->id == filter->fork_id) {
+		tep_read_number_field(filter->fork_parent, record->data, &parent);
+		tep_read_number_field(filter->fork_child, record->data, &child);
+		if (filter_find_pid(filter, parent))
+			filter_add_pid(filter, child);
+	} else if (event->id == filter->exit_id && filter->exit_pid) {
+		tep_read_number_field(filter->exit_pid, record->data, &pid);
+		filter_remove_pid(filter, pid);
+	}
+}
+
+/*
+ * Returns true if the record passes the filter. No Python objects are
+ * created here.
+ */
+static bool tc_record_filter_match(struct tc_record_filter *filter,
+				   struct tep_event *event,
+				   struct tep_record *record)
+{
+	bool match = true;
+
+	if (filter->pid_filter) {
+		match = filter_find_pid(filter,
+					tep_data_pid(filter->tep, record));
+
+		/* Exits must be processed after the PID is checked. */
+		if (filter->follow_fork)
+			filter_follow_fork(filter, event, record);
+	}
+
+	if (match && filter->filter)
+		match = tep_filter_match(filter->filter, record) ==
+			TEP_ERRNO__FILTER_MATCH;
+
+	return match;
+}
+
+static bool filter_set_pids(struct tc_record_filter *filter, PyObject *py_pids)
+{
+	unsigned long *pids = NULL;
+	int i, n = 0;
+
+	filter->pid_filter = true;
+	if (PyLong_CheckExact(py_pids)) {
+		if (!filter_add_pid(filter, PyLong_AsLong(py_pids))) {
+			MEM_ERROR;
+			return false;
+		}
+
+		return true;
+	}
+
+	if (!PyList_CheckExact(py_pids) ||
+	    tc_list_get_uint(py_pids, &pids, &n) != 0) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Failed to parse \'pids\' (must be int or list of ints).");
+		return false;
+	}
+
+	filter->pids = malloc((n ? n : 1) * sizeof(*filter->pids));
+	if (!filter->pids) {
+		free(pids);
+		MEM_ERROR;
+		return false;
+	}
+
+	for (i = 0; i < n; ++i)
+		filter->pids[i] = pids[i];
+
+	free(pids);
+
+	/* Sort once and drop the duplicates. */
+	qsort(filter->pids, n, sizeof(*filter->pids), cmp_pid);
+	filter->nr_pids = 0;
+	for (i = 0; i < n; ++i) {
+		if (!filter->nr_pids ||
+		    filter->pids[filter->nr_pids - 1] != filter->pids[i])
+			filter->pids[filter->nr_pids++] = filter->pids[i];
+	}
+
+	filter->pids_size = n ? n : 1;
+
+	return true;
+}
+
+PyObject *PyFtrace_record_filter(PyObject *self, PyObject *args,
+						 PyObject *kwargs)
+{
+	static char *kwlist[] = {"expression", "pids", "follow_fork", NULL};
+	struct tc_record_filter *filter;
+	const char *expression = NULL;
+	PyObject *py_filter, *py_pids = NULL;
+	int follow_fork = false;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|zOp",
+					 kwlist,
+					 &expression,
+					 &py_pids,
+					 &follow_fork)) {
+		return NULL;
+	}
+
+	if (follow_fork && !py_pids) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"\'follow_fork\' requires \'pids\'.");
+		return NULL;
+	}
+
+	filter = calloc(1, sizeof(*filter));
+	if (!filter) {
+		MEM_ERROR;
+		return NULL;
+	}
+
+	filter->follow_fork = follow_fork;
+	if (expression) {
+		filter->expression = strdup(expression);
+		if (!filter->expression) {
+			MEM_ERROR;
+			goto fail;
+		}
+	}
+
+	if (py_pids && !filter_set_pids(filter, py_pids))
+		goto fail;
+
+	py_filter = PyRecordFilter_New(filter);
+	if (!py_filter)
+		goto fail;
+
+	return py_filter;
+
+ fail:
+	tc_record_filter_free(filter);
+	return NULL;
+}
+
+PyObject *PyRecordFilter_pids(PyRecordFilter *self)
+{
+	struct tc_record_filter *filter = self->ptrObj;
+	PyObject *py_pids;
+	int i;
+
+	if (!filter) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"The filter is not initialized.");
+		return NULL;
+	}
+
+	py_pids = PyList_New(filter->nr_pids);
+	if (!py_pids)
+		return NULL;
+
+	for (i = 0; i < filter->nr_pids; ++i)
+		PyList_SET_ITEM(py_pids, i, PyLong_FromLong(filter->pids[i]));
+
+	return py_pids;
+}
+
+static bool get_optional_filter(PyObject *py_filter,
+				struct tc_record_filter **filter)
+{
+	*filter = NULL;
+	if (!py_filter)
+		return true;
+
+	if (!PyRecordFilter_Check(py_filter)) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Passing argument \'filter\' with incompatible type.");
+		return false;
+	}
+
+	*filter = ((PyRecordFilter *) py_filter)->ptrObj;
+
+	return true;
+}
+
+enum tc_agg_type {
+	TC_AGG_COUNT,
+	TC_AGG_SUM,
+	TC_AGG_MIN,
+	TC_AGG_MAX,
+	TC_AGG_LAST,
+	TC_AGG_HIST_LOG2,
+	TC_AGG_HIST_LINEAR,
+};
+
+static const char *const agg_type_names[] = {
+	[TC_AGG_COUNT]		= "count",
+	[TC_AGG_SUM]		= "sum",
+	[TC_AGG_MIN]		= "min",
+	[TC_AGG_MAX]		= "max",
+	[TC_AGG_LAST]		= "last",
+	[TC_AGG_HIST_LOG2]	= "hist_log2",
+	[TC_AGG_HIST_LINEAR]	= "hist_linear",
+};
+
+enum tc_agg_key_type {
+	TC_AGG_KEY_PID,
+	TC_AGG_KEY_CPU,
+	TC_AGG_KEY_EVENT,
+	TC_AGG_KEY_FIELD,
+};
+
+#define TC_AGG_MAX_KEYS		4
+#define TC_AGG_LOG2_BINS	64
+#define TC_AGG_INIT_SIZE	256
+
+struct tc_agg_key {
+	const char		*name;
+	enum tc_agg_key_type	type;
+	struct tep_format_field	*field;
+};
+
+struct tc_aggregator {
+	enum tc_agg_type	type;
+
+	/* The event to aggregate. NULL means all events. */
+	char			*system;
+	char			*event_name;
+	int			event_id;
+
+	int			nr_keys;
+	struct tc_agg_key	keys[TC_AGG_MAX_KEYS];
+
+	/* The field to aggregate (not used by "count"). */
+	char			*field_name;
+	struct tep_format_field	*field;
+
+	/*
+	 * Histogram parameters. A linear histogram has two extra bins, the
+	 * first and the last, counting the values out of its range.
+	 */
+	int			nr_bins;
+	int64_t			hist_min;
+	int64_t			hist_step;
+
+	/* Number of values per entry (the number of bins for histograms). */
+	int			nr_values;
+
+	/*
+	 * Open-addressing hash table. For each slot there are 'nr_keys' keys
+	 * and 'nr_values' values.
+	 */
+	size_t			nr_entries;
+	size_t			table_size;
+	bool			*used;
+	int64_t			*table_keys;
+	int64_t			*table_values;
+
+	/* Names of the keys, owned by the aggregator. */
+	char			*key_names[TC_AGG_MAX_KEYS];
+};
+
+void tc_aggregator_free(struct tc_aggregator *agg)
+{
+	int i;
+
+	if (!agg)
+		return;
+
+	for (i = 0; i < agg->nr_keys; ++i)
+		free(agg->key_names[i]);
+
+	free(agg->system);
+	free(agg->event_name);
+	free(agg->field_name);
+	free(agg->used);
+	free(agg->table_keys);
+	free(agg->table_values);
+	free(agg);
+}
+
+static uint64_t agg_hash(const int64_t *keys, int nr_keys)
+{
+	uint64_t h = 14695981039346656037ULL;
+	int i;
+
+	for (i = 0; i < nr_keys; ++i) {
+		h ^= (uint64_t) keys[i];
+		h *= 1099511628211ULL;
+		h ^= h >> 29;
+	}
+
+	return h;
+}
+
+static void agg_init_values(struct tc_aggregator *agg, int64_t *values)
+{
+	int64_t init = 0;
+	int i;
+
+	if (agg->type == TC_AGG_MIN)
+		init = INT64_MAX;
+	else if (agg->type == TC_AGG_MAX)
+		init = INT64_MIN;
+
+	for (i = 0; i < agg->nr_values; ++i)
+		values[i] = init;
+}
+
+static bool agg_alloc_table(struct tc_aggregator *agg, size_t size)
+{
+	int nr_keys = agg->nr_keys ? agg->nr_keys : 1;
+
+	agg->used = calloc(size, sizeof(*agg->used));
+	agg->table_keys = calloc(size * nr_keys, sizeof(*agg->table_keys));
+	agg->table_values = calloc(size * agg->nr_values,
+				   sizeof(*agg->table_values));
+	if (!agg->used || !agg->table_keys || !agg->table_values)
+		return false;
+
+	agg->table_size = size;
+	agg->nr_entries = 0;
+
+	return true;
+}
+
+static int64_t *agg_find(struct tc_aggregator *agg, const int64_t *keys,
+			 bool *new_entry);
+
+static bool agg_grow(struct tc_aggregator *agg)
+{
+	int64_t *old_keys = agg->table_keys, *old_values = agg->table_values;
+	int nr_keys = agg->nr_keys ? agg->nr_keys : 1;
+	size_t i, old_size = agg->table_size;
+	bool *old_used = agg->used;
+	int64_t *values;
+	bool new_entry;
+
+	if (!agg_alloc_table(agg, 2 * old_size)) {
+		free(agg->used);
+		free(agg->table_keys);
+		free(agg->table_values);
+		agg->used = old_used;
+		agg->table_keys = old_keys;
+		agg->table_values = old_values;
+		agg->table_size = old_size;
+		return false;
+	}
+
+	for (i = 0; i < old_size; ++i) {
+		if (!old_used[i])
+			continue;
+
+		values = agg_find(agg, old_keys + i * nr_keys, &new_entry);
+		memcpy(values, old_values + i * agg->nr_values,
+		       agg->nr_values * sizeof(*values));
+	}
+
+	free(old_used);
+	free(old_keys);
+	free(old_values);
+
+	return true;
+}
+
+/* Find the values of given keys. A new entry is added if not found. */
+static int64_t *agg_find(struct tc_aggregator *agg, const int64_t *keys,
+			 bool *new_entry)
+{
+	int nr_keys = agg->nr_keys ? agg->nr_keys : 1;
+	size_t mask, i;
+
+	if (2 * (agg->nr_entries + 1) > agg->table_size && !agg_grow(agg))
+		return NULL;
+
+	mask = agg->table_size - 1;
+	for (i = agg_hash(keys, nr_keys) & mask;; i = (i + 1) & mask) {
+		if (!agg->used[i])
+			break;
+
+		if (memcmp(agg->table_keys + i * nr_keys, keys,
+			   nr_keys * sizeof(*keys)) == 0) {
+			*new_entry = false;
+			return agg->table_values + i * agg->nr_values;
+		}
+	}
+
+	agg->used[i] = true;
+	memcpy(agg->table_keys + i * nr_keys, keys, nr_keys * sizeof(*keys));
+	agg_init_values(agg, agg->table_values + i * agg->nr_values);
+	++agg->nr_entries;
+	*new_entry = true;
+
+	return agg->table_values + i * agg->nr_values;
+}
+
+static int agg_log2_bin(int64_t val)
+{
+	int bin;
+
+	if (val <= 0)
+		return 0;
+
+	bin = 64 - __builtin_clzll(val);
+
+	return bin < TC_AGG_LOG2_BINS ? bin : TC_AGG_LOG2_BINS - 1;
+}
+
+static int agg_linear_bin(struct tc_aggregator *agg, int64_t val)
+{
+	uint64_t bin;
+
+	if (val < agg->hist_min)
+		return 0;
+
+	/* The difference does not fit in int64_t for extreme values. */
+	bin = ((uint64_t) val - (uint64_t) agg->hist_min) / agg->hist_step;
+
+	return bin < (uint64_t) agg->nr_bins ? bin + 1 : agg->nr_bins + 1;
+}
+
+/* Returns false in case of a memory error. */
+static bool tc_aggregator_update(struct tc_aggregator *agg,
+				 struct tep_event *event,
+				 struct tep_record *record)
+{
+	int64_t keys[TC_AGG_MAX_KEYS] = {0}, val = 0, *values;
+	bool new_entry;
+	int i;
+
+	if (agg->event_id >= 0 && event->id != agg->event_id)
+		return true;
+
+	for (i = 0; i < agg->nr_keys; ++i) {
+		switch (agg->keys[i].type) {
+		case TC_AGG_KEY_PID:
+			keys[i] = tep_data_pid(event->tep, record);
+			break;
+		case TC_AGG_KEY_CPU:
+			keys[i] = record->cpu;
+			break;
+		case TC_AGG_KEY_EVENT:
+			keys[i] = event->id;
+			break;
+		case TC_AGG_KEY_FIELD:
+			keys[i] = read_number_field(agg->keys[i].field,
+						    record->data);
+			break;
+		}
+	}
+
+	if (agg->field)
+		val = read_number_field(agg->field, record->data);
+
+	values = agg_find(agg, keys, &new_entry);
+	if (!values)
+		return false;
+
+	switch (agg->type) {
+	case TC_AGG_COUNT:
+		++values[0];
+		break;
+	case TC_AGG_SUM:
+		values[0] += val;
+		break;
+	case TC_AGG_MIN:
+		if (val < values[0])
+			values[0] = val;
+		break;
+	case TC_AGG_MAX:
+		if (val > values[0])
+			values[0] = val;
+		break;
+	case TC_AGG_LAST:
+		values[0] = val;
+		break;
+	case TC_AGG_HIST_LOG2:
+		++values[agg_log2_bin(val)];
+		break;
+	case TC_AGG_HIST_LINEAR:
+		++values[agg_linear_bin(agg, val)];
+		break;
+	}
+
+	return true;
+}
+
+static struct tep_format_field *agg_find_number_field(struct tep_event *event,
+						      const char *name)
+{
+	struct tep_format_field *field;
+
+	field = tep_find_any_field(event, name);
+	if (!field) {
+		PyErr_Format(TEP_ERROR,
+			     "Failed to find field \'%s\' in event \'%s\'",
+			     name, event->name);
+		return NULL;
+	}
+
+	if (!is_number(field) ||
+	    field->flags & (TEP_FIELD_IS_STRING | TEP_FIELD_IS_DYNAMIC |
+			    TEP_FIELD_IS_ARRAY)) {
+		PyErr_Format(TEP_ERROR,
+			     "Field \'%s\' of event \'%s\' is not a number.",
+			     name, event->name);
+		return NULL;
+	}
+
+	return field;
+}
+
+/* Resolve the event and the fields used by the aggregator. */
+static bool tc_aggregator_bind(struct tc_aggregator *agg,
+			       struct tc_tep *tt)
+{
+	struct tep_event *event = NULL;
+	int i;
+
+	agg->event_id = -1;
+	if (agg->event_name) {
+		event = tc_event_by_name(tt, agg->system, agg->event_name);
+		if (!event) {
+			PyErr_Format(TEP_ERROR, "Failed to find event \'%s/%s\'",
+				     agg->system, agg->event_name);
+			return false;
+		}
+
+		agg->event_id = event->id;
+	}
+
+	for (i = 0; i < agg->nr_keys; ++i) {
+		if (agg->keys[i].type != TC_AGG_KEY_FIELD)
+			continue;
+
+		agg->keys[i].field = agg_find_number_field(event,
+							   agg->keys[i].name);
+		if (!agg->keys[i].field)
+			return false;
+	}
+
+	if (agg->field_name) {
+		agg->field = agg_find_number_field(event, agg->field_name);
+		if (!agg->field)
+			return false;
+	}
+
+	return true;
+}
+
+static bool agg_add_key(struct tc_aggregator *agg, const char *name)
+{
+	struct tc_agg_key *key = &agg->keys[agg->nr_keys];
+
+	if (strcmp(name, "pid") == 0) {
+		key->type = TC_AGG_KEY_PID;
+	} else if (strcmp(name, "cpu") == 0) {
+		key->type = TC_AGG_KEY_CPU;
+	} else if (strcmp(name, "event") == 0) {
+		key->type = TC_AGG_KEY_EVENT;
+	} else {
+		if (!agg->event_name) {
+			PyErr_Format(TRACECRUNCHER_ERROR,
+				     "Key \'%s\' requires \'event\' to be specified.",
+				     name);
+			return false;
+		}
+
+		key->type = TC_AGG_KEY_FIELD;
+	}
+
+	agg->key_names[agg->nr_keys] = strdup(name);
+	if (!agg->key_names[agg->nr_keys]) {
+		MEM_ERROR;
+		return false;
+	}
+
+	key->name = agg->key_names[agg->nr_keys];
+	++agg->nr_keys;
+
+	return true;
+}
+
+static int agg_type_from_str(const char *type)
+{
+	int i;
+
+	for (i = 0; i < sizeof(agg_type_names) / sizeof(*agg_type_names); ++i)
+		if (strcmp(type, agg_type_names[i]) == 0)
+			return i;
+
+	PyErr_Format(TRACECRUNCHER_ERROR,
+		     "Unknown aggregator type \'%s\'.", type);
+
+	return -1;
+}
+
+PyObject *PyFtrace_aggregator(PyObject *self, PyObject *args,
+					      PyObject *kwargs)
+{
+	static char *kwlist[] = {"type", "event", "keys", "field", "bins",
+				 "min", "step", NULL};
+	const char *type_str, *event = NULL, *field = NULL, *key;
+	long long hist_min = 0, hist_step = 1;
+	PyObject *py_keys = NULL, *py_agg;
+	struct tc_aggregator *agg;
+	int i, n, type, bins = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "s|zOziLL",
+					 kwlist,
+					 &type_str,
+					 &event,
+					 &py_keys,
+					 &field,
+					 &bins,
+					 &hist_min,
+					 &hist_step)) {
+		return NULL;
+	}
+
+	type = agg_type_from_str(type_str);
+	if (type < 0)
+		return NULL;
+
+	if (type != TC_AGG_COUNT && (!field || !event)) {
+		PyErr_Format(TRACECRUNCHER_ERROR,
+			     "Aggregator \'%s\' requires \'event\' and \'field\'.",
+			     type_str);
+		return NULL;
+	}
+
+	if (field && !event) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"\'field\' requires \'event\' to be specified.");
+		return NULL;
+	}
+
+	if (type == TC_AGG_HIST_LINEAR && (bins <= 0 || hist_step <= 0)) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Linear histogram requires positive \'bins\' and \'step\'.");
+		return NULL;
+	}
+
+	agg = calloc(1, sizeof(*agg));
+	if (!agg) {
+		MEM_ERROR;
+		return NULL;
+	}
+
+	agg->type = type;
+	agg->event_id = -1;
+	agg->hist_min = hist_min;
+	agg->hist_step = hist_step;
+	agg->nr_bins = bins;
+	agg->nr_values = 1;
+	if (type == TC_AGG_HIST_LOG2)
+		agg->nr_values = agg->nr_bins = TC_AGG_LOG2_BINS;
+	else if (type == TC_AGG_HIST_LINEAR)
+		agg->nr_values = bins + 2;
+
+	if (event) {
+		char *system;
+
+		if (!split_event_name(event, &system, &event))
+			goto fail;
+
+		agg->system = system;
+		agg->event_name = strdup(event);
+		if (!agg->event_name)
+			goto mem_fail;
+	}
+
+	if (field) {
+		agg->field_name = strdup(field);
+		if (!agg->field_name)
+			goto mem_fail;
+	}
+
+	if (py_keys) {
+		if (PyUnicode_Check(py_keys)) {
+			if (!agg_add_key(agg, PyUnicode_AsUTF8(py_keys)))
+				goto fail;
+		} else if (PyList_CheckExact(py_keys) &&
+			   PyList_Size(py_keys) <= TC_AGG_MAX_KEYS) {
+			n = PyList_Size(py_keys);
+			for (i = 0; i < n; ++i) {
+				key = tc_str_from_list(py_keys, i);
+				if (!key) {
+					PyErr_SetString(TRACECRUNCHER_ERROR,
+							"Inconsistent \'keys\' argument.");
+					goto fail;
+				}
+
+				if (!agg_add_key(agg, key))
+					goto fail;
+			}
+		} else {
+			PyErr_Format(TRACECRUNCHER_ERROR,
+				     "\'keys\' must be a string or a list of up to %i strings.",
+				     TC_AGG_MAX_KEYS);
+			goto fail;
+		}
+	}
+
+	if (!agg_alloc_table(agg, TC_AGG_INIT_SIZE))
+		goto mem_fail;
+
+	py_agg = PyAggregator_New(agg);
+	if (!py_agg)
+		goto fail;
+
+	return py_agg;
+
+ mem_fail:
+	MEM_ERROR;
+ fail:
+	tc_aggregator_free(agg);
+	return NULL;
+}
+
+static PyObject *agg_key_to_py(struct tc_aggregator *agg, const int64_t *keys)
+{
+	PyObject *py_key;
+	int i;
+
+	if (agg->nr_keys == 1)
+		return PyLong_FromLongLong(keys[0]);
+
+	py_key = PyTuple_New(agg->nr_keys);
+	for (i = 0; i < agg->nr_keys; ++i)
+		PyTuple_SET_ITEM(py_key, i, PyLong_FromLongLong(keys[i]));
+
+	return py_key;
+}
+
+static PyObject *agg_values_to_py(struct tc_aggregator *agg,
+				  const int64_t *values)
+{
+	PyObject *py_values;
+	int i;
+
+	if (agg->type != TC_AGG_HIST_LOG2 && agg->type != TC_AGG_HIST_LINEAR)
+		return PyLong_FromLongLong(values[0]);
+
+	py_values = PyList_New(agg->nr_values);
+	for (i = 0; i < agg->nr_values; ++i)
+		PyList_SET_ITEM(py_values, i, PyLong_FromLongLong(values[i]));
+
+	return py_values;
+}
+
+static PyObject *agg_data_dict(struct tc_aggregator *agg)
+{
+	int nr_keys = agg->nr_keys ? agg->nr_keys : 1;
+	PyObject *data, *py_key, *py_val;
+	size_t i;
+
+	data = PyDict_New();
+	for (i = 0; i < agg->table_size; ++i) {
+		if (!agg->used[i])
+			continue;
+
+		py_key = agg_key_to_py(agg, agg->table_keys + i * nr_keys);
+		py_val = agg_values_to_py(agg, agg->table_values + i * agg->nr_values);
+		PyDict_SetItem(data, py_key, py_val);
+		Py_DECREF(py_key);
+		Py_DECREF(py_val);
+	}
+
+	return data;
+}
+
+static PyObject *agg_data_arrays(struct tc_aggregator *agg)
+{
+	int nr_keys = agg->nr_keys ? agg->nr_keys : 1;
+	npy_intp key_dims[2] = {agg->nr_entries, agg->nr_keys};
+	npy_intp val_dims[2] = {agg->nr_entries, agg->nr_values};
+	PyObject *data, *py_keys, *py_values;
+	int64_t *keys, *values;
+	size_t i;
+
+	py_keys = PyArray_SimpleNew(2, key_dims, NPY_INT64);
+	py_values = PyArray_SimpleNew(agg->nr_values > 1 ? 2 : 1, val_dims,
+				      NPY_INT64);
+	if (!py_keys || !py_values) {
+		Py_XDECREF(py_keys);
+		Py_XDECREF(py_values);
+		return NULL;
+	}
+
+	keys = PyArray_DATA((PyArrayObject *) py_keys);
+	values = PyArray_DATA((PyArrayObject *) py_values);
+	for (i = 0; i < agg->table_size; ++i) {
+		if (!agg->used[i])
+			continue;
+
+		memcpy(keys, agg->table_keys + i * nr_keys,
+		       agg->nr_keys * sizeof(*keys));
+		memcpy(values, agg->table_values + i * agg->nr_values,
+		       agg->nr_values * sizeof(*values));
+		keys += agg->nr_keys;
+		values += agg->nr_values;
+	}
+
+	data = PyDict_New();
+	PyDict_SetItemString(data, "keys", py_keys);
+	PyDict_SetItemString(data, "values", py_values);
+	Py_DECREF(py_keys);
+	Py_DECREF(py_values);
+
+	return data;
+}
+
+PyObject *PyAggregator_data(PyAggregator *self, PyObject *args,
+						PyObject *kwargs)
+{
+	static char *kwlist[] = {"as_numpy", NULL};
+	int as_numpy = false;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|p",
+					 kwlist,
+					 &as_numpy)) {
+		return NULL;
+	}
+
+	if (as_numpy)
+		return agg_data_arrays(self->ptrObj);
+
+	return agg_data_dict(self->ptrObj);
+}
+
+PyObject *PyAggregator_keys(PyAggregator *self)
+{
+	struct tc_aggregator *agg = self->ptrObj;
+	PyObject *py_keys;
+	int i;
+
+	py_keys = PyList_New(agg->nr_keys);
+	for (i = 0; i < agg->nr_keys; ++i)
+		PyList_SET_ITEM(py_keys, i,
+				PyUnicode_FromString(agg->keys[i].name));
+
+	return py_keys;
+}
+
+PyObject *PyAggregator_clear(PyAggregator *self)
+{
+	struct tc_aggregator *agg = self->ptrObj;
+
+	memset(agg->used, 0, agg->table_size * sizeof(*agg->used));
+	agg->nr_entries = 0;
+
+	Py_RETURN_NONE;
+}
+
+/*
+ * Get the aggregators from a list (or a single aggregator) and resolve
+ * their fields.
+ */
+static bool get_optional_aggregators(PyObject *py_aggs,
+				     struct tc_tep *tt,
+				     struct tc_aggregator ***aggs,
+				     int *nr_aggs)
+{
+	PyObject *py_agg;
+	int i, n;
+
+	*aggs = NULL;
+	*nr_aggs = 0;
+	if (!py_aggs)
+		return true;
+
+	if (PyAggregator_Check(py_aggs)) {
+		n = 1;
+	} else if (PyList_CheckExact(py_aggs)) {
+		n = PyList_Size(py_aggs);
+	} else {
+		goto type_fail;
+	}
+
+	*aggs = calloc(n ? n : 1, sizeof(**aggs));
+	if (!*aggs) {
+		MEM_ERROR;
+		return false;
+	}
+
+	for (i = 0; i < n; ++i) {
+		py_agg = PyList_CheckExact(py_aggs) ?
+			 PyList_GetItem(py_aggs, i) : py_aggs;
+
+		if (!PyAggregator_Check(py_agg)) {
+			free(*aggs);
+			*aggs = NULL;
+			goto type_fail;
+		}
+
+		(*aggs)[i] = ((PyAggregator *) py_agg)->ptrObj;
+		if (!tc_aggregator_bind((*aggs)[i], tt)) {
+			free(*aggs);
+			*aggs = NULL;
+			return false;
+		}
+	}
+
+	*nr_aggs = n;
+
+	return true;
+
+ type_fail:
+	PyErr_SetString(TRACECRUNCHER_ERROR,
+			"Passing argument \'aggregators\' with incompatible type.");
+	return false;
+}
+
+static unsigned long long time_now_ms(void)
+{
+	return time_now_ns() / 1000000;
+}
+
+struct tc_cpu_stats {
+	/* Records passed to the callback or to the aggregators. */
+	unsigned long long	delivered;
+
+	/* Records rejected by the filter. */
+	unsigned long long	filtered;
+
+	/* Events overwritten before being read, as reported by the pages. */
+	unsigned long long	missed_events;
+
+	/* The size of the event data read. */
+	unsigned long long	bytes;
+
+	/* Values of 'per_cpu/cpuN/stats' when the tracing started. */
+	long long		overrun;
+	long long		dropped;
+};
+
+struct tc_trace_stats {
+	int			nr_cpus;
+	struct tc_cpu_stats	*cpus;
+
+	/* Time (in nanoseconds) when the tracing started. */
+	unsigned long long	start_ns;
+
+	/* Time (in nanoseconds) spent running Python code. */
+	unsigned long long	python_ns;
+};
+
+static long long stats_file_value(const char *buf, const char *name)
+{
+	const char *val = buf ? strstr(buf, name) : NULL;
+
+	return val ? atoll(val + strlen(name)) : 0;
+}
+
+static void read_cpu_stats(struct tracefs_instance *instance, int cpu,
+			   long long *overrun, long long *dropped)
+{
+	char file[64], *buf;
+	int size;
+
+	snprintf(file, sizeof(file), "per_cpu/cpu%i/stats", cpu);
+	buf = tracefs_instance_file_read(instance, file, &size);
+
+	*overrun = stats_file_value(buf, "\noverrun:");
+	*dropped = stats_file_value(buf, "dropped events:");
+	free(buf);
+}
+
+static void trace_stats_free(struct tc_trace_stats *stats)
+{
+	free(stats->cpus);
+	stats->cpus = NULL;
+	stats->nr_cpus = 0;
+}
+
+static bool trace_stats_init(struct tc_trace_stats *stats,
+			     struct tracefs_instance *instance)
+{
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	stats->cpus = calloc(stats->nr_cpus, sizeof(*stats->cpus));
+	if (!stats->cpus) {
+		MEM_ERROR;
+		return false;
+	}
+
+	for (cpu = 0; cpu < stats->nr_cpus; ++cpu)
+		read_cpu_stats(instance, cpu, &stats->cpus[cpu].overrun,
+					      &stats->cpus[cpu].dropped);
+
+	stats->start_ns = time_now_ns();
+
+	return true;
+}
+
+static inline void trace_stats_record(struct tc_trace_stats *stats,
+				      struct tep_record *record,
+				      bool delivered)
+{
+	struct tc_cpu_stats *cpu_stats;
+
+	if (record->cpu < 0 || record->cpu >= stats->nr_cpus)
+		return;
+
+	cpu_stats = &stats->cpus[record->cpu];
+	cpu_stats->bytes += record->size;
+
+	/* A negative value means that events are lost, but not how many. */
+	if (record->missed_events)
+		cpu_stats->missed_events += record->missed_events > 0 ?
+					    record->missed_events : 1;
+
+	if (delivered)
+		++cpu_stats->delivered;
+	else
+		++cpu_stats->filtered;
+}
+
+#define STATS_SET(dict, name, val)					\
+	do {								\
+		PyObject *py_val = PyLong_FromLongLong(val);		\
+		PyDict_SetItemString(dict, name, py_val);		\
+		Py_DECREF(py_val);					\
+	} while (0)
+
+#define STATS_SET_TIME(dict, name, ns)					\
+	do {								\
+		PyObject *py_val = PyFloat_FromDouble((ns) * 1e-9);	\
+		PyDict_SetItemString(dict, name, py_val);		\
+		Py_DECREF(py_val);					\
+	} while (0)
+
+/*
+ * Build a dictionary of the statistics. The 'overrun' and 'dropped' values
+ * are the changes of the kernel counters since trace_stats_init(). If
+ * 'records' is false, only the kernel counters are reported.
+ */
+static PyObject *trace_stats_to_py(struct tc_trace_stats *stats,
+				   struct tracefs_instance *instance,
+				   bool records)
+{
+	long long overrun, dropped, total_overrun = 0, total_dropped = 0;
+	unsigned long long delivered = 0, filtered = 0, missed = 0, bytes = 0;
+	unsigned long long total_ns = time_now_ns() - stats->start_ns;
+	PyObject *py_stats, *py_cpus, *py_cpu;
+	struct tc_cpu_stats *cpu_stats;
+	int cpu;
+
+	py_stats = PyDict_New();
+	py_cpus = PyList_New(stats->nr_cpus);
+	if (!py_stats || !py_cpus)
+		goto fail;
+
+	for (cpu = 0; cpu < stats->nr_cpus; ++cpu) {
+		cpu_stats = &stats->cpus[cpu];
+		read_cpu_stats(instance, cpu, &overrun, &dropped);
+		overrun -= cpu_stats->overrun;
+		dropped -= cpu_stats->dropped;
+
+		py_cpu = PyDict_New();
+		if (!py_cpu)
+			goto fail;
+
+		PyList_SET_ITEM(py_cpus, cpu, py_cpu);
+		STATS_SET(py_cpu, "overrun", overrun);
+		STATS_SET(py_cpu, "dropped", dropped);
+		total_overrun += overrun;
+		total_dropped += dropped;
+		if (!records)
+			continue;
+
+		STATS_SET(py_cpu, "delivered", cpu_stats->delivered);
+		STATS_SET(py_cpu, "filtered", cpu_stats->filtered);
+		STATS_SET(py_cpu, "missed_events", cpu_stats->missed_events);
+		STATS_SET(py_cpu, "bytes", cpu_stats->bytes);
+		delivered += cpu_stats->delivered;
+		filtered += cpu_stats->filtered;
+		missed += cpu_stats->missed_events;
+		bytes += cpu_stats->bytes;
+	}
+
+	STATS_SET(py_stats, "overrun", total_overrun);
+	STATS_SET(py_stats, "dropped", total_dropped);
+	if (records) {
+		STATS_SET(py_stats, "delivered", delivered);
+		STATS_SET(py_stats, "filtered", filtered);
+		STATS_SET(py_stats, "missed_events", missed);
+		STATS_SET(py_stats, "bytes", bytes);
+		STATS_SET_TIME(py_stats, "python_time", stats->python_ns);
+		STATS_SET_TIME(py_stats, "native_time",
+			       total_ns - stats->python_ns);
+	}
+
+	PyDict_SetItemString(py_stats, "cpus", py_cpus);
+	Py_DECREF(py_cpus);
+
+	return py_stats;
+
+ fail:
+	Py_XDECREF(py_stats);
+	Py_XDECREF(py_cpus);
+	return NULL;
+}
+
+struct callback_context {
+	void	*py_callback;
+
+	bool	status;
+
+	/*
+	 * The maximum number of records delivered to the Python callback
+	 * with a single call. Zero means that the callback is called for
+	 * each individual record. Negative value means that all records
+	 * collected in one pass over the ring buffers are delivered at once.
+	 */
+	int	batch_size;
+
+	/* The tep handle of the events. Owned by the context. */
+	struct tc_tep		*tep;
+
+	/* The batch currently being filled. */
+	struct tc_record_batch	*batch;
+
+	/*
+	 * Records that do not pass the filter are not delivered (optional).
+	 * This is a copy owned by the context.
+	 */
+	struct tc_record_filter	*filter;
+
+	/* Aggregators updated natively for every record (optional). */
+	struct tc_aggregator	**aggs;
+	int			nr_aggs;
+
+	/* Counters returned to the user when the tracing is over. */
+	struct tc_trace_stats	stats;
+
+	/* The PyTepEvent objects passed to the callback. */
+	struct tc_event_cache	event_cache;
+
+	/*
+	 * The arguments of the last call of the callback. The record object
+	 * is repointed to the next record, unless the user kept a reference.
+	 */
+	PyObject		*arglist;
+	PyObject		*py_record;
+
+	/* The parallel reader providing the records (optional). */
+	struct tc_reader	*reader;
+
+	/* The state of the thread while the GIL is released. */
+	PyThreadState		*tstate;
+};
+
+/*
+ * The ring buffers are read without holding the GIL. The GIL is taken on
+ * the first record that needs Python, or state that is shared with Python,
+ * and is kept until the end of the pass over the ring buffers.
+ */
+static void callback_ctx_python(struct callback_context *ctx)
+{
+	if (ctx->tstate) {
+		PyEval_RestoreThread(ctx->tstate);
+		ctx->tstate = NULL;
+	}
+}
+
+/*
+ * Check if the user pressed Ctrl+c. The signal is handled by Python, hence
+ * it is only seen by the main thread. Must be called with the GIL held.
+ */
+static bool tc_interrupted(void)
+{
+	if (PyErr_CheckSignals() == 0)
+		return false;
+
+	if (PyErr_ExceptionMatches(PyExc_KeyboardInterrupt))
+		PyErr_Clear();
+
+	return true;
+}
+
+static int call_py_callback(struct callback_context *ctx, PyObject *arglist)
+{
+	unsigned long long t_start = time_now_ns();
+	PyObject *ret;
+
+	ret = PyObject_CallObject((PyObject *)ctx->py_callback, arglist);
+	ctx->stats.python_ns += time_now_ns() - t_start;
+
+	if (!ret) {
+		if (PyErr_Occurred()) {
+			PyObject *err_type, *err_value, *err_traceback;
+
+			PyErr_Fetch(&err_type, &err_value, &err_traceback);
+			if (err_type == PyExc_SystemExit) {
+				if (PyLong_CheckExact(err_value))
+					Py_Exit(PyLong_AsLong(err_value));
+				else
+					Py_Exit(0);
+			} else {
+				PyErr_Restore(err_type, err_value, err_traceback);
+				PyErr_Print();
+			}
+		}
+
+		goto stop;
+	}
+
+	if (PyLong_CheckExact(ret) && PyLong_AsLong(ret) != 0) {
+		Py_DECREF(ret);
+		goto stop;
+	}
+
+	Py_DECREF(ret);
+	return 0;
+
+ stop:
+	ctx->status = false;
+	return 1;
+}
+
+/* Deliver the records accumulated so far to the Python callback. */
+static int batch_flush(struct callback_context *ctx)
+{
+	struct tc_record_batch *batch = ctx->batch;
+	PyObject *arglist;
+	int ret;
+
+	if (!batch || !batch->count)
+		return 0;
+
+	callback_ctx_python(ctx);
+
+	/* The Python object takes the ownership of the batch. */
+	ctx->batch = NULL;
+	batch->tep = tc_tep_ref(ctx->tep);
+	tc_record_batch_finalize(batch);
+
+	arglist = PyTuple_New(1);
+	PyTuple_SetItem(arglist, 0, PyTepRecordBatch_New(batch));
+
+	ret = call_py_callback(ctx, arglist);
+	Py_DECREF(arglist);
+
+	return ret;
+}
+
+/*
+ * Get the arguments of the callback. The objects of the previous call are
+ * reused if nobody else holds references to them.
+ */
+static PyObject *callback_arglist(struct callback_context *ctx,
+				  struct tep_event *event,
+				  struct tep_record *record)
+{
+	PyObject *py_event, *old_event;
+
+	py_event = tc_event_cache_get(&ctx->event_cache, event);
+	if (!py_event)
+		return NULL;
+
+	Py_INCREF(py_event);
+	if (ctx->arglist && Py_REFCNT(ctx->arglist) == 1 &&
+	    Py_REFCNT(ctx->py_record) == 1) {
+		((PyTepRecord *) ctx->py_record)->ptrObj = record;
+		old_event = PyTuple_GET_ITEM(ctx->arglist, 0);
+		PyTuple_SET_ITEM(ctx->arglist, 0, py_event);
+		Py_DECREF(old_event);
+
+		return ctx->arglist;
+	}
+
+	Py_XDECREF(ctx->arglist);
+	ctx->py_record = PyTepRecord_New(record);
+
+	/* The record belongs to the reader, not to the Python object. */
+	((PyTepRecord *) ctx->py_record)->destroy = false;
+	ctx->arglist = PyTuple_New(2);
+	PyTuple_SET_ITEM(ctx->arglist, 0, py_event);
+	PyTuple_SET_ITEM(ctx->arglist, 1, ctx->py_record);
+
+	return ctx->arglist;
+}
+
+/*
+ * The user kept the record passed to the callback. Give the Python object
+ * its own copy of the record. If the record comes from the parallel reader,
+ * the copy holds a reference to the page buffer, so the payload is not
+ * copied.
+ */
+static bool callback_record_detach(struct callback_context *ctx)
+{
+	PyTepRecord *py_record = (PyTepRecord *) ctx->py_record;
+	struct tc_page *page = NULL;
+	struct tep_record *record;
+
+	/* The record got its own copy already (see PyTepRecord_getbuffer()). */
+	if (py_record->destroy)
+		goto done;
+
+	if (ctx->reader)
+		page = tc_reader_page_get(ctx->reader);
+
+	record = tc_record_copy(py_record->ptrObj, page, NULL);
+	if (!record) {
+		MEM_ERROR;
+		PyErr_Print();
+		return false;
+	}
+
+	py_record->ptrObj = record;
+	py_record->destroy = true;
+
+ done:
+	/* The record object cannot be reused any more. */
+	Py_CLEAR(ctx->arglist);
+	ctx->py_record = NULL;
+
+	return true;
+}
+
+/*
+ * Nobody kept the record passed to the callback. The record is freed by
+ * the reader when the callback returns, hence do not leave a dangling
+ * pointer behind.
+ */
+static void callback_record_release(struct callback_context *ctx)
+{
+	PyTepRecord *py_record = (PyTepRecord *) ctx->py_record;
+
+	if (py_record->destroy) {
+		tc_record_destroy(py_record->ptrObj);
+		py_record->destroy = false;
+	}
+
+	py_record->ptrObj = NULL;
+}
+
+static int batch_callback(struct tep_event *event, struct tep_record *record,
+			  struct callback_context *ctx)
+{
+	int size = ctx->batch_size > 0 ? ctx->batch_size :
+					 RECORD_BATCH_INIT_SIZE;
+
+	if (!ctx->batch) {
+		ctx->batch = tc_record_batch_alloc(size);
+		if (!ctx->batch)
+			goto fail;
+	}
+
+	if (!tc_record_batch_add(ctx->batch, event, record))
+		goto fail;
+
+	if (ctx->batch_size > 0 && ctx->batch->count >= ctx->batch_size)
+		return batch_flush(ctx);
+
+	return 0;
+
+ fail:
+	callback_ctx_python(ctx);
+	MEM_ERROR;
+	PyErr_Print();
+	ctx->status = false;
+	return 1;
+}
+
+static int callback(struct tep_event *event, struct tep_record *record,
+		    int cpu, void *ctx_ptr)
+{
+	struct callback_context *ctx = ctx_ptr;
+	PyObject *arglist;
+	int i, ret;
+
+	record->cpu = cpu; // Remove when the bug in libtracefs is fixed.
+
+	/* The format of the event is unknown (see tc_tep_get()). */
+	if (!event)
+		return 0;
+
+	if (ctx->nr_aggs || (ctx->py_callback && !ctx->batch_size))
+		callback_ctx_python(ctx);
+
+	/*
+	 * 'ctx->filter' is a private copy bound for this call only (see
+	 * callback_ctx_init()), hence it can be matched and updated without
+	 * holding the GIL.
+	 */
+	if (ctx->filter && !tc_record_filter_match(ctx->filter, event, record)) {
+		trace_stats_record(&ctx->stats, record, false);
+		return 0;
+	}
+
+	trace_stats_record(&ctx->stats, record, true);
+	for (i = 0; i < ctx->nr_aggs; ++i) {
+		if (!tc_aggregator_update(ctx->aggs[i], event, record)) {
+			MEM_ERROR;
+			ctx->status = false;
+			return 1;
+		}
+	}
+
+	if (!ctx->py_callback)
+		return 0;
+
+	if (ctx->batch_size)
+		return batch_callback(event, record, ctx);
+
+	arglist = callback_arglist(ctx, event, record);
+	if (!arglist) {
+		ctx->status = false;
+		return 1;
+	}
+
+	ret = call_py_callback(ctx, arglist);
+	if (Py_REFCNT(ctx->py_record) > 1) {
+		if (!callback_record_detach(ctx)) {
+			ctx->status = false;
+			return 1;
+		}
 	} else {
-		TfsError_fmt(NULL, "Unknown axis type %s\n");
+		callback_record_release(ctx);
+	}
+
+	return ret;
+}
+
+/* The context takes the ownership of the reference to the tep handle. */
+static bool callback_ctx_init(struct callback_context *ctx,
+			      struct tracefs_instance *instance,
+			      struct tc_tep *tt,
+			      PyObject *py_func, int batch_size,
+			      struct tc_record_filter *filter)
+{
+	ctx->py_callback = py_func;
+	ctx->batch_size = batch_size;
+	ctx->tep = tt;
+	ctx->filter = NULL;
+	if (filter) {
+		ctx->filter = tc_record_filter_bind(filter, tt);
+		if (!ctx->filter)
+			return false;
+	}
+
+	ctx->aggs = NULL;
+	ctx->nr_aggs = 0;
+	ctx->batch = NULL;
+	ctx->arglist = ctx->py_record = NULL;
+	ctx->reader = NULL;
+	ctx->tstate = NULL;
+	memset(&ctx->event_cache, 0, sizeof(ctx->event_cache));
+	ctx->event_cache.tep = tt;
+	(*(volatile bool *)&ctx->status) = true;
+
+	return trace_stats_init(&ctx->stats, instance);
+}
+
+/*
+ * Read all data available in the ring buffers and deliver the records
+ * to the Python callback. Returns false if the iteration must stop.
+ */
+static bool iterate_raw_events(struct tracefs_instance *instance,
+			       struct tep_handle *tep,
+			       struct callback_context *ctx)
+{
+	int ret;
+
+	ctx->tstate = PyEval_SaveThread();
+	ret = tracefs_iterate_raw_events(tep, instance, NULL, 0,
+					 callback, ctx);
+	callback_ctx_python(ctx);
+
+	if (*(volatile bool *)&ctx->status)
+		batch_flush(ctx);
+
+	if (*(volatile bool *)&ctx->status == false || ret < 0)
+		return false;
+
+	return true;
+}
+
+static void callback_ctx_clear(struct callback_context *ctx)
+{
+	tc_record_batch_free(ctx->batch);
+	ctx->batch = NULL;
+	tc_record_filter_unbind(ctx->filter);
+	ctx->filter = NULL;
+	free(ctx->aggs);
+	ctx->aggs = NULL;
+	ctx->nr_aggs = 0;
+	trace_stats_free(&ctx->stats);
+	Py_XDECREF(ctx->arglist);
+	ctx->arglist = ctx->py_record = NULL;
+	tc_event_cache_clear(&ctx->event_cache);
+	tc_tep_put(ctx->tep);
+	ctx->tep = NULL;
+}
+
+/* Release the context and return the statistics of the tracing. */
+static PyObject *callback_ctx_finish(struct callback_context *ctx,
+				     struct tracefs_instance *instance)
+{
+	PyObject *py_stats = NULL;
+
+	if (!PyErr_Occurred())
+		py_stats = trace_stats_to_py(&ctx->stats, instance, true);
+
+	callback_ctx_clear(ctx);
+
+	return py_stats;
+}
+
+static bool notrace_this_pid(struct tracefs_instance *instance)
+{
+	int pid = getpid();
+
+	if (!pid2file(instance, "set_ftrace_notrace_pid", pid, true) ||
+	    !pid2file(instance, "set_event_notrace_pid", pid, true)) {
+		TfsError_setstr(instance,
+			        "Failed to desable tracing for \'this\' process.");
+		return false;
+	}
+
+	return true;
+}
+
+static void iterate_raw_events_waitpid(struct tracefs_instance *instance,
+				       struct tep_handle *tep,
+				       struct callback_context *ctx,
+				       pid_t pid)
+{
+	do {
+		if (!iterate_raw_events(instance, tep, ctx))
+			break;
+	} while (waitpid(pid, NULL, WNOHANG) != pid);
+}
+
+static bool check_batch_size(int batch_size)
+{
+	if (batch_size < -1) {
+		PyErr_Format(TRACECRUNCHER_ERROR,
+			     "Invalid batch size %i.", batch_size);
+		return false;
+	}
+
+	return true;
+}
+
+/* The name of the callback used if no name is given. */
+static const char default_callback[] = "callback";
+
+/*
+ * If the records are aggregated, the callback is optional. Only a callback
+ * that is explicitly given is imported in this case.
+ */
+static const char *get_callback_name(const char *py_callback, PyObject *py_aggs)
+{
+	if (py_callback == default_callback && py_aggs)
+		return NULL;
+
+	return py_callback;
+}
+
+static bool init_callback_tep(struct tracefs_instance *instance,
+			      const char *plugin,
+			      const char *py_callback,
+			      struct tc_tep **tep,
+			      PyObject **py_func)
+{
+	/* No callback is OK, if the records are only aggregated. */
+	*py_func = NULL;
+	if (py_callback) {
+		*py_func = get_callback_func(plugin, py_callback);
+		if (!*py_func)
+			return false;
+	}
+
+	if (!notrace_this_pid(instance))
+		return false;
+
+	*tep = tc_tep_get(instance);
+
+	return *tep != NULL;
+}
+
+/*
+ * Start the program described by the 'argv' list in a child process that
+ * is being traced. Returns the PID of the child or -1 on failure.
+ */
+static pid_t fork_tracing_process(struct tracefs_instance *instance,
+				  PyObject *py_argv)
+{
+	PyObject *py_arg;
+	int i, argc;
+	pid_t pid;
+
+	if (!PyList_CheckExact(py_argv)) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Failed to parse \'argv\' list");
+		return -1;
+	}
+
+	argc = PyList_Size(py_argv);
+
+	pid = fork();
+	if (pid < 0) {
+		PyErr_SetString(TRACECRUNCHER_ERROR, "Failed to fork");
+		return -1;
+	}
+
+	if (pid == 0) {
+		char *argv[argc + 1];
+		char *envp[] = {NULL};
+
+		for (i = 0; i < argc; ++i) {
+			py_arg = PyList_GetItem(py_argv, i);
+			if (!PyUnicode_Check(py_arg))
+				exit(1);
+
+			argv[i] = PyUnicode_DATA(py_arg);
+		}
+		argv[argc] = NULL;
+		start_tracing_procces(instance, argv, envp);
+	}
+
+	return pid;
+}
+
+/* Kill the traced process, if it is still running, and reap it. */
+static void stop_tracing_process(pid_t pid)
+{
+	if (pid <= 0)
+		return;
+
+	if (waitpid(pid, NULL, WNOHANG) == 0) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+}
+
+PyObject *PyFtrace_trace_shell_process(PyObject *self, PyObject *args,
+						       PyObject *kwargs)
+{
+	const char *plugin = "__main__", *py_callback = default_callback;
+	static char *kwlist[] = {"process", "plugin", "callback", "instance",
+				 "batch", "filter", "aggregators", NULL};
+	PyObject *py_inst = NULL, *py_filter = NULL, *py_aggs = NULL;
+	struct callback_context ctx = {0};
+	struct tc_record_filter *filter;
+	struct tracefs_instance *instance;
+	struct tc_tep *tep;
+	int batch_size = 0;
+	PyObject *py_func;
+	char *process;
+	pid_t pid;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "s|szOiOO",
+					 kwlist,
+					 &process,
+					 &plugin,
+					 &py_callback,
+					 &py_inst,
+					 &batch_size,
+					 &py_filter,
+					 &py_aggs)) {
+		return NULL;
+	}
+
+	if (!check_batch_size(batch_size) ||
+	    !get_optional_instance(py_inst, &instance) ||
+	    !get_optional_filter(py_filter, &filter))
+		return NULL;
+
+	if (!init_callback_tep(instance, plugin,
+			       get_callback_name(py_callback, py_aggs),
+			       &tep, &py_func))
+		return NULL;
+
+	if (!callback_ctx_init(&ctx, instance, tep, py_func, batch_size,
+			       filter) ||
+	    !get_optional_aggregators(py_aggs, tep, &ctx.aggs,
+				      &ctx.nr_aggs)) {
+		callback_ctx_clear(&ctx);
+		return NULL;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		PyErr_SetString(TRACECRUNCHER_ERROR, "Failed to fork");
+		callback_ctx_clear(&ctx);
+		return NULL;
+	}
+
+	if (pid == 0) {
+		char *argv[] = {getenv("SHELL"), "-c", process, NULL};
+		char *envp[] = {NULL};
+
+		start_tracing_procces(instance, argv, envp);
+	}
+
+	iterate_raw_events_waitpid(instance, tep->tep, &ctx, pid);
+
+	return callback_ctx_finish(&ctx, instance);
+}
+
+PyObject *PyFtrace_trace_process(PyObject *self, PyObject *args,
+						 PyObject *kwargs)
+{
+	const char *plugin = "__main__", *py_callback = default_callback;
+	static char *kwlist[] = {"argv", "plugin", "callback", "instance",
+				 "batch", "filter", "aggregators", NULL};
+	PyObject *py_inst = NULL, *py_filter = NULL, *py_aggs = NULL;
+	struct callback_context ctx = {0};
+	struct tc_record_filter *filter;
+	struct tracefs_instance *instance;
+	struct tc_tep *tep;
+	PyObject *py_func, *py_argv;
+	int batch_size = 0;
+	pid_t pid;
+
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "O|szOiOO",
+					 kwlist,
+					 &py_argv,
+					 &plugin,
+					 &py_callback,
+					 &py_inst,
+					 &batch_size,
+					 &py_filter,
+					 &py_aggs)) {
+		return NULL;
 	}
 
-	return type;
+	if (!check_batch_size(batch_size) ||
+	    !get_optional_instance(py_inst, &instance) ||
+	    !get_optional_filter(py_filter, &filter))
+		return NULL;
+
+	if (!init_callback_tep(instance, plugin,
+			       get_callback_name(py_callback, py_aggs),
+			       &tep, &py_func))
+		return NULL;
+
+	if (!callback_ctx_init(&ctx, instance, tep, py_func, batch_size,
+			       filter) ||
+	    !get_optional_aggregators(py_aggs, tep, &ctx.aggs,
+				      &ctx.nr_aggs)) {
+		callback_ctx_clear(&ctx);
+		return NULL;
+	}
+
+	pid = fork_tracing_process(instance, py_argv);
+	if (pid < 0) {
+		callback_ctx_clear(&ctx);
+		return NULL;
+	}
+
+	iterate_raw_events_waitpid(instance, tep->tep, &ctx, pid);
+
+	return callback_ctx_finish(&ctx, instance);
 }
 
-static struct tracefs_hist *hist_from_key(struct tep_handle *tep,
-					  const char *system, const char *event,
-					  PyObject *py_key, PyObject * py_type)
+/* How often (in milliseconds) the loops reading the trace check for Ctrl+c. */
+#define READER_WAIT_MS	100
+
+/*
+ * Copy the text available in 'trace_pipe' to the standard output. Waits for
+ * data up to 'timeout' milliseconds. Does not touch Python objects, so it can
+ * be called without holding the GIL. Returns false in case of an error.
+ */
+static bool trace_pipe_print(int fd, char *buf, size_t size, int timeout)
 {
-	struct tracefs_hist *hist = NULL;
-	int type = 0;
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	ssize_t r;
 
-	if (PyUnicode_Check(py_key)) {
-		if (py_type) {
-			type = hist_key_type(py_type);
-			if (type < 0)
-				return NULL;
-		}
+	if (poll(&pfd, 1, timeout) < 0)
+		return errno == EINTR;
 
-		hist = tracefs_hist_alloc(tep, system, event,
-					  PyUnicode_DATA(py_key), type);
-	} else if (PyList_CheckExact(py_key)) {
-		int i, n_keys = PyList_Size(py_key);
-		struct tracefs_hist_axis *axes;
-		PyObject *item_type;
+	while ((r = read(fd, buf, size)) > 0)
+		if (!write_buffer(STDOUT_FILENO, buf, r))
+			return false;
 
-		if (py_type) {
-			/*
-			 * The format of the types have to match the format
-			 * of the keys.
-			 */
-			if (!PyList_CheckExact(py_key) ||
-			    PyList_Size(py_type) != n_keys)
-				return NULL;
-		}
+	return r == 0 || errno == EAGAIN || errno == EINTR;
+}
 
-		axes = calloc(n_keys + 1, sizeof(*axes));
-		if (!axes) {
-			MEM_ERROR
-			return NULL;
-		}
+PyObject *PyFtrace_read_trace(PyObject *self, PyObject *args,
+					      PyObject *kwargs)
+{
+	struct tracefs_instance *instance;
+	struct tc_trace_stats stats;
+	PyObject *py_stats = NULL;
+	char *path, buf[BUFSIZ];
+	bool ok = true;
+	int fd;
 
-		for (i = 0; i < n_keys; ++i) {
-			axes[i].key = tc_str_from_list(py_key, i);
-			if (!axes[i].key)
-				return NULL;
+	if (!get_instance_from_arg(args, kwargs, &instance) ||
+	    !notrace_this_pid(instance) ||
+	    !trace_stats_init(&stats, instance))
+		return NULL;
 
-			if (py_type) {
-				item_type = PyList_GetItem(py_type, i);
-				if (!PyLong_CheckExact(item_type))
-					return NULL;
+	path = tracefs_instance_get_file(instance, "trace_pipe");
+	fd = path ? open(path, O_RDONLY | O_NONBLOCK) : -1;
+	tracefs_put_tracing_file(path);
+	if (fd < 0) {
+		TfsError_fmt(instance,
+			     "Unable to read trace data from instance \'%s\'.",
+			     get_instance_name(instance));
+		goto out;
+	}
 
-				type = hist_key_type(item_type);
-				if (type < 0)
-					return NULL;
+	tracing_ON(instance);
+	while (ok && !tc_interrupted()) {
+		Py_BEGIN_ALLOW_THREADS
+		ok = trace_pipe_print(fd, buf, sizeof(buf), READER_WAIT_MS);
+		Py_END_ALLOW_THREADS
+	}
 
-				axes[i].type = type;
-			}
+	close(fd);
+	if (!ok) {
+		TfsError_fmt(instance,
+			     "Unable to read trace data from instance \'%s\'.",
+			     get_instance_name(instance));
+		goto out;
+	}
+
+	/* The text output is not parsed, hence only the kernel counters. */
+	if (!PyErr_Occurred())
+		py_stats = trace_stats_to_py(&stats, instance, false);
+
+ out:
+	trace_stats_free(&stats);
+
+	return py_stats;
+}
+
+/*
+ * Deliver the records collected by the per-CPU reader threads. The GIL is
+ * released while waiting for data and is taken only to call Python.
+ */
+static void iterate_reader_events(struct tracefs_instance *instance,
+				  struct tc_tep *tt,
+				  bool pin,
+				  struct callback_context *ctx)
+{
+	struct tep_record record;
+	struct tc_reader *reader;
+	struct tep_event *event;
+	int ret;
+
+	reader = tc_reader_alloc(instance, tt->tep, pin ? TC_READER_PIN : 0, 0);
+	if (!reader) {
+		TfsError_fmt(instance,
+			     "Failed to open the ring buffers of instance '%s'.",
+			     get_instance_name(instance));
+		return;
+	}
+
+	if (tc_reader_start(reader) < 0) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Failed to start the reader threads.");
+		goto out;
+	}
+
+	ctx->reader = reader;
+	while (!tc_interrupted()) {
+		Py_BEGIN_ALLOW_THREADS
+		ret = tc_reader_wait(reader, READER_WAIT_MS);
+		Py_END_ALLOW_THREADS
+
+		if (ret < 0)
+			break;
+
+		while (tc_reader_next(reader, &record)) {
+			event = tc_event_by_record(tt, &record);
+			if (!event)
+				continue;
+
+			if (callback(event, &record, record.cpu, ctx))
+				break;
 		}
 
-		hist = tracefs_hist_alloc_nd(tep, system, event, axes);
-		free(axes);
+		if (*(volatile bool *)&ctx->status)
+			batch_flush(ctx);
+
+		if (*(volatile bool *)&ctx->status == false)
+			break;
 	}
 
-	return hist;
+ out:
+	ctx->reader = NULL;
+	Py_BEGIN_ALLOW_THREADS
+	tc_reader_free(reader);
+	Py_END_ALLOW_THREADS
 }
 
-static struct tracefs_hist *hist_from_axis(struct tep_handle *tep,
-					   const char *system, const char *event,
-					   PyObject *py_axes)
+PyObject *PyFtrace_iterate_trace(PyObject *self, PyObject *args,
+					         PyObject *kwargs)
 {
-	struct tracefs_hist *hist = NULL;
-	struct tracefs_hist_axis *axes;
-	PyObject *key, *value;
-	Py_ssize_t i = 0;
-	int n_axes;
+	static char *kwlist[] = {"plugin", "callback", "instance", "batch",
+				 "parallel", "pin", "filter", "aggregators", NULL};
+	PyObject *py_inst = NULL, *py_filter = NULL, *py_aggs = NULL;
+	const char *plugin = "__main__", *py_callback = default_callback;
+	struct callback_context ctx = {0};
+	struct tracefs_instance *instance;
+	struct tc_record_filter *filter;
+	int parallel = false, pin = false;
+	struct tc_tep *tep;
+	int batch_size = 0;
+	PyObject *py_func;
 
-	n_axes = PyDict_Size(py_axes);
-	if (PyErr_Occurred())
+	if (!PyArg_ParseTupleAndKeywords(args,
+					 kwargs,
+					 "|szOippOO",
+					 kwlist,
+					 &plugin,
+					 &py_callback,
+					 &py_inst,
+					 &batch_size,
+					 &parallel,
+					 &pin,
+					 &py_filter,
+					 &py_aggs)) {
 		return NULL;
+	}
 
-	axes = calloc(n_axes + 1, sizeof(*axes));
-	if (!axes) {
-		MEM_ERROR
+	if (!check_batch_size(batch_size) ||
+	    !get_optional_filter(py_filter, &filter))
+		return NULL;
+
+	if (!get_optional_instance(py_inst, &instance) ||
+	    !init_callback_tep(instance, plugin,
+			       get_callback_name(py_callback, py_aggs),
+			       &tep, &py_func))
+		return NULL;
+
+	if (!callback_ctx_init(&ctx, instance, tep, py_func, batch_size,
+			       filter) ||
+	    !get_optional_aggregators(py_aggs, tep, &ctx.aggs,
+				      &ctx.nr_aggs)) {
+		callback_ctx_clear(&ctx);
 		return NULL;
 	}
 
-	while (PyDict_Next(py_axes, &i, &key, &value)) {
-		axes[i - 1].key = PyUnicode_DATA(key);
-		axes[i - 1].type = hist_key_type(value);
-		if (PyErr_Occurred()) {
-			PyErr_Print();
-			free(axes);
-			return NULL;
+	tracing_ON(instance);
+
+	if (parallel) {
+		iterate_reader_events(instance, tep, pin, &ctx);
+	} else {
+		while (!tc_interrupted()) {
+			if (!iterate_raw_events(instance, tep->tep, &ctx))
+				break;
 		}
 	}
 
-	hist = tracefs_hist_alloc_nd(tep, system, event, axes);
-	free(axes);
+	return callback_ctx_finish(&ctx, instance);
+}
 
-	return hist;
+struct tc_stream {
+	/* The Python objects of the instance and the filter (optional). */
+	PyObject		*py_inst;
+	PyObject		*py_filter;
+
+	struct tracefs_instance	*instance;
+	struct tc_tep		*tep;
+	struct tc_reader	*reader;
+
+	/* A copy of the filter, owned by the stream. */
+	struct tc_record_filter	*filter;
+
+	/* The maximum number of records returned by one call of next(). */
+	int			batch_size;
+
+	/* The reader threads are stopped. Only the queued data is returned. */
+	bool			stopped;
+
+	struct tc_trace_stats	stats;
+
+	/* The statistics when the stream was closed. */
+	PyObject		*py_final_stats;
+
+	/* The PyTepEvent objects of the records in the batches. */
+	struct tc_event_cache	event_cache;
+
+	/* Time (in nanoseconds) when the last batch was returned to Python. */
+	unsigned long long	t_return;
+};
+
+void tc_stream_free(struct tc_stream *stream)
+{
+	if (!stream)
+		return;
+
+	if (stream->reader) {
+		Py_BEGIN_ALLOW_THREADS
+		tc_reader_free(stream->reader);
+		Py_END_ALLOW_THREADS
+	}
+
+	trace_stats_free(&stream->stats);
+	tc_event_cache_clear(&stream->event_cache);
+	tc_record_filter_unbind(stream->filter);
+	tc_tep_put(stream->tep);
+	Py_XDECREF(stream->py_inst);
+	Py_XDECREF(stream->py_filter);
+	Py_XDECREF(stream->py_final_stats);
+	free(stream);
 }
 
-PyObject *PyFtrace_hist(PyObject *self, PyObject *args,
-					PyObject *kwargs)
+#define STREAM_DEFAULT_BATCH	1024
+
+PyObject *PyFtrace_stream(PyObject *self, PyObject *args,
+					  PyObject *kwargs)
 {
-	static char *kwlist[] =
-		{"system", "event", "key", "type", "axes", "name", NULL};
-	PyObject *py_axes = NULL, *py_key = NULL, *py_type = NULL;
-	const char *system, *event, *name = NULL;
-	struct tracefs_hist *hist = NULL;
-	struct tep_handle *tep;
+	static char *kwlist[] = {"instance", "batch", "filter", "buffer_pages",
+				 "pin", "threads", NULL};
+	PyObject *py_inst = NULL, *py_filter = NULL, *py_stream;
+	int batch_size = STREAM_DEFAULT_BATCH, pin = false, threads = true;
+	unsigned int buffer_pages = 0;
+	struct tc_record_filter *filter;
+	struct tc_stream *stream;
+	int flags = 0;
 
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "ss|OOOs",
+					 "|OiOIpp",
 					 kwlist,
-					 &system,
-					 &event,
-					 &py_key,
-					 &py_type,
-					 &py_axes,
-					 &name)) {
+					 &py_inst,
+					 &batch_size,
+					 &py_filter,
+					 &buffer_pages,
+					 &pin,
+					 &threads)) {
 		return NULL;
 	}
 
-	tep = get_tep(NULL, NULL);
-	if (!tep)
+	if (pin)
+		flags |= TC_READER_PIN;
+
+	if (!threads)
+		flags |= TC_READER_NO_THREADS;
+
+	if (batch_size <= 0) {
+		PyErr_Format(TRACECRUNCHER_ERROR,
+			     "Invalid batch size %i.", batch_size);
 		return NULL;
+	}
 
-	if (py_key && ! py_axes) {
-		hist = hist_from_key(tep, system, event, py_key, py_type);
-	} else if (!py_key && py_axes) {
-		hist = hist_from_axis(tep, system, event, py_axes);
-	} else {
-		TfsError_setstr(NULL, "'key' or 'axis' must be provided.");
+	stream = calloc(1, sizeof(*stream));
+	if (!stream) {
+		MEM_ERROR;
 		return NULL;
 	}
 
-	if (!hist)
+	stream->batch_size = batch_size;
+	if (!get_optional_instance(py_inst, &stream->instance) ||
+	    !get_optional_filter(py_filter, &filter) ||
+	    !notrace_this_pid(stream->instance))
 		goto fail;
 
-	if (name && tracefs_hist_add_name(hist, name) < 0)
+	/* Keep the instance and the filter alive as long as the stream. */
+	Py_XINCREF(py_inst);
+	stream->py_inst = py_inst;
+	Py_XINCREF(py_filter);
+	stream->py_filter = py_filter;
+
+	stream->tep = tc_tep_get(stream->instance);
+	if (!stream->tep)
 		goto fail;
 
-	return PyTraceHist_New(hist);
+	stream->event_cache.tep = stream->tep;
+	if (filter) {
+		stream->filter = tc_record_filter_bind(filter, stream->tep);
+		if (!stream->filter)
+			goto fail;
+	}
 
- fail:
-	TfsError_fmt(NULL, "Failed to create histogram for %s/%s",
-		     system, event);
-	tracefs_hist_free(hist);
-	return NULL;
-}
+	stream->reader = tc_reader_alloc(stream->instance, stream->tep->tep, flags,
+					 buffer_pages);
+	if (!stream->reader) {
+		TfsError_fmt(stream->instance,
+			     "Failed to open the ring buffers of instance \'%s\'.",
+			     get_instance_name(stream->instance));
+		goto fail;
+	}
 
-PyObject *PyFtrace_synth(PyObject *self, PyObject *args,
-					 PyObject *kwargs)
-{
-	const char *name, *start_match, *end_match, *match_name=NULL;
-	const char *start_sys, *start_evt, *end_sys, *end_evt;
-	static char *kwlist[] = {"name",
-				 "start_sys",
-				 "start_evt",
-				 "end_sys",
-				 "end_evt",
-				 "start_match",
-				 "end_match",
-				 "match_name",
-				 NULL};
-	static struct tracefs_synth *synth;
-	struct tep_handle *tep;
-	PyObject *py_synth;
+	if (!trace_stats_init(&stream->stats, stream->instance))
+		goto fail;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "sssssss|s",
-					 kwlist,
-					 &name,
-					 &start_sys,
-					 &start_evt,
-					 &end_sys,
-					 &end_evt,
-					 &start_match,
-					 &end_match,
-					 &match_name)) {
-		return NULL;
+	tracing_ON(stream->instance);
+	if (tc_reader_start(stream->reader) < 0) {
+		tracing_OFF(stream->instance);
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Failed to start the reader threads.");
+		goto fail;
+	}
+
+	py_stream = PyTraceStream_New(stream);
+	if (!py_stream)
+		goto fail;
+
+	return py_stream;
+
+ fail:
+	tc_stream_free(stream);
+	return NULL;
+}
+
+static bool check_stream(struct tc_stream *stream)
+{
+	if (!stream || !stream->reader) {
+		PyErr_SetString(TRACECRUNCHER_ERROR, "The stream is closed.");
+		return false;
 	}
 
-	tep = get_tep(NULL, NULL);
-	if (!tep)
-		return NULL;
+	return true;
+}
 
-	synth = tracefs_synth_alloc(tep, name,
-				    start_sys, start_evt,
-				    end_sys, end_evt,
-				    start_match, end_match,
-				    match_name);
-	tep_free(tep);
-	if (!synth) {
+/* Move up to 'batch_size' of the queued records into a new batch. */
+static int stream_fill_batch(PyTraceStream *self,
+			     struct tc_record_batch **batch_ptr)
+{
+	struct tc_stream *stream = self->ptrObj;
+	struct tc_record_batch *batch;
+	struct tep_record record;
+	struct tep_event *event;
+
+	if (!stream->stopped && tc_reader_fill(stream->reader) < 0) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Failed to read trace data.");
+		return -1;
+	}
+
+	batch = tc_record_batch_alloc(stream->batch_size);
+	if (!batch) {
 		MEM_ERROR;
-		return NULL;
+		return -1;
 	}
 
-	py_synth = PySynthEvent_New(synth);
-	/*
-	 * Here we only allocated and initializes a synthetic event object.
-	 * However, no synthetic event is added to the system yet. Hence,
-	 * there is no need to 'destroy' this event at exit.
-	 */
-	set_destroy_flag(py_synth, false);
-	return py_synth;
-}
+	while (batch->count < stream->batch_size &&
+	       tc_reader_next(stream->reader, &record)) {
+		event = tc_event_by_record(stream->tep, &record);
+		if (!event)
+			continue;
 
-#define SYNTH_SYS "synthetic"
+		if (stream->filter &&
+		    !tc_record_filter_match(stream->filter, event, &record)) {
+			trace_stats_record(&stream->stats, &record, false);
+			continue;
+		}
 
-static bool enable_synth(PySynthEvent *self, PyObject *args, PyObject *kwargs,
-			 bool enable)
-{
-	struct tracefs_instance *instance;
+		trace_stats_record(&stream->stats, &record, true);
+		if (!tc_record_batch_add(batch, event, &record)) {
+			tc_record_batch_free(batch);
+			MEM_ERROR;
+			return -1;
+		}
+	}
 
-	if (!get_instance_from_arg(args, kwargs, &instance))
-		return NULL;
+	*batch_ptr = batch;
 
-	return event_enable_disable(instance, SYNTH_SYS,
-				    tracefs_synth_get_name(self->ptrObj),
-				    enable);
+	return batch->count;
 }
 
-PyObject *PySynthEvent_enable(PySynthEvent *self, PyObject *args,
-						  PyObject *kwargs)
+/*
+ * The time between returning a batch and the next call of the stream is
+ * accounted as time spent in Python.
+ */
+static void stream_enter(struct tc_stream *stream)
 {
-	if (!enable_synth(self, args, kwargs, true))
-		return NULL;
-
-	Py_RETURN_NONE;
+	if (stream->t_return)
+		stream->stats.python_ns += time_now_ns() - stream->t_return;
 }
 
-PyObject *PySynthEvent_disable(PySynthEvent *self, PyObject *args,
-						   PyObject *kwargs)
+static void stream_leave(struct tc_stream *stream)
 {
-	if (!enable_synth(self, args, kwargs, false))
-		return NULL;
-
-	Py_RETURN_NONE;
+	stream->t_return = time_now_ns();
 }
 
-PyObject *PySynthEvent_is_enabled(PySynthEvent *self, PyObject *args,
-						      PyObject *kwargs)
+static PyObject *stream_batch_to_py(PyTraceStream *self,
+				    struct tc_record_batch *batch)
 {
-	struct tracefs_instance *instance;
-
-	if (!get_instance_from_arg(args, kwargs, &instance))
-		return NULL;
+	/* The batch keeps the stream (and its tep handle) alive. */
+	Py_INCREF(self);
+	batch->owner = (PyObject *) self;
+	batch->event_cache = &self->ptrObj->event_cache;
+	batch->tep = tc_tep_ref(self->ptrObj->tep);
+	tc_record_batch_finalize(batch);
+	stream_leave(self->ptrObj);
 
-	return event_is_enabled(instance, SYNTH_SYS,
-				tracefs_synth_get_name(self->ptrObj));
+	return PyTepRecordBatch_New(batch);
 }
 
-struct tep_event *synth_get_event(PySynthEvent *event, struct tep_handle **tep_ptr)
+PyObject *PyTraceStream_next(PyTraceStream *self)
 {
-	struct tep_event *tep_evt;
-	struct tep_handle *tep;
+	struct tc_stream *stream = self->ptrObj;
+	struct tc_record_batch *batch;
+	int ret;
 
-	tep = get_tep(NULL, NULL);
-	if (!tep)
+	/* The iteration over a closed stream is over. */
+	if (stream && !stream->reader)
 		return NULL;
 
-	tep_evt = tracefs_synth_get_event(tep, event->ptrObj);
-	if (!tep_evt) {
-		TfsError_setstr(NULL, "Failed to get synth. event.");
+	if (!check_stream(stream))
 		return NULL;
-	}
 
-	if (tep_ptr)
-		*tep_ptr = tep;
+	stream_enter(stream);
+	while (true) {
+		ret = stream_fill_batch(self, &batch);
+		if (ret < 0)
+			return NULL;
 
-	return tep_evt;
-}
+		if (ret > 0)
+			break;
 
-PyObject *PySynthEvent_set_filter(PySynthEvent *self, PyObject *args,
-						      PyObject *kwargs)
-{
-	struct tep_handle *tep;
-	struct tep_event *evt;
+		tc_record_batch_free(batch);
 
-	evt = synth_get_event(self, &tep);
-	if (!evt)
-		return NULL;
+		/* Nothing is queued and nothing else is coming. */
+		if (stream->stopped)
+			return NULL;
+
+		Py_BEGIN_ALLOW_THREADS
+		ret = tc_reader_wait(stream->reader, READER_WAIT_MS);
+		Py_END_ALLOW_THREADS
+
+		if (ret < 0) {
+			PyErr_SetString(TRACECRUNCHER_ERROR,
+					"Failed to wait for trace data.");
+			return NULL;
+		}
+
+		/* Allow Ctrl+c (KeyboardInterrupt) while waiting. */
+		if (PyErr_CheckSignals() < 0)
+			return NULL;
+	}
 
-	return set_filter(args, kwargs, tep, evt);
+	return stream_batch_to_py(self, batch);
 }
 
-PyObject *PySynthEvent_get_filter(PySynthEvent *self, PyObject *args,
-						      PyObject *kwargs)
+PyObject *PyTraceStream_read_batch(PyTraceStream *self)
 {
-	struct tep_event *evt = synth_get_event(self, NULL);
+	struct tc_stream *stream = self->ptrObj;
+	struct tc_record_batch *batch;
+	int ret;
 
-	if (!evt)
+	if (!check_stream(stream))
 		return NULL;
 
-	return get_filter(args, kwargs, SYNTH_SYS, evt->name);
+	stream_enter(stream);
+	ret = stream_fill_batch(self, &batch);
+	if (ret < 0)
+		return NULL;
+
+	if (ret == 0) {
+		tc_record_batch_free(batch);
+		stream_leave(stream);
+		if (stream->stopped) {
+			PyErr_SetNone(PyExc_StopIteration);
+			return NULL;
+		}
+
+		Py_RETURN_NONE;
+	}
+
+	return stream_batch_to_py(self, batch);
 }
 
-PyObject *PySynthEvent_clear_filter(PySynthEvent *self, PyObject *args,
-							PyObject *kwargs)
+PyObject *PyTraceStream_fileno(PyTraceStream *self)
 {
-	struct tep_event *evt = synth_get_event(self, NULL);
+	struct tc_stream *stream = self->ptrObj;
 
-	if (!evt)
+	if (!check_stream(stream))
 		return NULL;
 
-	return clear_filter(args, kwargs, evt);
+	return PyLong_FromLong(tc_reader_fd(stream->reader));
 }
 
-PyObject *PyFtrace_set_ftrace_loglevel(PyObject *self, PyObject *args,
-						       PyObject *kwargs)
+PyObject *PyTraceStream_stop(PyTraceStream *self)
 {
-	static char *kwlist[] = {"level", NULL};
-	int level;
+	struct tc_stream *stream = self->ptrObj;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "i",
-					 kwlist,
-					 &level)) {
+	if (!check_stream(stream))
 		return NULL;
-	}
-
-	if (level > TEP_LOG_ALL)
-		level = TEP_LOG_ALL;
 
-	if (level < 0)
-		level = 0;
+	Py_BEGIN_ALLOW_THREADS
+	tc_reader_stop(stream->reader);
+	Py_END_ALLOW_THREADS
 
-	tracefs_set_loglevel(level);
-	tep_set_loglevel(level);
+	stream->stopped = true;
 
 	Py_RETURN_NONE;
 }
 
-static bool set_fork_options(struct tracefs_instance *instance, bool enable)
+PyObject *PyTraceStream_resume(PyTraceStream *self)
 {
-	if (enable) {
-		if (tracefs_option_enable(instance, TRACEFS_OPTION_EVENT_FORK) < 0 ||
-		    tracefs_option_enable(instance, TRACEFS_OPTION_FUNCTION_FORK) < 0)
-			return false;
-	} else {
-		if (tracefs_option_disable(instance, TRACEFS_OPTION_EVENT_FORK) < 0 ||
-		    tracefs_option_disable(instance, TRACEFS_OPTION_FUNCTION_FORK) < 0)
-			return false;
+	struct tc_stream *stream = self->ptrObj;
+
+	if (!check_stream(stream))
+		return NULL;
+
+	if (stream->stopped) {
+		if (tc_reader_start(stream->reader) < 0) {
+			PyErr_SetString(TRACECRUNCHER_ERROR,
+					"Failed to start the reader threads.");
+			return NULL;
+		}
+
+		stream->stopped = false;
 	}
 
-	return true;
+	Py_RETURN_NONE;
 }
 
-static bool hook2pid(struct tracefs_instance *instance, PyObject *pid_val, int fork)
+PyObject *PyTraceStream_stats(PyTraceStream *self)
 {
-	if (!set_pid(instance, "set_ftrace_pid", pid_val) ||
-	    !set_pid(instance, "set_event_pid", pid_val))
-		goto fail;
-
-	if (fork < 0)
-		return true;
+	struct tc_stream *stream = self->ptrObj;
 
-	if (!set_fork_options(instance, fork))
-		goto fail;
+	if (stream && stream->py_final_stats)
+		return PyDict_Copy(stream->py_final_stats);
 
-	return true;
+	if (!check_stream(stream))
+		return NULL;
 
- fail:
-	TfsError_setstr(instance, "Failed to hook to PID");
-	PyErr_Print();
-	return false;
+	return trace_stats_to_py(&stream->stats, stream->instance, true);
 }
 
-static void start_tracing_procces(struct tracefs_instance *instance,
-				  char *const *argv,
-				  char *const *envp)
+PyObject *PyTraceStream_close(PyTraceStream *self)
 {
-	PyObject *pid_val = PyList_New(1);
+	struct tc_stream *stream = self->ptrObj;
 
-	PyList_SET_ITEM(pid_val, 0, PyLong_FromLong(getpid()));
-	if (!hook2pid(instance, pid_val, true))
-		exit(1);
+	if (stream && stream->reader) {
+		Py_BEGIN_ALLOW_THREADS
+		tc_reader_free(stream->reader);
+		Py_END_ALLOW_THREADS
 
-	tracing_ON(instance);
-	if (execvpe(argv[0], argv, envp) < 0) {
-		TfsError_fmt(instance, "Failed to exec \'%s\'",
-			     argv[0]);
+		stream->reader = NULL;
+		stream->stopped = true;
+
+		/* Keep the statistics readable. */
+		stream->py_final_stats = trace_stats_to_py(&stream->stats,
+							   stream->instance,
+							   true);
+		if (!stream->py_final_stats)
+			return NULL;
 	}
 
-	exit(1);
+	Py_RETURN_NONE;
 }
 
-static PyObject *get_callback_func(const char *plugin_name, const char * py_callback)
+static void free_array_data(PyObject *capsule)
 {
-	PyObject *py_name, *py_module, *py_func;
+	free(PyCapsule_GetPointer(capsule, NULL));
+}
 
-	py_name = PyUnicode_FromString(plugin_name);
-	py_module = PyImport_Import(py_name);
-	if (!py_module) {
-		PyErr_Format(TRACECRUNCHER_ERROR,
-			     "Failed to import plugin \'%s\'",
-			     plugin_name);
+/*
+ * Wrap a malloc'ed buffer into a NumPy array without copying the data.
+ * The array takes the ownership of the buffer.
+ */
+static PyObject *tc_array_from_buffer(void *data, npy_intp size, int type)
+{
+	PyObject *array, *capsule;
+
+	array = PyArray_SimpleNewFromData(1, &size, type, data);
+	if (!array) {
+		free(data);
 		return NULL;
 	}
 
-	py_func = PyObject_GetAttrString(py_module, py_callback);
-	if (!py_func || !PyCallable_Check(py_func)) {
-		PyErr_Format(TRACECRUNCHER_ERROR,
-			     "Failed to import callback from \'%s\'",
-			     plugin_name);
+	capsule = PyCapsule_New(data, NULL, free_array_data);
+	if (!capsule) {
+		free(data);
+		Py_DECREF(array);
 		return NULL;
 	}
 
-	return py_func;
+	/* The array steals the reference to the capsule, even on failure. */
+	if (PyArray_SetBaseObject((PyArrayObject *) array, capsule) < 0) {
+		Py_DECREF(array);
+		return NULL;
+	}
+
+	return array;
 }
 
-struct callback_context {
-	void	*py_callback;
+/* Used to mark the rows of events that do not have a given field. */
+#define TC_NO_FIELD_VALUE	INT64_MIN
 
-	bool	status;
-} callback_ctx;
+struct collect_field {
+	/* The column to be filled. */
+	int				column;
 
-static int callback(struct tep_event *event, struct tep_record *record,
-		    int cpu, void *ctx_ptr)
+	/* The field of the event. */
+	struct tep_format_field		*field;
+};
+
+struct collect_plan {
+	int			nr_fields;
+	struct collect_field	*fields;
+};
+
+struct collect_context {
+	struct tc_tep		*tep;
+
+	/* Number of records collected. */
+	size_t			count;
+
+	/* Allocated size of the columns. */
+	size_t			size;
+
+	/* Maximum number of records to collect. Zero means no limit. */
+	size_t			max_records;
+
+	int16_t			*event;
+	int16_t			*cpu;
+	int32_t			*pid;
+	uint64_t		*time;
+
+	/* User-chosen numeric fields, named "system/event/field". */
+	int			nr_columns;
+	char			**column_names;
+	int64_t			**columns;
+
+	/* Fields to be decoded for each event. Indexed by event Id. */
+	int			nr_plans;
+	struct collect_plan	*plans;
+
+	struct tc_trace_stats	stats;
+
+	bool			status;
+
+	bool			mem_error;
+};
+
+static void collect_ctx_free(struct collect_context *ctx)
 {
-	struct callback_context *ctx = ctx_ptr;
-	PyObject *ret;
+	int i;
 
-	record->cpu = cpu; // Remove when the bug in libtracefs is fixed.
+	free(ctx->event);
+	free(ctx->cpu);
+	free(ctx->pid);
+	free(ctx->time);
+	for (i = 0; i < ctx->nr_columns; ++i)
+		free(ctx->columns[i]);
 
-	PyObject *py_tep_event = PyTepEvent_New(event);
-	PyObject *py_tep_record = PyTepRecord_New(record);
+	free(ctx->columns);
+	for (i = 0; i < ctx->nr_columns; ++i)
+		free(ctx->column_names[i]);
 
-	PyObject *arglist = PyTuple_New(2);
-	PyTuple_SetItem(arglist, 0, py_tep_event);
-	PyTuple_SetItem(arglist, 1, py_tep_record);
+	free(ctx->column_names);
+	for (i = 0; i < ctx->nr_plans; ++i)
+		free(ctx->plans[i].fields);
 
-	ret = PyObject_CallObject((PyObject *)ctx->py_callback, arglist);
-	Py_DECREF(arglist);
+	free(ctx->plans);
+	trace_stats_free(&ctx->stats);
+	tc_tep_put(ctx->tep);
+}
 
-	if (!ret) {
-		if (PyErr_Occurred()) {
-			PyObject *err_type, *err_value, *err_traceback;
+#define COLLECT_INIT_SIZE	(64 * 1024)
 
-			PyErr_Fetch(&err_type, &err_value, &err_traceback);
-			if (err_type == PyExc_SystemExit) {
-				if (PyLong_CheckExact(err_value))
-					Py_Exit(PyLong_AsLong(err_value));
-				else
-					Py_Exit(0);
-			} else {
-				PyErr_Restore(err_type, err_value, err_traceback);
-				PyErr_Print();
-			}
-		}
+static bool collect_resize(struct collect_context *ctx, size_t size)
+{
+	void *tmp;
+	int i;
+
+#define COLLECT_RESIZE(array)					\
+	tmp = realloc(array, (size ? size : 1) * sizeof(*array));	\
+	if (!tmp)						\
+		return false;					\
+	array = tmp;
+
+	COLLECT_RESIZE(ctx->event)
+	COLLECT_RESIZE(ctx->cpu)
+	COLLECT_RESIZE(ctx->pid)
+	COLLECT_RESIZE(ctx->time)
+	for (i = 0; i < ctx->nr_columns; ++i) {
+		COLLECT_RESIZE(ctx->columns[i])
+	}
+
+#undef COLLECT_RESIZE
+
+	ctx->size = size;
+
+	return true;
+}
+
+static int collect_column(struct collect_context *ctx,
+			  struct tep_event *event,
+			  const char *field_name)
+{
+	char **names, *name;
+	int i;
+
+	if (asprintf(&name, "%s/%s/%s",
+		     event->system, event->name, field_name) <= 0)
+		return -1;
 
-		goto stop;
+	for (i = 0; i < ctx->nr_columns; ++i) {
+		if (strcmp(ctx->column_names[i], name) == 0) {
+			free(name);
+			return i;
+		}
 	}
 
-	if (PyLong_CheckExact(ret) && PyLong_AsLong(ret) != 0) {
-		Py_DECREF(ret);
-		goto stop;
+	names = realloc(ctx->column_names,
+			(ctx->nr_columns + 1) * sizeof(*names));
+	if (!names) {
+		free(name);
+		return -1;
 	}
 
-	Py_DECREF(ret);
-	return 0;
+	ctx->column_names = names;
+	ctx->column_names[ctx->nr_columns] = name;
 
- stop:
-	ctx->status = false;
-	return 1;
+	return ctx->nr_columns++;
 }
 
-static bool notrace_this_pid(struct tracefs_instance *instance)
+static bool collect_add_field(struct collect_context *ctx,
+			      struct tep_event *event,
+			      const char *field_name)
 {
-	int pid = getpid();
+	struct tep_format_field *field;
+	struct collect_plan *plan;
+	struct collect_field *tmp;
+	int column;
 
-	if (!pid2file(instance, "set_ftrace_notrace_pid", pid, true) ||
-	    !pid2file(instance, "set_event_notrace_pid", pid, true)) {
-		TfsError_setstr(instance,
-			        "Failed to desable tracing for \'this\' process.");
+	field = tep_find_any_field(event, field_name);
+	if (!field) {
+		PyErr_Format(TEP_ERROR,
+			     "Failed to find field \'%s\' in event \'%s\'",
+			     field_name, event->name);
 		return false;
 	}
 
-	return true;
-}
+	if (!is_number(field) ||
+	    field->flags & (TEP_FIELD_IS_STRING | TEP_FIELD_IS_DYNAMIC |
+			    TEP_FIELD_IS_ARRAY)) {
+		PyErr_Format(TEP_ERROR,
+			     "Field \'%s\' of event \'%s\' is not a number.",
+			     field_name, event->name);
+		return false;
+	}
 
-static void iterate_raw_events_waitpid(struct tracefs_instance *instance,
-				       struct tep_handle *tep,
-				       PyObject *py_func,
-				       pid_t pid)
-{
-	bool *callback_status = &callback_ctx.status;
-	int ret;
+	if (event->id >= ctx->nr_plans) {
+		struct collect_plan *plans;
 
-	callback_ctx.py_callback = py_func;
-	(*(volatile bool *)callback_status) = true;
-	do {
-		ret = tracefs_iterate_raw_events(tep, instance, NULL, 0,
-						 callback, &callback_ctx);
+		plans = realloc(ctx->plans, (event->id + 1) * sizeof(*plans));
+		if (!plans)
+			goto fail;
 
-		if (*(volatile bool *)callback_status == false || ret < 0)
-			break;
-	} while (waitpid(pid, NULL, WNOHANG) != pid);
+		memset(plans + ctx->nr_plans, 0,
+		       (event->id + 1 - ctx->nr_plans) * sizeof(*plans));
+		ctx->plans = plans;
+		ctx->nr_plans = event->id + 1;
+	}
+
+	column = collect_column(ctx, event, field_name);
+	if (column < 0)
+		goto fail;
+
+	plan = &ctx->plans[event->id];
+	tmp = realloc(plan->fields, (plan->nr_fields + 1) * sizeof(*tmp));
+	if (!tmp)
+		goto fail;
+
+	plan->fields = tmp;
+	plan->fields[plan->nr_fields].column = column;
+	plan->fields[plan->nr_fields].field = field;
+	++plan->nr_fields;
+
+	return true;
+
+ fail:
+	MEM_ERROR;
+	return false;
 }
 
-static bool init_callback_tep(struct tracefs_instance *instance,
-			      const char *plugin,
-			      const char *py_callback,
-			      struct tep_handle **tep,
-			      PyObject **py_func)
+/*
+ * Parse a dictionary of fields to be decoded. The keys are the names of the
+ * events ('system/event') and the values are lists of field names.
+ */
+static bool collect_init_fields(struct collect_context *ctx,
+				PyObject *py_fields)
 {
-	*py_func = get_callback_func(plugin, py_callback);
-	if (!*py_func)
-		return false;
+	PyObject *py_key, *py_list;
+	struct tep_event *event;
+	const char *event_name;
+	Py_ssize_t pos = 0;
+	const char *name;
+	char *system;
+	int i, n;
 
-	*tep = get_tep(tracefs_instance_get_dir(instance), NULL);
-	if (!*tep)
+	if (!PyDict_CheckExact(py_fields)) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Argument \'fields\' must be a dictionary.");
 		return false;
+	}
 
-	if (!notrace_this_pid(instance))
+	while (PyDict_Next(py_fields, &pos, &py_key, &py_list)) {
+		name = PyUnicode_Check(py_key) ? PyUnicode_AsUTF8(py_key) : NULL;
+		if (!name || !PyList_CheckExact(py_list)) {
+			PyErr_SetString(TRACECRUNCHER_ERROR,
+					"Inconsistent \'fields\' argument.");
+			return false;
+		}
+
+		if (!split_event_name(name, &system, &event_name))
+			return false;
+
+		event = tc_event_by_name(ctx->tep, system, event_name);
+		free(system);
+		if (!event) {
+			PyErr_Format(TEP_ERROR, "Failed to find event \'%s\'",
+				     name);
+			return false;
+		}
+
+		n = PyList_Size(py_list);
+		for (i = 0; i < n; ++i) {
+			name = tc_str_from_list(py_list, i);
+			if (!name) {
+				PyErr_SetString(TRACECRUNCHER_ERROR,
+						"Inconsistent \'fields\' argument.");
+				return false;
+			}
+
+			if (!collect_add_field(ctx, event, name))
+				return false;
+		}
+	}
+
+	ctx->columns = calloc(ctx->nr_columns ? ctx->nr_columns : 1,
+			      sizeof(*ctx->columns));
+	if (!ctx->columns) {
+		MEM_ERROR;
 		return false;
+	}
 
 	return true;
 }
 
-PyObject *PyFtrace_trace_shell_process(PyObject *self, PyObject *args,
-						       PyObject *kwargs)
+static int collect_callback(struct tep_event *event, struct tep_record *record,
+			    int cpu, void *ctx_ptr)
 {
-	const char *plugin = "__main__", *py_callback = "callback";
-	static char *kwlist[] = {"process", "plugin", "callback", "instance", NULL};
-	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	struct tep_handle *tep;
-	PyObject *py_func;
-	char *process;
-	pid_t pid;
+	struct collect_context *ctx = ctx_ptr;
+	struct collect_plan *plan;
+	size_t row = ctx->count;
+	int i;
 
-	if (!PyArg_ParseTupleAndKeywords(args,
-					 kwargs,
-					 "s|ssO",
-					 kwlist,
-					 &process,
-					 &plugin,
-					 &py_callback,
-					 &py_inst)) {
-		return NULL;
+	if (row == ctx->size && !collect_resize(ctx, 2 * ctx->size)) {
+		ctx->mem_error = true;
+		ctx->status = false;
+		return 1;
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
-		return NULL;
+	record->cpu = cpu;
+	trace_stats_record(&ctx->stats, record, true);
 
-	if (!init_callback_tep(instance, plugin, py_callback, &tep, &py_func))
-		return NULL;
+	ctx->event[row] = event->id;
+	ctx->cpu[row] = cpu;
+	ctx->pid[row] = tep_data_pid(ctx->tep->tep, record);
+	ctx->time[row] = record->ts;
 
-	pid = fork();
-	if (pid < 0) {
-		PyErr_SetString(TRACECRUNCHER_ERROR, "Failed to fork");
+	for (i = 0; i < ctx->nr_columns; ++i)
+		ctx->columns[i][row] = TC_NO_FIELD_VALUE;
+
+	if (event->id < ctx->nr_plans) {
+		plan = &ctx->plans[event->id];
+		for (i = 0; i < plan->nr_fields; ++i)
+			ctx->columns[plan->fields[i].column][row] =
+				read_number_field(plan->fields[i].field,
+						  record->data);
+	}
+
+	++ctx->count;
+	if (ctx->max_records && ctx->count >= ctx->max_records) {
+		ctx->status = false;
+		return 1;
+	}
+
+	return 0;
+}
+
+static PyObject *collect_to_dict(struct collect_context *ctx)
+{
+	npy_intp size = ctx->count;
+	PyObject *data, *array;
+	int i;
+
+	/* Release the memory that is not used. */
+	if (!collect_resize(ctx, ctx->count)) {
+		MEM_ERROR;
 		return NULL;
 	}
 
-	if (pid == 0) {
-		char *argv[] = {getenv("SHELL"), "-c", process, NULL};
-		char *envp[] = {NULL};
+	data = PyDict_New();
 
-		start_tracing_procces(instance, argv, envp);
+#define COLLECT_ADD_COLUMN(name, array_ptr, type)		\
+	array = tc_array_from_buffer(array_ptr, size, type);	\
+	array_ptr = NULL;					\
+	if (!array)						\
+		goto fail;					\
+	PyDict_SetItemString(data, name, array);		\
+	Py_DECREF(array);
+
+	COLLECT_ADD_COLUMN("event", ctx->event, NPY_INT16)
+	COLLECT_ADD_COLUMN("cpu", ctx->cpu, NPY_INT16)
+	COLLECT_ADD_COLUMN("pid", ctx->pid, NPY_INT32)
+	COLLECT_ADD_COLUMN("time", ctx->time, NPY_UINT64)
+	for (i = 0; i < ctx->nr_columns; ++i) {
+		COLLECT_ADD_COLUMN(ctx->column_names[i], ctx->columns[i],
+				   NPY_INT64)
 	}
 
-	iterate_raw_events_waitpid(instance, tep, py_func, pid);
+#undef COLLECT_ADD_COLUMN
 
-	Py_RETURN_NONE;
+	return data;
+
+ fail:
+	Py_DECREF(data);
+	return NULL;
 }
 
-PyObject *PyFtrace_trace_process(PyObject *self, PyObject *args,
+PyObject *PyFtrace_collect_trace(PyObject *self, PyObject *args,
 						 PyObject *kwargs)
 {
-	const char *plugin = "__main__", *py_callback = "callback";
-	static char *kwlist[] = {"argv", "plugin", "callback", "instance", NULL};
+	static char *kwlist[] = {"fields", "instance", "argv", "max_records",
+				 "time", "stats", NULL};
+	struct collect_context ctx = {0};
 	struct tracefs_instance *instance;
-	PyObject *py_inst = NULL;
-	struct tep_handle *tep;
-	PyObject *py_func, *py_argv, *py_arg;
-	pid_t pid;
-	int i, argc;
+	unsigned long long max_records = 0;
+	PyObject *py_fields = NULL, *py_argv = NULL, *py_inst = NULL;
+	PyObject *data = NULL, *py_stats, *ret_val;
+	unsigned long long t_end = 0;
+	unsigned int time = 0;
+	int stats = false;
+	pid_t pid = 0;
+	int ret;
 
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "O|ssO",
+					 "|OOOKIp",
 					 kwlist,
+					 &py_fields,
+					 &py_inst,
 					 &py_argv,
-					 &plugin,
-					 &py_callback,
-					 &py_inst)) {
+					 &max_records,
+					 &time,
+					 &stats)) {
 		return NULL;
 	}
 
-	if (!get_optional_instance(py_inst, &instance))
-		return NULL;
-
-	if (!init_callback_tep(instance, plugin, py_callback, &tep, &py_func))
+	if (!get_optional_instance(py_inst, &instance) ||
+	    !notrace_this_pid(instance))
 		return NULL;
 
-	if (!PyList_CheckExact(py_argv)) {
-		PyErr_SetString(TRACECRUNCHER_ERROR,
-				"Failed to parse \'argv\' list");
+	ctx.tep = tc_tep_get(instance);
+	if (!ctx.tep)
 		return NULL;
-	}
 
-	argc = PyList_Size(py_argv);
+	ctx.max_records = max_records;
+	if ((py_fields && !collect_init_fields(&ctx, py_fields)) ||
+	    !collect_resize(&ctx, COLLECT_INIT_SIZE)) {
+		if (!PyErr_Occurred())
+			MEM_ERROR;
 
-	pid = fork();
-	if (pid < 0) {
-		PyErr_SetString(TRACECRUNCHER_ERROR, "Failed to fork");
-		return NULL;
+		goto out;
 	}
 
-	if (pid == 0) {
-		char *argv[argc + 1];
-		char *envp[] = {NULL};
-
-		for (i = 0; i < argc; ++i) {
-			py_arg = PyList_GetItem(py_argv, i);
-			if (!PyUnicode_Check(py_arg))
-				return NULL;
+	if (!trace_stats_init(&ctx.stats, instance))
+		goto out;
 
-			argv[i] = PyUnicode_DATA(py_arg);
-		}
-		argv[argc] = NULL;
-		start_tracing_procces(instance, argv, envp);
+	if (py_argv) {
+		pid = fork_tracing_process(instance, py_argv);
+		if (pid < 0)
+			goto out;
+	} else {
+		tracing_ON(instance);
 	}
 
-	iterate_raw_events_waitpid(instance, tep, py_func, pid);
+	if (time)
+		t_end = time_now_ms() + time;
 
-	Py_RETURN_NONE;
-}
+	/* The records are collected natively, without holding the GIL. */
+	(*(volatile bool *)&ctx.status) = true;
+	while (!tc_interrupted()) {
+		Py_BEGIN_ALLOW_THREADS
+		ret = tracefs_iterate_raw_events(ctx.tep->tep, instance, NULL, 0,
+						 collect_callback, &ctx);
+		Py_END_ALLOW_THREADS
 
-static struct tracefs_instance *pipe_instance;
+		if (*(volatile bool *)&ctx.status == false || ret < 0)
+			break;
 
-static void pipe_stop(int sig)
-{
-	tracefs_trace_pipe_stop(pipe_instance);
-}
+		if (t_end && time_now_ms() >= t_end)
+			break;
 
-PyObject *PyFtrace_read_trace(PyObject *self, PyObject *args,
-					      PyObject *kwargs)
-{
-	signal(SIGINT, pipe_stop);
+		if (pid > 0 && waitpid(pid, NULL, WNOHANG) == pid) {
+			pid = 0;
+			break;
+		}
+	}
 
-	if (!get_instance_from_arg(args, kwargs, &pipe_instance) ||
-	    !notrace_this_pid(pipe_instance))
-		return NULL;
+	if (PyErr_Occurred())
+		goto out;
 
-	tracing_ON(pipe_instance);
-	if (tracefs_trace_pipe_print(pipe_instance, 0) < 0) {
-		TfsError_fmt(pipe_instance,
-			     "Unable to read trace data from instance \'%s\'.",
-			     get_instance_name(pipe_instance));
-		return NULL;
+	if (ctx.mem_error) {
+		MEM_ERROR;
+		goto out;
 	}
 
-	signal(SIGINT, SIG_DFL);
-	Py_RETURN_NONE;
-}
+	data = collect_to_dict(&ctx);
+	if (data && stats) {
+		py_stats = trace_stats_to_py(&ctx.stats, instance, true);
+		ret_val = py_stats ? PyTuple_Pack(2, data, py_stats) : NULL;
+		Py_DECREF(data);
+		Py_XDECREF(py_stats);
+		data = ret_val;
+	}
 
-struct tracefs_instance *itr_instance;
-static bool iterate_keep_going;
+ out:
+	stop_tracing_process(pid);
+	collect_ctx_free(&ctx);
 
-static void iterate_stop(int sig)
-{
-	iterate_keep_going = false;
-	tracefs_trace_pipe_stop(itr_instance);
+	return data;
 }
 
-PyObject *PyFtrace_iterate_trace(PyObject *self, PyObject *args,
-					         PyObject *kwargs)
+/* How often (in milliseconds) the recording checks if it must stop. */
+#define RECORD_WAIT_MS	50
+
+PyObject *PyFtrace_record(PyObject *self, PyObject *args,
+					  PyObject *kwargs)
 {
-	static char *kwlist[] = {"plugin", "callback", "instance", NULL};
-	const char *plugin = "__main__", *py_callback = "callback";
-	bool *callback_status = &callback_ctx.status;
-	bool *keep_going = &iterate_keep_going;
-	PyObject *py_inst = NULL;
-	struct tep_handle *tep;
-	PyObject *py_func;
+	static char *kwlist[] = {"output_file", "instance", "argv", "time", NULL};
+	PyObject *py_inst = NULL, *py_argv = NULL, *py_stats = NULL;
+	struct tc_trace_stats stats = {0};
+	struct tracefs_instance *instance;
+	struct tc_recorder *recorder;
+	unsigned long long t_end = 0;
+	const char *output_file;
+	unsigned int time = 0;
+	pid_t pid = 0;
 	int ret;
 
-	(*(volatile bool *)keep_going) = true;
-	signal(SIGINT, iterate_stop);
-
 	if (!PyArg_ParseTupleAndKeywords(args,
 					 kwargs,
-					 "|ssO",
+					 "s|OOI",
 					 kwlist,
-					 &plugin,
-					 &py_callback,
-					 &py_inst)) {
+					 &output_file,
+					 &py_inst,
+					 &py_argv,
+					 &time)) {
 		return NULL;
 	}
 
-	py_func = get_callback_func(plugin, py_callback);
-	if (!py_func ||
-	    !get_optional_instance(py_inst, &itr_instance) ||
-	    !notrace_this_pid(itr_instance))
+	if (!get_optional_instance(py_inst, &instance) ||
+	    !notrace_this_pid(instance))
 		return NULL;
 
-	tep = get_tep(tracefs_instance_get_dir(itr_instance), NULL);
-	if (!tep)
+	recorder = tc_recorder_alloc(instance, output_file);
+	if (!recorder) {
+		TfsError_fmt(instance,
+			     "Failed to open the ring buffers of instance \'%s\'.",
+			     get_instance_name(instance));
 		return NULL;
+	}
 
-	(*(volatile bool *)callback_status) = true;
-	callback_ctx.py_callback = py_func;
-	tracing_ON(itr_instance);
+	if (!trace_stats_init(&stats, instance))
+		goto out;
 
-	while (*(volatile bool *)keep_going) {
-		ret = tracefs_iterate_raw_events(tep, itr_instance, NULL, 0,
-						 callback, &callback_ctx);
+	/* Fork before starting the recorder threads. */
+	if (py_argv) {
+		pid = fork_tracing_process(instance, py_argv);
+		if (pid < 0)
+			goto out;
+	} else {
+		tracing_ON(instance);
+	}
+
+	if (tc_recorder_start(recorder) < 0) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Failed to start the recorder threads.");
+		goto out;
+	}
+
+	if (time)
+		t_end = time_now_ms() + time;
+
+	while (!tc_interrupted()) {
+		if (t_end && time_now_ms() >= t_end)
+			break;
 
-		if (*(volatile bool *)callback_status == false || ret < 0)
+		if (pid > 0 && waitpid(pid, NULL, WNOHANG) == pid) {
+			pid = 0;
 			break;
+		}
+
+		Py_BEGIN_ALLOW_THREADS
+		usleep(RECORD_WAIT_MS * 1000);
+		Py_END_ALLOW_THREADS
 	}
 
-	signal(SIGINT, SIG_DFL);
-	Py_RETURN_NONE;
+	Py_BEGIN_ALLOW_THREADS
+	tc_recorder_stop(recorder);
+	ret = tc_recorder_write(recorder);
+	Py_END_ALLOW_THREADS
+
+	if (PyErr_Occurred())
+		goto out;
+
+	if (ret < 0) {
+		PyErr_Format(TRACECRUNCHER_ERROR,
+			     "Failed to write trace data file \'%s\'.",
+			     output_file);
+		goto out;
+	}
+
+	/* The data is not parsed, hence only the kernel counters. */
+	py_stats = trace_stats_to_py(&stats, instance, false);
+
+ out:
+	stop_tracing_process(pid);
+	tc_recorder_free(recorder);
+	trace_stats_free(&stats);
+
+	return py_stats;
 }
 
 PyObject *PyFtrace_hook2pid(PyObject *self, PyObject *args, PyObject *kwargs)
@@ -3682,6 +9014,8 @@ int py_utrace_destroy(struct py_utrace_context *utrace)
 	for (i = 0; i < utrace->uevents.count; i++)
 		tracefs_dynevent_destroy(utrace->uevents.data[i], true);
 
+	tc_tep_cache_invalidate();
+
 	return 0;
 }
 
@@ -3878,6 +9212,8 @@ static int utrace_event_create(struct py_utrace_context *utrace,
 		return -1;
 	}
 
+	tc_tep_cache_invalidate();
+
 	utrace_list_add(&utrace->uevents, uevent);
 	return 0;
 }
@@ -4002,74 +9338,46 @@ static int py_utrace_disable(struct py_utrace_context *utrace, struct tracefs_in
 	return 0;
 }
 
-static bool tracing_run;
-
-static void tracing_stop(int sig)
-{
-	tracing_run = false;
-}
-
-static void tracing_timer(int sig, siginfo_t *si, void *uc)
-{
-	tracing_run = false;
-}
+#define PID_WAIT_CHECK_MS	100
 
-#define PID_WAIT_CHECK_USEC	500000
-#define TIMER_SEC_NANO		1000000000LL
+/*
+ * Wait until the traced process exits, the tracing time expires or the user
+ * presses Ctrl+c. Must be called with the GIL held. The GIL is released only
+ * while sleeping between the checks.
+ */
 static int utrace_wait_pid(struct py_utrace_context *utrace)
 {
-	struct itimerspec tperiod = {0};
-	struct sigaction saction = {0};
-	struct sigevent stime = {0};
-	timer_t timer_id;
+	unsigned long long deadline = 0;
+	bool done = false;
 
 	if (utrace->pid == 0)
 		return -1;
 
-	tracing_run = true;
-	signal(SIGINT, tracing_stop);
-
-	if (utrace->trace_time) {
-		stime.sigev_notify = SIGEV_SIGNAL;
-		stime.sigev_signo = SIGRTMIN;
-		if (timer_create(CLOCK_MONOTONIC, &stime, &timer_id))
-			return -1;
-		saction.sa_flags = SA_SIGINFO;
-		saction.sa_sigaction = tracing_timer;
-		sigemptyset(&saction.sa_mask);
-		if (sigaction(SIGRTMIN, &saction, NULL)) {
-			timer_delete(timer_id);
-			return -1;
-		}
-		/* Convert trace_time from msec to sec, nsec. */
-		tperiod.it_value.tv_nsec = ((unsigned long long)utrace->trace_time * 1000000LL);
-		if (tperiod.it_value.tv_nsec >= TIMER_SEC_NANO) {
-			tperiod.it_value.tv_sec = tperiod.it_value.tv_nsec / TIMER_SEC_NANO;
-			tperiod.it_value.tv_nsec %= TIMER_SEC_NANO;
-		}
-		if (timer_settime(timer_id, 0, &tperiod, NULL))
-			return -1;
-	}
+	if (utrace->trace_time)
+		deadline = time_now_ns() + utrace->trace_time * 1000000ULL;
 
-	do {
+	while (!done) {
 		if (utrace->cmd_argv) { /* Wait for a child. */
 			if (waitpid(utrace->pid, NULL, WNOHANG) == (int)utrace->pid) {
 				utrace->pid = 0;
-				tracing_run = false;
+				break;
 			}
 		} else { /* Not a child, check if still exist. */
 			if (kill(utrace->pid, 0) == -1 && errno == ESRCH) {
 				utrace->pid = 0;
-				tracing_run = false;
+				break;
 			}
 		}
-		usleep(PID_WAIT_CHECK_USEC);
-	} while (tracing_run);
 
-	if (utrace->trace_time)
-		timer_delete(timer_id);
+		if (deadline && time_now_ns() >= deadline)
+			break;
 
-	signal(SIGINT, SIG_DFL);
+		Py_BEGIN_ALLOW_THREADS
+		usleep(PID_WAIT_CHECK_MS * 1000);
+		Py_END_ALLOW_THREADS
+
+		done = tc_interrupted();
+	}
 
 	return 0;
 }
@@ -4352,19 +9660,21 @@ PyObject *PyFtrace_wait(PyObject *self, PyObject *args,
 	}
 
 	if (signals_list && tc_list_get_str(signals_list, &signals, NULL)) {
-		TfsError_fmt(pipe_instance,
+		TfsError_fmt(NULL,
 			     "Broken list of signals");
 		goto error;
 	}
 
 	if (pids_list && tc_list_get_uint(pids_list, &pids, &npids)) {
-		TfsError_fmt(pipe_instance,
+		TfsError_fmt(NULL,
 			     "Broken list of PIDs");
 		goto error;
 	}
 
+	Py_BEGIN_ALLOW_THREADS
 	tc_wait_condition(signals_list ? signals : signals_default,
 			  pids, npids, kill, time, NULL, NULL);
+	Py_END_ALLOW_THREADS
 
 	free(signals);
 	free(pids);
@@ -13,14 +13,92 @@
 // libtracefs
 #include "tracefs.h"
 
+// NumPy
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#define PY_ARRAY_UNIQUE_SYMBOL TC_FTRACE_ARRAY_API
+
 // trace-cruncher
 #include "common.h"
 
 C_OBJECT_WRAPPER_DECLARE(tep_record, PyTepRecord)
 
-C_OBJECT_WRAPPER_DECLARE(tep_event, PyTepEvent)
+struct tc_tep;
+
+void tc_tep_put(struct tc_tep *tt);
+
+C_OBJECT_WRAPPER_DECLARE(tc_tep, PyTep)
+
+void tc_tep_cache_invalidate(void);
+
+struct tc_event_cache {
+	/** The tep handle of the events. The owner of the cache holds a reference. */
+	struct tc_tep		*tep;
+
+	/** PyTepEvent objects, indexed by the Id of the event. */
+	PyObject		**events;
+
+	/** The allocated size of the "events" array. */
+	int			size;
+};
+
+struct tc_record_batch {
+	/** Array of copies of the records in this batch. */
+	struct tep_record	*records;
+
+	/** Array of the events of the records in this batch. */
+	struct tep_event	**events;
+
+	/** Offset of the payload of each record inside the "data" buffer. */
+	size_t			*data_offsets;
+
+	/** The number of records in the batch. */
+	int			count;
+
+	/** The allocated size of the record arrays. */
+	int			size;
+
+	/** Buffer holding the payload of all records in the batch. */
+	char			*data;
+
+	/** The number of bytes used in the "data" buffer. */
+	size_t			data_len;
+
+	/** The allocated size of the "data" buffer. */
+	size_t			data_size;
+
+	/** The tep handle of the events. The batch holds a reference. */
+	struct tc_tep		*tep;
+
+	/** The object owning "event_cache" (optional). */
+	PyObject		*owner;
+
+	/** The PyTepEvent objects of the owner (optional). */
+	struct tc_event_cache	*event_cache;
+};
+
+int tc_record_destroy(struct tep_record *record);
+
+void tc_record_batch_free(struct tc_record_batch *batch);
 
-C_OBJECT_WRAPPER_DECLARE(tep_handle, PyTep)
+C_OBJECT_WRAPPER_DECLARE(tc_record_batch, PyTepRecordBatch)
+
+struct tc_record_filter;
+
+void tc_record_filter_free(struct tc_record_filter *filter);
+
+C_OBJECT_WRAPPER_DECLARE(tc_record_filter, PyRecordFilter)
+
+struct tc_event;
+
+void tc_event_free(struct tc_event *event);
+
+C_OBJECT_WRAPPER_DECLARE(tc_event, PyTepEvent)
+
+struct tc_field_accessor;
+
+void tc_field_accessor_free(struct tc_field_accessor *acc);
+
+C_OBJECT_WRAPPER_DECLARE(tc_field_accessor, PyFieldAccessor)
 
 C_OBJECT_WRAPPER_DECLARE(tracefs_instance, PyTfsInstance)
 
@@ -53,6 +131,58 @@ PyObject *PyUserTrace_disable(PyUserTrace *self, PyObject *args, PyObject *kwarg
 
 PyObject *PyTepRecord_cpu(PyTepRecord* self);
 
+int PyTepRecord_getbuffer(PyTepRecord *self, Py_buffer *view, int flags);
+
+PyObject *PyTepRecordBatch_size(PyTepRecordBatch *self);
+
+PyObject *PyTepRecordBatch_event(PyTepRecordBatch *self, PyObject *args,
+						       PyObject *kwargs);
+
+PyObject *PyTepRecordBatch_record(PyTepRecordBatch *self, PyObject *args,
+							PyObject *kwargs);
+
+int PyTepRecordBatch_getbuffer(PyTepRecordBatch *self, Py_buffer *view,
+			       int flags);
+
+Py_ssize_t PyTepRecordBatch_len(PyTepRecordBatch *self);
+
+PyObject *PyTepRecordBatch_item(PyTepRecordBatch *self, Py_ssize_t i);
+
+PyObject *PyRecordFilter_pids(PyRecordFilter *self);
+
+struct tc_aggregator;
+
+void tc_aggregator_free(struct tc_aggregator *agg);
+
+C_OBJECT_WRAPPER_DECLARE(tc_aggregator, PyAggregator)
+
+PyObject *PyAggregator_data(PyAggregator *self, PyObject *args,
+						PyObject *kwargs);
+
+PyObject *PyAggregator_keys(PyAggregator *self);
+
+PyObject *PyAggregator_clear(PyAggregator *self);
+
+struct tc_stream;
+
+void tc_stream_free(struct tc_stream *stream);
+
+C_OBJECT_WRAPPER_DECLARE(tc_stream, PyTraceStream)
+
+PyObject *PyTraceStream_next(PyTraceStream *self);
+
+PyObject *PyTraceStream_read_batch(PyTraceStream *self);
+
+PyObject *PyTraceStream_fileno(PyTraceStream *self);
+
+PyObject *PyTraceStream_stop(PyTraceStream *self);
+
+PyObject *PyTraceStream_resume(PyTraceStream *self);
+
+PyObject *PyTraceStream_stats(PyTraceStream *self);
+
+PyObject *PyTraceStream_close(PyTraceStream *self);
+
 PyObject *PyTepEvent_name(PyTepEvent* self);
 
 PyObject *PyTepEvent_id(PyTepEvent* self);
@@ -65,18 +195,38 @@ PyObject *PyTepEvent_parse_record_field(PyTepEvent* self, PyObject *args,
 PyObject *PyTepEvent_get_pid(PyTepEvent* self, PyObject *args,
 					       PyObject *kwargs);
 
+PyObject *PyTepEvent_parse_record(PyTepEvent* self, PyObject *args,
+						    PyObject *kwargs);
+
+PyObject *PyTepEvent_parse_record_array(PyTepEvent* self, PyObject *args,
+							  PyObject *kwargs);
+
+PyObject *PyTepEvent_accessor(PyTepEvent* self, PyObject *args,
+					       PyObject *kwargs);
+
+PyObject *PyFieldAccessor_call(PyFieldAccessor *self, PyObject *args,
+						      PyObject *kwargs);
+
+PyObject *PyFieldAccessor_name(PyFieldAccessor *self);
+
 PyObject *PyTep_init_local(PyTep *self, PyObject *args,
 					PyObject *kwargs);
 
 PyObject *PyTep_get_event(PyTep *self, PyObject *args,
 				       PyObject *kwargs);
 
+PyObject *PyTep_event_by_id(PyTep *self, PyObject *args,
+					 PyObject *kwargs);
+
 PyObject *PyTep_event_record(PyTep *self, PyObject *args,
 					  PyObject *kwargs);
 
 PyObject *PyTep_info(PyTep *self, PyObject *args,
 				  PyObject *kwargs);
 
+PyObject *PyTep_format_records(PyTep *self, PyObject *args,
+					    PyObject *kwargs);
+
 PyObject *PyTep_process(PyTep *self, PyObject *args,
 				     PyObject *kwargs);
 
@@ -312,6 +462,21 @@ PyObject *PyFtrace_read_trace(PyObject *self, PyObject *args,
 PyObject *PyFtrace_iterate_trace(PyObject *self, PyObject *args,
 						 PyObject *kwargs);
 
+PyObject *PyFtrace_record_filter(PyObject *self, PyObject *args,
+						 PyObject *kwargs);
+
+PyObject *PyFtrace_aggregator(PyObject *self, PyObject *args,
+					      PyObject *kwargs);
+
+PyObject *PyFtrace_stream(PyObject *self, PyObject *args,
+					  PyObject *kwargs);
+
+PyObject *PyFtrace_collect_trace(PyObject *self, PyObject *args,
+						 PyObject *kwargs);
+
+PyObject *PyFtrace_record(PyObject *self, PyObject *args,
+					  PyObject *kwargs);
+
 PyObject *PyFtrace_hook2pid(PyObject *self, PyObject *args, PyObject *kwargs);
 
 PyObject *PyFtrace_error_log(PyObject *self, PyObject *args,
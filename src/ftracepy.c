@@ -8,6 +8,9 @@
 #include "ftracepy-utils.h"
 #include "ftracepy-docs.h"
 
+// NumPy
+#include "numpy/arrayobject.h"
+
 extern PyObject *TFS_ERROR;
 extern PyObject *TEP_ERROR;
 extern PyObject *TRACECRUNCHER_ERROR;
@@ -26,7 +29,111 @@ static PyMethodDef PyTepRecord_methods[] = {
 	{NULL}
 };
 
-C_OBJECT_WRAPPER(tep_record, PyTepRecord, NO_DESTROY, NO_FREE)
+static PyBufferProcs PyTepRecord_buffer = {
+	.bf_getbuffer = (getbufferproc) PyTepRecord_getbuffer,
+};
+
+C_OBJECT_WRAPPER(tep_record, PyTepRecord, tc_record_destroy, NO_FREE)
+
+static PyMethodDef PyTepRecordBatch_methods[] = {
+	{"size",
+	 (PyCFunction) PyTepRecordBatch_size,
+	 METH_NOARGS,
+	 PyTepRecordBatch_size_doc,
+	},
+	{"event",
+	 (PyCFunction) PyTepRecordBatch_event,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyTepRecordBatch_event_doc,
+	},
+	{"record",
+	 (PyCFunction) PyTepRecordBatch_record,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyTepRecordBatch_record_doc,
+	},
+	{NULL}
+};
+
+static PySequenceMethods PyTepRecordBatch_sequence = {
+	.sq_length = (lenfunc) PyTepRecordBatch_len,
+	.sq_item = (ssizeargfunc) PyTepRecordBatch_item,
+};
+
+static PyBufferProcs PyTepRecordBatch_buffer = {
+	.bf_getbuffer = (getbufferproc) PyTepRecordBatch_getbuffer,
+};
+
+C_OBJECT_WRAPPER(tc_record_batch, PyTepRecordBatch, NO_DESTROY,
+		 tc_record_batch_free)
+
+static PyMethodDef PyRecordFilter_methods[] = {
+	{"pids",
+	 (PyCFunction) PyRecordFilter_pids,
+	 METH_NOARGS,
+	 PyRecordFilter_pids_doc,
+	},
+	{NULL}
+};
+
+C_OBJECT_WRAPPER(tc_record_filter, PyRecordFilter, NO_DESTROY,
+		 tc_record_filter_free)
+
+static PyMethodDef PyAggregator_methods[] = {
+	{"data",
+	 (PyCFunction) PyAggregator_data,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyAggregator_data_doc,
+	},
+	{"keys",
+	 (PyCFunction) PyAggregator_keys,
+	 METH_NOARGS,
+	 PyAggregator_keys_doc,
+	},
+	{"clear",
+	 (PyCFunction) PyAggregator_clear,
+	 METH_NOARGS,
+	 PyAggregator_clear_doc,
+	},
+	{NULL}
+};
+
+C_OBJECT_WRAPPER(tc_aggregator, PyAggregator, NO_DESTROY, tc_aggregator_free)
+
+static PyMethodDef PyTraceStream_methods[] = {
+	{"read_batch",
+	 (PyCFunction) PyTraceStream_read_batch,
+	 METH_NOARGS,
+	 PyTraceStream_read_batch_doc,
+	},
+	{"fileno",
+	 (PyCFunction) PyTraceStream_fileno,
+	 METH_NOARGS,
+	 PyTraceStream_fileno_doc,
+	},
+	{"stop",
+	 (PyCFunction) PyTraceStream_stop,
+	 METH_NOARGS,
+	 PyTraceStream_stop_doc,
+	},
+	{"resume",
+	 (PyCFunction) PyTraceStream_resume,
+	 METH_NOARGS,
+	 PyTraceStream_resume_doc,
+	},
+	{"stats",
+	 (PyCFunction) PyTraceStream_stats,
+	 METH_NOARGS,
+	 PyTraceStream_stats_doc,
+	},
+	{"close",
+	 (PyCFunction) PyTraceStream_close,
+	 METH_NOARGS,
+	 PyTraceStream_close_doc,
+	},
+	{NULL}
+};
+
+C_OBJECT_WRAPPER(tc_stream, PyTraceStream, NO_DESTROY, tc_stream_free)
 
 static PyMethodDef PyTepEvent_methods[] = {
 	{"name",
@@ -49,15 +156,42 @@ static PyMethodDef PyTepEvent_methods[] = {
 	 METH_VARARGS | METH_KEYWORDS,
 	 PyTepEvent_parse_record_field_doc,
 	},
+	{"parse_record",
+	 (PyCFunction) PyTepEvent_parse_record,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyTepEvent_parse_record_doc,
+	},
+	{"parse_record_array",
+	 (PyCFunction) PyTepEvent_parse_record_array,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyTepEvent_parse_record_array_doc,
+	},
 	{"get_pid",
 	 (PyCFunction) PyTepEvent_get_pid,
 	 METH_VARARGS | METH_KEYWORDS,
 	 PyTepEvent_get_pid_doc,
 	},
+	{"accessor",
+	 (PyCFunction) PyTepEvent_accessor,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyTepEvent_accessor_doc,
+	},
 	{NULL}
 };
 
-C_OBJECT_WRAPPER(tep_event, PyTepEvent, NO_DESTROY, NO_FREE)
+C_OBJECT_WRAPPER(tc_event, PyTepEvent, NO_DESTROY, tc_event_free)
+
+static PyMethodDef PyFieldAccessor_methods[] = {
+	{"name",
+	 (PyCFunction) PyFieldAccessor_name,
+	 METH_NOARGS,
+	 PyFieldAccessor_name_doc,
+	},
+	{NULL}
+};
+
+C_OBJECT_WRAPPER(tc_field_accessor, PyFieldAccessor, NO_DESTROY,
+		 tc_field_accessor_free)
 
 static PyMethodDef PyTep_methods[] = {
 	{"init_local",
@@ -70,6 +204,11 @@ static PyMethodDef PyTep_methods[] = {
 	 METH_VARARGS | METH_KEYWORDS,
 	 PyTep_get_event_doc,
 	},
+	{"event_by_id",
+	 (PyCFunction) PyTep_event_by_id,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyTep_event_by_id_doc,
+	},
 	{"event_record",
 	 (PyCFunction) PyTep_event_record,
 	 METH_VARARGS | METH_KEYWORDS,
@@ -80,6 +219,11 @@ static PyMethodDef PyTep_methods[] = {
 	 METH_VARARGS | METH_KEYWORDS,
 	 PyTep_process_doc,
 	},
+	{"format_records",
+	 (PyCFunction) PyTep_format_records,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyTep_format_records_doc,
+	},
 	{"info",
 	 (PyCFunction) PyTep_info,
 	 METH_VARARGS | METH_KEYWORDS,
@@ -93,7 +237,7 @@ static PyMethodDef PyTep_methods[] = {
 	{NULL}
 };
 
-C_OBJECT_WRAPPER(tep_handle, PyTep, NO_DESTROY, tep_free)
+C_OBJECT_WRAPPER(tc_tep, PyTep, NO_DESTROY, tc_tep_put)
 
 static PyMethodDef PyTfsInstance_methods[] = {
 	{"dir",
@@ -184,6 +328,7 @@ static PyMethodDef PyDynevent_methods[] = {
 
 static int dynevent_destroy(struct tracefs_dynevent *devt)
 {
+	tc_tep_cache_invalidate();
 	return tracefs_dynevent_destroy(devt, true);
 }
 
@@ -323,8 +468,14 @@ static PyMethodDef PySynthEvent_methods[] = {
 	{NULL, NULL, 0, NULL}
 };
 
+static int synth_destroy(struct tracefs_synth *synth)
+{
+	tc_tep_cache_invalidate();
+	return tracefs_synth_destroy(synth);
+}
+
 C_OBJECT_WRAPPER(tracefs_synth, PySynthEvent,
-		 tracefs_synth_destroy,
+		 synth_destroy,
 		 tracefs_synth_free)
 
 static PyMethodDef PyUserTrace_methods[] = {
@@ -589,6 +740,31 @@ static PyMethodDef ftracepy_methods[] = {
 	 METH_VARARGS | METH_KEYWORDS,
 	 PyFtrace_iterate_trace_doc,
 	},
+	{"record_filter",
+	 (PyCFunction) PyFtrace_record_filter,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyFtrace_record_filter_doc,
+	},
+	{"aggregator",
+	 (PyCFunction) PyFtrace_aggregator,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyFtrace_aggregator_doc,
+	},
+	{"stream",
+	 (PyCFunction) PyFtrace_stream,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyFtrace_stream_doc,
+	},
+	{"collect_trace",
+	 (PyCFunction) PyFtrace_collect_trace,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyFtrace_collect_trace_doc,
+	},
+	{"record",
+	 (PyCFunction) PyFtrace_record,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyFtrace_record_doc,
+	},
 	{"hook2pid",
 	 (PyCFunction) PyFtrace_hook2pid,
 	 METH_VARARGS | METH_KEYWORDS,
@@ -610,22 +786,48 @@ static PyMethodDef ftracepy_methods[] = {
 static struct PyModuleDef ftracepy_module = {
 	PyModuleDef_HEAD_INIT,
 	"ftracepy",
-	"Python interface for Ftrace.",
+	"Python interface for Ftrace.\n\n"
+	"The event formats are parsed once per instance directory and reused by the tracing\n"
+	"functions. They are parsed again after a dynamic event is created or removed by this\n"
+	"module. Dynamic events created by other tools are not seen until then.",
 	-1,
 	ftracepy_methods
 };
 
 PyMODINIT_FUNC PyInit_ftracepy(void)
 {
+	import_array();
+
 	if (!PyTepTypeInit())
 		return NULL;
 
 	if (!PyTepEventTypeInit())
 		return NULL;
 
+	PyTepRecordType.tp_as_buffer = &PyTepRecord_buffer;
 	if (!PyTepRecordTypeInit())
 		return NULL;
 
+	PyFieldAccessorType.tp_call = (ternaryfunc) PyFieldAccessor_call;
+	if (!PyFieldAccessorTypeInit())
+		return NULL;
+
+	PyTepRecordBatchType.tp_as_sequence = &PyTepRecordBatch_sequence;
+	PyTepRecordBatchType.tp_as_buffer = &PyTepRecordBatch_buffer;
+	if (!PyTepRecordBatchTypeInit())
+		return NULL;
+
+	if (!PyRecordFilterTypeInit())
+		return NULL;
+
+	if (!PyAggregatorTypeInit())
+		return NULL;
+
+	PyTraceStreamType.tp_iter = PyObject_SelfIter;
+	PyTraceStreamType.tp_iternext = (iternextfunc) PyTraceStream_next;
+	if (!PyTraceStreamTypeInit())
+		return NULL;
+
 	if (!PyTfsInstanceTypeInit())
 		return NULL;
 
@@ -655,6 +857,11 @@ PyMODINIT_FUNC PyInit_ftracepy(void)
 	PyModule_AddObject(module, "tep_handle", (PyObject *) &PyTepType);
 	PyModule_AddObject(module, "tep_event", (PyObject *) &PyTepEventType);
 	PyModule_AddObject(module, "tep_record", (PyObject *) &PyTepRecordType);
+	PyModule_AddObject(module, "tep_record_batch", (PyObject *) &PyTepRecordBatchType);
+	PyModule_AddObject(module, "tep_field_accessor", (PyObject *) &PyFieldAccessorType);
+	PyModule_AddObject(module, "tc_record_filter", (PyObject *) &PyRecordFilterType);
+	PyModule_AddObject(module, "tc_aggregator", (PyObject *) &PyAggregatorType);
+	PyModule_AddObject(module, "tc_stream", (PyObject *) &PyTraceStreamType);
 	PyModule_AddObject(module, "tracefs_instance", (PyObject *) &PyTfsInstanceType);
 	PyModule_AddObject(module, "tracefs_dynevent", (PyObject *) &PyDyneventType);
 	PyModule_AddObject(module, "tracefs_hist", (PyObject *) &PyTraceHistType);
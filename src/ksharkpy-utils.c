@@ -10,6 +10,7 @@
 #endif // _GNU_SOURCE
 
 // C
+#include <stdlib.h>
 #include <string.h>
 
 // KernelShark
@@ -21,6 +22,10 @@
 // trace-cruncher
 #include "ksharkpy-utils.h"
 
+// NumPy
+#define NO_IMPORT_ARRAY
+#include "numpy/arrayobject.h"
+
 PyObject *KSHARK_ERROR = NULL;
 PyObject *TRACECRUNCHER_ERROR = NULL;
 
@@ -318,25 +323,272 @@ PyObject *PyKShark_event_name(PyObject *self, PyObject *args,
 	return ret;
 }
 
+static const char **get_field_names(PyObject *py_field, int *n_fields)
+{
+	const char **fields;
+	PyObject *item;
+	int i, n;
+
+	if (PyUnicode_Check(py_field)) {
+		fields = malloc(sizeof(*fields));
+		if (!fields) {
+			MEM_ERROR
+			return NULL;
+		}
+
+		fields[0] = PyUnicode_AsUTF8(py_field);
+		*n_fields = 1;
+		return fields;
+	}
+
+	if (!PyList_CheckExact(py_field) || !PyList_Size(py_field)) {
+		PyErr_SetString(TRACECRUNCHER_ERROR,
+				"Field must be a string or a list of strings");
+		return NULL;
+	}
+
+	n = PyList_Size(py_field);
+	fields = calloc(n, sizeof(*fields));
+	if (!fields) {
+		MEM_ERROR
+		return NULL;
+	}
+
+	for (i = 0; i < n; ++i) {
+		item = PyList_GetItem(py_field, i);
+		if (!PyUnicode_Check(item)) {
+			PyErr_SetString(TRACECRUNCHER_ERROR,
+					"Field must be a string or a list of strings");
+			free(fields);
+			return NULL;
+		}
+
+		fields[i] = PyUnicode_AsUTF8(item);
+	}
+
+	*n_fields = n;
+	return fields;
+}
+
+/** A record, which fields have to be decoded. */
+struct field_read {
+	/** The offset of the record in the trace file. */
+	int64_t		offset;
+
+	/** The Id of the event of the record. */
+	int16_t		event_id;
+
+	/** The position in the output arrays, where the values are stored. */
+	ssize_t		pos;
+};
+
+static int field_read_cmp(const void *a, const void *b)
+{
+	const struct field_read *ra = a, *rb = b;
+
+	if (ra->offset != rb->offset)
+		return ra->offset < rb->offset ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Decode the fields of the records in "reads". The records are visited in
+ * the order of their offsets, so that the trace file is read sequentially.
+ * The value of field "f" is stored in "values[f][pos]" for each record of
+ * event "event_ids[f]". On failure "failed_read" and "failed_field" are set
+ * to the indexes of the record and of the field that cannot be decoded. Note
+ * that "reads" is sorted in place.
+ */
+static int field_read_all(int sd, struct field_read *reads, ssize_t n,
+			  int n_fields, const int16_t *event_ids,
+			  const char **field_names, int64_t **values,
+			  ssize_t *failed_read, int *failed_field)
+{
+	struct kshark_entry entry;
+	ssize_t i;
+	int f;
+
+	qsort(reads, n, sizeof(*reads), field_read_cmp);
+
+	entry.stream_id = sd;
+	for (i = 0; i < n; ++i) {
+		entry.offset = reads[i].offset;
+		entry.event_id = reads[i].event_id;
+		for (f = 0; f < n_fields; ++f) {
+			if (event_ids[f] != entry.event_id)
+				continue;
+
+			if (kshark_read_event_field_int(&entry, field_names[f],
+							&values[f][reads[i].pos]) != 0) {
+				*failed_read = i;
+				*failed_field = f;
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Decode the fields of all selected records. The records are visited in
+ * the order of their offsets, so that the trace file is read sequentially,
+ * and the values are stored at the original positions of the records.
+ */
+static PyObject *read_event_field_array(int sd, PyObject *py_offset,
+					int event_id, PyObject *py_field,
+					PyObject *py_mask)
+{
+	PyArrayObject *offsets = NULL, *mask = NULL;
+	PyObject *values = NULL, *ret = NULL;
+	struct field_read *reads = NULL;
+	int16_t *event_ids = NULL;
+	const char **fields;
+	npy_intp i, n, size;
+	ssize_t failed_read;
+	int f, n_fields;
+	int64_t **data;
+	int64_t *ofst;
+	npy_bool *sel;
+
+	fields = get_field_names(py_field, &n_fields);
+	if (!fields)
+		return NULL;
+
+	data = calloc(n_fields, sizeof(*data));
+	event_ids = calloc(n_fields, sizeof(*event_ids));
+	values = PyList_New(n_fields);
+	if (!data || !event_ids || !values) {
+		MEM_ERROR
+		goto out;
+	}
+
+	offsets = (PyArrayObject *) PyArray_FROMANY(py_offset, NPY_INT64, 0, 1,
+						    NPY_ARRAY_IN_ARRAY |
+						    NPY_ARRAY_FORCECAST);
+	if (!offsets)
+		goto out;
+
+	size = PyArray_SIZE(offsets);
+	ofst = PyArray_DATA(offsets);
+	if (py_mask && py_mask != Py_None) {
+		mask = (PyArrayObject *) PyArray_FROMANY(py_mask, NPY_BOOL, 1, 1,
+							 NPY_ARRAY_IN_ARRAY);
+		if (!mask)
+			goto out;
+
+		if (PyArray_SIZE(mask) != size) {
+			PyErr_Format(TRACECRUNCHER_ERROR,
+				     "Mask size %zi does not match the number of offsets %zi",
+				     (ssize_t) PyArray_SIZE(mask), (ssize_t) size);
+			goto out;
+		}
+	}
+
+	reads = malloc((size ? size : 1) * sizeof(*reads));
+	if (!reads) {
+		MEM_ERROR
+		goto out;
+	}
+
+	sel = mask ? PyArray_DATA(mask) : NULL;
+	for (i = n = 0; i < size; ++i) {
+		if (sel && !sel[i])
+			continue;
+
+		reads[n].offset = ofst[i];
+		reads[n].event_id = event_id;
+		reads[n].pos = n;
+		++n;
+	}
+
+	for (f = 0; f < n_fields; ++f) {
+		PyObject *array = PyArray_SimpleNew(1, &n, NPY_INT64);
+
+		if (!array)
+			goto out;
+
+		PyList_SET_ITEM(values, f, array);
+		data[f] = PyArray_DATA((PyArrayObject *) array);
+		event_ids[f] = event_id;
+	}
+
+	if (field_read_all(sd, reads, n, n_fields, event_ids, fields, data,
+			   &failed_read, &f) != 0) {
+		PyErr_Format(KSHARK_ERROR,
+			     "Failed to read field '%s' of event '%i' (offset %lli)",
+			     fields[f], event_id,
+			     (long long) reads[failed_read].offset);
+		goto out;
+	}
+
+	if (PyUnicode_Check(py_field)) {
+		ret = PyList_GetItem(values, 0);
+		Py_INCREF(ret);
+		goto out;
+	}
+
+	ret = PyDict_New();
+	if (!ret)
+		goto out;
+
+	for (f = 0; f < n_fields; ++f) {
+		if (PyDict_SetItem(ret, PyList_GetItem(py_field, f),
+				   PyList_GetItem(values, f)) < 0) {
+			Py_CLEAR(ret);
+			goto out;
+		}
+	}
+
+ out:
+	Py_XDECREF(offsets);
+	Py_XDECREF(mask);
+	Py_XDECREF(values);
+	free(reads);
+	free(fields);
+	free(event_ids);
+	free(data);
+
+	return ret;
+}
+
+/*
+ * Python integers, NumPy integer scalars and 0-d integer arrays (e.g.
+ * 'data['offset'][i]') select a single record.
+ */
+static bool is_scalar_offset(PyObject *py_offset)
+{
+	if (PyLong_Check(py_offset) || PyArray_IsScalar(py_offset, Integer))
+		return true;
+
+	return PyArray_Check(py_offset) &&
+	       PyArray_NDIM((PyArrayObject *) py_offset) == 0 &&
+	       PyArray_ISINTEGER((PyArrayObject *) py_offset);
+}
+
 PyObject *PyKShark_read_event_field(PyObject *self, PyObject *args,
 						    PyObject *kwargs)
 {
 	struct kshark_context *kshark_ctx = NULL;
+	PyObject *py_offset, *py_field, *py_index;
+	PyObject *py_mask = NULL;
 	struct kshark_entry entry;
 	int event_id, ret, sd;
 	const char *field;
-	int64_t offset;
 	int64_t val;
 
-	static char *kwlist[] = {"stream_id", "offset", "event_id", "field", NULL};
+	static char *kwlist[] = {"stream_id", "offset", "event_id", "field",
+				 "mask", NULL};
 	if(!PyArg_ParseTupleAndKeywords(args,
 					kwargs,
-					"iLis",
+					"iOiO|O",
 					kwlist,
 					&sd,
-					&offset,
+					&py_offset,
 					&event_id,
-					&field)) {
+					&py_field,
+					&py_mask)) {
 		return NULL;
 	}
 
@@ -345,9 +597,22 @@ PyObject *PyKShark_read_event_field(PyObject *self, PyObject *args,
 		return NULL;
 	}
 
+	if (!is_scalar_offset(py_offset) || !PyUnicode_Check(py_field) ||
+	    (py_mask && py_mask != Py_None))
+		return read_event_field_array(sd, py_offset, event_id,
+					      py_field, py_mask);
+
+	py_index = PyNumber_Index(py_offset);
+	if (!py_index)
+		return NULL;
+
+	field = PyUnicode_AsUTF8(py_field);
 	entry.event_id = event_id;
-	entry.offset = offset;
+	entry.offset = PyLong_AsLongLong(py_index);
 	entry.stream_id = sd;
+	Py_DECREF(py_index);
+	if (PyErr_Occurred())
+		return NULL;
 
 	ret = kshark_read_event_field_int(&entry, field, &val);
 	if (ret != 0) {
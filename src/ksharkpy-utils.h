@@ -10,6 +10,10 @@
 // Python
 #include <Python.h>
 
+// NumPy
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#define PY_ARRAY_UNIQUE_SYMBOL TC_KSHARK_ARRAY_API
+
 // trace-cruncher
 #include "common.h"
 
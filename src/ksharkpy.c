@@ -18,6 +18,9 @@
 #include "ksharkpy-utils.h"
 #include "common.h"
 
+// NumPy
+#include "numpy/arrayobject.h"
+
 extern PyObject *KSHARK_ERROR;
 extern PyObject *TRACECRUNCHER_ERROR;
 
@@ -60,7 +63,7 @@ static PyMethodDef ksharkpy_methods[] = {
 	{"read_event_field",
 	 (PyCFunction) PyKShark_read_event_field,
 	 METH_VARARGS | METH_KEYWORDS,
-	 "Get the value of an event field having a given name"
+	 "Get the value of an event field having a given name (for one or many records)"
 	},
 	{"new_session_file",
 	 (PyCFunction) PyKShark_new_session_file,
@@ -80,7 +83,11 @@ static struct PyModuleDef ksharkpy_module = {
 
 PyMODINIT_FUNC PyInit_ksharkpy(void)
 {
-	PyObject *module = PyModule_Create(&ksharkpy_module);
+	PyObject *module;
+
+	import_array();
+
+	module = PyModule_Create(&ksharkpy_module);
 
 	KSHARK_ERROR = PyErr_NewException("tracecruncher.ksharkpy.ks_error",
 					  NULL, NULL);
@@ -15,7 +15,7 @@ import json
 
 from libcpp cimport bool
 
-from libc.stdlib cimport free
+from libc.stdlib cimport malloc, free
 
 from cpython cimport PyObject, Py_INCREF
 
@@ -41,6 +41,32 @@ cdef extern from 'trace2matrix.c':
                          int64_t **offset_array,
                          int64_t **ts_array)
 
+    cdef struct trace_chunks:
+        pass
+
+    trace_chunks *trace_chunks_open(int stream_id,
+                                    int n_fields,
+                                    const char **event_names,
+                                    const char **field_names,
+                                    int *failed)
+
+    void trace_chunks_close(trace_chunks *chunks)
+
+    int trace_chunks_set_window(trace_chunks *chunks,
+                                int64_t tmin, int64_t tmax,
+                                const int *cpus, int n_cpus)
+
+    ssize_t trace_chunks_next(trace_chunks *chunks,
+                              ssize_t rows, int64_t time_span,
+                              int16_t **event_array,
+                              int16_t **cpu_array,
+                              int32_t **pid_array,
+                              int64_t **offset_array,
+                              int64_t **ts_array,
+                              int64_t **field_arrays,
+                              int64_t fill,
+                              int *failed)
+
 data_columns = ['event', 'cpu', 'pid', 'offset', 'time']
 
 data_column_types = {
@@ -51,6 +77,18 @@ data_column_types = {
     data_columns[4]: np.NPY_UINT64
     }
 
+data_column_dtypes = {
+    data_columns[0]: np.int16,
+    data_columns[1]: np.int16,
+    data_columns[2]: np.int32,
+    data_columns[3]: np.int64,
+    data_columns[4]: np.uint64
+    }
+
+# The value of the field columns in the rows of the events that do not
+# have the field.
+field_fill_value = np.iinfo(np.int64).min
+
 cdef class KsDataWrapper:
     cdef int item_size
     cdef int data_size
@@ -94,12 +132,70 @@ cdef class KsDataWrapper:
         free(<void*>self.data_ptr)
 
 
+cdef wrap_column(int data_type, ssize_t size, void *data_ptr):
+    """ Make a Numpy array that owns the memory of a data column.
+    """
+    cdef KsDataWrapper array_wrapper
+    cdef np.ndarray column
+
+    array_wrapper = KsDataWrapper()
+    array_wrapper.init(data_type=data_type,
+                       data_size=size,
+                       item_size=0,
+                       data_ptr=data_ptr)
+
+    column = np.array(array_wrapper, copy=False)
+    column.base = <PyObject *> array_wrapper
+    Py_INCREF(array_wrapper)
+
+    return column
+
+def field_column(event, field):
+    """ The name of the data column of an event field.
+    """
+    return '{0}/{1}'.format(event.decode(), field.decode())
+
+def field_projection(fields):
+    """ Flatten the dictionary of events and field names into two lists.
+    """
+    events = []
+    names = []
+    if not fields:
+        return events, names
+
+    for event, event_fields in fields.items():
+        if isinstance(event_fields, str):
+            event_fields = [event_fields]
+
+        for field in event_fields:
+            events.append(event.encode())
+            names.append(field.encode())
+
+    return events, names
+
 def load(stream_id, evt_data=True, cpu_data=True, pid_data=True,
-                    ofst_data=True, ts_data=True):
+                    ofst_data=True, ts_data=True, fields=None,
+                    fill_value=field_fill_value, tmin=None, tmax=None,
+                    cpus=None):
     """ Python binding of the 'kshark_load_data_matrix' function that does not
         copy the data. The input parameters can be used to avoid loading the
-        data from the unnecessary fields.
+        data from the unnecessary fields. The 'fields' argument is a
+        dictionary of event names and lists of field names (for example
+        {'sched/sched_switch': ['next_pid', 'prev_state']}). The values of
+        those fields are loaded into additional columns named
+        "system/event/field". The rows of all other events are set to
+        'fill_value'. The fields are decoded while the records are read,
+        in a single sequential pass over the file. If 'tmin', 'tmax' or
+        'cpus' is given, only the records inside the time window
+        [tmin, tmax] and from the listed CPUs are loaded. The readers seek
+        directly to the pages containing 'tmin', so the rest of the trace
+        is not decoded.
     """
+    if fields or tmin is not None or tmax is not None or cpus is not None:
+        return load_sequential(stream_id, evt_data, cpu_data, pid_data,
+                               ofst_data, ts_data, fields, fill_value,
+                               tmin, tmax, cpus)
+
     cdef int16_t *evt_c
     cdef int16_t *cpu_c
     cdef int32_t *pid_c
@@ -199,5 +295,211 @@ def load(stream_id, evt_data=True, cpu_data=True, pid_data=True,
 
     return data_dict
 
+cdef class TraceChunks:
+    """ Iterator over the trace data loaded in chunks of bounded size.
+        Each chunk is a dictionary of data columns, like the one returned
+        by load(). The memory of a chunk is released when all references
+        to its columns are gone.
+    """
+    cdef trace_chunks *chunks
+    cdef ssize_t rows
+    cdef int64_t time_span
+    cdef int64_t fill_value
+    cdef object columns
+    cdef object events
+    cdef object names
+
+    def __cinit__(self, stream_id, rows=0, time_span=0,
+                  evt_data=True, cpu_data=True, pid_data=True,
+                  ofst_data=True, ts_data=True, fields=None,
+                  fill_value=field_fill_value, tmin=None, tmax=None,
+                  cpus=None):
+        self.chunks = NULL
+        self.rows = rows
+        self.time_span = time_span
+        self.fill_value = fill_value
+        self.columns = [evt_data, cpu_data, pid_data, ofst_data, ts_data]
+        self.events, self.names = field_projection(fields)
+
+        cdef int n_fields = len(self.names)
+        cdef int failed = -1
+        cdef int i
+
+        cdef const char **events_c = <const char **> malloc((n_fields + 1) * sizeof(char *))
+        cdef const char **names_c = <const char **> malloc((n_fields + 1) * sizeof(char *))
+        if events_c == NULL or names_c == NULL:
+            free(events_c)
+            free(names_c)
+            raise MemoryError()
+
+        for i in range(n_fields):
+            events_c[i] = self.events[i]
+            names_c[i] = self.names[i]
+
+        self.chunks = trace_chunks_open(stream_id, n_fields,
+                                        events_c, names_c, &failed)
+        free(events_c)
+        free(names_c)
+
+        if self.chunks == NULL:
+            if failed < 0:
+                raise Exception('Failed to open the data stream for reading.')
+
+            raise Exception('Failed to find field \'{0}\' of event \'{1}\'.'
+                            .format(self.names[failed].decode(),
+                                    self.events[failed].decode()))
+
+        if tmin is not None or tmax is not None or cpus is not None:
+            self.set_window(tmin, tmax, cpus)
+
+    def set_window(self, tmin, tmax, cpus):
+        """ Restrict the data to a time window and to a subset of the CPUs.
+            If 'cpus' is None, the data from all CPUs is loaded. An empty
+            list of CPUs gives no data.
+        """
+        cdef int *cpus_c = NULL
+        cdef int n_cpus = 0
+        cdef int i
+
+        if cpus is not None:
+            cpus = list(cpus)
+            n_cpus = len(cpus)
+            cpus_c = <int *> malloc((n_cpus + 1) * sizeof(int))
+            if cpus_c == NULL:
+                raise MemoryError()
+
+            for i in range(n_cpus):
+                cpus_c[i] = cpus[i]
+
+        ret = trace_chunks_set_window(self.chunks,
+                                      tmin if tmin is not None else np.iinfo(np.int64).min,
+                                      tmax if tmax is not None else np.iinfo(np.int64).max,
+                                      cpus_c, n_cpus)
+        free(cpus_c)
+
+        if ret < 0:
+            raise MemoryError()
+
+        if ret > 0:
+            raise Exception('Invalid CPU {0}.'.format(cpus[ret - 1]))
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        cdef int16_t *evt_c
+        cdef int16_t *cpu_c
+        cdef int32_t *pid_c
+        cdef int64_t *ofst_c
+        cdef int64_t *ts_c
+        cdef int n_fields = len(self.names)
+        cdef int failed = -1
+        cdef ssize_t size
+        cdef int i
+
+        if self.chunks == NULL:
+            raise StopIteration
+
+        cdef int64_t **fields_c = <int64_t **> malloc((n_fields + 1) * sizeof(int64_t *))
+        if fields_c == NULL:
+            raise MemoryError()
+
+        size = trace_chunks_next(self.chunks, self.rows, self.time_span,
+                                 &evt_c if self.columns[0] else NULL,
+                                 &cpu_c if self.columns[1] else NULL,
+                                 &pid_c if self.columns[2] else NULL,
+                                 &ofst_c if self.columns[3] else NULL,
+                                 &ts_c if self.columns[4] else NULL,
+                                 fields_c, self.fill_value, &failed)
+        if size <= 0:
+            free(fields_c)
+            trace_chunks_close(self.chunks)
+            self.chunks = NULL
+            if size < 0:
+                if failed < 0:
+                    raise MemoryError()
+
+                raise Exception('Failed to load field \'{0}\' of event \'{1}\'.'
+                                .format(self.names[failed].decode(),
+                                        self.events[failed].decode()))
+
+            raise StopIteration
+
+        data_dict = {}
+        if self.columns[0]:
+            data_dict.update({'event': wrap_column(np.NPY_INT16, size, evt_c)})
+
+        if self.columns[1]:
+            data_dict.update({'cpu': wrap_column(np.NPY_INT16, size, cpu_c)})
+
+        if self.columns[2]:
+            data_dict.update({'pid': wrap_column(np.NPY_INT32, size, pid_c)})
+
+        if self.columns[3]:
+            data_dict.update({'offset': wrap_column(np.NPY_INT64, size, ofst_c)})
+
+        if self.columns[4]:
+            data_dict.update({'time': wrap_column(np.NPY_UINT64, size, ts_c)})
+
+        for i in range(n_fields):
+            column = field_column(self.events[i], self.names[i])
+            data_dict.update({column: wrap_column(np.NPY_INT64, size,
+                                                  fields_c[i])})
+
+        free(fields_c)
+
+        return data_dict
+
+    def __dealloc__(self):
+        trace_chunks_close(self.chunks)
+
+def load_chunks(stream_id, rows=0, time_span=0, evt_data=True, cpu_data=True,
+                pid_data=True, ofst_data=True, ts_data=True, fields=None,
+                fill_value=field_fill_value, tmin=None, tmax=None, cpus=None):
+    """ Load the trace data in successive chunks. A chunk ends when it has
+        'rows' rows or when it spans 'time_span' nanoseconds. The records
+        are read sequentially, so that the peak memory does not depend on
+        the size of the trace. The other parameters are the same as for
+        load().
+    """
+    if rows <= 0 and time_span <= 0:
+        raise Exception('The size of the chunks must be limited by rows or time_span.')
+
+    return TraceChunks(stream_id, rows=rows, time_span=time_span,
+                       evt_data=evt_data, cpu_data=cpu_data,
+                       pid_data=pid_data, ofst_data=ofst_data,
+                       ts_data=ts_data, fields=fields,
+                       fill_value=fill_value, tmin=tmin, tmax=tmax,
+                       cpus=cpus)
+
+def load_sequential(stream_id, evt_data, cpu_data, pid_data, ofst_data,
+                    ts_data, fields, fill_value, tmin, tmax, cpus):
+    """ Load the data, together with the projected event fields, in one
+        sequential pass over the records. Optionally only the data inside
+        a time window and/or from a subset of the CPUs is loaded.
+    """
+    chunks = TraceChunks(stream_id, evt_data=evt_data, cpu_data=cpu_data,
+                         pid_data=pid_data, ofst_data=ofst_data,
+                         ts_data=ts_data, fields=fields,
+                         fill_value=fill_value, tmin=tmin, tmax=tmax,
+                         cpus=cpus)
+
+    data_dict = next(chunks, None)
+    if data_dict is not None:
+        return data_dict
+
+    # No data in the window. Return empty columns.
+    data_dict = {}
+    for column, requested in zip(data_columns, [evt_data, cpu_data, pid_data,
+                                                ofst_data, ts_data]):
+        if requested:
+            data_dict.update({column: np.empty(0, dtype=data_column_dtypes[column])})
+
+    events, names = field_projection(fields)
+    for event, field in zip(events, names):
+        data_dict.update({field_column(event, field): np.empty(0, dtype=np.int64)})
+
+    return data_dict
+
 def columns():
     return data_columns
@@ -4,6 +4,15 @@
  * Copyright 2019 VMware Inc, Yordan Karadzhov <ykaradzhov@vmware.com>
  */
 
+// C
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// trace-cmd
+#include "trace-cmd.h"
+
 // KernelShark
 #include "libkshark.h"
 
@@ -38,3 +47,513 @@ ssize_t trace2matrix(int sd,
 
 	return total;
 }
+
+struct chunk_field {
+	struct tep_event	*event;
+	struct tep_format_field	*field;
+};
+
+/*
+ * Sequential reader of the records of a data stream. It uses its own
+ * trace-cmd handle, so that the position of the reader is not affected
+ * by the random access (by offset) done by libkshark.
+ */
+struct trace_chunks {
+	struct kshark_data_stream	*stream;
+	struct tracecmd_input		*top;
+	struct tracecmd_input		*handle;
+	struct tep_handle		*tep;
+
+	/** The first record of the next chunk. */
+	struct tep_record		*next;
+
+	/** The "missed events" row of the next record has been added. */
+	bool				overflow_done;
+
+	int				n_fields;
+	struct chunk_field		*fields;
+
+	/** Read only the CPUs set in this mask (all CPUs if NULL). */
+	bool				*cpu_mask;
+	int				n_cpus;
+
+	/** Time window of the records (in calibrated time). */
+	int64_t				tmin;
+	int64_t				tmax;
+
+	/** The end of the time window has been reached. */
+	bool				done;
+};
+
+struct chunk_columns {
+	int16_t		**event;
+	int16_t		**cpu;
+	int32_t		**pid;
+	int64_t		**offset;
+	int64_t		**ts;
+	int64_t		**fields;
+	int		n_fields;
+};
+
+static struct tep_event *find_event(struct tep_handle *tep, const char *name)
+{
+	struct tep_event *event;
+	const char *sep;
+	char *system;
+
+	sep = strchr(name, '/');
+	if (!sep)
+		return tep_find_event_by_name(tep, NULL, name);
+
+	system = strndup(name, sep - name);
+	if (!system)
+		return NULL;
+
+	event = tep_find_event_by_name(tep, system, sep + 1);
+	free(system);
+
+	return event;
+}
+
+static struct tracecmd_input *open_buffer_handle(struct trace_chunks *chunks)
+{
+	struct kshark_data_stream *stream = chunks->stream;
+	const char *name;
+	int i, n;
+
+	chunks->top = tracecmd_open(stream->file, 0);
+	if (!chunks->top)
+		return NULL;
+
+	if (!stream->name || strcmp(stream->name, "top") == 0)
+		return chunks->top;
+
+	n = tracecmd_buffer_instances(chunks->top);
+	for (i = 0; i < n; ++i) {
+		name = tracecmd_buffer_instance_name(chunks->top, i);
+		if (name && strcmp(name, stream->name) == 0)
+			return tracecmd_buffer_instance_handle(chunks->top, i);
+	}
+
+	return NULL;
+}
+
+void trace_chunks_close(struct trace_chunks *chunks)
+{
+	if (!chunks)
+		return;
+
+	if (chunks->next)
+		tracecmd_free_record(chunks->next);
+
+	if (chunks->handle && chunks->handle != chunks->top)
+		tracecmd_close(chunks->handle);
+
+	if (chunks->top)
+		tracecmd_close(chunks->top);
+
+	free(chunks->fields);
+	free(chunks->cpu_mask);
+	free(chunks);
+}
+
+/*
+ * Open a sequential reader of the records of a data stream. The event
+ * fields to be decoded into additional columns are given by "event_names"
+ * and "field_names". On failure "failed" is set to the index of the field
+ * that cannot be found (or -1).
+ */
+struct trace_chunks *trace_chunks_open(int sd,
+				       int n_fields,
+				       const char **event_names,
+				       const char **field_names,
+				       int *failed)
+{
+	struct kshark_context *kshark_ctx = NULL;
+	struct trace_chunks *chunks;
+	int f;
+
+	*failed = -1;
+	if (!kshark_instance(&kshark_ctx))
+		return NULL;
+
+	chunks = calloc(1, sizeof(*chunks));
+	if (!chunks)
+		return NULL;
+
+	chunks->stream = kshark_get_data_stream(kshark_ctx, sd);
+	if (!chunks->stream)
+		goto fail;
+
+	chunks->handle = open_buffer_handle(chunks);
+	if (!chunks->handle)
+		goto fail;
+
+	chunks->tep = tracecmd_get_tep(chunks->handle);
+
+	if (n_fields > 0) {
+		chunks->fields = calloc(n_fields, sizeof(*chunks->fields));
+		if (!chunks->fields)
+			goto fail;
+	}
+
+	for (f = 0; f < n_fields; ++f) {
+		chunks->fields[f].event = find_event(chunks->tep,
+						     event_names[f]);
+		if (chunks->fields[f].event)
+			chunks->fields[f].field =
+				tep_find_any_field(chunks->fields[f].event,
+						   field_names[f]);
+
+		if (!chunks->fields[f].field) {
+			*failed = f;
+			goto fail;
+		}
+	}
+
+	chunks->n_fields = n_fields;
+	chunks->n_cpus = tracecmd_cpus(chunks->handle);
+	chunks->tmin = INT64_MIN;
+	chunks->tmax = INT64_MAX;
+
+	return chunks;
+
+ fail:
+	trace_chunks_close(chunks);
+
+	return NULL;
+}
+
+static int64_t chunks_calib(struct trace_chunks *chunks, int64_t ts)
+{
+	struct kshark_data_stream *stream = chunks->stream;
+
+	if (stream->calib && stream->calib_array)
+		stream->calib(&ts, stream->calib_array);
+
+	return ts;
+}
+
+/*
+ * Restrict the reader to the records of the given CPUs (all CPUs if "cpus"
+ * is NULL, none if "n_cpus" is zero) having timestamps in the window
+ * [tmin, tmax]. The
+ * per-CPU readers are moved directly to the first page that can contain
+ * "tmin", using the timestamps of the pages. Returns zero on success, or
+ * the index of an invalid CPU plus one.
+ */
+int trace_chunks_set_window(struct trace_chunks *chunks,
+			    int64_t tmin, int64_t tmax,
+			    const int *cpus, int n_cpus)
+{
+	int64_t seek_ts;
+	int i;
+
+	free(chunks->cpu_mask);
+	chunks->cpu_mask = NULL;
+	if (cpus) {
+		chunks->cpu_mask = calloc(chunks->n_cpus + 1, sizeof(bool));
+		if (!chunks->cpu_mask)
+			return -1;
+
+		for (i = 0; i < n_cpus; ++i) {
+			if (cpus[i] < 0 || cpus[i] >= chunks->n_cpus) {
+				free(chunks->cpu_mask);
+				chunks->cpu_mask = NULL;
+				return i + 1;
+			}
+
+			chunks->cpu_mask[cpus[i]] = true;
+		}
+	}
+
+	if (chunks->next) {
+		tracecmd_free_record(chunks->next);
+		chunks->next = NULL;
+	}
+
+	chunks->overflow_done = false;
+	chunks->done = false;
+	chunks->tmin = tmin;
+	chunks->tmax = tmax;
+
+	/*
+	 * The pages are indexed by the raw timestamps. Assume that the
+	 * calibration is a constant offset.
+	 */
+	seek_ts = tmin - (chunks_calib(chunks, tmin) - tmin);
+	if (seek_ts < 0)
+		seek_ts = 0;
+
+	for (i = 0; i < chunks->n_cpus; ++i) {
+		if (!chunks->cpu_mask || chunks->cpu_mask[i])
+			tracecmd_set_cpu_to_timestamp(chunks->handle, i, seek_ts);
+	}
+
+	return 0;
+}
+
+static struct tep_record *chunks_read_cpus(struct trace_chunks *chunks)
+{
+	struct tep_record *record;
+	unsigned long long ts = 0;
+	int cpu, next_cpu = -1;
+
+	if (!chunks->cpu_mask)
+		return tracecmd_read_next_data(chunks->handle, NULL);
+
+	for (cpu = 0; cpu < chunks->n_cpus; ++cpu) {
+		if (!chunks->cpu_mask[cpu])
+			continue;
+
+		record = tracecmd_peek_data(chunks->handle, cpu);
+		if (record && (next_cpu < 0 || record->ts < ts)) {
+			ts = record->ts;
+			next_cpu = cpu;
+		}
+	}
+
+	if (next_cpu < 0)
+		return NULL;
+
+	return tracecmd_read_data(chunks->handle, next_cpu);
+}
+
+/*
+ * Get the next record inside the time window and its calibrated
+ * timestamp. Returns NULL when there are no more records.
+ */
+static struct tep_record *chunks_read(struct trace_chunks *chunks,
+				      int64_t *ts)
+{
+	struct tep_record *record = chunks->next;
+
+	chunks->next = NULL;
+	while (!chunks->done) {
+		if (!record)
+			record = chunks_read_cpus(chunks);
+
+		if (!record)
+			break;
+
+		*ts = chunks_calib(chunks, record->ts);
+		if (*ts > chunks->tmax) {
+			tracecmd_free_record(record);
+			chunks->done = true;
+			break;
+		}
+
+		if (*ts >= chunks->tmin)
+			return record;
+
+		tracecmd_free_record(record);
+		record = NULL;
+	}
+
+	return NULL;
+}
+
+static bool column_resize(void *column, size_t item_size, ssize_t size)
+{
+	void **data = column, *tmp;
+
+	if (!data)
+		return true;
+
+	tmp = realloc(*data, size * item_size);
+	if (!tmp)
+		return false;
+
+	*data = tmp;
+
+	return true;
+}
+
+static bool chunk_resize(struct chunk_columns *cols, ssize_t size)
+{
+	int f;
+
+	if (!column_resize(cols->event, sizeof(int16_t), size) ||
+	    !column_resize(cols->cpu, sizeof(int16_t), size) ||
+	    !column_resize(cols->pid, sizeof(int32_t), size) ||
+	    !column_resize(cols->offset, sizeof(int64_t), size) ||
+	    !column_resize(cols->ts, sizeof(int64_t), size))
+		return false;
+
+	for (f = 0; f < cols->n_fields; ++f) {
+		if (!column_resize(&cols->fields[f], sizeof(int64_t), size))
+			return false;
+	}
+
+	return true;
+}
+
+static void chunk_free(struct chunk_columns *cols)
+{
+	int f;
+
+	if (cols->event)
+		free(*cols->event);
+
+	if (cols->cpu)
+		free(*cols->cpu);
+
+	if (cols->pid)
+		free(*cols->pid);
+
+	if (cols->offset)
+		free(*cols->offset);
+
+	if (cols->ts)
+		free(*cols->ts);
+
+	for (f = 0; f < cols->n_fields; ++f)
+		free(cols->fields[f]);
+}
+
+/*
+ * Returns the index of the field that cannot be decoded, or -1 on success.
+ */
+static int chunk_set_row(struct trace_chunks *chunks,
+			 struct chunk_columns *cols,
+			 struct tep_record *record,
+			 int event_id, int64_t ts,
+			 int64_t fill, ssize_t row)
+{
+	unsigned long long val;
+	int f;
+
+	if (cols->event)
+		(*cols->event)[row] = event_id;
+
+	if (cols->cpu)
+		(*cols->cpu)[row] = record->cpu;
+
+	if (cols->pid)
+		(*cols->pid)[row] = tep_data_pid(chunks->tep, record);
+
+	if (cols->offset)
+		(*cols->offset)[row] = record->offset;
+
+	if (cols->ts)
+		(*cols->ts)[row] = ts;
+
+	for (f = 0; f < cols->n_fields; ++f) {
+		if (chunks->fields[f].event->id != event_id) {
+			cols->fields[f][row] = fill;
+			continue;
+		}
+
+		if (tep_read_number_field(chunks->fields[f].field,
+					  record->data, &val) != 0)
+			return f;
+
+		cols->fields[f][row] = val;
+	}
+
+	return -1;
+}
+
+#define CHUNK_MIN_SIZE	1024
+
+/*
+ * Load the next chunk of records into newly allocated columns. A column is
+ * skipped if its pointer is NULL. The chunk ends when it has "rows" rows
+ * or when it spans "time_span" nanoseconds (zero means no limit). Returns
+ * the number of rows of the chunk, zero when all records have been read,
+ * or a negative value on failure. On failure "failed" is set to the index
+ * of the field that cannot be decoded (or -1).
+ */
+ssize_t trace_chunks_next(struct trace_chunks *chunks,
+			  ssize_t rows, int64_t time_span,
+			  int16_t **event_array,
+			  int16_t **cpu_array,
+			  int32_t **pid_array,
+			  int64_t **offset_array,
+			  int64_t **ts_array,
+			  int64_t **field_arrays,
+			  int64_t fill,
+			  int *failed)
+{
+	struct chunk_columns cols = {
+		.event = event_array,
+		.cpu = cpu_array,
+		.pid = pid_array,
+		.offset = offset_array,
+		.ts = ts_array,
+		.fields = field_arrays,
+		.n_fields = chunks->n_fields,
+	};
+	ssize_t n = 0, size = 0;
+	struct tep_record *record;
+	int64_t ts, t0 = 0;
+	int f;
+
+	*failed = -1;
+	if (event_array)
+		*event_array = NULL;
+
+	if (cpu_array)
+		*cpu_array = NULL;
+
+	if (pid_array)
+		*pid_array = NULL;
+
+	if (offset_array)
+		*offset_array = NULL;
+
+	if (ts_array)
+		*ts_array = NULL;
+
+	for (f = 0; f < chunks->n_fields; ++f)
+		field_arrays[f] = NULL;
+
+	while (true) {
+		record = chunks_read(chunks, &ts);
+		if (!record)
+			break;
+
+		if (n == 0) {
+			t0 = ts;
+		} else if ((rows > 0 && n >= rows) ||
+			   (time_span > 0 && ts - t0 >= time_span)) {
+			chunks->next = record;
+			break;
+		}
+
+		if (n == size) {
+			size = rows > 0 ? rows : (size ? 2 * size : CHUNK_MIN_SIZE);
+			if (!chunk_resize(&cols, size)) {
+				chunks->next = record;
+				goto fail;
+			}
+		}
+
+		if (record->missed_events && !chunks->overflow_done) {
+			/* Add a "missed events" row in front of the record. */
+			chunk_set_row(chunks, &cols, record, KS_EVENT_OVERFLOW,
+				      ts, fill, n++);
+			chunks->overflow_done = true;
+			chunks->next = record;
+			continue;
+		}
+
+		*failed = chunk_set_row(chunks, &cols, record,
+					tep_data_type(chunks->tep, record),
+					ts, fill, n++);
+		if (*failed >= 0) {
+			chunks->next = record;
+			goto fail;
+		}
+
+		chunks->overflow_done = false;
+		tracecmd_free_record(record);
+	}
+
+	return n;
+
+ fail:
+	chunk_free(&cols);
+
+	return -1;
+}
@@ -11,9 +11,13 @@ import sys
 import time
 import psutil
 import signal
+import threading
+import asyncio
 import unittest
 import subprocess
 import tracecruncher.ftracepy as ft
+import tracecruncher.ksharkpy as ks
+import tracecruncher.npdatawrapper as dw
 import tracecruncher.ft_utils as tc
 
 instance_name = 'test_instance1'
@@ -103,12 +107,86 @@ class PyTepTestCase(unittest.TestCase):
             tep.init_local(dir='/no/dir', systems=['sched', 'irq'])
         self.assertTrue(err in str(context.exception))
 
+    def test_init_local_shared(self):
+        tracefs_dir = ft.dir()
+        tep1 = ft.tep_handle();
+        tep1.init_local(tracefs_dir);
+        tep2 = ft.tep_handle();
+        tep2.init_local(tracefs_dir);
+        id = tep1.get_event(system='sched', name='sched_switch').id()
+        del tep1
+        evt = tep2.get_event(system='sched', name='sched_switch');
+        self.assertEqual(evt.id(), id)
+
     def test_get_event(self):
         tracefs_dir = ft.dir()
         tep = ft.tep_handle();
         tep.init_local(tracefs_dir);
         evt = tep.get_event(system='sched', name='sched_switch');
 
+    def test_event_by_id(self):
+        tracefs_dir = ft.dir()
+        tep = ft.tep_handle();
+        tep.init_local(tracefs_dir);
+        evt = tep.get_event(system='sched', name='sched_switch');
+        self.assertEqual(tep.event_by_id(evt.id()).name(), 'sched_switch')
+        self.assertEqual(tep.event_by_id(id=evt.id()).id(), evt.id())
+
+        err='No event with Id -1'
+        with self.assertRaises(Exception) as context:
+            tep.event_by_id(-1)
+        self.assertTrue(err in str(context.exception))
+
+    def test_process(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_events(instance=inst,
+                         events={'sched': ['sched_process_fork',
+                                           'sched_process_exec',
+                                           'sched_switch']})
+        s = ft.stream(instance=inst)
+        subprocess.run(['testapp/tc-test-app', '-t', '100'])
+        s.stop()
+
+        tep = ft.tep_handle();
+        tep.init_local(dir=inst.dir());
+        names = set()
+        for batch in s:
+            for event, record in batch:
+                names.add(tep.process(event=event, record=record).rsplit('-', 1)[0])
+        s.close()
+        self.assertTrue('tc-test-app' in names)
+
+    def test_format_records(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        s = ft.stream(instance=inst, batch=4)
+        batch = next(s)
+        s.close()
+
+        tep = ft.tep_handle();
+        tep.init_local(dir=inst.dir());
+        lines = tep.format_records(batch).splitlines()
+        self.assertEqual(len(lines), len(batch))
+        for line, (event, record) in zip(lines, batch):
+            self.assertEqual(line, tep.event_record(event=event, record=record))
+
+        lines = tep.format_records(records=batch, format='process').splitlines()
+        for line, (event, record) in zip(lines, batch):
+            self.assertEqual(line, tep.process(event=event, record=record))
+
+        text = tep.format_records(batch, format='info')
+        r, w = os.pipe()
+        n = tep.format_records(batch, format='info', fd=w)
+        os.close(w)
+        self.assertEqual(n, len(text.encode()))
+        self.assertEqual(os.read(r, n + 1).decode(), text)
+        os.close(r)
+
+        err='Unknown record format \'no_format\''
+        with self.assertRaises(Exception) as context:
+            tep.format_records(batch, format='no_format')
+        self.assertTrue(err in str(context.exception))
+
 
 class PyTepEventTestCase(unittest.TestCase):
     def test_name(self):
@@ -136,6 +214,73 @@ class PyTepEventTestCase(unittest.TestCase):
                                   'next_pid',
                                   'next_prio'])
 
+    def test_accessor(self):
+        tracefs_dir = ft.dir()
+        tep = ft.tep_handle();
+        tep.init_local(tracefs_dir);
+        evt = tep.get_event(system='sched', name='sched_switch');
+        acc = evt.accessor('next_pid')
+        self.assertEqual(acc.name(), 'next_pid')
+
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        s = ft.stream(instance=inst, batch=16)
+        batch = next(s)
+        s.close()
+        values = acc(batch)
+        self.assertEqual(len(values), len(batch))
+        for (event, record), val in zip(batch, values):
+            self.assertEqual(acc(record), val)
+            self.assertEqual(event.parse_record_field(record=record,
+                                                      field='next_pid'), val)
+
+        comm = evt.accessor('next_comm')
+        comm_raw = evt.accessor('next_comm', mode='raw')
+        comm_intern = evt.accessor('next_comm', mode='intern')
+        raw_values = comm_raw(batch)
+        for i, (event, record) in enumerate(batch):
+            val = comm(record)
+            self.assertIsInstance(comm_raw(record), memoryview)
+            self.assertEqual(bytes(comm_raw(record)), val.encode())
+            self.assertEqual(bytes(raw_values[i]), val.encode())
+            self.assertEqual(comm_intern(record), val)
+            self.assertTrue(comm_intern(record) is comm_intern(record))
+
+        err = 'Failed to find field \'no_field\''
+        with self.assertRaises(Exception) as context:
+            evt.accessor('no_field')
+        self.assertTrue(err in str(context.exception))
+
+        err = 'Unknown accessor mode \'bytes\''
+        with self.assertRaises(Exception) as context:
+            evt.accessor('next_comm', mode='bytes')
+        self.assertTrue(err in str(context.exception))
+
+    def test_parse_record(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        s = ft.stream(instance=inst, batch=4)
+        batch = next(s)
+        s.close()
+        fields = ['prev_comm', 'prev_pid', 'next_pid']
+        for event, record in batch:
+            values = event.parse_record(record, fields)
+            self.assertEqual(len(values), 3)
+            for f, val in zip(fields, values):
+                self.assertEqual(event.parse_record_field(record=record,
+                                                          field=f), val)
+
+            values = event.parse_record(record, fields, as_dict=True)
+            self.assertEqual(list(values.keys()), fields)
+
+            values = event.parse_record(record=record, as_dict=True)
+            self.assertEqual(list(values.keys()), event.field_names())
+
+        err = 'Failed to find field \'no_field\''
+        with self.assertRaises(Exception) as context:
+            event.parse_record(record, ['prev_pid', 'no_field'])
+        self.assertTrue(err in str(context.exception))
+
 
 class TracersTestCase(unittest.TestCase):
     def test_available_tracers(self):
@@ -475,6 +620,37 @@ class KprobeTestCase(unittest.TestCase):
         ret = kp1.is_enabled(instance=inst)
         self.assertEqual(ret, '0')
 
+    def test_array_kprobe(self):
+        fields = tc.kprobe_add_array_arg(name='arr', param_id=2,
+                                         param_type='x64', size=4)
+        self.assertEqual(list(fields.keys()), ['arr0', 'arr1', 'arr2', 'arr3'])
+
+        probe = ' '.join(['{0}={1}'.format(f, fields[f]) for f in fields])
+        kp = ft.kprobe(event='arr', function='do_sys_openat2', probe=probe)
+        kp.register()
+        inst = ft.create_instance(instance_name)
+        kp.enable(instance=inst)
+        s = ft.stream(instance=inst, batch=1)
+        subprocess.run(['cat', '/dev/null'])
+        event, record = next(s)[0]
+        s.close()
+
+        arr = tc.kprobe_parse_record_array_field(event, record, 'arr')
+        self.assertEqual(len(arr), 4)
+        for i in range(4):
+            val = event.parse_record_field(record=record,
+                                           field='arr' + str(i))
+            self.assertEqual(arr[i] & 0xffffffffffffffff,
+                             val & 0xffffffffffffffff)
+
+        arr = event.parse_record_array(record=record, field='arr', size=2)
+        self.assertEqual(len(arr), 2)
+
+        err = 'Failed to find field \'no_arr0\''
+        with self.assertRaises(Exception) as context:
+            event.parse_record_array(record=record, field='no_arr')
+        self.assertTrue(err in str(context.exception))
+
 class EprobeTestCase(unittest.TestCase):
     def test_eprobe(self):
         """ Event probes are introduced in Linux kernel 5.15
@@ -935,6 +1111,385 @@ class SynthOopTestCase(unittest.TestCase):
         split_4 = hist_e.split('trace(')
         self.assertTrue('$' + arg3 in split_4[1])
 
+batch_sizes = []
+
+def batch_callback(batch):
+    batch_sizes.append(len(batch))
+    for event, record in batch:
+        if event.name() != 'sched_switch':
+            return 1
+
+parallel_records = []
+
+def parallel_callback(event, record):
+    parallel_records.append((event.name(), record.CPU()))
+    if len(parallel_records) >= 100:
+        return 1
+
+filtered_events = []
+
+def filter_callback(event, record):
+    filtered_events.append(event.name())
+
+kept_records = []
+kept_views = []
+event_objects = {}
+
+def reuse_callback(event, record):
+    event_objects.setdefault(event.name(), set()).add(id(event))
+    if len(kept_records) < 2:
+        kept_records.append((record, record.time()))
+
+    if len(kept_views) < 2:
+        comm_raw = event.accessor('next_comm', mode='raw')
+        comm = event.parse_record_field(record=record, field='next_comm')
+        kept_views.append((comm_raw(record), comm))
+
+window_records = []
+nr_window_records = [0]
+
+def window_callback(event, record):
+    pid = event.parse_record_field(record=record, field='next_pid')
+    window_records.append((event, record, record.time(), pid))
+    if len(window_records) > 8:
+        del window_records[0]
+
+    nr_window_records[0] += 1
+    if nr_window_records[0] >= 200:
+        return 1
+
+agg_records = []
+
+def agg_callback(event, record):
+    prev_pid = event.parse_record_field(record=record, field='prev_pid')
+    agg_records.append((record.CPU(), prev_pid))
+
+class IterateTraceTestCase(unittest.TestCase):
+    name_test_app = 'testapp/tc-test-app'
+    def test_parallel(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        parallel_records.clear()
+        p = subprocess.Popen([self.name_test_app, '-t', '500'])
+        ft.iterate_trace(instance=inst,
+                         plugin=__name__,
+                         callback='parallel_callback',
+                         parallel=True,
+                         pin=True)
+        p.wait()
+        self.assertEqual(len(parallel_records), 100)
+        for name, cpu in parallel_records:
+            self.assertEqual(name, 'sched_switch')
+            self.assertTrue(cpu >= 0 and cpu < os.cpu_count())
+
+    def test_retain_records(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        window_records.clear()
+        nr_window_records[0] = 0
+        p = subprocess.Popen([self.name_test_app, '-t', '500'])
+        ft.iterate_trace(instance=inst,
+                         plugin=__name__,
+                         callback='window_callback',
+                         parallel=True)
+        p.wait()
+        self.assertEqual(len(window_records), 8)
+        for event, record, ts, pid in window_records:
+            self.assertEqual(record.time(), ts)
+            self.assertEqual(event.parse_record_field(record=record,
+                                                      field='next_pid'), pid)
+
+class StreamTestCase(unittest.TestCase):
+    name_test_app = 'testapp/tc-test-app'
+    def test_stream(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        p = subprocess.Popen([self.name_test_app, '-t', '500'])
+        s = ft.stream(instance=inst, batch=8)
+        batch = next(s)
+        event, record = batch[0]
+        ts = record.time()
+        n = len(batch)
+        del batch
+        self.assertEqual(record.time(), ts)
+        self.assertEqual(event.name(), 'sched_switch')
+        for batch in s:
+            self.assertTrue(len(batch) > 0 and len(batch) <= 8)
+            for event, record in batch:
+                self.assertEqual(event.name(), 'sched_switch')
+            n += len(batch)
+            if n > 32:
+                break
+
+        s.stop()
+        for batch in s:
+            self.assertTrue(len(batch) <= 8)
+            n += len(batch)
+
+        stats = s.stats()
+        self.assertEqual(stats['delivered'], n)
+        self.assertEqual(len(stats['cpus']), os.cpu_count())
+
+        s.close()
+        p.wait()
+        with self.assertRaises(StopIteration):
+            next(s)
+
+        self.assertEqual(s.stats()['delivered'], n)
+
+        err = 'Invalid batch size'
+        with self.assertRaises(Exception) as context:
+            s = ft.stream(instance=inst, batch=0)
+        self.assertTrue(err in str(context.exception))
+
+    def test_async_stream(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        p = subprocess.Popen([self.name_test_app, '-t', '500'])
+        s = tc.tc_async_stream(instance=inst, batch=8)
+        self.assertTrue(s.fileno() >= 0)
+
+        async def consume():
+            n = 0
+            async for batch in s:
+                self.assertTrue(len(batch) > 0 and len(batch) <= 8)
+                n += len(batch)
+                if n > 32:
+                    s.stop()
+            return n
+
+        self.assertTrue(asyncio.run(consume()) > 32)
+        s.close()
+        p.wait()
+
+class TraceProcessTestCase(unittest.TestCase):
+    name_test_app = 'testapp/tc-test-app'
+    def test_batch(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        batch_sizes.clear()
+        ft.trace_process(instance=inst,
+                         argv=[self.name_test_app, '-t', '200'],
+                         plugin=__name__,
+                         callback='batch_callback',
+                         batch=16)
+        self.assertTrue(len(batch_sizes) > 0)
+        self.assertTrue(max(batch_sizes) <= 16)
+
+        err = 'Invalid batch size'
+        with self.assertRaises(Exception) as context:
+            ft.trace_process(instance=inst,
+                             argv=[self.name_test_app, '-t', '200'],
+                             plugin=__name__,
+                             callback='batch_callback',
+                             batch=-2)
+        self.assertTrue(err in str(context.exception))
+
+    def test_filter(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_events(instance=inst,
+                         events={'sched': ['sched_switch', 'sched_wakeup']})
+        f = ft.record_filter(expression='sched/sched_switch: prev_state != 0')
+        filtered_events.clear()
+        ft.trace_process(instance=inst,
+                         argv=[self.name_test_app, '-t', '200'],
+                         plugin=__name__,
+                         callback='filter_callback',
+                         filter=f)
+        self.assertTrue(len(filtered_events) > 0)
+        self.assertEqual(set(filtered_events), {'sched_switch'})
+
+        f = ft.record_filter(pids=[1, 5, 3, 5], follow_fork=True)
+        self.assertEqual(f.pids(), [1, 3, 5])
+
+        err = 'Failed to compile filter'
+        with self.assertRaises(Exception) as context:
+            f = ft.record_filter(expression='sched/sched_switch: no_field == 1')
+            ft.trace_process(instance=inst,
+                             argv=[self.name_test_app, '-t', '200'],
+                             plugin=__name__,
+                             callback='filter_callback',
+                             filter=f)
+        self.assertTrue(err in str(context.exception))
+
+    def test_aggregator(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        count = ft.aggregator(type='count', keys='pid')
+        hist = ft.aggregator(type='hist_log2', event='sched/sched_switch',
+                             field='prev_pid', keys=['cpu'])
+        # No callback is imported when only aggregating.
+        ft.trace_process(instance=inst,
+                         argv=[self.name_test_app, '-t', '200'],
+                         aggregators=[count, hist])
+        self.assertEqual(count.keys(), ['pid'])
+        data = count.data()
+        self.assertTrue(len(data) > 0)
+        self.assertTrue(all(v > 0 for v in data.values()))
+
+        data = hist.data(as_numpy=True)
+        self.assertEqual(data['keys'].shape[1], 1)
+        self.assertEqual(data['values'].shape, (len(data['keys']), 64))
+
+        hist.clear()
+        self.assertEqual(hist.data(), {})
+
+        # Compare with the records delivered to Python.
+        count = ft.aggregator(type='count', keys='cpu')
+        total = ft.aggregator(type='sum', event='sched/sched_switch',
+                              field='prev_pid', keys='cpu')
+        hist = ft.aggregator(type='hist_linear', event='sched/sched_switch',
+                             field='prev_pid', bins=2, min=1, step=100)
+        agg_records.clear()
+        ft.trace_process(instance=inst,
+                         argv=[self.name_test_app, '-t', '200'],
+                         plugin=__name__,
+                         callback='agg_callback',
+                         aggregators=[count, total, hist])
+        self.assertTrue(len(agg_records) > 0)
+        expected_count, expected_total = {}, {}
+        expected_hist = [0] * 4
+        for cpu, pid in agg_records:
+            expected_count[cpu] = expected_count.get(cpu, 0) + 1
+            expected_total[cpu] = expected_total.get(cpu, 0) + pid
+            if pid < 1:
+                expected_hist[0] += 1
+            elif pid >= 201:
+                expected_hist[3] += 1
+            else:
+                expected_hist[1 + (pid - 1) // 100] += 1
+
+        self.assertEqual(count.data(), expected_count)
+        self.assertEqual(total.data(), expected_total)
+        self.assertEqual(hist.data(), {(): expected_hist})
+
+        err = 'requires \'event\' and \'field\''
+        with self.assertRaises(Exception) as context:
+            ft.aggregator(type='sum', keys='pid')
+        self.assertTrue(err in str(context.exception))
+
+        err = '\'field\' requires \'event\''
+        with self.assertRaises(Exception) as context:
+            ft.aggregator(type='count', field='prev_pid')
+        self.assertTrue(err in str(context.exception))
+
+    def test_reuse_objects(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        kept_records.clear()
+        kept_views.clear()
+        event_objects.clear()
+        ft.trace_process(instance=inst,
+                         argv=[self.name_test_app, '-t', '200'],
+                         plugin=__name__,
+                         callback='reuse_callback')
+        self.assertEqual(len(event_objects['sched_switch']), 1)
+        self.assertEqual(len(kept_records), 2)
+        self.assertFalse(kept_records[0][0] is kept_records[1][0])
+        for record, ts in kept_records:
+            self.assertEqual(record.time(), ts)
+
+        self.assertEqual(len(kept_views), 2)
+        for view, comm in kept_views:
+            self.assertIsInstance(view, memoryview)
+            self.assertEqual(bytes(view), comm.encode())
+
+    def test_stats(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_events(instance=inst,
+                         events={'sched': ['sched_switch', 'sched_wakeup']})
+        f = ft.record_filter(expression='sched/sched_switch: prev_pid >= 0')
+        stats = ft.trace_process(instance=inst,
+                                 argv=[self.name_test_app, '-t', '200'],
+                                 callback=None,
+                                 filter=f)
+        self.assertTrue(stats['delivered'] > 0)
+        self.assertTrue(stats['filtered'] > 0)
+        self.assertTrue(stats['bytes'] > 0)
+        self.assertTrue(stats['native_time'] > 0)
+        self.assertEqual(stats['python_time'], 0)
+        self.assertEqual(stats['delivered'],
+                         sum(c['delivered'] for c in stats['cpus']))
+        for key in ['missed_events', 'overrun', 'dropped']:
+            self.assertTrue(stats[key] >= 0)
+
+    def test_record(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        file_name = 'test_record.dat'
+        stats = ft.record(output_file=file_name, instance=inst,
+                          argv=[self.name_test_app, '-t', '200'])
+        self.assertTrue('overrun' in stats and 'dropped' in stats)
+        self.assertTrue(os.path.isfile(file_name))
+        with open(file_name, 'rb') as f:
+            self.assertEqual(f.read(12), b'\x17\x08\x44tracing6\x00')
+        self.assertTrue(os.path.getsize(file_name) > 0)
+
+        sd = ks.open(file_name)
+        data = dw.load(sd)
+        self.assertTrue(data['time'].size > 0)
+        self.assertTrue((data['time'][1:] >= data['time'][:-1]).all())
+        ss_id = ks.event_id(stream_id=sd, name='sched/sched_switch')
+        self.assertTrue((data['event'] == ss_id).any())
+        ks.close()
+        os.remove(file_name)
+
+        ft.record(output_file=file_name, instance=inst, time=100)
+        self.assertTrue(os.path.isfile(file_name))
+        os.remove(file_name)
+
+    def test_collect(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        data = ft.collect_trace(instance=inst,
+                                argv=[self.name_test_app, '-t', '200'],
+                                fields={'sched/sched_switch': ['prev_pid', 'next_pid'],
+                                        'sched/sched_waking': ['pid']})
+        columns = ['event', 'cpu', 'pid', 'time',
+                   'sched/sched_switch/prev_pid',
+                   'sched/sched_switch/next_pid',
+                   'sched/sched_waking/pid']
+        self.assertEqual(sorted(data.keys()), sorted(columns))
+        size = data['time'].size
+        self.assertTrue(size > 0)
+        for c in columns:
+            self.assertEqual(data[c].size, size)
+
+        # The "pid" field does not replace the built-in (int32) column.
+        self.assertEqual(data['pid'].dtype.itemsize, 4)
+
+        data, stats = ft.collect_trace(instance=inst, max_records=10,
+                                       argv=[self.name_test_app, '-t', '200'],
+                                       stats=True)
+        self.assertTrue(data['time'].size <= 10)
+        self.assertEqual(stats['delivered'], data['time'].size)
+
+        err = 'Failed to find field'
+        with self.assertRaises(Exception) as context:
+            ft.collect_trace(instance=inst,
+                             fields={'sched/sched_switch': ['no_field']})
+        self.assertTrue(err in str(context.exception))
+
+    def test_release_gil(self):
+        inst = ft.create_instance(instance_name)
+        ft.enable_event(instance=inst, system='sched', event='sched_switch')
+        ticks = []
+        done = threading.Event()
+
+        def ticker():
+            while not done.is_set():
+                ticks.append(time.monotonic())
+                time.sleep(0.01)
+
+        t = threading.Thread(target=ticker)
+        t.start()
+        t_start = time.monotonic()
+        ft.collect_trace(instance=inst, time=500)
+        t_end = time.monotonic()
+        done.set()
+        t.join()
+        self.assertTrue(len([t for t in ticks if t_start < t < t_end]) > 10)
+
 class CondWaitTestCase(unittest.TestCase):
     name_test_app = 'testapp/tc-test-app'
     def test_app_check(self):
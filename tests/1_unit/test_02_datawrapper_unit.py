@@ -9,8 +9,11 @@ Copyright 2021 VMware Inc, Yordan Karadzhov (VMware) <y.karadz@gmail.com>
 import os
 import sys
 import unittest
+import tempfile
+import numpy as np
 import tracecruncher.ksharkpy as ks
 import tracecruncher.npdatawrapper as dw
+import tracecruncher.ks_utils as tc
 
 file_1 = 'testdata/trace_test1.dat'
 
@@ -36,6 +39,156 @@ class DwPyTestCase(unittest.TestCase):
 
         ks.close()
 
+    def test_load_fields(self):
+        sd = ks.open(file_1)
+        ss_id = ks.event_id(stream_id=sd, name='sched/sched_switch')
+        fields = {'sched/sched_switch': ['next_pid', 'prev_state']}
+        data = dw.load(sd, fields=fields)
+        self.assertEqual(len(dw.columns()) + 2, len(data))
+
+        next_pid = data['sched/sched_switch/next_pid']
+        self.assertEqual(next_pid.size, 1530)
+        self.assertEqual(data['sched/sched_switch/prev_state'].size, 1530)
+
+        mask = data['event'] == ss_id
+        self.assertTrue((next_pid[~mask] == dw.field_fill_value).all())
+        for i in mask.nonzero()[0][:5]:
+            pid = ks.read_event_field(stream_id=sd,
+                                      offset=data['offset'][i],
+                                      event_id=ss_id,
+                                      field='next_pid')
+            self.assertEqual(next_pid[i], pid)
+
+        data_ts = dw.load(sd, evt_data=False,
+                              cpu_data=False,
+                              pid_data=False,
+                              ofst_data=False,
+                              fields={'sched/sched_switch': 'next_pid'},
+                              fill_value=-1)
+        self.assertEqual(2, len(data_ts))
+        self.assertEqual(data_ts['sched/sched_switch/next_pid'][~mask][0], -1)
+
+        err = 'Failed to find field'
+        with self.assertRaises(Exception) as context:
+            dw.load(sd, fields={'sched/sched_switch': ['no_field']})
+        self.assertTrue(err in str(context.exception))
+
+        ks.close()
+
+    def test_load_chunks(self):
+        sd = ks.open(file_1)
+        data = dw.load(sd)
+
+        chunks = list(dw.load_chunks(sd, rows=100))
+        self.assertEqual(len(chunks), 16)
+        for c in chunks[:-1]:
+            self.assertEqual(c['time'].size, 100)
+
+        for col in dw.columns():
+            merged = np.concatenate([c[col] for c in chunks])
+            self.assertTrue((merged == data[col]).all())
+
+        span = int(data['time'][-1] - data['time'][0]) // 4 + 1
+        chunks = list(dw.load_chunks(sd, time_span=span, pid_data=False,
+                                         cpu_data=False))
+        self.assertTrue(len(chunks) <= 4)
+        self.assertEqual(sum(c['time'].size for c in chunks), 1530)
+        for c in chunks:
+            self.assertEqual(len(c), 3)
+            self.assertTrue(int(c['time'][-1] - c['time'][0]) < span)
+
+        fields = {'sched/sched_switch': ['next_pid']}
+        data = dw.load(sd, fields=fields)
+        chunks = dw.load_chunks(sd, rows=500, fields=fields)
+        merged = np.concatenate([c['sched/sched_switch/next_pid'] for c in chunks])
+        self.assertTrue((merged == data['sched/sched_switch/next_pid']).all())
+
+        err = 'must be limited'
+        with self.assertRaises(Exception) as context:
+            dw.load_chunks(sd)
+        self.assertTrue(err in str(context.exception))
+
+        err = 'Failed to find field'
+        with self.assertRaises(Exception) as context:
+            dw.load_chunks(sd, rows=10, fields={'sched/sched_switch': 'no_field'})
+        self.assertTrue(err in str(context.exception))
+
+        ks.close()
+
+    def test_load_window(self):
+        sd = ks.open(file_1)
+        data = dw.load(sd)
+        tmin = int(data['time'][300])
+        tmax = int(data['time'][900])
+
+        win = dw.load(sd, tmin=tmin, tmax=tmax)
+        self.assertEqual(len(dw.columns()), len(win))
+        mask = (data['time'] >= tmin) & (data['time'] <= tmax)
+        for col in dw.columns():
+            self.assertTrue((win[col] == data[col][mask]).all())
+
+        cpu = int(data['cpu'][0])
+        win = dw.load(sd, cpus=[cpu], ts_data=False)
+        self.assertEqual(len(dw.columns()) - 1, len(win))
+        mask = data['cpu'] == cpu
+        self.assertEqual(win['cpu'].size, np.count_nonzero(mask))
+        self.assertTrue((win['offset'] == data['offset'][mask]).all())
+
+        win = dw.load(sd, tmin=tmin, tmax=tmax, cpus=[cpu])
+        mask = (data['time'] >= tmin) & (data['time'] <= tmax) & (data['cpu'] == cpu)
+        self.assertTrue((win['time'] == data['time'][mask]).all())
+
+        win = dw.load(sd, tmin=int(data['time'][-1]) + 1)
+        self.assertEqual(len(dw.columns()), len(win))
+        self.assertEqual(win['time'].size, 0)
+
+        win = dw.load(sd, cpus=[])
+        self.assertEqual(len(dw.columns()), len(win))
+        self.assertEqual(win['cpu'].size, 0)
+
+        err = 'Invalid CPU'
+        with self.assertRaises(Exception) as context:
+            dw.load(sd, cpus=[1024])
+        self.assertTrue(err in str(context.exception))
+
+        ks.close()
+
+    def test_load_cache(self):
+        with tempfile.TemporaryDirectory() as cache_dir:
+            cache_file = os.path.join(cache_dir, 'trace_test1.tccache')
+            f = tc.tc_file_stream(file_1)
+            data = f.load()
+
+            cached = f.load(cache=cache_file)
+            self.assertTrue(os.path.exists(cache_file))
+            for col in dw.columns():
+                self.assertTrue((cached[col] == data[col]).all())
+
+            cached = f.load(cache=cache_file, pid_data=False)
+            self.assertEqual(len(dw.columns()) - 1, len(cached))
+            self.assertTrue(isinstance(cached['time'].base, np.memmap))
+            self.assertFalse(cached['time'].flags.writeable)
+
+            fields = {'sched/sched_switch': ['next_pid']}
+            column = 'sched/sched_switch/next_pid'
+            data = f.load(fields=fields)
+            cached = f.load(cache=cache_file, fields=fields)
+            self.assertTrue((cached[column] == data[column]).all())
+
+            data = f.load(fields=fields, fill_value=-1)
+            cached = f.load(cache=cache_file, fields=fields, fill_value=-1)
+            self.assertTrue((cached[column] == data[column]).all())
+
+            tmin = int(data['time'][300])
+            tmax = int(data['time'][900])
+            cpu = int(data['cpu'][0])
+            data = f.load(tmin=tmin, tmax=tmax, cpus=[cpu])
+            cached = f.load(cache=cache_file, tmin=tmin, tmax=tmax, cpus=[cpu])
+            for col in dw.columns():
+                self.assertTrue((cached[col] == data[col]).all())
+
+            f.close()
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -67,6 +67,57 @@ class KsPyTestCase(unittest.TestCase):
                                     field='next_pid')
         self.assertEqual(next_pid, 4182)
 
+    def test_read_field_array(self):
+        sd = ks.open(file_1)
+        data = dw.load(sd)
+        mask = data['event'] == ss_id
+        offsets = data['offset'][mask]
+
+        next_pid = ks.read_event_field(stream_id=sd,
+                                       offset=offsets,
+                                       event_id=ss_id,
+                                       field='next_pid')
+        self.assertEqual(next_pid.size, offsets.size)
+        for i in [0, offsets.size // 2, offsets.size - 1]:
+            pid = ks.read_event_field(stream_id=sd,
+                                      offset=int(offsets[i]),
+                                      event_id=ss_id,
+                                      field='next_pid')
+            self.assertEqual(next_pid[i], pid)
+
+        pid_masked = ks.read_event_field(stream_id=sd,
+                                         offset=data['offset'],
+                                         mask=mask,
+                                         event_id=ss_id,
+                                         field='next_pid')
+        self.assertTrue((pid_masked == next_pid).all())
+
+        fields = ks.read_event_field(stream_id=sd,
+                                     offset=offsets[::-1],
+                                     event_id=ss_id,
+                                     field=['next_pid', 'prev_pid'])
+        self.assertEqual(len(fields), 2)
+        self.assertTrue((fields['next_pid'] == next_pid[::-1]).all())
+        self.assertEqual(fields['prev_pid'].size, offsets.size)
+
+        for ofst in [offsets[0], offsets[0:1].reshape(())]:
+            pid = ks.read_event_field(stream_id=sd,
+                                      offset=ofst,
+                                      event_id=ss_id,
+                                      field='next_pid')
+            self.assertIsInstance(pid, int)
+            self.assertEqual(pid, next_pid[0])
+
+        err = 'Failed to read field'
+        with self.assertRaises(Exception) as context:
+            ks.read_event_field(stream_id=sd,
+                                offset=offsets,
+                                event_id=ss_id,
+                                field='no_field')
+        self.assertTrue(err in str(context.exception))
+
+        ks.close()
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -7,6 +7,7 @@ Copyright 2019 VMware Inc, Yordan Karadzhov (VMware) <y.karadz@gmail.com>
 import sys
 import time
 import ctypes
+import asyncio
 
 from . import ftracepy as ft
 
@@ -359,7 +360,9 @@ def kprobe_add_array_arg(name, param_id, param_type, offset=0,
         field_name = name + str(i)
         probe = '+{0}(+{1}'.format(offset, i * ptr_size)
         probe += '($arg{0})):{1}'.format(param_id, param_type)
-        return kprobe_add_raw_field(name=field_name, probe=probe, fields=fields)
+        fields = kprobe_add_raw_field(name=field_name, probe=probe, fields=fields)
+
+    return fields
 
 
 def kprobe_add_string_arg(name, param_id, offset=0, usr_space=False, fields=None):
@@ -438,24 +441,17 @@ def kprobe_parse_record_array_field(event, record, field, size=-1):
         The event descriptor.
     record : PyTepRecord
         The record.
+    field : string
+        The name of the array field.
+    size : int
+        The maximum number of elements. If not provided, all recorded elements are returned.
 
     Returns
     -------
-    fields : list of int or string
+    fields : NumPy array of int or list of string
         The values of the array field.
     """
-    if size < 0:
-        size = 10
-
-    arr = []
-    for i in range(size):
-        field_name = field + str(i)
-        val = event.parse_record_field(record=record, field=field_name)
-        if (val == '(nil)'):
-            break
-        arr.append(val)
-
-    return arr
+    return event.parse_record_array(record=record, field=field, size=size)
 
 
 class tc_kretval_probe(_kprobe_base):
@@ -1030,3 +1026,88 @@ def synth_field_sum(name, start_field, end_field):
         A field from the end event
     """
     return 'sum {0} {1} {2}'.format(name, start_field, end_field)
+
+
+class tc_async_stream:
+    """
+    A class used to represent a stream of live trace data, that can be consumed
+    by 'async for' loops. No threads are used. The ring buffers are watched by
+    the asyncio event loop, hence one loop can serve several streams (instances).
+
+    Attributes
+    ----------
+    stream : PyTraceStream
+        Low-level stream object.
+    poll_interval : float
+        The kernel wakes up the readers only when the ring buffer is filled above
+        the watermark (see 'buffer_percent'). The available data is also read
+        periodically, using this interval (in seconds).
+    """
+    def __init__(self, instance=None, batch=1024, filter=None, buffer_pages=0,
+                 poll_interval=0.1):
+        """
+        Constructor.
+
+        Parameters
+        ----------
+        instance : PyTfsInstance (optional)
+            The Ftrace instance. This argument is optional. If not provided, the 'top' instance is used.
+        batch : int (optional)
+            The maximum number of records in one batch.
+        filter : PyRecordFilter (optional)
+            Filter evaluated before the records are added to the batch.
+        buffer_pages : int (optional)
+            The number of pages buffered per CPU.
+        poll_interval : float (optional)
+            Interval (in seconds) for reading the data that did not wake up the reader.
+        """
+        kwargs = {'batch': batch, 'buffer_pages': buffer_pages, 'threads': False}
+        if instance is not None:
+            kwargs['instance'] = instance
+
+        if filter is not None:
+            kwargs['filter'] = filter
+
+        self.stream = ft.stream(**kwargs)
+        self.poll_interval = poll_interval
+
+    def fileno(self):
+        """
+        Get the file descriptor watched by the event loop.
+        """
+        return self.stream.fileno()
+
+    def stop(self):
+        """
+        Stop reading. The iteration ends once the buffered records are consumed.
+        """
+        self.stream.stop()
+
+    def close(self):
+        """
+        Stop reading and release the buffers.
+        """
+        self.stream.close()
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        loop = asyncio.get_running_loop()
+        fd = self.stream.fileno()
+        while True:
+            try:
+                batch = self.stream.read_batch()
+            except StopIteration:
+                raise StopAsyncIteration
+
+            if batch is not None:
+                return batch
+
+            ready = loop.create_future()
+            loop.add_reader(fd, lambda: ready.done() or ready.set_result(None))
+            try:
+                await asyncio.wait({ready}, timeout=self.poll_interval)
+            finally:
+                loop.remove_reader(fd)
+                ready.cancel()
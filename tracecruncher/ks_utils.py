@@ -6,10 +6,24 @@ Copyright 2019 VMware Inc, Yordan Karadzhov (VMware) <y.karadz@gmail.com>
 
 import os
 import json
+import struct
+import hashlib
+import tempfile
+
+import numpy as np
 
 from . import npdatawrapper as dw
 from . import ksharkpy as ks
 
+# Layout of the columnar cache file: magic, length of the JSON header,
+# JSON header, data columns (each aligned to 'cache_align' bytes).
+cache_magic = b'TCCACHE1'
+cache_align = 64
+
+# Number of bytes from the beginning and from the end of the trace file
+# used to compute the hash that identifies the file.
+cache_hash_size = 1 << 20
+
 
 def size(data):
     """ Get the number of trace records.
@@ -21,6 +35,101 @@ def size(data):
     raise Exception('Data size is unknown.')
 
 
+def cache_key(file_name, buffer_name, clock_offset):
+    """ Identify the decoded data of a trace file by the size, the
+        modification time and the hash of the file (only its beginning and
+        its end are hashed), the buffer and the clock offset.
+    """
+    stat = os.stat(file_name)
+    digest = hashlib.blake2b(digest_size=16)
+    with open(file_name, 'rb') as f:
+        digest.update(f.read(cache_hash_size))
+        if stat.st_size > cache_hash_size:
+            f.seek(max(cache_hash_size, stat.st_size - cache_hash_size))
+            digest.update(f.read(cache_hash_size))
+
+    return {'size': stat.st_size,
+            'mtime': stat.st_mtime_ns,
+            'hash': digest.hexdigest(),
+            'buffer': buffer_name,
+            'clock_offset': clock_offset}
+
+
+def read_cache(cache_file, key):
+    """ Map the columnar cache file into memory. The returned arrays share
+        the (read-only) mapping of the file. Returns None if the file does
+        not exist or does not match the key.
+    """
+    try:
+        buf = np.memmap(cache_file, dtype=np.uint8, mode='r')
+    except (OSError, ValueError):
+        return None
+
+    try:
+        magic = bytes(buf[:len(cache_magic)])
+        if magic != cache_magic:
+            return None
+
+        pos = len(cache_magic)
+        header_size, = struct.unpack('<Q', bytes(buf[pos:pos + 8]))
+        pos += 8
+        header = json.loads(bytes(buf[pos:pos + header_size]))
+        if header['key'] != key:
+            return None
+
+        data = {}
+        for name, col in header['columns'].items():
+            data[name] = np.frombuffer(buf, dtype=np.dtype(col['dtype']),
+                                       count=header['rows'],
+                                       offset=col['offset'])
+    except (ValueError, KeyError, struct.error):
+        return None
+
+    return data
+
+
+def write_cache(cache_file, key, data):
+    """ Write the data columns into a columnar cache file. The file is
+        replaced atomically, so that readers already mapping the old file
+        are not affected.
+    """
+    rows = size(data)
+    columns = {}
+    header_size = 4096
+    while True:
+        offset = len(cache_magic) + 8 + header_size
+        for name, col in data.items():
+            offset = (offset + cache_align - 1) // cache_align * cache_align
+            columns[name] = {'dtype': col.dtype.str, 'offset': offset}
+            offset += col.nbytes
+
+        header = json.dumps({'key': key, 'rows': rows,
+                             'columns': columns}).encode()
+        if len(header) <= header_size:
+            break
+
+        header_size *= 2
+
+    header = header.ljust(header_size)
+    cache_dir = os.path.dirname(os.path.abspath(cache_file))
+    os.makedirs(cache_dir, exist_ok=True)
+    fd, tmp_file = tempfile.mkstemp(dir=cache_dir, suffix='.tmp')
+    try:
+        os.fchmod(fd, 0o644)
+        with os.fdopen(fd, 'wb') as f:
+            f.write(cache_magic)
+            f.write(struct.pack('<Q', header_size))
+            f.write(header)
+            for name, col in data.items():
+                f.seek(columns[name]['offset'])
+                f.write(np.ascontiguousarray(col).tobytes())
+
+        os.replace(tmp_file, cache_file)
+    except BaseException:
+        os.unlink(tmp_file)
+        raise
+
+
 class tc_file_stream:
     def __init__(self, file_name='', buffer_name='top'):
         """ Constructor.
@@ -28,6 +137,7 @@ class tc_file_stream:
         self.file_name = file_name
         self.buffer_name = buffer_name
         self.stream_id = -1
+        self.clock_offset = 0
 
         if file_name:
             self.open(file_name)
@@ -57,17 +167,160 @@ class tc_file_stream:
             data stream.
         """
         ks.set_clock_offset(stream_id=self.stream_id, offset=offset)
+        self.clock_offset = offset
 
     def load(self, cpu_data=True, pid_data=True, evt_data=True,
-             ofst_data=True, ts_data=True):
-        """ Load the trace data.
+             ofst_data=True, ts_data=True, fields=None,
+             fill_value=dw.field_fill_value, tmin=None, tmax=None, cpus=None,
+             cache=False):
+        """ Load the trace data. The values of the event fields listed in
+            'fields' are loaded into additional columns. The data can be
+            restricted to the time window [tmin, tmax] and to a list of CPUs.
+            If 'cache' is True (or the path of a cache file), the decoded
+            columns are stored in a cache file and the following loads map
+            this file into memory instead of decoding the trace again.
         """
+        if cache:
+            cache_file = self.cache_file() if cache is True else cache
+            return self.load_cached(cache_file=cache_file,
+                                    ofst_data=ofst_data,
+                                    cpu_data=cpu_data,
+                                    ts_data=ts_data,
+                                    pid_data=pid_data,
+                                    evt_data=evt_data,
+                                    fields=fields,
+                                    fill_value=fill_value,
+                                    tmin=tmin,
+                                    tmax=tmax,
+                                    cpus=cpus)
+
         return dw.load(stream_id=self.stream_id,
                        ofst_data=ofst_data,
                        cpu_data=cpu_data,
                        ts_data=ts_data,
                        pid_data=pid_data,
-                       evt_data=evt_data)
+                       evt_data=evt_data,
+                       fields=fields,
+                       fill_value=fill_value,
+                       tmin=tmin,
+                       tmax=tmax,
+                       cpus=cpus)
+
+    def iter_chunks(self, rows=0, time_span=0, cpu_data=True, pid_data=True,
+                    evt_data=True, ofst_data=True, ts_data=True, fields=None,
+                    fill_value=dw.field_fill_value, tmin=None, tmax=None,
+                    cpus=None):
+        """ Load the trace data in successive chunks of at most 'rows' rows
+            or spanning at most 'time_span' nanoseconds. The peak memory
+            does not depend on the size of the trace.
+        """
+        return dw.load_chunks(stream_id=self.stream_id,
+                              rows=rows,
+                              time_span=time_span,
+                              ofst_data=ofst_data,
+                              cpu_data=cpu_data,
+                              ts_data=ts_data,
+                              pid_data=pid_data,
+                              evt_data=evt_data,
+                              fields=fields,
+                              fill_value=fill_value,
+                              tmin=tmin,
+                              tmax=tmax,
+                              cpus=cpus)
+
+    def cache_file(self):
+        """ The default columnar cache file of this data stream. It is
+            placed next to the trace file, or in the user's cache directory
+            if the directory of the trace file is not writable.
+        """
+        name = os.path.abspath(self.file_name)
+        if self.buffer_name != 'top':
+            name += '.' + self.buffer_name
+
+        name += '.tccache'
+        if os.access(os.path.dirname(name), os.W_OK):
+            return name
+
+        cache_dir = os.environ.get('XDG_CACHE_HOME',
+                                   os.path.expanduser('~/.cache'))
+        digest = hashlib.blake2b(name.encode(), digest_size=16).hexdigest()
+
+        return os.path.join(cache_dir, 'tracecruncher', digest + '.tccache')
+
+    def load_cached(self, cache_file, cpu_data=True, pid_data=True,
+                    evt_data=True, ofst_data=True, ts_data=True, fields=None,
+                    fill_value=dw.field_fill_value, tmin=None, tmax=None,
+                    cpus=None):
+        """ Load the trace data from a columnar cache file. The columns
+            missing in the cache are decoded and added to the cache file.
+            The returned arrays are read-only views of the file mapping,
+            with two exceptions. If 'cpus' is given, the selected rows are
+            copied into memory. If 'fill_value' differs from the default,
+            the field columns are copied, because the cached columns use
+            the default fill value. Only the rows inside [tmin, tmax] are
+            copied.
+        """
+        key = cache_key(self.file_name, self.buffer_name, self.clock_offset)
+        cached = read_cache(cache_file, key) or {}
+
+        events, names = dw.field_projection(fields)
+        field_columns = [dw.field_column(e, n) for e, n in zip(events, names)]
+
+        missing_fields = {}
+        for event, name, column in zip(events, names, field_columns):
+            if column not in cached:
+                missing_fields.setdefault(event.decode(), []).append(name.decode())
+
+        missing = [c not in cached for c in dw.columns()]
+        if any(missing) or missing_fields:
+            # The cached field columns always use the default fill value.
+            new = dw.load(stream_id=self.stream_id,
+                          evt_data=missing[0],
+                          cpu_data=missing[1],
+                          pid_data=missing[2],
+                          ofst_data=missing[3],
+                          ts_data=missing[4],
+                          fields=missing_fields)
+            cached.update(new)
+            try:
+                write_cache(cache_file, key, cached)
+                cached = read_cache(cache_file, key) or cached
+            except OSError:
+                pass
+
+        requested = [evt_data, cpu_data, pid_data, ofst_data, ts_data]
+        data = {c: cached[c] for c, r in zip(dw.columns(), requested) if r}
+
+        for column in field_columns:
+            data[column] = cached[column]
+
+        # The records are sorted in time.
+        first, last = 0, cached['time'].size
+        if tmin is not None:
+            first = np.searchsorted(cached['time'], max(tmin, 0), 'left')
+
+        if tmax is not None:
+            last = np.searchsorted(cached['time'], max(tmax, 0), 'right')
+
+        data = {c: a[first:last] for c, a in data.items()}
+        event_ids = cached['event'][first:last]
+
+        copied = False
+        if cpus is not None:
+            mask = np.isin(cached['cpu'][first:last], list(cpus))
+            data = {c: a[mask] for c, a in data.items()}
+            event_ids = event_ids[mask]
+            copied = True
+
+        if fill_value != dw.field_fill_value:
+            for event, column in zip(events, field_columns):
+                if not copied:
+                    data[column] = data[column].copy()
+
+                event_id = self.event_id(name=event.decode())
+                data[column][event_ids != event_id] = fill_value
+
+        return data
 
     def get_tasks(self):
         """ Get a dictionary (name and PID) of all tasks presented in the
@@ -85,13 +338,19 @@ class tc_file_stream:
         """
         return ks.event_name(stream_id=self.stream_id, event_id=event_id)
 
-    def read_event_field(self, offset, event_id, field):
-        """ Retrieve the value of a trace event field.
+    def read_event_field(self, offset, event_id, field, mask=None):
+        """ Retrieve the value of a trace event field. If 'offset' is a
+            single integer (a Python int, a NumPy integer scalar or a 0-d
+            array), an int is returned. If 'offset' is an array (optionally
+            filtered by a boolean 'mask'), an array of values is returned.
+            If 'field' is a list of names, a dictionary of arrays is
+            returned.
         """
         return ks.read_event_field(stream_id=self.stream_id,
                                    offset=offset,
                                    event_id=event_id,
-                                   field=field)
+                                   field=field,
+                                   mask=mask)
 
     def __enter__(self):
         """